@@ -0,0 +1,405 @@
+//
+// Created by fathi on 11/22/2024.
+//
+
+#include "aot.h"
+#include "vm.h"
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <dlfcn.h>
+
+struct AotModule {
+    void *library;
+    AotRun run;
+};
+
+// C name of the handler of every opcode that has one, see the handler table in vm.c
+static const char *handler_names[256] = {
+        [OP_NOPE]            = "handle_nop",
+        [OP_LOAD_CONST_INT]  = "handle_load_const_int",
+        [OP_LOAD_CONST_FLOAT] = "handle_load_const_float",
+        [OP_LOAD_VAR]        = "handle_load_var",
+        [OP_STORE_VAR]       = "handle_store_var",
+        [OP_LOAD_GLOBAL]     = "handle_load_global",
+        [OP_STORE_GLOBAL]    = "handle_store_global",
+        [OP_ADD]             = "handle_add",
+        [OP_SUB]             = "handle_sub",
+        [OP_MUL]             = "handle_mul",
+        [OP_DIV]             = "handle_div",
+        [OP_AND]             = "handle_and",
+        [OP_OR]              = "handle_or",
+        [OP_NOT]             = "handle_not",
+        [OP_EQUAL]           = "handle_equal",
+        [OP_NOT_EQUAL]       = "handle_not_equal",
+        [OP_LESS_THAN]       = "handle_less_than",
+        [OP_GREATER_THAN]    = "handle_greater_than",
+        [OP_LESS_EQUAL]      = "handle_less_equal",
+        [OP_GREATER_EQUAL]   = "handle_greater_equal",
+        [OP_ADD_INT_INT]     = "handle_add_int_int",
+        [OP_ADD_FLOAT_FLOAT] = "handle_add_float_float",
+        [OP_SUB_INT_INT]     = "handle_sub_int_int",
+        [OP_SUB_FLOAT_FLOAT] = "handle_sub_float_float",
+        [OP_MUL_INT_INT]     = "handle_mul_int_int",
+        [OP_MUL_FLOAT_FLOAT] = "handle_mul_float_float",
+        [OP_DIV_INT_INT]     = "handle_div_int_int",
+        [OP_DIV_FLOAT_FLOAT] = "handle_div_float_float",
+        [OP_EQ_INT_INT]      = "handle_eq_int_int",
+        [OP_EQ_FLOAT_FLOAT]  = "handle_eq_float_float",
+        [OP_NE_INT_INT]      = "handle_ne_int_int",
+        [OP_NE_FLOAT_FLOAT]  = "handle_ne_float_float",
+        [OP_LT_INT_INT]      = "handle_lt_int_int",
+        [OP_LT_FLOAT_FLOAT]  = "handle_lt_float_float",
+        [OP_GT_INT_INT]      = "handle_gt_int_int",
+        [OP_GT_FLOAT_FLOAT]  = "handle_gt_float_float",
+        [OP_LE_INT_INT]      = "handle_le_int_int",
+        [OP_LE_FLOAT_FLOAT]  = "handle_le_float_float",
+        [OP_GE_INT_INT]      = "handle_ge_int_int",
+        [OP_GE_FLOAT_FLOAT]  = "handle_ge_float_float",
+        [OP_JMP]             = "handle_jmp",
+        [OP_JMP_IF_TRUE]     = "handle_jmp_if_true",
+        [OP_JMP_IF_FALSE]    = "handle_jmp_if_false",
+        [OP_CALL]            = "handle_call",
+        [OP_CALL_NATIVE]     = "handle_call_native",
+        [OP_RETURN]          = "handle_return",
+        [OP_TAIL_CALL]       = "handle_tail_call",
+        [OP_LOAD_STRING]     = "handle_load_string",
+        [OP_LOAD_BOOL]       = "handle_load_bool",
+        [OP_ENTER_SCOPE]     = "handle_enter_scope",
+        [OP_EXIT_SCOPE]      = "handle_exit_scope",
+        [OP_PUSH]            = "handle_push",
+        [OP_POP]             = "handle_pop",
+        [OP_SAVE_SP]         = "handle_save_sp",
+        [OP_RESET_SP]        = "handle_reset_sp",
+        [OP_INC_REG]         = "handle_inc_reg",
+        [OP_ADD_RRR]         = "handle_add_rrr",
+        [OP_SUB_RRR]         = "handle_sub_rrr",
+        [OP_MUL_RRR]         = "handle_mul_rrr",
+        [OP_DIV_RRR]         = "handle_div_rrr",
+        [OP_ADD_RRI]         = "handle_add_rri",
+        [OP_SUB_RRI]         = "handle_sub_rri",
+        [OP_MUL_RRI]         = "handle_mul_rri",
+        [OP_DIV_RRI]         = "handle_div_rri",
+        [OP_MOV_RR]          = "handle_mov_rr",
+        [OP_MOV_RI]          = "handle_mov_ri",
+        [OP_EQ_RR_JMP]       = "handle_compare_jmp",
+        [OP_NE_RR_JMP]       = "handle_compare_jmp",
+        [OP_LT_RR_JMP]       = "handle_compare_jmp",
+        [OP_LE_RR_JMP]       = "handle_compare_jmp",
+        [OP_GT_RR_JMP]       = "handle_compare_jmp",
+        [OP_GE_RR_JMP]       = "handle_compare_jmp",
+        [OP_EQ_RI_JMP]       = "handle_compare_jmp",
+        [OP_NE_RI_JMP]       = "handle_compare_jmp",
+        [OP_LT_RI_JMP]       = "handle_compare_jmp",
+        [OP_LE_RI_JMP]       = "handle_compare_jmp",
+        [OP_GT_RI_JMP]       = "handle_compare_jmp",
+        [OP_GE_RI_JMP]       = "handle_compare_jmp",
+        [OP_HALT]            = "handle_halt",
+};
+
+// operands that are plain values, the others are pointers into the running process
+static bool has_immediate(Opcode opcode) {
+    switch (opcode) {
+        case OP_LOAD_CONST_INT:
+        case OP_LOAD_CONST_FLOAT:
+        case OP_LOAD_BOOL:
+        case OP_MOV_RI:
+        case OP_ADD_RRI: case OP_SUB_RRI: case OP_MUL_RRI: case OP_DIV_RRI:
+        case OP_EQ_RI_JMP: case OP_NE_RI_JMP: case OP_LT_RI_JMP:
+        case OP_LE_RI_JMP: case OP_GT_RI_JMP: case OP_GE_RI_JMP:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static uint64_t fnv1a(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t aot_fingerprint(const InstructionStream *stream) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    hash = fnv1a(hash, &stream->count, sizeof(stream->count));
+    for (size_t i = 0; i < stream->count; i++) {
+        const Instruction *ins = &stream->code[i];
+        const int64_t target = ins->target ? ins->target - stream->code : -1;
+        hash = fnv1a(hash, &ins->opcode, sizeof(ins->opcode));
+        hash = fnv1a(hash, &ins->a, sizeof(ins->a));
+        hash = fnv1a(hash, &ins->b, sizeof(ins->b));
+        hash = fnv1a(hash, &ins->c, sizeof(ins->c));
+        hash = fnv1a(hash, &target, sizeof(target));
+        if (has_immediate(ins->opcode)) {
+            hash = fnv1a(hash, &ins->operand.as_int, sizeof(ins->operand.as_int));
+        }
+    }
+    return hash;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// C emitter
+////////////////////////////////////////////////////////////////////////////////
+
+// an int64_t literal, INT64_MIN has none
+static void emit_int(FILE *out, int64_t value) {
+    if (value == INT64_MIN) {
+        fprintf(out, "INT64_MIN");
+    } else {
+        fprintf(out, "INT64_C(%" PRId64 ")", value);
+    }
+}
+
+// r[b] or the immediate, as the right operand of an integer operation
+static void emit_rhs(FILE *out, const Instruction *ins, bool immediate, uint16_t reg) {
+    if (immediate) {
+        emit_int(out, ins->operand.as_int);
+    } else {
+        fprintf(out, "AS_INT(r[%u])", reg);
+    }
+}
+
+static void emit_arith(FILE *out, size_t i, const Instruction *ins, bool immediate, char op) {
+    fprintf(out, "    if (IS_INT(r[%u])", ins->b);
+    if (!immediate) {
+        fprintf(out, " && IS_INT(r[%u])", ins->c);
+    }
+    // wrap around like the interpreter does, without the undefined behavior
+    fprintf(out, ") {\n        r[%u] = make_int((int64_t) ((uint64_t) AS_INT(r[%u]) %c (uint64_t) ", ins->a, ins->b, op);
+    emit_rhs(out, ins, immediate, ins->c);
+    fprintf(out, "));\n    } else HANDLER(%zu, %s);\n", i, handler_names[ins->opcode]);
+}
+
+static const char *relations[] = {"==", "!=", "<", "<=", ">", ">="};
+
+// jumps backwards are safepoints, see vm_set_budget
+static void emit_goto(FILE *out, size_t i, const Instruction *ins, const Instruction *code) {
+    const ptrdiff_t target = ins->target - code;
+    if (target <= (ptrdiff_t) i) {
+        fprintf(out, "BACK_EDGE(%td);", target);
+    } else {
+        fprintf(out, "goto i%td;", target);
+    }
+}
+
+static void emit_compare_jump(FILE *out, size_t i, const Instruction *ins, const Instruction *code, bool immediate) {
+    const int relation = immediate ? ins->opcode - OP_EQ_RI_JMP : ins->opcode - OP_EQ_RR_JMP;
+    fprintf(out, "    if (IS_INT(r[%u])", ins->a);
+    if (!immediate) {
+        fprintf(out, " && IS_INT(r[%u])", ins->b);
+    }
+    fprintf(out, ") {\n        if (AS_INT(r[%u]) %s ", ins->a, relations[relation]);
+    emit_rhs(out, ins, immediate, ins->b);
+    fprintf(out, ") ");
+    emit_goto(out, i, ins, code);
+    fprintf(out, "\n    } else HANDLER(%zu, handle_compare_jmp);\n", i);
+}
+
+// ADD, SUB, MUL on the operand stack, the result replaces the lower operand
+static void emit_stack_arith(FILE *out, size_t i, const Instruction *ins, char op) {
+    fprintf(out, "    if (INT_PAIR()) {\n"
+                 "        BELOW = make_int((int64_t) ((uint64_t) AS_INT(BELOW) %c (uint64_t) AS_INT(TOP)));\n"
+                 "        S->sp--;\n    } else HANDLER(%zu, %s);\n", op, i, handler_names[ins->opcode]);
+}
+
+static void emit_stack_compare(FILE *out, size_t i, const Instruction *ins, const char *relation) {
+    fprintf(out, "    if (INT_PAIR()) {\n"
+                 "        BELOW = make_bool(AS_INT(BELOW) %s AS_INT(TOP));\n"
+                 "        S->sp--;\n    } else HANDLER(%zu, %s);\n", relation, i, handler_names[ins->opcode]);
+}
+
+bool aot_emit_c(const InstructionStream *stream, FILE *out) {
+    const Instruction *code = stream->code;
+
+    fprintf(out, "// Generated by tige --emit-c, do not edit.\n");
+    fprintf(out, "// Build it as a shared object (see cmake/TigeAot.cmake) and run it with tige --aot.\n\n");
+    fprintf(out, "#include \"vm.h\"\n#include \"op_handlers.h\"\n#include \"aot.h\"\n\n");
+    fprintf(out, "const uint32_t tige_aot_abi = TIGE_AOT_ABI;\n");
+    fprintf(out, "const uint64_t tige_aot_fingerprint = UINT64_C(0x%016" PRIx64 ");\n\n", aot_fingerprint(stream));
+    fprintf(out, "// call the handler of instruction i, then continue wherever it left vm->pc\n");
+    fprintf(out, "#define HANDLER(i, handler) do { \\\n"
+                 "        vm->pc = &code[(i) + 1]; \\\n"
+                 "        if (!handler(vm, &code[i])) return false; \\\n"
+                 "        r = vm->registers; \\\n"
+                 "        if (vm->pc != &code[(i) + 1]) goto dispatch; \\\n"
+                 "    } while (0)\n");
+    fprintf(out, "#define BACK_EDGE(t) do { \\\n"
+                 "        if (--vm->fuel <= 0) { \\\n"
+                 "            vm->pc = &code[t]; \\\n"
+                 "            if (!vm_safepoint(vm)) return false; \\\n"
+                 "        } \\\n"
+                 "        goto i##t; \\\n"
+                 "    } while (0)\n");
+    fprintf(out, "#define TOP (S->values[S->sp])\n");
+    fprintf(out, "#define BELOW (S->values[S->sp - 1])\n");
+    fprintf(out, "#define CAN_PUSH() (S->sp + 1 < S->capacity)\n");
+    fprintf(out, "#define INT_PAIR() (S->sp >= 1 && IS_INT(TOP) && IS_INT(BELOW))\n\n");
+    fprintf(out, "bool tige_aot_run(VM *vm, const Instruction *code) {\n");
+    fprintf(out, "    Value *r = vm->registers;\n");
+    fprintf(out, "    Stack *S = vm->stack;\n");
+    fprintf(out, "    goto dispatch;\n\n");
+
+    for (size_t i = 0; i < stream->count; i++) {
+        const Instruction *ins = &code[i];
+        const Opcode opcode = ins->opcode;
+        fprintf(out, "i%zu:\n", i);
+
+        switch (opcode) {
+            case OP_NOPE:
+                break;
+            case OP_MOV_RR:
+                fprintf(out, "    r[%u] = r[%u];\n", ins->a, ins->b);
+                break;
+            case OP_MOV_RI:
+                fprintf(out, "    r[%u] = make_int(", ins->a);
+                emit_int(out, ins->operand.as_int);
+                fprintf(out, ");\n");
+                break;
+            case OP_ADD_RRR: emit_arith(out, i, ins, false, '+'); break;
+            case OP_SUB_RRR: emit_arith(out, i, ins, false, '-'); break;
+            case OP_MUL_RRR: emit_arith(out, i, ins, false, '*'); break;
+            case OP_ADD_RRI: emit_arith(out, i, ins, true, '+'); break;
+            case OP_SUB_RRI: emit_arith(out, i, ins, true, '-'); break;
+            case OP_MUL_RRI: emit_arith(out, i, ins, true, '*'); break;
+            case OP_INC_REG:
+                fprintf(out, "    if (IS_INT(r[%u])) r[%u] = make_int(AS_INT(r[%u]) + 1);\n    else HANDLER(%zu, handle_inc_reg);\n",
+                        ins->a, ins->a, ins->a, i);
+                break;
+            case OP_EQ_RR_JMP: case OP_NE_RR_JMP: case OP_LT_RR_JMP:
+            case OP_LE_RR_JMP: case OP_GT_RR_JMP: case OP_GE_RR_JMP:
+                emit_compare_jump(out, i, ins, code, false);
+                break;
+            case OP_EQ_RI_JMP: case OP_NE_RI_JMP: case OP_LT_RI_JMP:
+            case OP_LE_RI_JMP: case OP_GT_RI_JMP: case OP_GE_RI_JMP:
+                emit_compare_jump(out, i, ins, code, true);
+                break;
+            case OP_JMP:
+                fprintf(out, "    ");
+                emit_goto(out, i, ins, code);
+                fprintf(out, "\n");
+                break;
+            case OP_JMP_IF_TRUE:
+            case OP_JMP_IF_FALSE:
+                fprintf(out, "    if (S->sp >= 0 && IS_BOOL(TOP)) {\n"
+                             "        if (%sAS_BOOL(S->values[S->sp--])) ", opcode == OP_JMP_IF_TRUE ? "" : "!");
+                emit_goto(out, i, ins, code);
+                fprintf(out, "\n    } else HANDLER(%zu, %s);\n", i, handler_names[opcode]);
+                break;
+            case OP_LOAD_VAR:
+                fprintf(out, "    if (CAN_PUSH()) S->values[++S->sp] = r[%u];\n    else HANDLER(%zu, handle_load_var);\n", ins->a, i);
+                break;
+            case OP_LOAD_CONST_INT:
+                fprintf(out, "    if (CAN_PUSH()) S->values[++S->sp] = make_int(");
+                emit_int(out, ins->operand.as_int);
+                fprintf(out, ");\n    else HANDLER(%zu, handle_load_const_int);\n", i);
+                break;
+            case OP_STORE_VAR:
+                fprintf(out, "    if (S->sp >= 0) r[%u] = S->values[S->sp--];\n    else HANDLER(%zu, handle_store_var);\n", ins->a, i);
+                break;
+            case OP_POP:
+                fprintf(out, "    if (S->sp >= 0) S->sp--;\n    else HANDLER(%zu, handle_pop);\n", i);
+                break;
+            case OP_SAVE_SP:
+                fprintf(out, "    vm->sp_reset = S->sp;\n");
+                break;
+            case OP_RESET_SP:
+                fprintf(out, "    S->sp = vm->sp_reset;\n");
+                break;
+            case OP_ADD: case OP_ADD_INT_INT: emit_stack_arith(out, i, ins, '+'); break;
+            case OP_SUB: case OP_SUB_INT_INT: emit_stack_arith(out, i, ins, '-'); break;
+            case OP_MUL: case OP_MUL_INT_INT: emit_stack_arith(out, i, ins, '*'); break;
+            case OP_EQUAL: case OP_EQ_INT_INT: emit_stack_compare(out, i, ins, "=="); break;
+            case OP_NOT_EQUAL: case OP_NE_INT_INT: emit_stack_compare(out, i, ins, "!="); break;
+            case OP_LESS_THAN: case OP_LT_INT_INT: emit_stack_compare(out, i, ins, "<"); break;
+            case OP_LESS_EQUAL: case OP_LE_INT_INT: emit_stack_compare(out, i, ins, "<="); break;
+            case OP_GREATER_THAN: case OP_GT_INT_INT: emit_stack_compare(out, i, ins, ">"); break;
+            case OP_GREATER_EQUAL: case OP_GE_INT_INT: emit_stack_compare(out, i, ins, ">="); break;
+            default:
+                if (handler_names[opcode]) {
+                    fprintf(out, "    HANDLER(%zu, %s);\n", i, handler_names[opcode]);
+                } else if (vm_opcode_handler(opcode)) {
+                    fprintf(stderr, "Error: no C translation for opcode 0x%02X.\n", opcode);
+                    return false;
+                } else {
+                    // no handler, execution stops like in the interpreter
+                    fprintf(out, "    vm->pc = &code[%zu];\n    return false;\n", i + 1);
+                }
+                break;
+        }
+    }
+
+    // falling off the end of the stream leaves the module like any unknown pc
+    fprintf(out, "    vm->pc = &code[%zu];\n    return true;\n\n", stream->count);
+    fprintf(out, "dispatch:\n    switch (vm->pc - code) {\n");
+    for (size_t i = 0; i < stream->count; i++) {
+        fprintf(out, "        case %zu: goto i%zu;\n", i, i);
+    }
+    fprintf(out, "        default: return true;\n    }\n}\n");
+
+    return !ferror(out);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Loading
+////////////////////////////////////////////////////////////////////////////////
+
+AotModule *aot_load(const char *path, const InstructionStream *stream) {
+    void *library = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!library) {
+        fprintf(stderr, "Error: could not load '%s': %s\n", path, dlerror());
+        return nullptr;
+    }
+
+    const uint32_t *abi = dlsym(library, "tige_aot_abi");
+    const uint64_t *fingerprint = dlsym(library, "tige_aot_fingerprint");
+    const AotRun run = (AotRun) dlsym(library, "tige_aot_run");
+    if (!abi || !fingerprint || !run) {
+        fprintf(stderr, "Error: '%s' is not a tige module.\n", path);
+        dlclose(library);
+        return nullptr;
+    }
+    if (*abi != TIGE_AOT_ABI) {
+        fprintf(stderr, "Error: '%s' was generated by another version of tige.\n", path);
+        dlclose(library);
+        return nullptr;
+    }
+    if (*fingerprint != aot_fingerprint(stream)) {
+        fprintf(stderr, "Error: '%s' was generated from another script.\n", path);
+        dlclose(library);
+        return nullptr;
+    }
+
+    AotModule *module = malloc(sizeof(AotModule));
+    if (!module) {
+        fprintf(stderr, "Failed to allocate the AOT module.\n");
+        exit(EXIT_FAILURE);
+    }
+    module->library = library;
+    module->run = run;
+    return module;
+}
+
+void aot_unload(AotModule *module) {
+    if (module) {
+        dlclose(module->library);
+        free(module);
+    }
+}
+
+Value aot_execute(AotModule *module, VM *vm) {
+    if (vm->pc == nullptr) {
+        fprintf(stderr, "Error: no code loaded in the VM.\n");
+        return make_null();
+    }
+
+    vm->suspended = false;
+    module->run(vm, vm->code->code);
+
+    if (!vm->suspended && vm->stack->sp >= 0) {
+        return vm_pop(vm);
+    }
+
+    return make_null();
+}
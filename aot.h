@@ -0,0 +1,54 @@
+//
+// Created by fathi on 11/22/2024.
+//
+
+#ifndef TIGE_AOT_H
+#define TIGE_AOT_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "decoder.h"
+#include "value.h"
+
+// Ahead-of-time compilation.
+// `tige --emit-c <file.c> <script>` translates the decoded instructions of a script
+// into one C function: register instructions and jumps become plain C with an
+// integer fast path, every other instruction calls its regular handler, and control
+// flow the handlers decide (calls, returns) goes through a switch over the
+// instruction index. Compiled into a shared object (see cmake/TigeAot.cmake), it is
+// run with `tige --aot <module.so> <script>` in place of the interpreter.
+//
+// The module holds no pointers: it runs on the instruction stream decoded from the
+// same script at load time, and refuses to load when the stream differs from the
+// one it was generated from.
+
+// bumped whenever the generated code or the runtime it calls into changes,
+// modules only run in a tige built with the same Value representation
+#ifdef TIGE_NAN_BOXING
+#define TIGE_AOT_ABI 0x10004
+#else
+#define TIGE_AOT_ABI 4
+#endif
+
+typedef struct VM VM;
+typedef struct AotModule AotModule;
+
+// signature of the module's tige_aot_run: runs from vm->pc until a handler returns
+// false (false) or execution leaves the module's code (true)
+typedef bool (*AotRun)(VM *vm, const Instruction *code);
+
+// identifies the code of a stream, pointers (strings, functions) excluded
+uint64_t aot_fingerprint(const InstructionStream *stream);
+
+// write the C translation of stream to out
+bool aot_emit_c(const InstructionStream *stream, FILE *out);
+
+// nullptr when the module cannot be loaded or was generated from other code
+AotModule *aot_load(const char *path, const InstructionStream *stream);
+void aot_unload(AotModule *module);
+
+// vm_execute with the module's code, the VM must have the stream it was loaded for.
+// A suspended VM (see vm_set_budget) resumes with another aot_execute.
+Value aot_execute(AotModule *module, VM *vm);
+
+#endif //TIGE_AOT_H
@@ -38,12 +38,12 @@ ASTValue* create_int_value(long long val)
     return value;
 }
 
-ASTValue* create_string_value(const char* str)
+ASTValue* create_string_value(VM* vm, const char* str, size_t length)
 {
-    TString* tstr = new_string();
+    TString* tstr = new_string(vm);
     if (tstr)
     {
-        tstr->chars = strdup(str);
+        tstr->chars = strndup(str, length);
         const auto value = (ASTValue*)malloc(sizeof(ASTValue));
         value->str_value = tstr;
         return value;
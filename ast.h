@@ -163,7 +163,8 @@ ASTValue *create_float_value(double value);
 
 ASTValue *create_int_value(long long val);
 
-ASTValue *create_string_value(const char *str);
+// strings live on the heap of the VM that will run the code
+ASTValue *create_string_value(VM *vm, const char *str, size_t length);
 
 ASTValue *create_bool_value(bool val);
 
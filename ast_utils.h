@@ -17,6 +17,7 @@
 #define AST_IS_BOOL(node)         ((node)->type == AST_BOOL)
 #define AST_IS_STRING(node)       ((node)->type == AST_STRING)
 #define AST_IS_CALL(node)         ((node)->type == AST_CALL)
+#define AST_IS_CALL(node)         ((node)->type == AST_CALL)
 #define AST_IS_EXPRESSION_STMT(node) ((node)->type == AST_EXPRESSION_STMT)
 #define AST_IS_BLOCK(node)        ((node)->type == AST_BLOCK)
 #define AST_IS_IF(node)           ((node)->type == AST_IF)
@@ -6,38 +6,56 @@
 #include "opcode.h"
 #include "tige_string.h"
 
-#define INITIAL_CHUNK_CAPACITY 1024
+#define INITIAL_SEGMENT_CAPACITY 1024
 
 typedef struct TObject TObject;
 typedef struct TString TString;
 
-// Structure to hold a single bytecode chunk (doubly linked list)
-typedef struct BytecodeChunk {
-    uint8_t *bytecode;              // Pointer to bytecode array for this chunk
-    size_t size;                    // Current size of this chunk's bytecode
-    size_t capacity;                // Allocated capacity for this chunk
-    size_t chunk_id;                // Unique identifier for the chunk
-    bool is_linked;
-    size_t linked_with;
+// A contiguous, growable block of bytecode.
+// The top level code and every function body get a segment of their own, so a
+// function never has to be split, and jumps only ever target their own segment.
+typedef struct CodeSegment {
+    uint8_t *bytecode;              // Pointer to bytecode array for this segment
+    size_t size;                    // Current size of this segment's bytecode
+    size_t capacity;                // Allocated capacity for this segment
+    size_t segment_id;              // Unique identifier for the segment
+    bool mapped;                    // bytecode points into the file mapping of the buffer, not owned
 
-    struct BytecodeChunk *prev;     // Pointer to the previous chunk
-    struct BytecodeChunk *next;     // Pointer to the next chunk
-} BytecodeChunk;
+    struct CodeSegment *next;       // Next segment in creation order
+} CodeSegment;
+
+// Jumps encode a signed 32-bit offset, relative to the end of the jump instruction
+typedef int32_t JumpOffset;
 
 // Structure to represent a jump placeholder
 typedef struct {
-    BytecodeChunk *chunk; // The chunk where the jump instruction is
-    size_t offset;        // Offset within the chunk where the placeholder is
+    CodeSegment *segment; // The segment where the jump instruction is
+    size_t offset;        // Offset within the segment where the JumpOffset is
 } JumpPlaceholder;
 
-// Structure to hold the bytecode buffer with multiple chunks
+// Version of the bytecode encoding, part of the key of saved code (see snapshot.h):
+// bump it whenever the operands of an instruction change
+#define BYTECODE_VERSION 2
+
+// Structure to hold the bytecode buffer with one segment per function
+// The bytecode holds no addresses, so it can be saved and mapped back as it is:
+// strings live in the constant pool and OP_LOAD_STRING refers to them by index.
 typedef struct {
-    BytecodeChunk *head;            // Pointer to the first chunk
-    BytecodeChunk *tail;            // Pointer to the last chunk
-    BytecodeChunk *current_chunk;   // Pointer to the current chunk
-    size_t chunk_count;             // Number of chunks currently in use
-    size_t next_chunk_id;           // Next chunk ID to assign
-    BytecodeChunk* return_to;       // The chunk ID that will be resumed when we add a non-linked chunk
+    CodeSegment *head;              // The top level code
+    CodeSegment *tail;              // Last created segment
+    CodeSegment *current;           // Segment being emitted into
+    size_t segment_count;           // Number of segments in the buffer
+
+    CodeSegment **suspended;        // Segments interrupted by a (nested) function body
+    size_t suspended_count;
+    size_t suspended_capacity;
+
+    TString **constants;            // string constants, by OP_LOAD_STRING index
+    size_t constant_count;
+    size_t constant_capacity;
+
+    void *mapping;                  // saved code the segments were loaded from, unmapped with the buffer
+    size_t mapping_size;
 } BytecodeBuffer;
 
 // Function prototypes
@@ -45,9 +63,14 @@ BytecodeBuffer *bc_buffer_create();
 
 void bc_destroy_bytecode_buffer(BytecodeBuffer *buffer);
 
-// linkage utilities
-void bc_start_non_linked_chunk(BytecodeBuffer* buffer);
-BytecodeChunk * bc_end_non_linked_chunk(BytecodeBuffer* buffer);
+// function bodies: emit into a fresh segment until the matching bc_end_segment,
+// which returns the finished segment and resumes the one that was interrupted
+void bc_start_segment(BytecodeBuffer *buffer);
+CodeSegment *bc_end_segment(BytecodeBuffer *buffer);
+
+// Link step, run once compilation is done: checks that every segment was closed
+// and trims each segment to its final size
+bool bc_finalize(BytecodeBuffer *buffer);
 
 // Emit functions
 void bc_emit_byte(BytecodeBuffer *buffer, uint8_t byte);
@@ -65,7 +88,12 @@ void bc_emit_opcode(BytecodeBuffer *buffer, Opcode opcode);
 
 // Combined emit functions to ensure atomic emission
 void bc_emit_opcode_with_string(BytecodeBuffer *buffer, Opcode opcode, const char *string);
+// OP_CALL/OP_TAIL_CALL <base:uint16_t> <name\0>, the arguments are in the registers starting at base
+void bc_emit_call(BytecodeBuffer *buffer, Opcode opcode, uint16_t base, const char *name);
+// OP_LOAD_STRING <index:u32>, the string is added to the constant pool
 void bc_emit_opcode_with_string_obj(BytecodeBuffer *buffer, Opcode opcode, TString *string);
+// index of a new constant
+uint32_t bc_add_constant(BytecodeBuffer *buffer, TString *string);
 void bc_emit_opcode_with_int(BytecodeBuffer *buffer, Opcode opcode, int64_t value);
 
 void bc_emit_opcode_with_uint(BytecodeBuffer *buffer, Opcode opcode, uint64_t value);
@@ -76,50 +104,36 @@ void bc_emit_opcode_with_float(BytecodeBuffer *buffer, Opcode opcode, double val
 
 void bc_emit_opcode_with_byte(BytecodeBuffer *buffer, Opcode opcode, uint8_t value);
 
+// register instructions
+void bc_emit_opcode_with_regs(BytecodeBuffer *buffer, Opcode opcode, uint16_t dst, uint16_t a, uint16_t b);
+void bc_emit_opcode_with_reg_reg(BytecodeBuffer *buffer, Opcode opcode, uint16_t dst, uint16_t src);
+void bc_emit_opcode_with_reg_imm(BytecodeBuffer *buffer, Opcode opcode, uint16_t dst, uint16_t a, int64_t imm);
+void bc_emit_opcode_with_reg_int(BytecodeBuffer *buffer, Opcode opcode, uint16_t dst, int64_t imm);
+
 // emit a jump with a placeholder
 JumpPlaceholder bc_emit_jump_with_placeholder(BytecodeBuffer *buffer, Opcode opcode);
 
-// backpatch a jump with the actual target address
-void bc_backpatch_jump(JumpPlaceholder placeholder, size_t target_chunk_id, size_t target_offset);
+// emit a fused compare and jump (register/register or register/immediate) with a placeholder
+JumpPlaceholder bc_emit_compare_jump_rr_with_placeholder(BytecodeBuffer *buffer, Opcode opcode, uint16_t a, uint16_t b);
+JumpPlaceholder bc_emit_compare_jump_ri_with_placeholder(BytecodeBuffer *buffer, Opcode opcode, uint16_t a, int64_t imm);
 
-void bc_emit_opcode_with_jump(BytecodeBuffer *buffer, Opcode opcode, size_t chunk_id, size_t offset);
+// current emit position in the current segment, used as a jump label
+size_t bc_current_offset(BytecodeBuffer *buffer);
 
-bool bc_is_buffer_valid(BytecodeBuffer *buffer);
+// backpatch a jump to target an offset of its own segment
+void bc_backpatch_jump(JumpPlaceholder placeholder, size_t target_offset);
 
-// Chunk management utility functions
-BytecodeChunk *bc_create_bytecode_chunk(size_t initial_capacity);
+// emit a jump to an already emitted offset of the current segment (backward jump)
+void bc_emit_opcode_with_jump(BytecodeBuffer *buffer, Opcode opcode, size_t target_offset);
 
-void bc_destroy_bytecode_chunk(BytecodeChunk *chunk);
+bool bc_is_buffer_valid(BytecodeBuffer *buffer);
 
-bool bc_chunk_has_free_space(BytecodeChunk *chunk, size_t size_needed);
+// Segment management utility functions
+CodeSegment *bc_create_segment(size_t initial_capacity);
 
-BytecodeChunk *bc_add_new_chunk(BytecodeBuffer *buffer, size_t initial_capacity, bool link);
+void bc_destroy_segment(CodeSegment *segment);
 
 size_t bc_get_total_bytecode_size(BytecodeBuffer *buffer);
 
-// Reading from the bytecode buffer
-uint8_t bc_read_byte(BytecodeChunk **chunk, size_t *offset);
-
-int64_t bc_read_int(BytecodeChunk **chunk, size_t *offset);
-
-uint64_t bc_read_uint(BytecodeChunk **chunk, size_t *offset);
-
-double bc_read_float(BytecodeChunk **chunk, size_t *offset);
-
-char *bc_read_string(BytecodeChunk **chunk, size_t *offset);
-
-// Unsafe write into bytecode buffer, internal use only!!
-void bc_write_byte(BytecodeChunk **chunk, uint8_t byte);
-void bc_write_ptr(BytecodeChunk **chunk, uintptr_t ptr);
-
-// Jumping between chunks
-void bc_set_chunk(BytecodeBuffer *buffer, size_t chunk_id);
-void bc_return_to(BytecodeBuffer* buffer);
-BytecodeChunk* bc_get_chunk_by_id(BytecodeBuffer* buffer, size_t chunk_id);
-
-// Checking if a chunk has code/free slots
-bool bc_chunk_has_code(BytecodeChunk *chunk);
-
-bool bc_chunk_has_free_slots(BytecodeChunk *chunk, size_t size_needed);
 
 #endif // TIGE_BYTECODE_BUFFER_H
\ No newline at end of file
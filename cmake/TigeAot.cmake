@@ -0,0 +1,31 @@
+# Ahead-of-time compiled scripts (see aot.h).
+#
+#   tige_add_aot_module(<name> <script>)
+#
+# Translates <script> to C with `tige --emit-c` and builds it into the shared object
+# <name>.so, run with `tige --aot <name>.so <script>`. The module has to be rebuilt
+# whenever the script or tige changes, tige refuses modules generated from other code.
+
+set(TIGE_AOT_INCLUDE_DIR ${CMAKE_CURRENT_LIST_DIR}/..)
+
+function(tige_add_aot_module name script)
+    get_filename_component(script_path ${script} ABSOLUTE)
+    set(c_file ${CMAKE_CURRENT_BINARY_DIR}/aot/${name}.c)
+
+    add_custom_command(
+            OUTPUT ${c_file}
+            COMMAND ${CMAKE_COMMAND} -E make_directory ${CMAKE_CURRENT_BINARY_DIR}/aot
+            COMMAND tige --emit-c ${c_file} ${script_path}
+            DEPENDS tige ${script_path}
+            COMMENT "Compiling ${script} to C"
+    )
+
+    add_library(${name} MODULE ${c_file})
+    set_target_properties(${name} PROPERTIES PREFIX "" C_STANDARD 23)
+    target_include_directories(${name} PRIVATE ${TIGE_AOT_INCLUDE_DIR})
+    if (TIGE_NAN_BOXING)
+        target_compile_definitions(${name} PRIVATE TIGE_NAN_BOXING)
+    endif ()
+    # one big function with a label per instruction, higher levels mostly cost build time
+    target_compile_options(${name} PRIVATE -O2)
+endfunction()
@@ -10,7 +10,15 @@
 
 typedef uint16_t Reg;
 
-static Context *gcontext;
+// state of the compilation running on this thread, other threads compile their own contexts
+static thread_local Context *gcontext;
+
+// number of temporary registers in use by the expression being compiled
+static thread_local uint16_t temp_count;
+
+static void compile_expr_into(BytecodeBuffer *buffer, ASTNode *node, Reg dst);
+static Symbol *resolve_call(ASTNode *node);
+static void compile_function_call(BytecodeBuffer *buffer, ASTNode *node, const Symbol *fn, Opcode opcode);
 
 void compile_node(ASTNode *node, BytecodeBuffer *buffer) {
     switch (node->type) {
@@ -91,7 +99,10 @@ void compile_fn_decl(BytecodeBuffer *buffer, ASTNode *node) {
     add_function_symbol(gcontext->symbols, func_name, argc);
     auto fn_sym = lookup_symbol(gcontext->symbols, func_name);
 
-    enter_scope(gcontext->symbols);
+    // the body runs in its own register window, the caller stores the arguments in its first registers
+    enter_function_scope(gcontext->symbols);
+    const uint16_t saved_temps = temp_count;
+    temp_count = 0;
 
     fn_sym->data.function.arg_b = gcontext->symbols->current_scope->variable_index_counter;
     // define all params
@@ -101,29 +112,26 @@ void compile_fn_decl(BytecodeBuffer *buffer, ASTNode *node) {
     }
     fn_sym->data.function.arg_e = gcontext->symbols->current_scope->variable_index_counter;
 
-    // load the arguments
-    for (uint16_t i = fn_sym->data.function.arg_b; i < fn_sym->data.function.arg_e; ++i) {
-        bc_emit_opcode_with_uint16(buffer, OP_LOAD_VAR, i);
-    }
-
-    // do not link function chunk since it's only accessible by calling/jumping to it
-    bc_start_non_linked_chunk(buffer);
+    // the body gets its own segment since it's only reachable by calling it
+    bc_start_segment(buffer);
     compile_node(node->fn_decl_stmt.body, buffer);
-    auto chunk = bc_end_non_linked_chunk(buffer);
-    bc_end_non_linked_chunk(buffer);
+    // implicit `return 0;` so execution never runs off the end of the function segment
+    bc_emit_opcode_with_int(buffer, OP_LOAD_CONST_INT, 0);
+    bc_emit_opcode(buffer, OP_RETURN);
+    auto segment = bc_end_segment(buffer);
 
-    Function* function = create_function();
+    Function* function = create_function(gcontext->vm);
     function->props = nullptr;
     function->metadata = nullptr;
-    function->stack = get_vm()->stack;
+    function->stack = gcontext->vm->stack;
     function->arity = argc;
-    function->return_addr.chunk = buffer->current_chunk;
-    function->return_addr.offset = -1;
-    function->chunk = chunk;
+    function->segment = segment;
     function->name = strdup(func_name);
+    function->register_count = gcontext->symbols->frame_size;
 
     register_function(gcontext, func_name, function);
 
+    temp_count = saved_temps;
     exit_scope(gcontext->symbols);
 }
 
@@ -136,9 +144,224 @@ BytecodeBuffer *compile_ast(ASTNode *node, Context *context) {
     compile_node(node, buffer);
 
     bc_emit_opcode(buffer, OP_HALT);
+
+    if (!bc_finalize(buffer)) {
+        bc_destroy_bytecode_buffer(buffer);
+        return nullptr;
+    }
     return buffer;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Register instruction selection
+////////////////////////////////////////////////////////////////////////////////
+
+// Variables of the function being compiled are in its register window, top level
+// ones are reached through LOAD_GLOBAL/STORE_GLOBAL
+static bool is_local(const Symbol *sym) {
+    return sym->data.variable.function_depth == gcontext->symbols->function_depth;
+}
+
+static bool is_global(const Symbol *sym) {
+    return sym->data.variable.function_depth == 0;
+}
+
+// Register of a plain local variable operand, or -1 when the node is anything else
+static int32_t operand_register(ASTNode *node) {
+    if (!AST_IS_SYMBOL(node)) {
+        return -1;
+    }
+    const Symbol *sym = lookup_symbol(gcontext->symbols, node->value->str_value->chars);
+    if (!sym || sym->type != SYMBOL_VARIABLE || !is_local(sym)) {
+        return -1;
+    }
+    return sym->data.variable.index;
+}
+
+// first register above the variables and temporaries in use
+static Reg next_free_register(void) {
+    const uint32_t reg = gcontext->symbols->current_scope->variable_index_counter + temp_count;
+    if (reg >= MAX_REGISTERS) {
+        fprintf(stderr, "Error: expression needs more than %d registers\n", MAX_REGISTERS);
+        exit(EXIT_FAILURE);
+    }
+    return (Reg) reg;
+}
+
+// Temporaries live right above the variables of the current scope, for the
+// duration of a single expression. Callees get their own window above them, so
+// temporaries survive calls.
+static Reg alloc_temp(void) {
+    const Reg reg = next_free_register();
+    reserve_register(gcontext->symbols, reg);
+    temp_count++;
+    return reg;
+}
+
+static void free_temp(void) {
+    temp_count--;
+}
+
+// three-address form of an arithmetic operator, OP_NOPE if there is none
+static Opcode arith_rrr_opcode(TokenType operator) {
+    switch (operator) {
+        case TOKEN_PLUS:
+            return OP_ADD_RRR;
+        case TOKEN_MINUS:
+            return OP_SUB_RRR;
+        case TOKEN_ASTERISK:
+            return OP_MUL_RRR;
+        case TOKEN_SLASH:
+            return OP_DIV_RRR;
+        default:
+            return OP_NOPE;
+    }
+}
+
+// position of a comparison in the EQ, NE, LT, LE, GT, GE opcode groups, -1 if not a comparison
+static int relation_index(TokenType operator) {
+    switch (operator) {
+        case TOKEN_EQ:
+            return 0;
+        case TOKEN_NEQ:
+            return 1;
+        case TOKEN_LT:
+            return 2;
+        case TOKEN_LTE:
+            return 3;
+        case TOKEN_GT:
+            return 4;
+        case TOKEN_GTE:
+            return 5;
+        default:
+            return -1;
+    }
+}
+
+// a <op> b  <=>  !(a <inverse op> b)
+static const int inverse_relation[] = {1, 0, 5, 4, 3, 2};
+// a <op> b  <=>  b <mirrored op> a
+static const int mirrored_relation[] = {0, 1, 4, 5, 2, 3};
+
+static bool is_register_arith(ASTNode *node) {
+    return gcontext->register_ops && AST_IS_BINARY_OP(node) &&
+           arith_rrr_opcode(node->binary_op_expr.operator) != OP_NOPE;
+}
+
+// r[dst] = left <op> right, operands are variables, integer immediates or temporaries
+static void compile_arith_into(BytecodeBuffer *buffer, ASTNode *node, Reg dst) {
+    const Opcode rrr = arith_rrr_opcode(node->binary_op_expr.operator);
+    const Opcode rri = rrr + (OP_ADD_RRI - OP_ADD_RRR);
+    const bool commutative = rrr == OP_ADD_RRR || rrr == OP_MUL_RRR;
+    ASTNode *left = node->binary_op_expr.left;
+    ASTNode *right = node->binary_op_expr.right;
+
+    // `2 * x` is `x * 2`
+    if (commutative && AST_IS_INTEGER(left) && !AST_IS_INTEGER(right)) {
+        ASTNode *swap = left;
+        left = right;
+        right = swap;
+    }
+
+    uint16_t temps = 0;
+    int32_t a = operand_register(left);
+    if (a < 0) {
+        a = alloc_temp();
+        temps++;
+        compile_expr_into(buffer, left, (Reg) a);
+    }
+
+    if (AST_IS_INTEGER(right)) {
+        bc_emit_opcode_with_reg_imm(buffer, rri, dst, (Reg) a, right->value->int_value);
+    } else {
+        int32_t b = operand_register(right);
+        if (b < 0) {
+            b = alloc_temp();
+            temps++;
+            compile_expr_into(buffer, right, (Reg) b);
+        }
+        bc_emit_opcode_with_regs(buffer, rrr, dst, (Reg) a, (Reg) b);
+    }
+
+    while (temps--) {
+        free_temp();
+    }
+}
+
+// Evaluate an expression straight into a register, without going through the stack
+// whenever its operands are variables or integer constants
+static void compile_expr_into(BytecodeBuffer *buffer, ASTNode *node, Reg dst) {
+    if (gcontext->register_ops) {
+        const int32_t src = operand_register(node);
+        if (src >= 0) {
+            if (src != dst) {
+                bc_emit_opcode_with_reg_reg(buffer, OP_MOV_RR, dst, (Reg) src);
+            }
+            return;
+        }
+        if (AST_IS_INTEGER(node)) {
+            bc_emit_opcode_with_reg_int(buffer, OP_MOV_RI, dst, node->value->int_value);
+            return;
+        }
+        if (is_register_arith(node)) {
+            compile_arith_into(buffer, node, dst);
+            return;
+        }
+    }
+
+    compile_node(node, buffer);
+    bc_emit_opcode_with_uint16(buffer, OP_STORE_VAR, dst);
+}
+
+// Emit a jump taken when `condition` evaluates to `when`, fused with the
+// comparison if both operands can be read from registers
+static JumpPlaceholder compile_condition_jump(BytecodeBuffer *buffer, ASTNode *condition, bool when) {
+    const int relation = AST_IS_COMPARE(condition) ? relation_index(condition->compare_expr.operator) : -1;
+    if (!gcontext->register_ops || relation < 0) {
+        compile_node(condition, buffer);
+        return bc_emit_jump_with_placeholder(buffer, when ? OP_JMP_IF_TRUE : OP_JMP_IF_FALSE);
+    }
+
+    ASTNode *left = condition->compare_expr.left;
+    ASTNode *right = condition->compare_expr.right;
+    int rel = when ? relation : inverse_relation[relation];
+
+    // keep the immediate on the right hand side
+    if (AST_IS_INTEGER(left) && !AST_IS_INTEGER(right)) {
+        ASTNode *swap = left;
+        left = right;
+        right = swap;
+        rel = mirrored_relation[rel];
+    }
+
+    uint16_t temps = 0;
+    int32_t a = operand_register(left);
+    if (a < 0) {
+        a = alloc_temp();
+        temps++;
+        compile_expr_into(buffer, left, (Reg) a);
+    }
+
+    JumpPlaceholder jump;
+    if (AST_IS_INTEGER(right)) {
+        jump = bc_emit_compare_jump_ri_with_placeholder(buffer, OP_EQ_RI_JMP + rel, (Reg) a,
+                                                        right->value->int_value);
+    } else {
+        int32_t b = operand_register(right);
+        if (b < 0) {
+            b = alloc_temp();
+            temps++;
+            compile_expr_into(buffer, right, (Reg) b);
+        }
+        jump = bc_emit_compare_jump_rr_with_placeholder(buffer, OP_EQ_RR_JMP + rel, (Reg) a, (Reg) b);
+    }
+
+    while (temps--) {
+        free_temp();
+    }
+    return jump;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Compiler implementation
 ////////////////////////////////////////////////////////////////////////////////
@@ -172,7 +395,15 @@ void compile_symbol(BytecodeBuffer *buffer, ASTNode *node) {
 
     if (sym) {
         if (sym->type == SYMBOL_VARIABLE) {
-            bc_emit_opcode_with_uint16(buffer, OP_LOAD_VAR, sym->data.variable.index);
+            if (is_local(sym)) {
+                bc_emit_opcode_with_uint16(buffer, OP_LOAD_VAR, sym->data.variable.index);
+            } else if (is_global(sym)) {
+                bc_emit_opcode_with_uint16(buffer, OP_LOAD_GLOBAL, sym->data.variable.index);
+            } else {
+                fprintf(stderr, "Error: '%s' belongs to an enclosing function, closures are not supported\n",
+                        name->chars);
+                exit(EXIT_FAILURE);
+            }
         } else {
             fprintf(stderr, "Error: '%s' is not a variable\n", name->chars);
             exit(EXIT_FAILURE);
@@ -185,6 +416,15 @@ void compile_symbol(BytecodeBuffer *buffer, ASTNode *node) {
 
 /// Compile Binary Operation AST Node
 void compile_binary_op(BytecodeBuffer *buffer, ASTNode *node) {
+    // compute into a temporary and push that, instead of pushing both operands
+    if (is_register_arith(node)) {
+        const Reg temp = alloc_temp();
+        compile_arith_into(buffer, node, temp);
+        bc_emit_opcode_with_uint16(buffer, OP_LOAD_VAR, temp);
+        free_temp();
+        return;
+    }
+
     // Compile left and right operands
     compile_node(node->binary_op_expr.left, buffer);
     compile_node(node->binary_op_expr.right, buffer);
@@ -250,11 +490,8 @@ void compile_unary_op(BytecodeBuffer *buffer, ASTNode *node) {
 
 /// Compile Ternary Operation AST Node
 void compile_ternary_op(BytecodeBuffer *buffer, ASTNode *node) {
-    // Compile condition
-    compile_node(node->ternary_op_expr.condition, buffer);
-
-    // Emit JMP_IF_FALSE to false_expr, with placeholder
-    JumpPlaceholder jump_to_false = bc_emit_jump_with_placeholder(buffer, OP_JMP_IF_FALSE);
+    // Compile condition, jump to false_expr when it does not hold
+    JumpPlaceholder jump_to_false = compile_condition_jump(buffer, node->ternary_op_expr.condition, false);
 
     // Compile true_expr
     compile_node(node->ternary_op_expr.true_expr, buffer);
@@ -263,19 +500,13 @@ void compile_ternary_op(BytecodeBuffer *buffer, ASTNode *node) {
     JumpPlaceholder jump_to_end = bc_emit_jump_with_placeholder(buffer, OP_JMP);
 
     // Backpatch JMP_IF_FALSE to current position (start of false_expr)
-    size_t else_chunk_id = buffer->current_chunk->chunk_id;
-    size_t else_offset = buffer->current_chunk->size;
-
-    bc_backpatch_jump(jump_to_false, else_chunk_id, else_offset);
+    bc_backpatch_jump(jump_to_false, bc_current_offset(buffer));
 
     // Compile false_expr
     compile_node(node->ternary_op_expr.false_expr, buffer);
 
     // Backpatch JMP to end address (current position)
-    size_t end_chunk_id = buffer->current_chunk->chunk_id;
-    size_t end_offset = buffer->current_chunk->size;
-
-    bc_backpatch_jump(jump_to_end, end_chunk_id, end_offset);
+    bc_backpatch_jump(jump_to_end, bc_current_offset(buffer));
 }
 
 /// Compile Compare AST Node
@@ -312,6 +543,12 @@ void compile_compare(BytecodeBuffer *buffer, ASTNode *node) {
 
 /// Compile Assign AST Node
 void compile_assign(BytecodeBuffer *buffer, ASTNode *node) {
+    const int32_t target = operand_register(node->assignment_expr.left);
+    if (gcontext->register_ops && target >= 0) {
+        compile_expr_into(buffer, node->assignment_expr.right, (Reg) target);
+        return;
+    }
+
     // Compile the right-hand side expression
     compile_node(node->assignment_expr.right, buffer);
 
@@ -319,8 +556,14 @@ void compile_assign(BytecodeBuffer *buffer, ASTNode *node) {
         auto var_name = node->assignment_expr.left->value->str_value;
         Symbol *symbol = lookup_symbol(gcontext->symbols, var_name->chars);
 
-        if (symbol) {
+        if (symbol && is_global(symbol) && !is_local(symbol)) {
+            bc_emit_opcode_with_uint16(buffer, OP_STORE_GLOBAL, symbol->data.variable.index);
+        } else if (symbol && is_local(symbol)) {
             bc_emit_opcode_with_uint16(buffer, OP_STORE_VAR, symbol->data.variable.index);
+        } else if (symbol) {
+            fprintf(stderr, "Error: '%s' belongs to an enclosing function, closures are not supported\n",
+                    var_name->chars);
+            exit(EXIT_FAILURE);
         } else {
             fprintf(stderr, "Error: Assignment to an undeclared variable '%s'", var_name->chars);
         }
@@ -356,11 +599,8 @@ void compile_if(BytecodeBuffer *buffer, ASTNode *node) {
     enter_scope(gcontext->symbols);
     bc_emit_opcode(buffer, OP_SAVE_SP);
 
-    // Compile condition
-    compile_node(node->if_stmt.condition, buffer);
-
-    // Emit JMP_IF_FALSE to else_branch, with placeholder
-    JumpPlaceholder jump_to_else = bc_emit_jump_with_placeholder(buffer, OP_JMP_IF_FALSE);
+    // Compile condition, jump to else_branch when it does not hold
+    JumpPlaceholder jump_to_else = compile_condition_jump(buffer, node->if_stmt.condition, false);
 
     // Compile then_branch
     compile_node(node->if_stmt.then_branch, buffer);
@@ -369,10 +609,7 @@ void compile_if(BytecodeBuffer *buffer, ASTNode *node) {
     JumpPlaceholder jump_to_end = bc_emit_jump_with_placeholder(buffer, OP_JMP);
 
     // Backpatch JMP_IF_FALSE to current position (start of else_branch or end if no else_branch)
-    size_t else_chunk_id = buffer->current_chunk->chunk_id;
-    size_t else_offset = buffer->current_chunk->size;
-
-    bc_backpatch_jump(jump_to_else, else_chunk_id, else_offset);
+    bc_backpatch_jump(jump_to_else, bc_current_offset(buffer));
 
     // Compile else_branch if it exists
     if (node->if_stmt.else_branch) {
@@ -380,10 +617,7 @@ void compile_if(BytecodeBuffer *buffer, ASTNode *node) {
     }
 
     // Backpatch JMP to end address (current position)
-    size_t end_chunk_id = buffer->current_chunk->chunk_id;
-    size_t end_offset = buffer->current_chunk->size;
-
-    bc_backpatch_jump(jump_to_end, end_chunk_id, end_offset);
+    bc_backpatch_jump(jump_to_end, bc_current_offset(buffer));
 
     bc_emit_opcode(buffer, OP_RESET_SP);
     exit_scope(gcontext->symbols);
@@ -411,19 +645,34 @@ void compile_for(BytecodeBuffer *buffer, ASTNode *node) {
     add_symbol(gcontext->symbols, "__end", SYMBOL_VARIABLE);
     Symbol *end_symbol = lookup_symbol(gcontext->symbols, "__end");
 
-    // Compile the start expression
-    compile_node(node->for_stmt.range->range_expr.start, buffer);
-    // Store start value in the loop variable's register
-    bc_emit_opcode_with_uint16(buffer, OP_STORE_VAR, symbol->data.variable.index);
+    // Store start and end values in the loop variable's and the end variable's registers
+    compile_expr_into(buffer, node->for_stmt.range->range_expr.start, symbol->data.variable.index);
+    compile_expr_into(buffer, node->for_stmt.range->range_expr.end, end_symbol->data.variable.index);
+
+    if (gcontext->register_ops) {
+        // rotated loop: the condition is tested once up front and then at the back edge,
+        // so each iteration ends in `INC_REG i; LT_RR_JMP i, __end` (fused into one dispatch)
+        JumpPlaceholder exit_jump = bc_emit_compare_jump_rr_with_placeholder(buffer, OP_GE_RR_JMP,
+                                                                             symbol->data.variable.index,
+                                                                             end_symbol->data.variable.index);
 
-    // Compile the end expression
-    compile_node(node->for_stmt.range->range_expr.end, buffer);
-    // Store end value in the end variable's register
-    bc_emit_opcode_with_uint16(buffer, OP_STORE_VAR, end_symbol->data.variable.index);
+        size_t body_offset = bc_current_offset(buffer);
+
+        compile_node(node->for_stmt.body, buffer);
+
+        bc_emit_opcode_with_uint16(buffer, OP_INC_REG, symbol->data.variable.index);
+        JumpPlaceholder back_edge = bc_emit_compare_jump_rr_with_placeholder(buffer, OP_LT_RR_JMP,
+                                                                             symbol->data.variable.index,
+                                                                             end_symbol->data.variable.index);
+        bc_backpatch_jump(back_edge, body_offset);
+
+        bc_backpatch_jump(exit_jump, bc_current_offset(buffer));
+        exit_scope(gcontext->symbols);
+        return;
+    }
 
     // Prepare labels for jumps
-    size_t loop_start_chunk_id = buffer->current_chunk->chunk_id;
-    size_t loop_start_offset = buffer->current_chunk->size;
+    size_t loop_start_offset = bc_current_offset(buffer);
 
     // Load loop variable and end value for comparison
     bc_emit_opcode_with_uint16(buffer, OP_LOAD_VAR, symbol->data.variable.index);
@@ -442,12 +691,10 @@ void compile_for(BytecodeBuffer *buffer, ASTNode *node) {
     bc_emit_opcode_with_uint16(buffer, OP_INC_REG, symbol->data.variable.index);
 
     // Jump back to the loop start
-    bc_emit_opcode_with_jump(buffer, OP_JMP, loop_start_chunk_id, loop_start_offset);
+    bc_emit_opcode_with_jump(buffer, OP_JMP, loop_start_offset);
 
     // Backpatch the exit jump
-    size_t loop_end_chunk_id = buffer->current_chunk->chunk_id;
-    size_t loop_end_offset = buffer->current_chunk->size;
-    bc_backpatch_jump(exit_jump, loop_end_chunk_id, loop_end_offset);
+    bc_backpatch_jump(exit_jump, bc_current_offset(buffer));
 
     // Exit the loop scope
     // bc_emit_opcode(buffer, OP_RESET_SP);
@@ -464,7 +711,17 @@ void compile_break(BytecodeBuffer *buffer, ASTNode *node) {
 
 /// Compile Return Statement AST Node
 void compile_return(BytecodeBuffer *buffer, ASTNode *node) {
-    if (node->return_stmt.value) {
+    ASTNode *value = node->return_stmt.value;
+    // `return f(...)` from a function: f reuses our frame instead of returning through it
+    if (value && AST_IS_CALL(value) && gcontext->symbols->function_depth > 0) {
+        const Symbol *fn = resolve_call(value);
+        if (fn->data.function.native < 0) {
+            compile_function_call(buffer, value, fn, OP_TAIL_CALL);
+            return;
+        }
+    }
+
+    if (value) {
         // Compile the return expression
         compile_node(node->return_stmt.value, buffer);
         // Emit RETURN opcode
@@ -484,8 +741,8 @@ void compile_range(BytecodeBuffer *buffer, ASTNode *node) {
     exit(1);
 }
 
-/// Compile Call AST Node
-void compile_call(BytecodeBuffer *buffer, ASTNode *node) {
+// Callee of a call expression, checked against the number of arguments
+static Symbol *resolve_call(ASTNode *node) {
     auto const callee = node->call_expr.callee->value->str_value;
     Symbol* fn = lookup_symbol(gcontext->symbols, callee->chars);
 
@@ -501,12 +758,100 @@ void compile_call(BytecodeBuffer *buffer, ASTNode *node) {
         fprintf(stderr, "Error: '%s' expects %lu argument(s) although %lu provided", fn->name, arity, argc);
         exit(EXIT_FAILURE);
     }
+    return fn;
+}
+
+// OP_CALL or OP_TAIL_CALL of a bytecode function
+static void compile_function_call(BytecodeBuffer *buffer, ASTNode *node, const Symbol *fn, Opcode opcode) {
+    const size_t argc = node->call_expr.arguments->count;
+
+    // the arguments are evaluated straight into the first registers of the callee's window
+    const Reg base = next_free_register();
+    for (size_t i = 0; i < argc; ++i) {
+        compile_expr_into(buffer, node->call_expr.arguments->nodes[i], alloc_temp());
+    }
+
+    bc_emit_call(buffer, opcode, base, fn->name);
+
+    for (size_t i = 0; i < argc; ++i) {
+        free_temp();
+    }
+}
+
+/// Compile Call AST Node
+void compile_call(BytecodeBuffer *buffer, ASTNode *node) {
+    const Symbol *fn = resolve_call(node);
+    if (fn->data.function.native >= 0) {
+        compile_native_call(buffer, node, (uint16_t) fn->data.function.native);
+        return;
+    }
+
+    compile_function_call(buffer, node, fn, OP_CALL);
+}
+
+// Literal operand as a value, false for anything that is not a number or a bool
+static bool constant_value(ASTNode *node, Value *value) {
+    switch (node->type) {
+        case AST_INTEGER:
+            *value = make_int(node->value->int_value);
+            return true;
+        case AST_FLOAT:
+            *value = make_float(node->value->float_value);
+            return true;
+        case AST_BOOL:
+            *value = make_bool(node->value->bool_value);
+            return true;
+        default:
+            return false;
+    }
+}
 
+// pure natives called with constant arguments are evaluated right away
+static bool fold_native_call(BytecodeBuffer *buffer, ASTNode *node, const NativeFunction *native) {
+    Value args[UINT8_MAX];
+    const size_t argc = node->call_expr.arguments->count;
+    if (!(native->flags & NATIVE_PURE)) {
+        return false;
+    }
     for (size_t i = 0; i < argc; ++i) {
+        if (!constant_value(node->call_expr.arguments->nodes[i], &args[i])) {
+            return false;
+        }
+    }
+
+    Value result;
+    if (!native->fn(gcontext->vm, args, argc, &result)) {
+        // leave the error to run time
+        return false;
+    }
+
+    switch (VALUE_TYPE(result)) {
+        case VAL_INT:
+            bc_emit_opcode_with_int(buffer, OP_LOAD_CONST_INT, AS_INT(result));
+            return true;
+        case VAL_FLOAT:
+            bc_emit_opcode_with_float(buffer, OP_LOAD_CONST_FLOAT, AS_FLOAT(result));
+            return true;
+        case VAL_BOOL:
+            bc_emit_opcode_with_byte(buffer, OP_LOAD_BOOL, AS_BOOL(result) ? 1 : 0);
+            return true;
+        default:
+            return false;
+    }
+}
+
+/// Compile a call to a C builtin, no call frame is involved
+void compile_native_call(BytecodeBuffer *buffer, ASTNode *node, uint16_t index) {
+    const NativeFunction *native = get_native(gcontext, index);
+    if (fold_native_call(buffer, node, native)) {
+        return;
+    }
+
+    for (size_t i = 0; i < node->call_expr.arguments->count; ++i) {
         compile_node(node->call_expr.arguments->nodes[i], buffer);
     }
 
-    bc_emit_opcode_with_string(buffer, OP_CALL, fn->name);
+    bc_emit_opcode_with_uint16(buffer, OP_CALL_NATIVE, index);
 }
 
 /// Compile Variable Declaration AST Node
@@ -520,7 +865,8 @@ void compile_var_decl(BytecodeBuffer *buffer, ASTNode *node) {
     Symbol *symbol = lookup_symbol(gcontext->symbols, node->var_decl_expr.identifier);
 
     if (node->var_decl_expr.value) {
-        compile_node(node->var_decl_expr.value, buffer);
+        compile_expr_into(buffer, node->var_decl_expr.value, symbol->data.variable.index);
+        return;
     }
 
     bc_emit_opcode_with_uint16(buffer, OP_STORE_VAR, symbol->data.variable.index);
@@ -24,6 +24,7 @@ void compile_ternary_op(BytecodeBuffer* buffer, ASTNode* node);
 void compile_compare(BytecodeBuffer* buffer, ASTNode* node);
 void compile_assign(BytecodeBuffer* buffer, ASTNode* node);
 void compile_call(BytecodeBuffer* buffer, ASTNode* node);
+void compile_native_call(BytecodeBuffer* buffer, ASTNode* node, uint16_t index);
 void compile_expression_statement(BytecodeBuffer* buffer, ASTNode* node);
 void compile_block(BytecodeBuffer* buffer, ASTNode* node);
 void compile_if(BytecodeBuffer* buffer, ASTNode* node);
@@ -12,25 +12,25 @@
 #include "compiler.h"
 #include "uthash.h"
 
-void ctx_init(Context *ctx, const char *source_code) {
-    ctx->source_length = strlen(source_code);
-    ctx->source = (char *) tige_alloc(ctx, ctx->source_length + 1);
-    strcpy(ctx->source, source_code);
+void ctx_init(Context *ctx, const char *source_code, size_t length) {
+    ctx->source = source_code;
+    ctx->source_length = length;
 
     ctx->error_list = create_error_list();
-    lexer_init(&ctx->lexer, ctx->source);
+    lexer_init(&ctx->lexer, ctx->source, ctx->source_length);
     parser_init(&ctx->parser, ctx);
 
     // as soon as we encounter a block, this will be initialized
     ctx->symbols = create_symbol_table();
+    ctx->register_ops = true;
+    ctx->functions = nullptr;
+    ctx->natives = (NativeTable) {};
+    register_builtin_natives(ctx);
     ctx->vm = create_vm(ctx);
 }
 
 void ctx_free(Context *ctx) {
-    if (ctx->source != nullptr) {
-        tige_free(ctx, ctx->source);
-        ctx->source = nullptr;
-    }
+    ctx->source = nullptr;
 
     if (ctx->error_list != nullptr) {
         free_error_list(ctx->error_list);
@@ -38,6 +38,7 @@ void ctx_free(Context *ctx) {
     }
 
     destroy_symbol_table(ctx->symbols);
+    destroy_native_table(&ctx->natives);
     bc_destroy_bytecode_buffer(ctx->code);
 }
 
@@ -47,15 +48,28 @@ void ctx_destroy(Context* context) {
 }
 
 // TODO: multithreading
-void vm_swap_code_buffer(VM *vm, BytecodeBuffer *buffer) {
+// Load a compiled buffer into the VM, decoding and validating it once up front
+bool vm_swap_code_buffer(VM *vm, BytecodeBuffer *buffer) {
     // sometimes we need to switch the buffer in the middle of another so
     // TODO: save the last buffer execution state for later resume
-    if (bc_is_buffer_valid(buffer)) {
-        vm->bytecode = buffer->current_chunk->bytecode;
-        vm->size = bc_get_total_bytecode_size(buffer);
-        vm->buffer = buffer;
-        vm->chunk = buffer->current_chunk;
+    if (!bc_is_buffer_valid(buffer)) {
+        return false;
+    }
+
+    InstructionStream *code = decode_buffer(buffer, vm->context);
+    if (!code) {
+        fprintf(stderr, "Error: failed to load the compiled code.\n");
+        return false;
     }
+
+    if (vm->jit) {
+        jit_reset(vm->jit, code);
+    }
+    destroy_instruction_stream(vm->code);
+    vm->code = code;
+    vm->buffer = buffer;
+    vm->pc = code->entry;
+    return true;
 }
 
 void ctx_get_compiled_code(Context *context, BytecodeBuffer **buf) {
@@ -92,7 +106,6 @@ void ctx_start_parsing(Context *context) {
     auto ast = parse(context);
     if (ast) {
         context->ast = ast;
-        context->vm = create_vm(context);
         context->code = compile_ast(ast, context);
     }
 }
@@ -108,8 +121,19 @@ bool register_function(Context *context, const char *name, Function *function_ob
         return false;
     }
 
+    // redefinition: keep the entry, call sites that cached the old function follow redefined_by
+    FunctionEntry *existing = nullptr;
+    HASH_FIND_STR(context->functions, name, existing);
+    if (existing) {
+        if (existing->function != function_obj) {
+            existing->function->redefined_by = function_obj;
+            existing->function = function_obj;
+        }
+        return true;
+    }
+
     // Allocate memory for the FunctionEntry
-    FunctionEntry *entry = (FunctionEntry *)vm_malloc(sizeof(FunctionEntry));
+    FunctionEntry *entry = (FunctionEntry *)vm_malloc(context->vm, sizeof(FunctionEntry));
     if (!entry) {
         fprintf(stderr, "Failed to allocate memory for FunctionEntry.\n");
         return false;
@@ -119,11 +143,12 @@ bool register_function(Context *context, const char *name, Function *function_ob
     entry->name = strdup(name);
     if (!entry->name) {
         fprintf(stderr, "Failed to allocate memory for function name.\n");
-        vm_free(entry);
+        vm_free(context->vm, entry);
         return false;
     }
 
     entry->function = function_obj;
+    entry->first = function_obj;
     // add the symbol if it's not already there
     add_function_symbol(context->symbols, name, function_obj->arity);
 
@@ -139,14 +164,17 @@ Function *get_function(Context *context, const char *name) {
         return nullptr;
     }
 
+    Function *function = find_function(context, name);
+    if (!function) {
+        fprintf(stderr, "Function '%s' not found in the context.\n", name);
+    }
+    return function;
+}
+
+Function *find_function(Context *context, const char *name) {
     FunctionEntry *entry = nullptr;
     HASH_FIND_STR(context->functions, name, entry);
-
-    if (entry) {
-        return entry->function;
-    }
-    fprintf(stderr, "Function '%s' not found in the context.\n", name);
-    return nullptr;
+    return entry ? entry->function : nullptr;
 }
 
 bool remove_function(Context *context, const char *name) {
@@ -161,7 +189,7 @@ bool remove_function(Context *context, const char *name) {
     if (entry) {
         HASH_DEL(context->functions, entry);
         free(entry->name);
-        vm_free(entry);
+        vm_free(context->vm, entry);
         return true;
     } else {
         fprintf(stderr, "Function '%s' not found. Cannot remove.\n", name);
@@ -177,7 +205,13 @@ void destroy_function_map(Context *context) {
     HASH_ITER(hh, context->functions, current_entry, tmp) {
         HASH_DEL(context->functions, current_entry);
         free(current_entry->name);
-        destroy_function(current_entry->function);
-        vm_free(current_entry);
+        // older definitions were kept alive for the call sites that may still cache them
+        Function *fn = current_entry->first;
+        while (fn) {
+            Function *next = fn->redefined_by;
+            destroy_function(fn);
+            fn = next;
+        }
+        vm_free(context->vm, current_entry);
     }
 }
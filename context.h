@@ -11,18 +11,20 @@
 #include "symbol_table.h"
 #include "vm.h"
 #include "bytecode_buffer.h"
+#include "natives.h"
 
 typedef struct Context Context;
 
 typedef struct FunctionEntry {
     char *name;                 // Key: Function name
     Function *function;       // Value: Pointer to Function Object
+    Function *first;            // First definition, its redefined_by chain ends in function
     UT_hash_handle hh;          // Makes this structure hashable
 } FunctionEntry;
 
 struct Context {
-    // code information
-    char* source;
+    // code information, borrowed from the caller of ctx_init
+    const char* source;
     size_t source_length;
 
     // Lexer and parser instances
@@ -34,6 +36,8 @@ struct Context {
 
     // scope checking for the compilation phase
     SymbolTable* symbols;
+    // emit register (three-address) instructions for locals and constants
+    bool register_ops;
 
     // total allocated memory
     size_t total_mem;
@@ -44,12 +48,17 @@ struct Context {
 
     // Functions map
     FunctionEntry *functions;
+    // C builtins, called by index
+    NativeTable natives;
 };
 
 bool register_function(Context *context, const char *name, Function* function_obj);
 Function *get_function(Context *context, const char *name);
+// like get_function, but a missing function is left to the caller to report
+Function *find_function(Context *context, const char *name);
 
-void ctx_init(Context* ctx, const char* source_code);
+// source_code is not copied nor NUL terminated, it has to outlive the context
+void ctx_init(Context* ctx, const char* source_code, size_t length);
 bool ctx_is_initialized(Context *context);
 
 void ctx_start_parsing(Context *context);
@@ -66,7 +75,7 @@ VM *ctx_get_active_vm(Context *context);
 
 void ctx_get_compiled_code(Context *context, BytecodeBuffer **buf);
 
-void vm_swap_code_buffer(VM *vm, BytecodeBuffer *buffer);
+bool vm_swap_code_buffer(VM *vm, BytecodeBuffer *buffer);
 
 void ctx_destroy(Context* context);
 
@@ -0,0 +1,395 @@
+//
+// Created by fathi on 11/14/2024.
+//
+
+#include "decoder.h"
+#include "context.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// a jump that still has to be resolved to an instruction pointer
+typedef struct {
+    size_t instruction;
+    size_t map;                 // jumps never leave their segment
+    int64_t offset;
+} PendingJump;
+
+// per segment map from bytecode offsets to instruction indices
+typedef struct {
+    CodeSegment *segment;
+    int64_t *index_of;          // segment->size + 1 entries, -1 for non instruction boundaries
+} SegmentMap;
+
+typedef struct {
+    Instruction *code;
+    size_t count;
+    size_t capacity;
+
+    PendingJump *jumps;
+    size_t jump_count;
+    size_t jump_capacity;
+
+    SegmentMap *maps;
+    size_t map_count;
+
+    Context *context;           // resolves call sites
+    const BytecodeBuffer *buffer;   // constant pool
+} Decoder;
+
+static Instruction *decoder_append(Decoder *decoder, Opcode opcode) {
+    if (decoder->count >= decoder->capacity) {
+        decoder->capacity = decoder->capacity == 0 ? 256 : decoder->capacity * 2;
+        decoder->code = realloc(decoder->code, sizeof(Instruction) * decoder->capacity);
+        if (!decoder->code) {
+            fprintf(stderr, "Failed to allocate memory for decoded instructions.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    Instruction *ins = &decoder->code[decoder->count++];
+    memset(ins, 0, sizeof(Instruction));
+    ins->opcode = opcode;
+    return ins;
+}
+
+static void decoder_add_jump(Decoder *decoder, int64_t offset) {
+    if (decoder->jump_count >= decoder->jump_capacity) {
+        decoder->jump_capacity = decoder->jump_capacity == 0 ? 64 : decoder->jump_capacity * 2;
+        decoder->jumps = realloc(decoder->jumps, sizeof(PendingJump) * decoder->jump_capacity);
+        if (!decoder->jumps) {
+            fprintf(stderr, "Failed to allocate memory for jump fixups.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    decoder->jumps[decoder->jump_count++] = (PendingJump) {
+            .instruction = decoder->count - 1,
+            .map = decoder->map_count - 1,
+            .offset = offset,
+    };
+}
+
+// bounds checked operand read, the whole operand must lie inside the segment
+static bool read_operand(const CodeSegment *segment, size_t *offset, void *dst, size_t size) {
+    if (*offset + size > segment->size) {
+        fprintf(stderr, "Error: truncated operand in segment %zu at offset 0x%02zx.\n", segment->segment_id, *offset);
+        return false;
+    }
+    memcpy(dst, segment->bytecode + *offset, size);
+    *offset += size;
+    return true;
+}
+
+static bool read_register(const CodeSegment *segment, size_t *offset, uint16_t *reg) {
+    if (!read_operand(segment, offset, reg, sizeof(uint16_t))) {
+        return false;
+    }
+    if (*reg >= MAX_REGISTERS) {
+        fprintf(stderr, "Error: register r%u out of range in segment %zu.\n", *reg, segment->segment_id);
+        return false;
+    }
+    return true;
+}
+
+// the relative offset ends the instruction, resolve it against the segment offset right after it
+static bool read_jump(Decoder *decoder, const CodeSegment *segment, size_t *offset) {
+    JumpOffset relative;
+    if (!read_operand(segment, offset, &relative, sizeof(JumpOffset))) {
+        return false;
+    }
+    decoder_add_jump(decoder, (int64_t) *offset + relative);
+    return true;
+}
+
+// decode a single instruction starting at *offset
+static bool decode_instruction(Decoder *decoder, const CodeSegment *segment, size_t *offset) {
+    const size_t start = *offset;
+    const auto opcode = (Opcode) segment->bytecode[(*offset)++];
+    Instruction *ins = decoder_append(decoder, opcode);
+
+    switch (opcode) {
+        case OP_LOAD_CONST_INT:
+            return read_operand(segment, offset, &ins->operand.as_int, sizeof(int64_t));
+        case OP_LOAD_CONST_FLOAT:
+            return read_operand(segment, offset, &ins->operand.as_float, sizeof(double));
+        case OP_LOAD_BOOL: {
+            uint8_t value;
+            if (!read_operand(segment, offset, &value, sizeof(uint8_t))) return false;
+            ins->operand.as_bool = value != 0;
+            return true;
+        }
+        case OP_LOAD_STRING: {
+            uint32_t index;
+            if (!read_operand(segment, offset, &index, sizeof(uint32_t))) return false;
+            if (index >= decoder->buffer->constant_count) {
+                fprintf(stderr, "Error: constant %u out of range in segment %zu.\n", index, segment->segment_id);
+                return false;
+            }
+            ins->operand.as_string = decoder->buffer->constants[index];
+            return true;
+        }
+        case OP_LOAD_VAR:
+        case OP_STORE_VAR:
+        case OP_LOAD_GLOBAL:
+        case OP_STORE_GLOBAL:
+        case OP_INC_REG:
+            return read_register(segment, offset, &ins->a);
+        case OP_JMP:
+        case OP_JMP_IF_TRUE:
+        case OP_JMP_IF_FALSE:
+            return read_jump(decoder, segment, offset);
+        case OP_ADD_RRR:
+        case OP_SUB_RRR:
+        case OP_MUL_RRR:
+        case OP_DIV_RRR:
+            return read_register(segment, offset, &ins->a) &&
+                   read_register(segment, offset, &ins->b) &&
+                   read_register(segment, offset, &ins->c);
+        case OP_ADD_RRI:
+        case OP_SUB_RRI:
+        case OP_MUL_RRI:
+        case OP_DIV_RRI:
+            return read_register(segment, offset, &ins->a) &&
+                   read_register(segment, offset, &ins->b) &&
+                   read_operand(segment, offset, &ins->operand.as_int, sizeof(int64_t));
+        case OP_MOV_RR:
+            return read_register(segment, offset, &ins->a) &&
+                   read_register(segment, offset, &ins->b);
+        case OP_MOV_RI:
+            return read_register(segment, offset, &ins->a) &&
+                   read_operand(segment, offset, &ins->operand.as_int, sizeof(int64_t));
+        case OP_EQ_RR_JMP:
+        case OP_NE_RR_JMP:
+        case OP_LT_RR_JMP:
+        case OP_LE_RR_JMP:
+        case OP_GT_RR_JMP:
+        case OP_GE_RR_JMP:
+        case OP_EQ_RI_JMP:
+        case OP_NE_RI_JMP:
+        case OP_LT_RI_JMP:
+        case OP_LE_RI_JMP:
+        case OP_GT_RI_JMP:
+        case OP_GE_RI_JMP: {
+            if (!read_register(segment, offset, &ins->a)) return false;
+            if (opcode >= OP_EQ_RI_JMP) {
+                if (!read_operand(segment, offset, &ins->operand.as_int, sizeof(int64_t))) return false;
+            } else if (!read_register(segment, offset, &ins->b)) {
+                return false;
+            }
+            return read_jump(decoder, segment, offset);
+        }
+        case OP_CALL:
+        case OP_TAIL_CALL: {
+            // base of the callee's register window, then the function name stored inline and null terminated
+            if (!read_register(segment, offset, &ins->a)) return false;
+            const void *end = memchr(segment->bytecode + *offset, '\0', segment->size - *offset);
+            if (!end) {
+                fprintf(stderr, "Error: unterminated function name in segment %zu at offset 0x%02zx.\n",
+                        segment->segment_id, start);
+                return false;
+            }
+            // link the call site to its callee once, instead of a name lookup per call
+            const char *name = (const char *) (segment->bytecode + *offset);
+            ins->operand.as_function = decoder->context ? get_function(decoder->context, name) : nullptr;
+            if (!ins->operand.as_function) {
+                fprintf(stderr, "Error: call to unknown function '%s' in segment %zu at offset 0x%02zx.\n",
+                        name, segment->segment_id, start);
+                return false;
+            }
+            *offset = (const uint8_t *) end - segment->bytecode + 1;
+            return true;
+        }
+        case OP_CALL_NATIVE: {
+            uint16_t index;
+            if (!read_operand(segment, offset, &index, sizeof(uint16_t))) return false;
+            const NativeFunction *native = get_native(decoder->context, index);
+            if (!native) {
+                fprintf(stderr, "Error: unknown native function %u in segment %zu at offset 0x%02zx.\n",
+                        index, segment->segment_id, start);
+                return false;
+            }
+            // copied into the instruction so a call never has to touch the table
+            ins->operand.as_native = native->fn;
+            ins->b = native->flags;
+            ins->c = native->arity;
+            return true;
+        }
+        case OP_NOPE:
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_DIV:
+        case OP_AND:
+        case OP_OR:
+        case OP_NOT:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_LESS_THAN:
+        case OP_GREATER_THAN:
+        case OP_LESS_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_RETURN:
+        case OP_ENTER_SCOPE:
+        case OP_EXIT_SCOPE:
+        case OP_PUSH:
+        case OP_POP:
+        case OP_SAVE_SP:
+        case OP_RESET_SP:
+        case OP_HALT:
+            return true;
+        default:
+            fprintf(stderr, "Error: unsupported opcode 0x%02x in segment %zu at offset 0x%02zx.\n",
+                    opcode, segment->segment_id, start);
+            return false;
+    }
+}
+
+static bool decode_segment(Decoder *decoder, SegmentMap *map) {
+    const CodeSegment *segment = map->segment;
+    map->index_of = malloc(sizeof(int64_t) * (segment->size + 1));
+    for (size_t i = 0; i <= segment->size; i++) {
+        map->index_of[i] = -1;
+    }
+
+    size_t offset = 0;
+    while (offset < segment->size) {
+        map->index_of[offset] = (int64_t) decoder->count;
+        if (!decode_instruction(decoder, segment, &offset)) {
+            return false;
+        }
+    }
+
+    // jumps may target the end of a segment, and a segment that does not end in a
+    // terminator must not fall through into whatever got decoded after it
+    map->index_of[segment->size] = (int64_t) decoder->count;
+    decoder_append(decoder, OP_HALT);
+    return true;
+}
+
+static SegmentMap *find_segment_map(Decoder *decoder, size_t segment_id) {
+    // segments are listed in creation order, so their ids are sorted
+    size_t lo = 0, hi = decoder->map_count;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        const size_t id = decoder->maps[mid].segment->segment_id;
+        if (id == segment_id) {
+            return &decoder->maps[mid];
+        }
+        if (id < segment_id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return nullptr;
+}
+
+static int64_t resolve(const SegmentMap *map, int64_t offset) {
+    if (offset < 0 || (size_t) offset > map->segment->size || map->index_of[offset] < 0) {
+        fprintf(stderr, "Error: jump into the middle of an instruction (segment %zu, offset 0x%02llx).\n",
+                map->segment->segment_id, (long long) offset);
+        return -1;
+    }
+    return map->index_of[offset];
+}
+
+static void decoder_free(Decoder *decoder) {
+    for (size_t i = 0; i < decoder->map_count; i++) {
+        free(decoder->maps[i].index_of);
+    }
+    free(decoder->maps);
+    free(decoder->jumps);
+    free(decoder->code);
+}
+
+InstructionStream *decode_buffer(BytecodeBuffer *buffer, Context *context) {
+    if (!bc_is_buffer_valid(buffer)) {
+        return nullptr;
+    }
+
+    Decoder decoder = {};
+    decoder.context = context;
+    decoder.buffer = buffer;
+    decoder.maps = calloc(buffer->segment_count, sizeof(SegmentMap));
+
+    for (CodeSegment *segment = buffer->head; segment; segment = segment->next) {
+        if (decoder.map_count >= buffer->segment_count) {
+            fprintf(stderr, "Error: bytecode buffer segment count mismatch.\n");
+            decoder_free(&decoder);
+            return nullptr;
+        }
+        SegmentMap *map = &decoder.maps[decoder.map_count++];
+        map->segment = segment;
+        if (!decode_segment(&decoder, map)) {
+            decoder_free(&decoder);
+            return nullptr;
+        }
+    }
+
+    // move everything into its final, aligned home before taking addresses
+    InstructionStream *stream = malloc(sizeof(InstructionStream));
+    const size_t bytes = sizeof(Instruction) * decoder.count;
+    stream->code = aligned_alloc(INSTRUCTION_ALIGNMENT,
+                                 (bytes + INSTRUCTION_ALIGNMENT - 1) / INSTRUCTION_ALIGNMENT * INSTRUCTION_ALIGNMENT);
+    if (!stream->code) {
+        fprintf(stderr, "Failed to allocate memory for the instruction stream.\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(stream->code, decoder.code, bytes);
+    stream->count = decoder.count;
+    stream->entry = stream->code;
+
+    for (size_t i = 0; i < decoder.jump_count; i++) {
+        const PendingJump *jump = &decoder.jumps[i];
+        const int64_t target = resolve(&decoder.maps[jump->map], jump->offset);
+        if (target < 0) {
+            decoder_free(&decoder);
+            destroy_instruction_stream(stream);
+            return nullptr;
+        }
+        stream->code[jump->instruction].target = &stream->code[target];
+    }
+
+    if (!vm_bind_handlers(stream->code, stream->count)) {
+        decoder_free(&decoder);
+        destroy_instruction_stream(stream);
+        return nullptr;
+    }
+
+    // resolve the entry point of every bytecode function
+    if (context) {
+        FunctionEntry *entry, *tmp;
+        HASH_ITER(hh, context->functions, entry, tmp) {
+            Function *fn = entry->function;
+            if (!fn->segment) {
+                continue;
+            }
+            const SegmentMap *map = find_segment_map(&decoder, fn->segment->segment_id);
+            if (!map) {
+                fprintf(stderr, "Error: function '%s' has no code in this buffer.\n", fn->name);
+            }
+            const int64_t index = map ? resolve(map, 0) : -1;
+            if (index < 0) {
+                decoder_free(&decoder);
+                destroy_instruction_stream(stream);
+                return nullptr;
+            }
+            fn->entry = &stream->code[index];
+            // the segment ends in the HALT guard appended by decode_segment
+            fn->end = &stream->code[map->index_of[fn->segment->size] + 1];
+            fn->calls = 0;
+        }
+    }
+
+    decoder_free(&decoder);
+    return stream;
+}
+
+void destroy_instruction_stream(InstructionStream *stream) {
+    if (stream) {
+        free(stream->code);
+        free(stream);
+    }
+}
@@ -0,0 +1,63 @@
+//
+// Created by fathi on 11/14/2024.
+//
+
+#ifndef TIGE_DECODER_H
+#define TIGE_DECODER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "opcode.h"
+#include "bytecode_buffer.h"
+#include "op_handlers.h"
+#include "natives.h"
+
+typedef struct Context Context;
+typedef struct Instruction Instruction;
+typedef struct Function Function;
+
+// where dispatching an instruction goes
+typedef union InstructionHandler {
+    const void *label;          // dispatch label (threaded dispatch)
+    OpcodeHandler fn;           // handler function (portable dispatch)
+} InstructionHandler;
+
+// A fixed-width, pre-decoded instruction.
+// Operands are decoded and jump targets are resolved once at load time, so the
+// VM never has to touch the raw bytecode (or bounds check it) while executing.
+struct Instruction {
+    InstructionHandler handler;
+    uint8_t opcode;
+    uint8_t tos_state;          // cached stack values on entry (threaded dispatch)
+    uint16_t a;                 // register operands; stack arithmetic and comparisons
+    uint16_t b;                 // keep their quickening state here instead
+    uint16_t c;                 // (see op_handlers.c)
+    union {
+        int64_t as_int;
+        double as_float;
+        bool as_bool;
+        TString *as_string;
+        Function *as_function;  // OP_CALL callee, cached at load time
+        NativeFn as_native;     // OP_CALL_NATIVE entry point
+    } operand;
+    const Instruction *target;  // resolved jump target
+};
+
+static_assert(sizeof(Instruction) == 32, "Instruction must stay 32 bytes wide");
+
+#define INSTRUCTION_ALIGNMENT 32
+
+// The decoded form of a whole BytecodeBuffer
+typedef struct InstructionStream {
+    Instruction *code;
+    size_t count;
+    const Instruction *entry;   // first instruction of the top level code
+} InstructionStream;
+
+// Translate every code segment of the buffer and resolve the entry point of every
+// function registered in the context. Returns nullptr on malformed bytecode.
+InstructionStream *decode_buffer(BytecodeBuffer *buffer, Context *context);
+
+void destroy_instruction_stream(InstructionStream *stream);
+
+#endif //TIGE_DECODER_H
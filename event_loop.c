@@ -0,0 +1,638 @@
+//
+// Created by fathi on 11/26/2024.
+//
+
+// accept4
+#define _GNU_SOURCE
+#include "event_loop.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include "context.h"
+#include "vm.h"
+#include "uthash.h"
+
+#define EVENT_BATCH 64
+#define READ_CHUNK 65536
+#define LISTEN_BACKLOG 512
+
+typedef enum {
+    HANDLE_TIMER,
+    HANDLE_LISTENER,
+    HANDLE_CONNECTION,
+} HandleKind;
+
+typedef struct Handle {
+    int64_t id;                 // what scripts see, never reused
+    HandleKind kind;
+    int fd;
+    uint32_t events;            // registered with epoll, 0 when not registered
+    Function *callback;         // timers, listeners, and connections until connected
+    Function *on_data;          // set by tcp_read
+    bool repeat;                // set_interval
+    bool connecting;
+    bool closing;               // close once the output is written
+    bool closed;
+    char *output;               // queued by tcp_write, output_start bytes of it are written
+    size_t output_start;
+    size_t output_length;
+    size_t output_capacity;
+    struct Handle *next_closed;
+    UT_hash_handle hh;
+} Handle;
+
+struct EventLoop {
+    VM *vm;
+    int epoll_fd;
+    Handle *handles;            // open handles by id
+    Handle *closed;             // freed once the events in flight are dispatched
+    int64_t next_id;
+    bool failed;                // a callback failed, the loop stops
+    bool sleeping;              // the VM is parked in sleep until sleep_fd expires
+    int sleep_fd;               // timerfd of sleep, -1 until the first one
+    char buffer[READ_CHUNK + 1];
+};
+
+EventLoop *create_event_loop(VM *vm) {
+    EventLoop *loop = malloc(sizeof(EventLoop));
+    if (!loop) {
+        return nullptr;
+    }
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0) {
+        perror("Error: epoll_create1");
+        free(loop);
+        return nullptr;
+    }
+    loop->vm = vm;
+    loop->handles = nullptr;
+    loop->closed = nullptr;
+    loop->next_id = 1;
+    loop->failed = false;
+    loop->sleeping = false;
+    loop->sleep_fd = -1;
+    return loop;
+}
+
+static void free_closed(EventLoop *loop) {
+    while (loop->closed) {
+        Handle *handle = loop->closed;
+        loop->closed = handle->next_closed;
+        free(handle->output);
+        free(handle);
+    }
+}
+
+static void close_handle(EventLoop *loop, Handle *handle) {
+    if (handle->closed) {
+        return;
+    }
+    // closing the descriptor removes it from the epoll set
+    close(handle->fd);
+    HASH_DEL(loop->handles, handle);
+    handle->closed = true;
+    handle->next_closed = loop->closed;
+    loop->closed = handle;
+}
+
+void destroy_event_loop(EventLoop *loop) {
+    if (!loop) {
+        return;
+    }
+    Handle *handle, *tmp;
+    HASH_ITER(hh, loop->handles, handle, tmp) {
+        close_handle(loop, handle);
+    }
+    free_closed(loop);
+    if (loop->sleep_fd >= 0) {
+        close(loop->sleep_fd);
+    }
+    close(loop->epoll_fd);
+    free(loop);
+}
+
+size_t event_loop_pending(const EventLoop *loop) {
+    return HASH_COUNT(loop->handles);
+}
+
+// register the events the handle waits for right now
+static bool update_events(EventLoop *loop, Handle *handle) {
+    uint32_t events = 0;
+    switch (handle->kind) {
+        case HANDLE_TIMER:
+        case HANDLE_LISTENER:
+            events = EPOLLIN;
+            break;
+        case HANDLE_CONNECTION:
+            events = (handle->on_data ? EPOLLIN : 0) |
+                     (handle->connecting || handle->output_length > handle->output_start ? EPOLLOUT : 0);
+            break;
+    }
+    if (events == handle->events) {
+        return true;
+    }
+
+    // a registered socket would report hang ups even without events, so idle ones leave the set
+    struct epoll_event event = {.events = events, .data.ptr = handle};
+    const int op = !events ? EPOLL_CTL_DEL : !handle->events ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(loop->epoll_fd, op, handle->fd, &event) < 0) {
+        perror("Error: epoll_ctl");
+        return false;
+    }
+    handle->events = events;
+    return true;
+}
+
+static Handle *add_handle(EventLoop *loop, HandleKind kind, int fd) {
+    Handle *handle = calloc(1, sizeof(Handle));
+    if (!handle) {
+        close(fd);
+        return nullptr;
+    }
+    handle->id = loop->next_id++;
+    handle->kind = kind;
+    handle->fd = fd;
+    HASH_ADD(hh, loop->handles, id, sizeof(int64_t), handle);
+    return handle;
+}
+
+static Handle *find_handle(EventLoop *loop, Value id) {
+    if (!IS_INT(id)) {
+        return nullptr;
+    }
+    const int64_t key = AS_INT(id);
+    Handle *handle = nullptr;
+    HASH_FIND(hh, loop->handles, &key, sizeof(int64_t), handle);
+    return handle;
+}
+
+static void call(EventLoop *loop, Function *fn, const Value *args, size_t argc) {
+    Value result;
+    if (!vm_call(loop->vm, fn, args, argc, &result)) {
+        loop->failed = true;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Events
+////////////////////////////////////////////////////////////////////////////////
+
+static void on_timer(EventLoop *loop, Handle *handle) {
+    uint64_t expirations;
+    if (read(handle->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    Function *callback = handle->callback;
+    const Value args[] = {make_int(handle->id)};
+    if (!handle->repeat) {
+        close_handle(loop, handle);
+    }
+    // an interval that fell behind runs once, not once per missed expiration
+    call(loop, callback, args, 1);
+}
+
+static void on_accept(EventLoop *loop, Handle *listener) {
+    for (;;) {
+        const int fd = accept4(listener->fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                perror("Error: accept");
+            }
+            return;
+        }
+        Handle *connection = add_handle(loop, HANDLE_CONNECTION, fd);
+        if (!connection) {
+            return;
+        }
+        const Value args[] = {make_int(listener->id), make_int(connection->id)};
+        call(loop, listener->callback, args, 2);
+        if (loop->failed || listener->closed) {
+            return;
+        }
+    }
+}
+
+// write as much of the queued output as the socket takes
+static bool flush_output(EventLoop *loop, Handle *handle) {
+    while (handle->output_start < handle->output_length) {
+        const ssize_t written = send(handle->fd, handle->output + handle->output_start,
+                                     handle->output_length - handle->output_start, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            // the peer is gone, so is the output
+            close_handle(loop, handle);
+            return false;
+        }
+        handle->output_start += (size_t) written;
+    }
+    if (handle->output_start == handle->output_length) {
+        handle->output_start = handle->output_length = 0;
+        if (handle->closing) {
+            close_handle(loop, handle);
+            return true;
+        }
+    }
+    return update_events(loop, handle);
+}
+
+static void on_connected(EventLoop *loop, Handle *handle) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    getsockopt(handle->fd, SOL_SOCKET, SO_ERROR, &error, &length);
+    handle->connecting = false;
+    Function *callback = handle->callback;
+    handle->callback = nullptr;
+    if (error) {
+        close_handle(loop, handle);
+    } else {
+        update_events(loop, handle);
+    }
+    const Value args[] = {make_int(handle->id), make_bool(error == 0)};
+    call(loop, callback, args, 2);
+}
+
+static void on_readable(EventLoop *loop, Handle *handle) {
+    ssize_t count;
+    do {
+        count = recv(handle->fd, loop->buffer, READ_CHUNK, 0);
+    } while (count < 0 && errno == EINTR);
+    if (count < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return;
+    }
+
+    Function *on_data = handle->on_data;
+    if (count <= 0) {
+        // end of the stream (or an error, the same to scripts): reading stops
+        count = 0;
+        handle->on_data = nullptr;
+        update_events(loop, handle);
+    }
+    loop->buffer[count] = '\0';
+    const Value args[] = {make_int(handle->id), vm_make_string(loop->vm, loop->buffer, (size_t) count)};
+    call(loop, on_data, args, 2);
+}
+
+static void dispatch(EventLoop *loop, Handle *handle, uint32_t events) {
+    switch (handle->kind) {
+        case HANDLE_TIMER:
+            on_timer(loop, handle);
+            break;
+        case HANDLE_LISTENER:
+            on_accept(loop, handle);
+            break;
+        case HANDLE_CONNECTION:
+            if (handle->connecting) {
+                on_connected(loop, handle);
+                break;
+            }
+            if ((events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) && handle->output_length) {
+                flush_output(loop, handle);
+            }
+            if (!handle->closed && !loop->failed && handle->on_data && (events & (EPOLLIN | EPOLLERR | EPOLLHUP))) {
+                on_readable(loop, handle);
+            }
+            break;
+    }
+}
+
+// wait up to timeout ms (-1 for ever) for a batch of events and dispatch it
+static bool poll_events(EventLoop *loop, int timeout) {
+    struct epoll_event events[EVENT_BATCH];
+    const int count = epoll_wait(loop->epoll_fd, events, EVENT_BATCH, timeout);
+    if (count < 0) {
+        if (errno == EINTR) {
+            return true;
+        }
+        perror("Error: epoll_wait");
+        return false;
+    }
+    for (int i = 0; i < count && !loop->failed; i++) {
+        Handle *handle = events[i].data.ptr;
+        // closed by an earlier callback of the batch
+        if (!handle->closed) {
+            dispatch(loop, handle, events[i].events);
+        }
+    }
+    free_closed(loop);
+    return true;
+}
+
+bool event_loop_run(EventLoop *loop) {
+    while (!loop->failed && loop->handles) {
+        if (!poll_events(loop, -1)) {
+            return false;
+        }
+    }
+    return !loop->failed;
+}
+
+bool event_loop_run_ready(EventLoop *loop) {
+    return poll_events(loop, 0) && !loop->failed;
+}
+
+int event_loop_wait_fd(const EventLoop *loop) {
+    return loop->sleeping ? loop->sleep_fd : loop->epoll_fd;
+}
+
+bool event_loop_wait_parked(EventLoop *loop) {
+    if (!loop || !loop->sleeping) {
+        return true;
+    }
+    struct pollfd expired = {.fd = loop->sleep_fd, .events = POLLIN};
+    int ready;
+    while ((ready = poll(&expired, 1, -1)) < 0 && errno == EINTR) {
+    }
+    uint64_t expirations;
+    loop->sleeping = false;
+    return ready > 0 && read(loop->sleep_fd, &expirations, sizeof(expirations)) == sizeof(expirations);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Builtins
+////////////////////////////////////////////////////////////////////////////////
+
+static EventLoop *loop_of(VM *vm) {
+    if (!vm->events && !(vm->events = create_event_loop(vm))) {
+        fprintf(stderr, "Error: the event loop is not available.\n");
+    }
+    return vm->events;
+}
+
+// the function named by a callback argument, it has to take arity arguments
+static Function *callback_arg(VM *vm, Value name, size_t arity, const char *builtin) {
+    if (VALUE_TYPE(name) != VAL_STRING) {
+        fprintf(stderr, "%s expects the name of the callback function.\n", builtin);
+        return nullptr;
+    }
+    Function *fn = find_function(vm->context, AS_STRING(name));
+    if (!fn) {
+        fprintf(stderr, "%s: unknown callback function '%s'.\n", builtin, AS_STRING(name));
+        return nullptr;
+    }
+    if (fn->arity != arity) {
+        fprintf(stderr, "The callback '%s' of %s has to take %zu argument(s).\n", fn->name, builtin, arity);
+        return nullptr;
+    }
+    return fn;
+}
+
+static bool parse_address(Value host, Value port, struct sockaddr_in *address, const char *builtin) {
+    if (VALUE_TYPE(host) != VAL_STRING || !IS_INT(port) || AS_INT(port) < 0 || AS_INT(port) > 65535) {
+        fprintf(stderr, "%s expects a host and a port.\n", builtin);
+        return false;
+    }
+    const char *name = strcmp(AS_STRING(host), "localhost") == 0 ? "127.0.0.1" : AS_STRING(host);
+    *address = (struct sockaddr_in) {.sin_family = AF_INET, .sin_port = htons((uint16_t) AS_INT(port))};
+    if (inet_pton(AF_INET, name, &address->sin_addr) != 1) {
+        fprintf(stderr, "%s: '%s' is not an IPv4 address.\n", builtin, AS_STRING(host));
+        return false;
+    }
+    return true;
+}
+
+static bool start_timer(VM *vm, const Value *args, bool repeat, Value *result, const char *builtin) {
+    if (!IS_INT(args[0]) || AS_INT(args[0]) < 0) {
+        fprintf(stderr, "%s expects a delay in milliseconds.\n", builtin);
+        return false;
+    }
+    Function *callback = callback_arg(vm, args[1], 1, builtin);
+    EventLoop *loop = callback ? loop_of(vm) : nullptr;
+    if (!loop) {
+        return false;
+    }
+
+    const int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0) {
+        perror("Error: timerfd_create");
+        return false;
+    }
+    const int64_t ms = AS_INT(args[0]);
+    const struct timespec delay = {.tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000 + (ms == 0)};
+    const struct itimerspec spec = {.it_value = delay, .it_interval = repeat ? delay : (struct timespec) {}};
+    Handle *handle = timerfd_settime(fd, 0, &spec, nullptr) == 0 ? add_handle(loop, HANDLE_TIMER, fd) : nullptr;
+    if (!handle) {
+        fprintf(stderr, "Error: could not start a timer.\n");
+        return false;
+    }
+    handle->callback = callback;
+    handle->repeat = repeat;
+    if (!update_events(loop, handle)) {
+        close_handle(loop, handle);
+        return false;
+    }
+    *result = make_int(handle->id);
+    return true;
+}
+
+static bool native_set_timeout(VM *vm, const Value *args, [[maybe_unused]] size_t argc, Value *result) {
+    return start_timer(vm, args, false, result, "set_timeout");
+}
+
+static bool native_set_interval(VM *vm, const Value *args, [[maybe_unused]] size_t argc, Value *result) {
+    return start_timer(vm, args, true, result, "set_interval");
+}
+
+static bool native_clear_timer(VM *vm, const Value *args, [[maybe_unused]] size_t argc, Value *result) {
+    Handle *handle = vm->events ? find_handle(vm->events, args[0]) : nullptr;
+    *result = make_bool(handle && handle->kind == HANDLE_TIMER);
+    if (AS_BOOL(*result)) {
+        close_handle(vm->events, handle);
+    }
+    return true;
+}
+
+static bool native_tcp_listen(VM *vm, const Value *args, [[maybe_unused]] size_t argc, Value *result) {
+    struct sockaddr_in address;
+    if (!parse_address(args[0], args[1], &address, "tcp_listen")) {
+        return false;
+    }
+    Function *callback = callback_arg(vm, args[2], 2, "tcp_listen");
+    EventLoop *loop = callback ? loop_of(vm) : nullptr;
+    if (!loop) {
+        return false;
+    }
+
+    *result = make_int(-1);
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    const int reuse = 1;
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0 ||
+        bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(fd, LISTEN_BACKLOG) < 0) {
+        // listening can fail for reasons the script may handle (port taken)
+        perror("tcp_listen");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return true;
+    }
+    Handle *handle = add_handle(loop, HANDLE_LISTENER, fd);
+    if (handle) {
+        handle->callback = callback;
+        if (update_events(loop, handle)) {
+            *result = make_int(handle->id);
+        } else {
+            close_handle(loop, handle);
+        }
+    }
+    return true;
+}
+
+static bool native_tcp_connect(VM *vm, const Value *args, [[maybe_unused]] size_t argc, Value *result) {
+    struct sockaddr_in address;
+    if (!parse_address(args[0], args[1], &address, "tcp_connect")) {
+        return false;
+    }
+    Function *callback = callback_arg(vm, args[2], 2, "tcp_connect");
+    EventLoop *loop = callback ? loop_of(vm) : nullptr;
+    if (!loop) {
+        return false;
+    }
+
+    *result = make_int(-1);
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || (connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0 && errno != EINPROGRESS)) {
+        perror("tcp_connect");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return true;
+    }
+    // the outcome is reported once the socket is writable, even when it connected right away
+    Handle *handle = add_handle(loop, HANDLE_CONNECTION, fd);
+    if (handle) {
+        handle->callback = callback;
+        handle->connecting = true;
+        if (update_events(loop, handle)) {
+            *result = make_int(handle->id);
+        } else {
+            close_handle(loop, handle);
+        }
+    }
+    return true;
+}
+
+static bool native_sleep(VM *vm, const Value *args, [[maybe_unused]] size_t argc, Value *result) {
+    if (!IS_INT(args[0]) || AS_INT(args[0]) < 0) {
+        fprintf(stderr, "sleep expects a delay in milliseconds.\n");
+        return false;
+    }
+    const int64_t ms = AS_INT(args[0]);
+    struct timespec wake_at;
+    clock_gettime(CLOCK_MONOTONIC, &wake_at);
+    wake_at.tv_sec += ms / 1000 + (wake_at.tv_nsec + ms % 1000 * 1000000) / 1000000000;
+    wake_at.tv_nsec = (wake_at.tv_nsec + ms % 1000 * 1000000) % 1000000000;
+    *result = make_null();
+
+    // on its fiber the VM leaves the thread to its driver until the timer expires
+    EventLoop *loop = loop_of(vm);
+    if (loop && loop->sleep_fd < 0) {
+        loop->sleep_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    }
+    if (loop && loop->sleep_fd >= 0) {
+        const struct itimerspec spec = {.it_value = wake_at};
+        loop->sleeping = timerfd_settime(loop->sleep_fd, TFD_TIMER_ABSTIME, &spec, nullptr) == 0;
+        if (loop->sleeping && vm_park(vm)) {
+            return true;
+        }
+        loop->sleeping = false;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake_at, nullptr) == EINTR) {
+    }
+    return true;
+}
+
+static Handle *connection_arg(VM *vm, Value id) {
+    Handle *handle = vm->events ? find_handle(vm->events, id) : nullptr;
+    return handle && handle->kind == HANDLE_CONNECTION && !handle->closing ? handle : nullptr;
+}
+
+static bool native_tcp_read(VM *vm, const Value *args, [[maybe_unused]] size_t argc, Value *result) {
+    Function *on_data = callback_arg(vm, args[1], 2, "tcp_read");
+    if (!on_data) {
+        return false;
+    }
+    Handle *handle = connection_arg(vm, args[0]);
+    if (handle) {
+        handle->on_data = on_data;
+    }
+    *result = make_bool(handle && update_events(vm->events, handle));
+    return true;
+}
+
+static bool native_tcp_write(VM *vm, const Value *args, [[maybe_unused]] size_t argc, Value *result) {
+    if (VALUE_TYPE(args[1]) != VAL_STRING) {
+        fprintf(stderr, "tcp_write expects a connection and a string.\n");
+        return false;
+    }
+    Handle *handle = connection_arg(vm, args[0]);
+    *result = make_bool(handle != nullptr);
+    if (!handle) {
+        return true;
+    }
+
+    const size_t length = strlen(AS_STRING(args[1]));
+    if (handle->output_length + length > handle->output_capacity) {
+        size_t capacity = handle->output_capacity ? handle->output_capacity : 4096;
+        while (capacity < handle->output_length + length) {
+            capacity *= 2;
+        }
+        char *output = realloc(handle->output, capacity);
+        if (!output) {
+            fprintf(stderr, "Error: out of memory queueing output.\n");
+            return false;
+        }
+        handle->output = output;
+        handle->output_capacity = capacity;
+    }
+    memcpy(handle->output + handle->output_length, AS_STRING(args[1]), length);
+    handle->output_length += length;
+    // written right away when the socket takes it, no need to wait for the loop
+    if (!handle->connecting) {
+        *result = make_bool(flush_output(vm->events, handle));
+    } else {
+        update_events(vm->events, handle);
+    }
+    return true;
+}
+
+static bool native_tcp_close(VM *vm, const Value *args, [[maybe_unused]] size_t argc, Value *result) {
+    Handle *handle = vm->events ? find_handle(vm->events, args[0]) : nullptr;
+    *result = make_bool(handle && handle->kind != HANDLE_TIMER);
+    if (!AS_BOOL(*result)) {
+        return true;
+    }
+    if (handle->kind == HANDLE_CONNECTION && handle->output_length > handle->output_start) {
+        handle->closing = true;
+        handle->on_data = nullptr;
+        update_events(vm->events, handle);
+    } else {
+        close_handle(vm->events, handle);
+    }
+    return true;
+}
+
+void register_event_natives(Context *context) {
+    register_native(context, "set_timeout", native_set_timeout, 2, 0);
+    register_native(context, "set_interval", native_set_interval, 2, 0);
+    register_native(context, "clear_timer", native_clear_timer, 1, NATIVE_NO_GC);
+    register_native(context, "sleep", native_sleep, 1, 0);
+    register_native(context, "tcp_listen", native_tcp_listen, 3, 0);
+    register_native(context, "tcp_connect", native_tcp_connect, 3, 0);
+    register_native(context, "tcp_read", native_tcp_read, 2, 0);
+    register_native(context, "tcp_write", native_tcp_write, 2, 0);
+    register_native(context, "tcp_close", native_tcp_close, 1, NATIVE_NO_GC);
+}
@@ -0,0 +1,64 @@
+//
+// Created by fathi on 11/26/2024.
+//
+
+#ifndef TIGE_EVENT_LOOP_H
+#define TIGE_EVENT_LOOP_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// Event loop.
+// Timers and non-blocking TCP sockets for scripts, on epoll and timerfd. Each VM gets
+// its loop the first time the script uses one of the builtins below; the script
+// registers callbacks by function name, and once its top level code has run, the
+// loop waits for events and calls them (see vm_call) until nothing is left open:
+// event_loop_run, or a driver that waits on event_loop_wait_fd itself (the scheduler).
+//
+//   set_timeout(ms, "cb")              cb(timer) once, returns the timer
+//   set_interval(ms, "cb")             cb(timer) every ms milliseconds
+//   clear_timer(timer)
+//   sleep(ms)                          pauses the script, see event_loop_wait_parked
+//   tcp_listen(host, port, "cb")       cb(listener, connection) per accepted connection,
+//                                      returns the listener, -1 on error
+//   tcp_connect(host, port, "cb")      cb(connection, connected), returns the connection
+//   tcp_read(connection, "cb")         cb(connection, data) per chunk read, "" at the end
+//   tcp_write(connection, data)        queued, written as the socket accepts it
+//   tcp_close(handle)                  connections close once their output is written
+//
+// Hosts are IPv4 addresses or "localhost". Data is passed around as strings, bytes
+// after a NUL are lost.
+
+typedef struct VM VM;
+typedef struct Context Context;
+typedef struct EventLoop EventLoop;
+
+// nullptr when epoll is not available
+EventLoop *create_event_loop(VM *vm);
+void destroy_event_loop(EventLoop *loop);
+
+// Wait for events and run their callbacks until every timer and socket is closed.
+// Returns false when a callback fails.
+bool event_loop_run(EventLoop *loop);
+
+// Run the callbacks of the events ready right now, without waiting.
+// Returns false when a callback fails.
+bool event_loop_run_ready(EventLoop *loop);
+
+// sleep parks a VM running on its fiber (see vm_park): its driver calls this to wait
+// the time out before vm_run_fiber continues the script. Events of the other handles
+// stay pending until event_loop_run. Without a fiber, sleep blocks the thread.
+bool event_loop_wait_parked(EventLoop *loop);
+
+// Readable once the VM can go on: the sleep is over while it is parked in one, else
+// events are ready for event_loop_run_ready. For drivers that wait on many loops.
+int event_loop_wait_fd(const EventLoop *loop);
+
+// timers and sockets still open
+size_t event_loop_pending(const EventLoop *loop);
+
+// the builtins above
+void register_event_natives(Context *context);
+
+#endif //TIGE_EVENT_LOOP_H
@@ -0,0 +1,228 @@
+//
+// Created by fathi on 11/25/2024.
+//
+
+#include "fiber.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <threads.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#if !TIGE_FIBER_ASM
+#include <ucontext.h>
+#endif
+
+// ThreadSanitizer has to be told about every switch, or it crashes on fiber stacks
+#if defined(__SANITIZE_THREAD__)
+#define TIGE_FIBER_TSAN 1
+#elif defined(__has_feature)
+#if __has_feature(thread_sanitizer)
+#define TIGE_FIBER_TSAN 1
+#endif
+#endif
+#ifdef TIGE_FIBER_TSAN
+#include <sanitizer/tsan_interface.h>
+#endif
+
+struct Fiber {
+#if TIGE_FIBER_ASM
+    void *sp;                   // saved stack pointer of the fiber while it is not running
+    void *resumer_sp;           // saved stack pointer of fiber_resume while it is
+#else
+    ucontext_t context;
+    ucontext_t resumer;
+#endif
+    Fiber *previous;            // fiber_current of the resumer
+    FiberFn fn;
+    void *data;
+    bool done;
+    uint8_t *mapping;           // guard page and stack
+    size_t mapping_size;
+#ifdef TIGE_FIBER_TSAN
+    void *tsan_fiber;
+    void *tsan_resumer;
+#endif
+};
+
+static thread_local Fiber *current_fiber;
+
+#if TIGE_FIBER_ASM
+
+// fiber_switch(&save_sp, next_sp): push the callee saved registers and the SSE/x87
+// control words, swap stacks, pop them back from the other stack and return there
+void fiber_switch(void **save_sp, void *next_sp);
+// first return of a new fiber's stack: the Fiber is in r12, the stack is aligned
+void fiber_start(void);
+
+__asm__(
+        ".text\n"
+        ".globl fiber_switch\n"
+        ".type fiber_switch, @function\n"
+        "fiber_switch:\n"
+        "    pushq %rbp\n"
+        "    pushq %rbx\n"
+        "    pushq %r12\n"
+        "    pushq %r13\n"
+        "    pushq %r14\n"
+        "    pushq %r15\n"
+        "    subq $8, %rsp\n"
+        "    stmxcsr (%rsp)\n"
+        "    fnstcw 4(%rsp)\n"
+        "    movq %rsp, (%rdi)\n"
+        "    movq %rsi, %rsp\n"
+        "    ldmxcsr (%rsp)\n"
+        "    fldcw 4(%rsp)\n"
+        "    addq $8, %rsp\n"
+        "    popq %r15\n"
+        "    popq %r14\n"
+        "    popq %r13\n"
+        "    popq %r12\n"
+        "    popq %rbx\n"
+        "    popq %rbp\n"
+        "    ret\n"
+        ".size fiber_switch, .-fiber_switch\n"
+        ".globl fiber_start\n"
+        ".type fiber_start, @function\n"
+        "fiber_start:\n"
+        "    movq %r12, %rdi\n"
+        "    call fiber_main\n"
+        "    ud2\n"
+        ".size fiber_start, .-fiber_start\n"
+);
+
+// the slots fiber_switch pops, lowest address first
+typedef struct {
+    uint32_t mxcsr;
+    uint16_t fpu_control;
+    uint16_t padding;
+    uint64_t r15, r14, r13, r12, rbx, rbp;
+    void (*return_address)(void);
+} InitialFrame;
+
+#endif
+
+// runs on the fiber's stack, switches away for good once fn returns
+void fiber_main(Fiber *fiber) {
+    fiber->fn(fiber->data);
+    fiber->done = true;
+#ifdef TIGE_FIBER_TSAN
+    __tsan_switch_to_fiber(fiber->tsan_resumer, 0);
+#endif
+#if TIGE_FIBER_ASM
+    void *unused;
+    fiber_switch(&unused, fiber->resumer_sp);
+#else
+    setcontext(&fiber->resumer);
+#endif
+    abort();
+}
+
+#if !TIGE_FIBER_ASM
+// makecontext only passes int arguments
+static void fiber_entry(unsigned int high, unsigned int low) {
+    fiber_main((Fiber *) ((uintptr_t) high << 32 | low));
+}
+#endif
+
+Fiber *create_fiber(size_t stack_size, FiberFn fn, void *data) {
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    stack_size = ((stack_size ? stack_size : FIBER_STACK_SIZE) + page - 1) & ~(page - 1);
+
+    Fiber *fiber = calloc(1, sizeof(Fiber));
+    if (!fiber) {
+        return nullptr;
+    }
+    fiber->mapping_size = stack_size + page;
+    fiber->mapping = mmap(nullptr, fiber->mapping_size, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (fiber->mapping == MAP_FAILED) {
+        fprintf(stderr, "Error: could not map a fiber stack.\n");
+        free(fiber);
+        return nullptr;
+    }
+    // an overflow faults instead of running into other memory
+    mprotect(fiber->mapping, page, PROT_NONE);
+    fiber->fn = fn;
+    fiber->data = data;
+#ifdef TIGE_FIBER_TSAN
+    fiber->tsan_fiber = __tsan_create_fiber(0);
+#endif
+
+    uint8_t *top = fiber->mapping + fiber->mapping_size;
+#if TIGE_FIBER_ASM
+    // 16 bytes above the frame keep the stack of fiber_start aligned after its ret
+    static_assert(sizeof(InitialFrame) % 16 == 0);
+    InitialFrame *frame = (InitialFrame *) (top - sizeof(InitialFrame) - 16);
+    uint32_t mxcsr;
+    uint16_t fpu_control;
+    __asm__ volatile("stmxcsr %0" : "=m"(mxcsr));
+    __asm__ volatile("fnstcw %0" : "=m"(fpu_control));
+    *frame = (InitialFrame) {
+        .mxcsr = mxcsr,
+        .fpu_control = fpu_control,
+        .r12 = (uint64_t) (uintptr_t) fiber,
+        .return_address = fiber_start,
+    };
+    fiber->sp = frame;
+#else
+    getcontext(&fiber->context);
+    fiber->context.uc_stack.ss_sp = fiber->mapping + page;
+    fiber->context.uc_stack.ss_size = stack_size;
+    fiber->context.uc_link = nullptr;
+    makecontext(&fiber->context, (void (*)(void)) fiber_entry, 2,
+                (unsigned int) ((uintptr_t) fiber >> 32), (unsigned int) (uintptr_t) fiber);
+    (void) top;
+#endif
+    return fiber;
+}
+
+void destroy_fiber(Fiber *fiber) {
+    if (fiber) {
+#ifdef TIGE_FIBER_TSAN
+        __tsan_destroy_fiber(fiber->tsan_fiber);
+#endif
+        munmap(fiber->mapping, fiber->mapping_size);
+        free(fiber);
+    }
+}
+
+bool fiber_resume(Fiber *fiber) {
+    if (fiber->done) {
+        return false;
+    }
+    fiber->previous = current_fiber;
+    current_fiber = fiber;
+#ifdef TIGE_FIBER_TSAN
+    fiber->tsan_resumer = __tsan_get_current_fiber();
+    __tsan_switch_to_fiber(fiber->tsan_fiber, 0);
+#endif
+#if TIGE_FIBER_ASM
+    fiber_switch(&fiber->resumer_sp, fiber->sp);
+#else
+    swapcontext(&fiber->resumer, &fiber->context);
+#endif
+    current_fiber = fiber->previous;
+    return !fiber->done;
+}
+
+void fiber_yield(void) {
+    Fiber *fiber = current_fiber;
+    if (!fiber) {
+        fprintf(stderr, "Error: fiber_yield outside of a fiber.\n");
+        return;
+    }
+#ifdef TIGE_FIBER_TSAN
+    __tsan_switch_to_fiber(fiber->tsan_resumer, 0);
+#endif
+#if TIGE_FIBER_ASM
+    fiber_switch(&fiber->sp, fiber->resumer_sp);
+#else
+    swapcontext(&fiber->context, &fiber->resumer);
+#endif
+}
+
+Fiber *fiber_current(void) {
+    return current_fiber;
+}
@@ -0,0 +1,45 @@
+//
+// Created by fathi on 11/25/2024.
+//
+
+#ifndef TIGE_FIBER_H
+#define TIGE_FIBER_H
+
+#include <stddef.h>
+
+// Stackful fibers.
+// A fiber runs a function on its own mmap'ed stack, with a guard page below it. The
+// thread that calls fiber_resume runs the fiber until it calls fiber_yield or its
+// function returns, and picks up right after fiber_resume. Switching saves only the
+// callee saved registers: a hand-written switch on x86-64, ucontext elsewhere.
+// A fiber may be resumed from another thread than the one it last yielded to, but
+// only by one thread at a time.
+
+// x86-64 uses its own switch, define TIGE_FIBER_UCONTEXT to use ucontext everywhere
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__)) && !defined(TIGE_FIBER_UCONTEXT)
+#define TIGE_FIBER_ASM 1
+#else
+#define TIGE_FIBER_ASM 0
+#endif
+
+// enough for the interpreter, the JIT and the natives, only touched pages are committed
+#define FIBER_STACK_SIZE (256 * 1024)
+
+typedef struct Fiber Fiber;
+typedef void (*FiberFn)(void *data);
+
+// stack_size 0 means FIBER_STACK_SIZE, nullptr when the stack cannot be mapped
+Fiber *create_fiber(size_t stack_size, FiberFn fn, void *data);
+void destroy_fiber(Fiber *fiber);
+
+// Run the fiber until it yields or fn returns. Returns false once fn has returned,
+// the fiber cannot be resumed anymore.
+bool fiber_resume(Fiber *fiber);
+
+// from inside a fiber: go back to the fiber_resume that runs it
+void fiber_yield(void);
+
+// the fiber running on this thread, nullptr outside of fibers
+Fiber *fiber_current(void);
+
+#endif //TIGE_FIBER_H
@@ -5,81 +5,57 @@
 #include "functions.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/mman.h>
 
 #include "object.h"
 
 // Create a new function
-Function* create_function() {
-    auto fn = (Function*)vm_malloc(sizeof(Function));
+Function* create_function(VM* vm) {
+    auto fn = (Function*)vm_malloc(vm, sizeof(Function));
     if (!fn) {
         fprintf(stderr, "Failed to allocate memory for function");
         exit(EXIT_FAILURE);
     }
 
-    object_init((TObject*)fn);
+    object_init(vm, (TObject*)fn);
 
     // we will need to fill up these info whenever we create a new function
-    fn->chunk = nullptr;
+    fn->segment = nullptr;
+    fn->entry = nullptr;
+    fn->end = nullptr;
+    fn->redefined_by = nullptr;
     fn->arity = 0;
+    fn->register_count = 0;
+    fn->calls = 0;
     fn->stack = nullptr;
     return fn;
 }
 
 // Create a new call stack
-CallStack* create_call_stack() {
+CallStack* create_call_stack(size_t capacity) {
     CallStack* stack = malloc(sizeof(CallStack));
     if (!stack) {
         fprintf(stderr, "Failed to allocate CallStack.\n");
         exit(1);
     }
-    stack->top = nullptr;
+    // reserved, deep recursion backs the pages it reaches
+    stack->frames = mmap(nullptr, sizeof(CallFrame) * capacity, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (stack->frames == MAP_FAILED) {
+        fprintf(stderr, "Failed to allocate CallStack.\n");
+        exit(1);
+    }
+    stack->count = 0;
+    stack->capacity = capacity;
     return stack;
 }
 
 // Destroy the call stack
 void destroy_call_stack(CallStack* stack) {
-    while (stack->top) {
-        CallFrame* frame = stack->top;
-        stack->top = frame->previous;
-        // Assuming registers are allocated dynamically per frame
-        vm_free(frame->registers);
-        vm_free(frame);
-    }
-    free(stack);
-}
-
-// Push a new call frame onto the stack
-bool push_call_frame(CallStack* stack, BytecodeChunk* chunk, size_t ip, Value* registers) {
-    CallFrame* frame = vm_malloc(sizeof(CallFrame));
-    if (!frame) {
-        fprintf(stderr, "Failed to allocate CallFrame.\n");
-        return false;
+    if (stack) {
+        munmap(stack->frames, sizeof(CallFrame) * stack->capacity);
+        free(stack);
     }
-    frame->chunk = chunk;
-    frame->ip = ip;
-    frame->registers = registers;
-    frame->previous = stack->top;
-    stack->top = frame;
-    return true;
-}
-
-// Pop the top call frame from the stack
-bool pop_call_frame(CallStack* stack, BytecodeChunk** chunk, size_t* ip, Value** registers) {
-    if (!stack->top) {
-        fprintf(stderr, "Error: Can't use return outside of a function.\n");
-        return false;
-    }
-    CallFrame* frame = stack->top;
-    stack->top = frame->previous;
-
-    if (chunk) {
-        *chunk = frame->chunk;
-    }
-
-    *ip = frame->ip;
-    *registers = frame->registers;
-    vm_free(frame);
-    return true;
 }
 
 void destroy_function(Function *ptr) {
@@ -6,6 +6,7 @@
 #define TIGE_FUNCTIONS_H
 
 #include <stdint.h>
+#include <stdio.h>
 #include "value.h"
 #include "bytecode_buffer.h"
 #include "memory.h"
@@ -14,39 +15,65 @@
 typedef struct TObjectMetadata TObjectMetadata;
 typedef struct TObjectProperty TObjectProperty;
 typedef struct Function Function;
+typedef struct Instruction Instruction;
 
 struct Function {
     TObjectMetadata* metadata;
     TObjectProperty* props;
-    BytecodeChunk* chunk;
+    CodeSegment* segment;
+    const Instruction* entry;   // resolved by the decoder at load time
+    const Instruction* end;     // one past the function's last instruction
+    Function* redefined_by;     // newer definition of the same name, call sites caching this one follow it
     char* name;
     Stack* stack;
     size_t arity;
-    JumpPlaceholder return_addr;
+    uint16_t register_count;    // size of the register window of a call
+    uint32_t calls;             // hotness counter of the JIT
     UT_hash_handle hh;
 };
 
 // TODO: Closures
 
-// Structure representing a call frame
+#define CALL_STACK_SIZE 16384
+
+// Structure representing a call frame, what the caller needs back on return
 typedef struct CallFrame {
-    BytecodeChunk* chunk;
-    size_t ip;
-    Value* registers;
-    struct CallFrame* previous;
+    const Instruction* return_pc;
+    Value* registers;           // the caller's register window
+    int sp_reset;
 } CallFrame;
 
-// Structure representing the call stack
+// Structure representing the call stack, reserved up front so calls never allocate
 typedef struct CallStack {
-    CallFrame* top;
+    CallFrame* frames;
+    size_t count;
+    size_t capacity;
 } CallStack;
 
 
-Function* create_function();
+Function* create_function(VM* vm);
 void destroy_function(Function* ptr);
-CallStack* create_call_stack();
+CallStack* create_call_stack(size_t capacity);
 void destroy_call_stack(CallStack* stack);
-bool push_call_frame(CallStack* stack, BytecodeChunk* chunk, size_t ip, Value* registers);
-bool pop_call_frame(CallStack* stack, BytecodeChunk** chunk, size_t* ip, Value** registers);
+
+// Push a new call frame onto the stack, false on overflow
+static inline bool push_call_frame(CallStack* stack, const Instruction* return_pc, Value* registers, int sp_reset) {
+    if (stack->count >= stack->capacity) {
+        fprintf(stderr, "Error: call stack overflow (%zu frames).\n", stack->capacity);
+        return false;
+    }
+    stack->frames[stack->count++] = (CallFrame) {return_pc, registers, sp_reset};
+    return true;
+}
+
+// Pop the top call frame from the stack
+static inline bool pop_call_frame(CallStack* stack, CallFrame* frame) {
+    if (stack->count == 0) {
+        fprintf(stderr, "Error: Can't use return outside of a function.\n");
+        return false;
+    }
+    *frame = stack->frames[--stack->count];
+    return true;
+}
 
 #endif //TIGE_FUNCTIONS_H
@@ -0,0 +1,1345 @@
+//
+// Created by fathi on 11/20/2024.
+//
+
+#include "jit.h"
+#include "vm.h"
+#include "functions.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#if TIGE_JIT_SUPPORTED
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+static_assert(sizeof(Value) == 16, "the JIT addresses registers and stack slots as 16 byte values");
+
+// machine code of one function or loop
+typedef struct JitBlock {
+    uint8_t *memory;
+    size_t size;
+    struct JitBlock *next;
+} JitBlock;
+
+typedef struct JitEntry {
+    const uint8_t *block;           // start of the block holding the code, its prologue
+    const uint8_t *address;         // where compiled code runs the instruction from, nullptr if nowhere
+    InstructionHandler saved;       // dispatch target of a loop header before the JIT took it over
+    uint32_t loop_hits;             // iterations counted at a loop header
+    uint16_t loop_length;           // instructions from a loop header to its back edge, 0 if not a header
+    uint8_t loop_deopts;            // times the compiled code of the loop was thrown away
+    uint8_t reserved;
+} JitEntry;
+
+struct Jit {
+    const Instruction *code;    // instruction stream the entries refer to
+    size_t count;
+    JitEntry *entries;          // one per instruction of the stream
+    JitBlock *blocks;
+};
+
+static_assert(sizeof(JitEntry) == sizeof(Instruction), "the generated code indexes the entry table with instruction offsets");
+
+// compiled code is entered through the prologue of its block, with the address to jump to
+typedef bool (*JitCode)(VM *vm, const uint8_t *address);
+
+Jit *create_jit(void) {
+    Jit *jit = calloc(1, sizeof(Jit));
+    if (!jit) {
+        fprintf(stderr, "Failed to allocate the JIT.\n");
+        exit(EXIT_FAILURE);
+    }
+    return jit;
+}
+
+void jit_reset(Jit *jit, const InstructionStream *stream) {
+    while (jit->blocks) {
+        JitBlock *block = jit->blocks;
+        jit->blocks = block->next;
+        munmap(block->memory, block->size);
+        free(block);
+    }
+    free(jit->entries);
+    jit->entries = nullptr;
+    jit->code = nullptr;
+    jit->count = 0;
+
+    if (stream) {
+        jit->entries = calloc(stream->count, sizeof(JitEntry));
+        if (!jit->entries) {
+            fprintf(stderr, "Failed to allocate the JIT entry table.\n");
+            exit(EXIT_FAILURE);
+        }
+        jit->code = stream->code;
+        jit->count = stream->count;
+
+        // loop headers are the targets of backward jumps, the last one is the back edge
+        for (size_t i = 0; i < stream->count; i++) {
+            const Instruction *target = stream->code[i].target;
+            if (target && target <= &stream->code[i]) {
+                const size_t length = (size_t) (&stream->code[i] - target) + 1;
+                JitEntry *header = &jit->entries[target - stream->code];
+                if (length <= UINT16_MAX && length > header->loop_length) {
+                    header->loop_length = (uint16_t) length;
+                }
+            }
+        }
+        for (size_t i = 0; i < stream->count; i++) {
+            if (jit->entries[i].loop_length) {
+                jit->entries[i].saved = stream->code[i].handler;
+                vm_set_loop_header(&stream->code[i]);
+            }
+        }
+    }
+}
+
+void destroy_jit(Jit *jit) {
+    if (jit) {
+        jit_reset(jit, nullptr);
+        free(jit);
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// x86-64 assembler
+////////////////////////////////////////////////////////////////////////////////
+
+enum {
+    RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+    R8 = 8, R9 = 9, R10 = 10, R11 = 11, R12 = 12, R13 = 13, R14 = 14, R15 = 15,
+};
+
+// condition codes of jcc
+enum { CC_S = 0x8, CC_E = 0x4, CC_NE = 0x5, CC_L = 0xC, CC_GE = 0xD, CC_LE = 0xE, CC_G = 0xF };
+
+// `<op> reg, r/m` opcodes, two byte ones with their 0x0F escape
+enum { X86_ADD = 0x03, X86_SUB = 0x2B, X86_CMP = 0x3B, X86_STORE = 0x89, X86_LOAD = 0x8B, X86_IMUL = 0x0FAF };
+
+typedef struct {
+    uint8_t *bytes;
+    size_t size;
+    size_t capacity;
+} Assembler;
+
+static void emit(Assembler *as, const void *bytes, size_t n) {
+    if (as->size + n > as->capacity) {
+        as->capacity = as->capacity == 0 ? 4096 : as->capacity * 2;
+        as->bytes = realloc(as->bytes, as->capacity);
+        if (!as->bytes) {
+            fprintf(stderr, "Failed to allocate memory for machine code.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    memcpy(as->bytes + as->size, bytes, n);
+    as->size += n;
+}
+
+#define EMIT(as, ...) do { const uint8_t bytes_[] = {__VA_ARGS__}; emit(as, bytes_, sizeof(bytes_)); } while (0)
+
+static void emit_u32(Assembler *as, uint32_t value) {
+    emit(as, &value, sizeof(value));
+}
+
+static void emit_u64(Assembler *as, uint64_t value) {
+    emit(as, &value, sizeof(value));
+}
+
+// ModRM (+SIB) and disp32 of [base + disp], reg is the other operand or an opcode extension
+static void emit_mem(Assembler *as, uint8_t reg, uint8_t base, int32_t disp) {
+    EMIT(as, 0x80 | (reg & 7) << 3 | (base & 7));
+    if ((base & 7) == RSP) {
+        EMIT(as, 0x24);     // SIB, r12 needs one
+    }
+    emit_u32(as, (uint32_t) disp);
+}
+
+// REX.W prefix and opcode of a 64 bit `<op> reg, rm`
+static void emit_rex_op(Assembler *as, uint16_t opcode, uint8_t reg, uint8_t rm) {
+    EMIT(as, 0x48 | (reg >> 3) << 2 | (rm >> 3));
+    if (opcode > 0xFF) {
+        EMIT(as, opcode >> 8);
+    }
+    EMIT(as, opcode & 0xFF);
+}
+
+// 64 bit `<op> reg, rm` between registers
+static void emit_op_reg(Assembler *as, uint16_t opcode, uint8_t reg, uint8_t rm) {
+    emit_rex_op(as, opcode, reg, rm);
+    EMIT(as, 0xC0 | (reg & 7) << 3 | (rm & 7));
+}
+
+// rel32 placeholder, returns where to patch it
+static size_t emit_rel32(Assembler *as) {
+    const size_t at = as->size;
+    emit_u32(as, 0);
+    return at;
+}
+
+static void patch_rel32(Assembler *as, size_t at, size_t target) {
+    const int32_t rel = (int32_t) ((int64_t) target - (int64_t) (at + 4));
+    memcpy(as->bytes + at, &rel, sizeof(rel));
+}
+
+static size_t emit_jcc(Assembler *as, uint8_t cc) {
+    EMIT(as, 0x0F, 0x80 | cc);
+    return emit_rel32(as);
+}
+
+static size_t emit_jmp(Assembler *as) {
+    EMIT(as, 0xE9);
+    return emit_rel32(as);
+}
+
+static void emit_mov_imm64(Assembler *as, uint8_t reg, uint64_t value) {
+    EMIT(as, 0x48 | (reg >> 3), 0xB8 | (reg & 7));
+    emit_u64(as, value);
+}
+
+static void emit_call(Assembler *as, const void *fn) {
+    emit_mov_imm64(as, RAX, (uint64_t) (uintptr_t) fn);
+    EMIT(as, 0xFF, 0xD0);                    // call rax
+}
+
+static bool fits_i32(int64_t value) {
+    return value >= INT32_MIN && value <= INT32_MAX;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Compiler state
+////////////////////////////////////////////////////////////////////////////////
+
+// registers of the generated code, callee saved so handlers keep them
+//   r12: the VM, rbx: its register window, r13: its operand stack
+#define VM_FIELD(field) ((int32_t) offsetof(VM, field))
+#define STACK_FIELD(field) ((int32_t) offsetof(Stack, field))
+#define SLOT(r) ((int32_t) ((r) * sizeof(Value)))
+#define TYPE_OF(r) (SLOT(r) + (int32_t) offsetof(Value, type))
+#define PAYLOAD_OF(r) (SLOT(r) + (int32_t) offsetof(Value, as_integer))
+
+// machine registers a specialized loop keeps integer registers of the window in
+static const uint8_t cache_registers[] = {RBP, R14, R15, RSI, R8, R9, R10};
+#define CACHE_REGISTERS (sizeof(cache_registers) / sizeof(cache_registers[0]))
+// and vm->fuel, a decrement in memory on every back edge would chain the iterations
+#define FUEL_REGISTER R11
+
+// a jump to the code of an instruction, patched once everything is placed
+typedef struct {
+    size_t at;
+    const Instruction *target;
+} Fixup;
+
+// a backward jump whose fuel ran out, see emit_fuel_check
+typedef struct {
+    size_t jump;
+    size_t resume;
+    const Instruction *ins;
+} Safepoint;
+
+// guard failures of a template end up in its slow path: the regular handler
+typedef struct {
+    size_t index;
+    size_t jumps[4];
+    int jump_count;
+} SlowPath;
+
+typedef struct {
+    Assembler as;
+    const Jit *jit;
+    const Instruction *first;   // compiled instructions
+    size_t count;
+    size_t *offsets;            // code of every instruction
+    Fixup *fixups;
+    size_t fixup_count;
+    size_t fixup_capacity;
+    SlowPath *slow_paths;
+    size_t slow_count;
+    size_t slow_capacity;
+    SlowPath *slow;             // slow path of the template being emitted
+    Safepoint *safepoints;
+    size_t safepoint_count;
+    size_t safepoint_capacity;
+
+    // type specialization of a loop, nullptr/0 for functions
+    size_t register_count;      // registers of the window the code uses
+    bool *is_int;               // holds an integer all along the compiled code, no guard needed
+    bool *defined_first;        // written before anything reads it, its value on entry does not matter
+    int8_t *cached_in;          // machine register holding its payload, -1 if it lives in the window
+    uint16_t cached[CACHE_REGISTERS];
+    size_t cached_count;
+    bool fuel_cached;           // vm->fuel lives in FUEL_REGISTER
+
+    size_t exit_continue;       // continue at vm->pc, in compiled code if there is some
+    size_t exit_leave;          // return to the interpreter at vm->pc
+    size_t exit_stop;           // execution stops (a handler returned false)
+} JitCompiler;
+
+static void jump_to_instruction(JitCompiler *c, size_t at, const Instruction *target) {
+    if (c->fixup_count >= c->fixup_capacity) {
+        c->fixup_capacity = c->fixup_capacity == 0 ? 64 : c->fixup_capacity * 2;
+        c->fixups = realloc(c->fixups, sizeof(Fixup) * c->fixup_capacity);
+        if (!c->fixups) {
+            fprintf(stderr, "Failed to allocate memory for JIT fixups.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    c->fixups[c->fixup_count++] = (Fixup) {at, target};
+}
+
+static bool in_range(const JitCompiler *c, const Instruction *ins) {
+    return ins >= c->first && ins < c->first + c->count;
+}
+
+static void begin_slow_path(JitCompiler *c, size_t index) {
+    if (c->slow_count >= c->slow_capacity) {
+        c->slow_capacity = c->slow_capacity == 0 ? 64 : c->slow_capacity * 2;
+        c->slow_paths = realloc(c->slow_paths, sizeof(SlowPath) * c->slow_capacity);
+        if (!c->slow_paths) {
+            fprintf(stderr, "Failed to allocate memory for JIT slow paths.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    c->slow = &c->slow_paths[c->slow_count++];
+    *c->slow = (SlowPath) {.index = index};
+}
+
+static void bail_if(JitCompiler *c, uint8_t cc) {
+    c->slow->jumps[c->slow->jump_count++] = emit_jcc(&c->as, cc);
+}
+
+static bool proven_int(const JitCompiler *c, uint16_t reg) {
+    return reg < c->register_count && c->is_int[reg];
+}
+
+static int cache_of(const JitCompiler *c, uint16_t reg) {
+    return reg < c->register_count ? c->cached_in[reg] : -1;
+}
+
+// the window is the truth whenever a handler runs or the code is left
+static void write_back_cache(JitCompiler *c) {
+    for (size_t i = 0; i < c->cached_count; i++) {
+        emit_rex_op(&c->as, X86_STORE, cache_registers[i], RBX);
+        emit_mem(&c->as, cache_registers[i], RBX, PAYLOAD_OF(c->cached[i]));
+    }
+    if (c->fuel_cached) {
+        emit_rex_op(&c->as, X86_STORE, FUEL_REGISTER, R12);
+        emit_mem(&c->as, FUEL_REGISTER, R12, VM_FIELD(fuel));
+    }
+}
+
+static void load_cache(JitCompiler *c) {
+    for (size_t i = 0; i < c->cached_count; i++) {
+        emit_rex_op(&c->as, X86_LOAD, cache_registers[i], RBX);
+        emit_mem(&c->as, cache_registers[i], RBX, PAYLOAD_OF(c->cached[i]));
+    }
+    if (c->fuel_cached) {
+        emit_rex_op(&c->as, X86_LOAD, FUEL_REGISTER, R12);
+        emit_mem(&c->as, FUEL_REGISTER, R12, VM_FIELD(fuel));
+    }
+}
+
+// Backward jumps burn a unit of fuel before they run (see vm_set_budget). The
+// check falls through while there is fuel left, its out of line stub puts the VM
+// state back in memory and lets vm_safepoint decide at the jump itself.
+static void emit_fuel_check(JitCompiler *c, const Instruction *ins) {
+    Assembler *as = &c->as;
+    if (c->fuel_cached) {
+        EMIT(as, 0x49, 0xFF, 0xC8 | (FUEL_REGISTER & 7));     // dec r11
+    } else {
+        EMIT(as, 0x49, 0xFF);                // dec qword [r12 + fuel]
+        emit_mem(as, 1, R12, VM_FIELD(fuel));
+    }
+    if (c->safepoint_count >= c->safepoint_capacity) {
+        c->safepoint_capacity = c->safepoint_capacity == 0 ? 16 : c->safepoint_capacity * 2;
+        c->safepoints = realloc(c->safepoints, sizeof(Safepoint) * c->safepoint_capacity);
+        if (!c->safepoints) {
+            fprintf(stderr, "Failed to allocate memory for JIT safepoints.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    const size_t jump = emit_jcc(as, CC_LE);
+    c->safepoints[c->safepoint_count++] = (Safepoint) {jump, as->size, ins};
+}
+
+static void emit_safepoint(JitCompiler *c, const Safepoint *safepoint) {
+    Assembler *as = &c->as;
+    patch_rel32(as, safepoint->jump, as->size);
+    write_back_cache(c);
+    emit_mov_imm64(as, RAX, (uint64_t) (uintptr_t) safepoint->ins);
+    EMIT(as, 0x49, 0x89);                    // mov [r12 + pc], rax
+    emit_mem(as, RAX, R12, VM_FIELD(pc));
+    EMIT(as, 0x4C, 0x89, 0xE7);              // mov rdi, r12
+    emit_call(as, vm_safepoint);
+    EMIT(as, 0x84, 0xC0);                    // test al, al
+    patch_rel32(as, emit_jcc(as, CC_E), c->exit_stop);
+    load_cache(c);
+    patch_rel32(as, emit_jmp(as), safepoint->resume);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Templates
+////////////////////////////////////////////////////////////////////////////////
+
+// 64 bit `<op> reg, r[slot].as_integer`, from the machine register caching it or the window
+static void emit_op_slot(JitCompiler *c, uint16_t opcode, uint8_t reg, uint16_t slot) {
+    const int cached = cache_of(c, slot);
+    if (cached >= 0) {
+        emit_op_reg(&c->as, opcode, reg, cache_registers[cached]);
+    } else {
+        emit_rex_op(&c->as, opcode, reg, RBX);
+        emit_mem(&c->as, reg, RBX, PAYLOAD_OF(slot));
+    }
+}
+
+// cmp dword [rbx + type of r], VAL_INT; jne slow
+static void guard_int(JitCompiler *c, uint16_t reg) {
+    if (proven_int(c, reg)) {
+        return;
+    }
+    EMIT(&c->as, 0x81);
+    emit_mem(&c->as, 7, RBX, TYPE_OF(reg));
+    emit_u32(&c->as, VAL_INT);
+    bail_if(c, CC_NE);
+}
+
+// r[dst] = rax, as an integer
+static void store_int_result(JitCompiler *c, uint16_t dst) {
+    emit_op_slot(c, X86_STORE, RAX, dst);
+    if (!proven_int(c, dst)) {
+        EMIT(&c->as, 0xC7);
+        emit_mem(&c->as, 0, RBX, TYPE_OF(dst));
+        emit_u32(&c->as, VAL_INT);
+    }
+}
+
+// to = r[reg].as_integer
+static void load_payload(JitCompiler *c, uint8_t to, uint16_t reg) {
+    emit_op_slot(c, X86_LOAD, to, reg);
+}
+
+// reserve a stack slot, rcx = its address
+static void push_slot(JitCompiler *c) {
+    Assembler *as = &c->as;
+    EMIT(as, 0x41, 0x8B);                    // mov eax, [r13 + sp]
+    emit_mem(as, RAX, R13, STACK_FIELD(sp));
+    EMIT(as, 0x8D, 0x48, 0x01);              // lea ecx, [rax + 1]
+    EMIT(as, 0x41, 0x3B);                    // cmp ecx, [r13 + capacity], growing is left to the handler
+    emit_mem(as, RCX, R13, STACK_FIELD(capacity));
+    bail_if(c, CC_GE);
+    EMIT(as, 0x41, 0x89);                    // mov [r13 + sp], ecx
+    emit_mem(as, RCX, R13, STACK_FIELD(sp));
+    EMIT(as, 0x48, 0x63, 0xC9);              // movsxd rcx, ecx
+    EMIT(as, 0x48, 0xC1, 0xE1, 0x04);        // shl rcx, 4
+    EMIT(as, 0x49, 0x03);                    // add rcx, [r13 + values]
+    emit_mem(as, RCX, R13, STACK_FIELD(values));
+}
+
+// rcx = address of the top of the stack, eax = sp - 1 (not written back yet)
+static void peek_slot(JitCompiler *c) {
+    Assembler *as = &c->as;
+    EMIT(as, 0x41, 0x8B);                    // mov eax, [r13 + sp]
+    emit_mem(as, RAX, R13, STACK_FIELD(sp));
+    EMIT(as, 0x85, 0xC0);                    // test eax, eax
+    bail_if(c, CC_S);
+    EMIT(as, 0x48, 0x63, 0xC8);              // movsxd rcx, eax
+    EMIT(as, 0x48, 0xC1, 0xE1, 0x04);        // shl rcx, 4
+    EMIT(as, 0x49, 0x03);                    // add rcx, [r13 + values]
+    emit_mem(as, RCX, R13, STACK_FIELD(values));
+    EMIT(as, 0xFF, 0xC8);                    // dec eax
+}
+
+static void commit_pop(Assembler *as) {
+    EMIT(as, 0x41, 0x89);                    // mov [r13 + sp], eax
+    emit_mem(as, RAX, R13, STACK_FIELD(sp));
+}
+
+static void emit_arith(JitCompiler *c, const Instruction *ins, bool immediate) {
+    Assembler *as = &c->as;
+    const Opcode op = immediate ? ins->opcode - (OP_ADD_RRI - OP_ADD_RRR) : ins->opcode;
+
+    guard_int(c, ins->b);
+    if (!immediate) {
+        guard_int(c, ins->c);
+    }
+    load_payload(c, RAX, ins->b);
+
+    if (!immediate) {
+        emit_op_slot(c, op == OP_ADD_RRR ? X86_ADD : op == OP_SUB_RRR ? X86_SUB : X86_IMUL, RAX, ins->c);
+    } else if (fits_i32(ins->operand.as_int)) {
+        switch (op) {
+            case OP_ADD_RRR: EMIT(as, 0x48, 0x05); break;
+            case OP_SUB_RRR: EMIT(as, 0x48, 0x2D); break;
+            default: EMIT(as, 0x48, 0x69, 0xC0); break;
+        }
+        emit_u32(as, (uint32_t) ins->operand.as_int);
+    } else {
+        emit_mov_imm64(as, RCX, (uint64_t) ins->operand.as_int);
+        switch (op) {
+            case OP_ADD_RRR: EMIT(as, 0x48, 0x01, 0xC8); break;
+            case OP_SUB_RRR: EMIT(as, 0x48, 0x29, 0xC8); break;
+            default: EMIT(as, 0x48, 0x0F, 0xAF, 0xC1); break;
+        }
+    }
+    store_int_result(c, ins->a);
+}
+
+// EQ, NE, LT, LE, GT, GE
+static const uint8_t relation_cc[] = {CC_E, CC_NE, CC_L, CC_LE, CC_G, CC_GE};
+
+#define BELOW(field) ((uint8_t) (int8_t) ((int) offsetof(Value, field) - (int) sizeof(Value)))
+#define TOP(field) ((uint8_t) offsetof(Value, field))
+
+// rcx = address of the top of the stack, the operand below it at rcx - 16, both integers,
+// eax = sp - 1 (not written back yet)
+static void peek_int_pair(JitCompiler *c) {
+    Assembler *as = &c->as;
+    EMIT(as, 0x41, 0x8B);                    // mov eax, [r13 + sp]
+    emit_mem(as, RAX, R13, STACK_FIELD(sp));
+    EMIT(as, 0x83, 0xF8, 0x01);              // cmp eax, 1
+    bail_if(c, CC_L);
+    EMIT(as, 0x48, 0x63, 0xC8);              // movsxd rcx, eax
+    EMIT(as, 0x48, 0xC1, 0xE1, 0x04);        // shl rcx, 4
+    EMIT(as, 0x49, 0x03);                    // add rcx, [r13 + values]
+    emit_mem(as, RCX, R13, STACK_FIELD(values));
+    EMIT(as, 0x81, 0x79, TOP(type));         // cmp dword [rcx + type], VAL_INT
+    emit_u32(as, VAL_INT);
+    bail_if(c, CC_NE);
+    EMIT(as, 0x81, 0x79, BELOW(type));       // cmp dword [rcx - 16 + type], VAL_INT
+    emit_u32(as, VAL_INT);
+    bail_if(c, CC_NE);
+    EMIT(as, 0xFF, 0xC8);                    // dec eax
+}
+
+// ADD, SUB, MUL on the operand stack, the result replaces the lower operand
+static void emit_stack_arith(JitCompiler *c, Opcode op) {
+    Assembler *as = &c->as;
+    peek_int_pair(c);
+    EMIT(as, 0x48, 0x8B, 0x51, BELOW(as_integer));       // mov rdx, [rcx - 16 + payload]
+    switch (op) {
+        case OP_ADD: EMIT(as, 0x48, 0x03, 0x51, TOP(as_integer)); break;
+        case OP_SUB: EMIT(as, 0x48, 0x2B, 0x51, TOP(as_integer)); break;
+        default: EMIT(as, 0x48, 0x0F, 0xAF, 0x51, TOP(as_integer)); break;
+    }
+    EMIT(as, 0x48, 0x89, 0x51, BELOW(as_integer));       // mov [rcx - 16 + payload], rdx
+    commit_pop(as);
+}
+
+// comparisons on the operand stack, cc tells when the result is true
+static void emit_stack_compare(JitCompiler *c, uint8_t cc) {
+    Assembler *as = &c->as;
+    peek_int_pair(c);
+    EMIT(as, 0x48, 0x8B, 0x51, BELOW(as_integer));       // mov rdx, [rcx - 16 + payload]
+    EMIT(as, 0x48, 0x3B, 0x51, TOP(as_integer));         // cmp rdx, [rcx + payload]
+    EMIT(as, 0x0F, 0x90 | cc, 0xC2);                      // setcc dl
+    EMIT(as, 0x0F, 0xB6, 0xD2);                           // movzx edx, dl
+    EMIT(as, 0x48, 0x89, 0x51, BELOW(as_integer));       // mov [rcx - 16 + payload], rdx
+    EMIT(as, 0xC7, 0x41, BELOW(type));                    // mov dword [rcx - 16 + type], VAL_BOOL
+    emit_u32(as, VAL_BOOL);
+    commit_pop(as);
+}
+
+static void emit_compare_jump(JitCompiler *c, const Instruction *ins, bool immediate) {
+    Assembler *as = &c->as;
+    const int relation = immediate ? ins->opcode - OP_EQ_RI_JMP : ins->opcode - OP_EQ_RR_JMP;
+
+    guard_int(c, ins->a);
+    if (!immediate) {
+        guard_int(c, ins->b);
+    }
+    load_payload(c, RAX, ins->a);
+    if (!immediate) {
+        emit_op_slot(c, X86_CMP, RAX, ins->b);
+    } else if (fits_i32(ins->operand.as_int)) {
+        EMIT(as, 0x48, 0x3D);                // cmp rax, imm32
+        emit_u32(as, (uint32_t) ins->operand.as_int);
+    } else {
+        emit_mov_imm64(as, RCX, (uint64_t) ins->operand.as_int);
+        EMIT(as, 0x48, 0x39, 0xC8);          // cmp rax, rcx
+    }
+    jump_to_instruction(c, emit_jcc(as, relation_cc[relation]), ins->target);
+}
+
+// machine code for the instruction, false when it only has a handler
+static bool emit_template(JitCompiler *c, const Instruction *ins) {
+    Assembler *as = &c->as;
+    if (ins->target && ins->target <= ins) {
+        emit_fuel_check(c, ins);
+    }
+    begin_slow_path(c, (size_t) (ins - c->first));
+
+    switch (ins->opcode) {
+        case OP_NOPE:
+            break;
+        case OP_MOV_RR:
+            if (cache_of(c, ins->a) >= 0 || cache_of(c, ins->b) >= 0) {
+                // one side is a cached integer, both are when the destination is
+                load_payload(c, RAX, ins->b);
+                store_int_result(c, ins->a);
+                break;
+            }
+            EMIT(as, 0xF3, 0x0F, 0x6F);      // movdqu xmm0, r[src]
+            emit_mem(as, 0, RBX, SLOT(ins->b));
+            EMIT(as, 0xF3, 0x0F, 0x7F);      // movdqu r[dst], xmm0
+            emit_mem(as, 0, RBX, SLOT(ins->a));
+            break;
+        case OP_MOV_RI:
+            emit_mov_imm64(as, RAX, (uint64_t) ins->operand.as_int);
+            store_int_result(c, ins->a);
+            break;
+        case OP_ADD_RRR:
+        case OP_SUB_RRR:
+        case OP_MUL_RRR:
+            emit_arith(c, ins, false);
+            break;
+        case OP_ADD_RRI:
+        case OP_SUB_RRI:
+        case OP_MUL_RRI:
+            emit_arith(c, ins, true);
+            break;
+        case OP_INC_REG:
+            if (cache_of(c, ins->a) >= 0) {
+                const uint8_t reg = cache_registers[cache_of(c, ins->a)];
+                emit_rex_op(as, 0xFF, 0, reg);   // inc reg
+                EMIT(as, 0xC0 | (reg & 7));
+                break;
+            }
+            guard_int(c, ins->a);
+            EMIT(as, 0x48, 0xFF);            // inc qword r[a]
+            emit_mem(as, 0, RBX, PAYLOAD_OF(ins->a));
+            break;
+        case OP_EQ_RR_JMP:
+        case OP_NE_RR_JMP:
+        case OP_LT_RR_JMP:
+        case OP_LE_RR_JMP:
+        case OP_GT_RR_JMP:
+        case OP_GE_RR_JMP:
+            emit_compare_jump(c, ins, false);
+            break;
+        case OP_EQ_RI_JMP:
+        case OP_NE_RI_JMP:
+        case OP_LT_RI_JMP:
+        case OP_LE_RI_JMP:
+        case OP_GT_RI_JMP:
+        case OP_GE_RI_JMP:
+            emit_compare_jump(c, ins, true);
+            break;
+        case OP_JMP:
+            jump_to_instruction(c, emit_jmp(as), ins->target);
+            break;
+        // generic arithmetic and comparisons keep an integer fast path, whichever
+        // form quickening left them in
+        case OP_ADD:
+        case OP_ADD_INT_INT:
+            emit_stack_arith(c, OP_ADD);
+            break;
+        case OP_SUB:
+        case OP_SUB_INT_INT:
+            emit_stack_arith(c, OP_SUB);
+            break;
+        case OP_MUL:
+        case OP_MUL_INT_INT:
+            emit_stack_arith(c, OP_MUL);
+            break;
+        case OP_EQUAL:
+        case OP_EQ_INT_INT:
+            emit_stack_compare(c, CC_E);
+            break;
+        case OP_NOT_EQUAL:
+        case OP_NE_INT_INT:
+            emit_stack_compare(c, CC_NE);
+            break;
+        case OP_LESS_THAN:
+        case OP_LT_INT_INT:
+            emit_stack_compare(c, CC_L);
+            break;
+        case OP_GREATER_THAN:
+        case OP_GT_INT_INT:
+            emit_stack_compare(c, CC_G);
+            break;
+        case OP_LESS_EQUAL:
+        case OP_LE_INT_INT:
+            emit_stack_compare(c, CC_LE);
+            break;
+        case OP_GREATER_EQUAL:
+        case OP_GE_INT_INT:
+            emit_stack_compare(c, CC_GE);
+            break;
+        case OP_LOAD_VAR:
+            push_slot(c);
+            if (cache_of(c, ins->a) >= 0) {
+                const uint8_t reg = cache_registers[cache_of(c, ins->a)];
+                EMIT(as, 0xC7, 0x41, TOP(type));     // mov dword [rcx + type], VAL_INT
+                emit_u32(as, VAL_INT);
+                emit_rex_op(as, X86_STORE, reg, RCX);    // mov [rcx + payload], reg
+                EMIT(as, 0x40 | (reg & 7) << 3 | RCX, TOP(as_integer));
+                break;
+            }
+            EMIT(as, 0xF3, 0x0F, 0x6F);      // movdqu xmm0, r[a]
+            emit_mem(as, 0, RBX, SLOT(ins->a));
+            EMIT(as, 0xF3, 0x0F, 0x7F, 0x01);    // movdqu [rcx], xmm0
+            break;
+        case OP_LOAD_CONST_INT:
+            push_slot(c);
+            EMIT(as, 0xC7, 0x41, TOP(type));         // mov dword [rcx + type], VAL_INT
+            emit_u32(as, VAL_INT);
+            emit_mov_imm64(as, RAX, (uint64_t) ins->operand.as_int);
+            EMIT(as, 0x48, 0x89, 0x41, TOP(as_integer));     // mov [rcx + payload], rax
+            break;
+        case OP_STORE_VAR:
+            // never specialized, anything can be stored
+            peek_slot(c);
+            EMIT(as, 0xF3, 0x0F, 0x6F, 0x01);    // movdqu xmm0, [rcx]
+            EMIT(as, 0xF3, 0x0F, 0x7F);      // movdqu r[a], xmm0
+            emit_mem(as, 0, RBX, SLOT(ins->a));
+            commit_pop(as);
+            break;
+        case OP_POP:
+            peek_slot(c);
+            commit_pop(as);
+            break;
+        case OP_SAVE_SP:
+            EMIT(as, 0x41, 0x8B);            // mov eax, [r13 + sp]
+            emit_mem(as, RAX, R13, STACK_FIELD(sp));
+            EMIT(as, 0x41, 0x89);            // mov [r12 + sp_reset], eax
+            emit_mem(as, RAX, R12, VM_FIELD(sp_reset));
+            break;
+        case OP_RESET_SP:
+            EMIT(as, 0x41, 0x8B);            // mov eax, [r12 + sp_reset]
+            emit_mem(as, RAX, R12, VM_FIELD(sp_reset));
+            EMIT(as, 0x41, 0x89);            // mov [r13 + sp], eax
+            emit_mem(as, RAX, R13, STACK_FIELD(sp));
+            break;
+        case OP_JMP_IF_TRUE:
+        case OP_JMP_IF_FALSE:
+            peek_slot(c);
+            EMIT(as, 0x81, 0x79, TOP(type));         // cmp dword [rcx + type], VAL_BOOL
+            emit_u32(as, VAL_BOOL);
+            bail_if(c, CC_NE);
+            commit_pop(as);
+            EMIT(as, 0x80, 0x79, TOP(as_boolean), 0x00);     // cmp byte [rcx + payload], 0
+            jump_to_instruction(c, emit_jcc(as, ins->opcode == OP_JMP_IF_TRUE ? CC_NE : CC_E), ins->target);
+            break;
+        default:
+            c->slow_count--;
+            c->slow = nullptr;
+            return false;
+    }
+
+    if (c->slow->jump_count == 0) {
+        c->slow_count--;
+    }
+    c->slow = nullptr;
+    return true;
+}
+
+// Call the handler of ins with vm->pc on the next instruction, then continue with
+// whatever instruction the handler left in vm->pc: fall through or jump when it is
+// one of ours, go through exit_continue otherwise (calls, returns)
+static void emit_handler_call(JitCompiler *c, size_t index, bool falls_into_next) {
+    Assembler *as = &c->as;
+    const Instruction *ins = &c->first[index];
+    const Instruction *next = ins + 1;
+
+    write_back_cache(c);
+    emit_mov_imm64(as, RAX, (uint64_t) (uintptr_t) next);
+    EMIT(as, 0x49, 0x89);                    // mov [r12 + pc], rax
+    emit_mem(as, RAX, R12, VM_FIELD(pc));
+    EMIT(as, 0x4C, 0x89, 0xE7);              // mov rdi, r12
+    emit_mov_imm64(as, RSI, (uint64_t) (uintptr_t) ins);
+    emit_call(as, vm_opcode_handler(ins->opcode));
+    EMIT(as, 0x84, 0xC0);                    // test al, al
+    patch_rel32(as, emit_jcc(as, CC_E), c->exit_stop);
+
+    // calls and returns move the register window
+    EMIT(as, 0x49, 0x8B);                    // mov rbx, [r12 + registers]
+    emit_mem(as, RBX, R12, VM_FIELD(registers));
+    load_cache(c);
+    EMIT(as, 0x49, 0x8B);                    // mov rax, [r12 + pc]
+    emit_mem(as, RAX, R12, VM_FIELD(pc));
+    emit_mov_imm64(as, RCX, (uint64_t) (uintptr_t) next);
+    EMIT(as, 0x48, 0x39, 0xC8);              // cmp rax, rcx
+
+    if (falls_into_next && !ins->target) {
+        patch_rel32(as, emit_jcc(as, CC_NE), c->exit_continue);
+        return;
+    }
+    jump_to_instruction(c, emit_jcc(as, CC_E), next);
+    if (ins->target) {
+        emit_mov_imm64(as, RCX, (uint64_t) (uintptr_t) ins->target);
+        EMIT(as, 0x48, 0x39, 0xC8);          // cmp rax, rcx
+        jump_to_instruction(c, emit_jcc(as, CC_E), ins->target);
+    }
+    patch_rel32(as, emit_jmp(as), c->exit_continue);
+}
+
+static void emit_prologue(JitCompiler *c) {
+    Assembler *as = &c->as;
+    // entered as bool (VM *vm, const uint8_t *address)
+    EMIT(as, 0x53);                          // push rbx
+    EMIT(as, 0x55);                          // push rbp
+    EMIT(as, 0x41, 0x54);                    // push r12
+    EMIT(as, 0x41, 0x55);                    // push r13
+    EMIT(as, 0x41, 0x56);                    // push r14
+    EMIT(as, 0x41, 0x57);                    // push r15
+    EMIT(as, 0x48, 0x83, 0xEC, 0x08);        // sub rsp, 8, keeps calls 16 byte aligned
+    EMIT(as, 0x49, 0x89, 0xFC);              // mov r12, rdi
+    EMIT(as, 0x49, 0x8B);                    // mov rbx, [r12 + registers]
+    emit_mem(as, RBX, R12, VM_FIELD(registers));
+    EMIT(as, 0x4D, 0x8B);                    // mov r13, [r12 + stack]
+    emit_mem(as, R13, R12, VM_FIELD(stack));
+    EMIT(as, 0xFF, 0xE6);                    // jmp rsi
+
+    // calls and returns land in other compiled code most of the time, go there directly:
+    // rax = entries[vm->pc - code].address, both tables have the same stride
+    c->exit_continue = as->size;
+    EMIT(as, 0x49, 0x8B);                    // mov rax, [r12 + pc]
+    emit_mem(as, RAX, R12, VM_FIELD(pc));
+    emit_mov_imm64(as, RCX, (uint64_t) (uintptr_t) c->jit->code);
+    EMIT(as, 0x48, 0x29, 0xC8);              // sub rax, rcx
+    emit_mov_imm64(as, RCX, (uint64_t) (uintptr_t) c->jit->entries);
+    EMIT(as, 0x48, 0x8B, 0x44, 0x01, (uint8_t) offsetof(JitEntry, address));    // mov rax, [rcx + rax + address]
+    EMIT(as, 0x48, 0x85, 0xC0);              // test rax, rax
+    EMIT(as, 0x74, 0x02);                    // jz leave
+    EMIT(as, 0xFF, 0xE0);                    // jmp rax
+    c->exit_leave = as->size;
+    EMIT(as, 0xB8, 0x01, 0x00, 0x00, 0x00);  // mov eax, 1
+    EMIT(as, 0xEB, 0x02);                    // jmp epilogue
+    c->exit_stop = as->size;
+    EMIT(as, 0x31, 0xC0);                    // xor eax, eax
+    EMIT(as, 0x48, 0x83, 0xC4, 0x08);        // add rsp, 8
+    EMIT(as, 0x41, 0x5F);                    // pop r15
+    EMIT(as, 0x41, 0x5E);                    // pop r14
+    EMIT(as, 0x41, 0x5D);                    // pop r13
+    EMIT(as, 0x41, 0x5C);                    // pop r12
+    EMIT(as, 0x5D);                          // pop rbp
+    EMIT(as, 0x5B);                          // pop rbx
+    EMIT(as, 0xC3);                          // ret
+}
+
+static bool has_template(Opcode opcode) {
+    switch (opcode) {
+        case OP_NOPE:
+        case OP_MOV_RR: case OP_MOV_RI:
+        case OP_ADD_RRR: case OP_SUB_RRR: case OP_MUL_RRR:
+        case OP_ADD_RRI: case OP_SUB_RRI: case OP_MUL_RRI:
+        case OP_INC_REG:
+        case OP_EQ_RR_JMP: case OP_NE_RR_JMP: case OP_LT_RR_JMP:
+        case OP_LE_RR_JMP: case OP_GT_RR_JMP: case OP_GE_RR_JMP:
+        case OP_EQ_RI_JMP: case OP_NE_RI_JMP: case OP_LT_RI_JMP:
+        case OP_LE_RI_JMP: case OP_GT_RI_JMP: case OP_GE_RI_JMP:
+        case OP_JMP:
+        case OP_ADD: case OP_SUB: case OP_MUL:
+        case OP_ADD_INT_INT: case OP_SUB_INT_INT: case OP_MUL_INT_INT:
+        case OP_EQUAL: case OP_NOT_EQUAL: case OP_LESS_THAN:
+        case OP_GREATER_THAN: case OP_LESS_EQUAL: case OP_GREATER_EQUAL:
+        case OP_EQ_INT_INT: case OP_NE_INT_INT: case OP_LT_INT_INT:
+        case OP_GT_INT_INT: case OP_LE_INT_INT: case OP_GE_INT_INT:
+        case OP_LOAD_VAR: case OP_LOAD_CONST_INT: case OP_STORE_VAR: case OP_POP:
+        case OP_SAVE_SP: case OP_RESET_SP:
+        case OP_JMP_IF_TRUE: case OP_JMP_IF_FALSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// every instruction needs a template or a handler
+static bool can_compile(const Instruction *first, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (!has_template(first[i].opcode) && !vm_opcode_handler(first[i].opcode)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool begin_compile(JitCompiler *c, const Jit *jit, const Instruction *first, size_t count) {
+    *c = (JitCompiler) {};
+    c->jit = jit;
+    c->first = first;
+    c->count = count;
+    if (!can_compile(first, count)) {
+        return false;
+    }
+    c->offsets = malloc(sizeof(size_t) * count);
+    if (!c->offsets) {
+        fprintf(stderr, "Failed to allocate memory for the JIT.\n");
+        exit(EXIT_FAILURE);
+    }
+    emit_prologue(c);
+    return true;
+}
+
+// the code of every instruction, then the slow paths out of line so the fast paths
+// fall through into each other
+static void emit_instructions(JitCompiler *c) {
+    for (size_t i = 0; i < c->count; i++) {
+        c->offsets[i] = c->as.size;
+        if (!emit_template(c, &c->first[i])) {
+            emit_handler_call(c, i, true);
+        }
+    }
+    jump_to_instruction(c, emit_jmp(&c->as), c->first + c->count);
+
+    for (size_t s = 0; s < c->slow_count; s++) {
+        const SlowPath *slow = &c->slow_paths[s];
+        for (int j = 0; j < slow->jump_count; j++) {
+            patch_rel32(&c->as, slow->jumps[j], c->as.size);
+        }
+        emit_handler_call(c, slow->index, false);
+    }
+    for (size_t s = 0; s < c->safepoint_count; s++) {
+        emit_safepoint(c, &c->safepoints[s]);
+    }
+}
+
+// Resolve the jumps, leaving through a stub for every target outside the compiled
+// range, and map the code. Returns the executable block or nullptr.
+static uint8_t *finish_compile(JitCompiler *c, Jit *jit) {
+    const size_t fixup_count = c->fixup_count;
+    size_t *exits = malloc(sizeof(size_t) * (fixup_count + 1));
+    for (size_t f = 0; f < fixup_count; f++) {
+        const Fixup *fixup = &c->fixups[f];
+        if (in_range(c, fixup->target)) {
+            patch_rel32(&c->as, fixup->at, c->offsets[fixup->target - c->first]);
+            continue;
+        }
+        // one stub per target
+        size_t g = 0;
+        while (g < f && c->fixups[g].target != fixup->target) {
+            g++;
+        }
+        if (g == f) {
+            exits[f] = c->as.size;
+            write_back_cache(c);
+            emit_mov_imm64(&c->as, RAX, (uint64_t) (uintptr_t) fixup->target);
+            EMIT(&c->as, 0x49, 0x89);        // mov [r12 + pc], rax
+            emit_mem(&c->as, RAX, R12, VM_FIELD(pc));
+            patch_rel32(&c->as, emit_jmp(&c->as), c->exit_continue);
+        } else {
+            exits[f] = exits[g];
+        }
+        patch_rel32(&c->as, fixup->at, exits[f]);
+    }
+    free(exits);
+
+    const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+    const size_t size = (c->as.size + page - 1) / page * page;
+    uint8_t *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return nullptr;
+    }
+    memcpy(memory, c->as.bytes, c->as.size);
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(memory, size);
+        return nullptr;
+    }
+
+    JitBlock *block = malloc(sizeof(JitBlock));
+    *block = (JitBlock) {memory, size, jit->blocks};
+    jit->blocks = block;
+    return memory;
+}
+
+static void free_compiler(JitCompiler *c) {
+    free(c->as.bytes);
+    free(c->offsets);
+    free(c->fixups);
+    free(c->slow_paths);
+    free(c->safepoints);
+    free(c->is_int);
+    free(c->defined_first);
+    free(c->cached_in);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Functions
+////////////////////////////////////////////////////////////////////////////////
+
+bool jit_compile_function(VM *vm, Function *fn) {
+    Jit *jit = vm->jit;
+    if (!jit || !vm->code || !fn->entry || !fn->end) {
+        return false;
+    }
+    if (jit->code != vm->code->code) {
+        jit_reset(jit, vm->code);
+    }
+
+    const size_t base = (size_t) (fn->entry - jit->code);
+    if (jit->entries[base].address) {
+        return true;
+    }
+
+    JitCompiler c;
+    if (!begin_compile(&c, jit, fn->entry, (size_t) (fn->end - fn->entry))) {
+        free_compiler(&c);
+        return false;
+    }
+    emit_instructions(&c);
+
+    uint8_t *memory = finish_compile(&c, jit);
+    if (memory) {
+        // every instruction can be entered, the code makes no assumption about the window
+        for (size_t i = 0; i < c.count; i++) {
+            jit->entries[base + i].block = memory;
+            jit->entries[base + i].address = memory + c.offsets[i];
+        }
+        // the function is entered at its entry and re-entered after each call returns
+        vm_set_jit_entry((Instruction *) fn->entry);
+        for (size_t i = 0; i + 1 < c.count; i++) {
+            if (c.first[i].opcode == OP_CALL) {
+                vm_set_jit_entry((Instruction *) &c.first[i + 1]);
+            }
+        }
+    } else {
+        fprintf(stderr, "Warning: could not map executable memory for '%s'.\n", fn->name);
+    }
+
+    free_compiler(&c);
+    return memory != nullptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Loops
+////////////////////////////////////////////////////////////////////////////////
+
+// Register operands of an instruction: returns how many it has, the written one
+// (if any) comes last and is reported in *written, -1 otherwise
+static int register_operands(const Instruction *ins, uint16_t regs[3], int *written) {
+    *written = -1;
+    switch (ins->opcode) {
+        case OP_MOV_RR:
+            regs[0] = ins->b, regs[1] = ins->a, *written = ins->a;
+            return 2;
+        case OP_MOV_RI:
+        case OP_STORE_VAR:
+            regs[0] = ins->a, *written = ins->a;
+            return 1;
+        case OP_ADD_RRR: case OP_SUB_RRR: case OP_MUL_RRR: case OP_DIV_RRR:
+            regs[0] = ins->b, regs[1] = ins->c, regs[2] = ins->a, *written = ins->a;
+            return 3;
+        case OP_ADD_RRI: case OP_SUB_RRI: case OP_MUL_RRI: case OP_DIV_RRI:
+            regs[0] = ins->b, regs[1] = ins->a, *written = ins->a;
+            return 2;
+        case OP_INC_REG:
+        case OP_LOAD_VAR:
+        case OP_EQ_RI_JMP: case OP_NE_RI_JMP: case OP_LT_RI_JMP:
+        case OP_LE_RI_JMP: case OP_GT_RI_JMP: case OP_GE_RI_JMP:
+            regs[0] = ins->a;
+            return 1;
+        case OP_EQ_RR_JMP: case OP_NE_RR_JMP: case OP_LT_RR_JMP:
+        case OP_LE_RR_JMP: case OP_GT_RR_JMP: case OP_GE_RR_JMP:
+            regs[0] = ins->a, regs[1] = ins->b;
+            return 2;
+        default:
+            return 0;
+    }
+}
+
+static bool *alloc_flags(size_t count) {
+    bool *flags = calloc(count ? count : 1, sizeof(bool));
+    if (!flags) {
+        fprintf(stderr, "Failed to allocate memory for the JIT.\n");
+        exit(EXIT_FAILURE);
+    }
+    return flags;
+}
+
+// Find the registers the loop can treat as plain integers: those holding one in the
+// window right now, or written before they are read, and that every instruction of
+// the loop writing them keeps an integer. Anything else that may write a register
+// (stores, calls, globals) rules it out. The most used ones get a machine register.
+// Returns false when the integer templates would keep failing their guards, e.g. on
+// a float loop, which runs faster in the interpreter.
+static bool specialize_loop(JitCompiler *c, const VM *vm) {
+    const Instruction *first = c->first;
+    const size_t count = c->count;
+    const Value *window = vm->registers;
+    uint16_t regs[3];
+    int written;
+
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        const int operands = register_operands(&first[i], regs, &written);
+        for (int k = 0; k < operands; k++) {
+            if ((size_t) regs[k] + 1 > n) {
+                n = (size_t) regs[k] + 1;
+            }
+        }
+    }
+    c->register_count = n;
+    c->is_int = alloc_flags(n);
+    c->defined_first = alloc_flags(n);
+    c->cached_in = malloc(n ? n : 1);
+    memset(c->cached_in, -1, n ? n : 1);
+    if (n == 0) {
+        return true;
+    }
+
+    // written before read along the straight line code from the header
+    bool *seen = alloc_flags(n);
+    for (size_t i = 0; i < count; i++) {
+        const Instruction *ins = &first[i];
+        bool targeted = false;
+        for (size_t j = 0; j < count && i > 0; j++) {
+            targeted |= first[j].target == ins;
+        }
+        if (targeted || !has_template(ins->opcode)) {
+            break;
+        }
+        const int operands = register_operands(ins, regs, &written);
+        for (int k = 0; k < operands; k++) {
+            if (regs[k] == written && !seen[regs[k]]) {
+                c->defined_first[regs[k]] = true;
+            }
+            seen[regs[k]] = true;
+        }
+        if (ins->target) {
+            break;
+        }
+    }
+    free(seen);
+
+    for (size_t r = 0; r < n; r++) {
+        c->is_int[r] = c->defined_first[r] || window[r].type == VAL_INT;
+    }
+
+    const bool top_level = vm->registers == vm->register_file;
+    for (size_t i = 0; i < count; i++) {
+        const Instruction *ins = &first[i];
+        switch (ins->opcode) {
+            case OP_STORE_VAR:
+            case OP_DIV_RRR:
+            case OP_DIV_RRI:
+                c->is_int[ins->a] = false;
+                break;
+            case OP_CALL:
+            case OP_TAIL_CALL:
+                // the callee's window starts at its arguments
+                for (size_t r = ins->a; r < n; r++) {
+                    c->is_int[r] = false;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    if (top_level) {
+        // the top level window is where functions store globals
+        for (size_t i = 0; i < vm->code->count; i++) {
+            const Instruction *ins = &vm->code->code[i];
+            if (ins->opcode == OP_STORE_GLOBAL && ins->a < n) {
+                c->is_int[ins->a] = false;
+            }
+        }
+    }
+
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 0; i < count; i++) {
+            const Instruction *ins = &first[i];
+            bool keeps_int = true;
+            switch (ins->opcode) {
+                case OP_MOV_RR:
+                case OP_ADD_RRI: case OP_SUB_RRI: case OP_MUL_RRI:
+                    keeps_int = c->is_int[ins->b];
+                    break;
+                case OP_ADD_RRR: case OP_SUB_RRR: case OP_MUL_RRR:
+                    keeps_int = c->is_int[ins->b] && c->is_int[ins->c];
+                    break;
+                default:
+                    break;
+            }
+            if (!keeps_int && c->is_int[ins->a]) {
+                c->is_int[ins->a] = false;
+                changed = true;
+            }
+        }
+    }
+
+    // cache the most referenced integer registers
+    uint32_t *uses = calloc(n, sizeof(uint32_t));
+    for (size_t i = 0; i < count; i++) {
+        const int operands = register_operands(&first[i], regs, &written);
+        for (int k = 0; k < operands; k++) {
+            uses[regs[k]] += c->is_int[regs[k]];
+        }
+    }
+    while (c->cached_count < CACHE_REGISTERS) {
+        size_t best = n;
+        for (size_t r = 0; r < n; r++) {
+            if (uses[r] && (best == n || uses[r] > uses[best])) {
+                best = r;
+            }
+        }
+        if (best == n) {
+            break;
+        }
+        uses[best] = 0;
+        c->cached_in[best] = (int8_t) c->cached_count;
+        c->cached[c->cached_count++] = (uint16_t) best;
+    }
+    free(uses);
+    c->fuel_cached = true;
+
+    for (size_t i = 0; i < count; i++) {
+        const Instruction *ins = &first[i];
+        if (ins->opcode == OP_MOV_RR || ins->opcode == OP_STORE_VAR || ins->opcode == OP_LOAD_VAR) {
+            continue;
+        }
+        // the written register comes last
+        const int operands = register_operands(ins, regs, &written);
+        for (int k = 0; k < operands - (written >= 0); k++) {
+            if (!c->is_int[regs[k]] && window[regs[k]].type != VAL_INT) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Entry into the loop from outside its code. The guards check the types the code was
+// specialized for; registers written before they are read only get their type set.
+// A failed guard calls on_failure, if any, and returns to the interpreter.
+static size_t emit_loop_entry(JitCompiler *c, const Instruction *at, bool check_all, void (*on_failure)(VM *, Instruction *)) {
+    Assembler *as = &c->as;
+
+    const size_t failure = as->size;
+    if (on_failure) {
+        EMIT(as, 0x4C, 0x89, 0xE7);          // mov rdi, r12
+        emit_mov_imm64(as, RSI, (uint64_t) (uintptr_t) at);
+        emit_call(as, on_failure);
+    }
+    patch_rel32(as, emit_jmp(as), c->exit_leave);
+
+    const size_t entry = as->size;
+    for (size_t r = 0; r < c->register_count; r++) {
+        if (!c->is_int[r]) {
+            continue;
+        }
+        if (c->defined_first[r] && !check_all) {
+            EMIT(as, 0xC7);                  // mov dword r[r].type, VAL_INT
+            emit_mem(as, 0, RBX, TYPE_OF(r));
+            emit_u32(as, VAL_INT);
+        } else {
+            EMIT(as, 0x81);                  // cmp dword r[r].type, VAL_INT
+            emit_mem(as, 7, RBX, TYPE_OF(r));
+            emit_u32(as, VAL_INT);
+            patch_rel32(as, emit_jcc(as, CC_NE), failure);
+        }
+    }
+    load_cache(c);
+    jump_to_instruction(c, emit_jmp(as), at);
+    return entry;
+}
+
+// The header's guards failed: the loop runs with other types than it was compiled for.
+// Throw the code away and count again, so that it gets specialized for what runs now.
+static void deoptimize_loop(VM *vm, Instruction *header) {
+    JitEntry *entry = &vm->jit->entries[header - vm->jit->code];
+    entry->block = nullptr;
+    entry->address = nullptr;
+    header->handler = entry->saved;
+    if (++entry->loop_deopts < JIT_MAX_LOOP_DEOPTS) {
+        entry->loop_hits = 0;
+        vm_set_loop_header(header);
+    }
+}
+
+static bool compile_loop(VM *vm, Instruction *header, size_t length) {
+    Jit *jit = vm->jit;
+    JitCompiler c;
+    if (!begin_compile(&c, jit, header, length)) {
+        free_compiler(&c);
+        return false;
+    }
+    if (!specialize_loop(&c, vm)) {
+        free_compiler(&c);
+        return false;
+    }
+    emit_instructions(&c);
+
+    // on-stack replacement at the header, and back into the loop when a call returns
+    const size_t header_entry = emit_loop_entry(&c, header, false, deoptimize_loop);
+    size_t *call_entries = calloc(length, sizeof(size_t));
+    for (size_t i = 0; i + 1 < length; i++) {
+        if (header[i].opcode == OP_CALL) {
+            call_entries[i + 1] = emit_loop_entry(&c, &header[i + 1], true, nullptr);
+        }
+    }
+
+    uint8_t *memory = finish_compile(&c, jit);
+    if (memory) {
+        JitEntry *entries = &jit->entries[header - jit->code];
+        entries[0].block = memory;
+        entries[0].address = memory + header_entry;
+        // inner loops keep their own entries
+        for (size_t i = 1; i < length; i++) {
+            if (call_entries[i] && !entries[i].address) {
+                entries[i].block = memory;
+                entries[i].address = memory + call_entries[i];
+            }
+        }
+        vm_set_jit_entry(header);
+    }
+
+    free(call_entries);
+    free_compiler(&c);
+    return memory != nullptr;
+}
+
+InstructionHandler jit_loop_header(VM *vm, Instruction *header) {
+    Jit *jit = vm->jit;
+    JitEntry *entry = &jit->entries[header - jit->code];
+    if (++entry->loop_hits < JIT_HOT_LOOP) {
+        return entry->saved;
+    }
+
+    // hot: stop counting, and run compiled code from now on if the loop can be compiled
+    header->handler = entry->saved;
+    if (!entry->address) {
+        compile_loop(vm, header, entry->loop_length);
+    }
+    return header->handler;
+}
+
+bool jit_has_code(const Jit *jit, const Instruction *ins) {
+    return ins >= jit->code && ins < jit->code + jit->count && jit->entries[ins - jit->code].address;
+}
+
+bool jit_enter(VM *vm, const Instruction *ins) {
+    const JitEntry *entry = &vm->jit->entries[ins - vm->jit->code];
+    return ((JitCode) entry->block)(vm, entry->address);
+}
+
+#else
+
+Jit *create_jit(void) {
+    return nullptr;
+}
+
+void destroy_jit([[maybe_unused]] Jit *jit) {
+}
+
+void jit_reset([[maybe_unused]] Jit *jit, [[maybe_unused]] const InstructionStream *stream) {
+}
+
+bool jit_compile_function([[maybe_unused]] VM *vm, [[maybe_unused]] Function *fn) {
+    return false;
+}
+
+InstructionHandler jit_loop_header([[maybe_unused]] VM *vm, Instruction *header) {
+    return header->handler;
+}
+
+bool jit_has_code([[maybe_unused]] const Jit *jit, [[maybe_unused]] const Instruction *ins) {
+    return false;
+}
+
+bool jit_enter([[maybe_unused]] VM *vm, [[maybe_unused]] const Instruction *ins) {
+    return false;
+}
+
+#endif
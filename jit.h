@@ -0,0 +1,72 @@
+//
+// Created by fathi on 11/20/2024.
+//
+
+#ifndef TIGE_JIT_H
+#define TIGE_JIT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "decoder.h"
+
+// Baseline template JIT.
+// Once a bytecode function gets hot, its decoded instructions are translated one
+// by one into x86-64 machine code placed in mmap'ed executable memory. Register
+// instructions, jumps and the simple stack instructions have a machine code
+// template with an inline integer fast path; everything else, and every failed
+// type guard, calls the regular handler from op_handlers.c. All the VM state
+// (registers, operand stack, pc) stays in memory, so the interpreter can take
+// over at any instruction. Calls and returns jump straight into the compiled code
+// of their destination when it has some, and leave the machine code otherwise.
+//
+// Loops are counted at their header (the target of the back edge) and, once hot,
+// compiled on their own and entered on the spot, in the middle of the running
+// frame. That code is specialized for the register types seen at that point: the
+// registers that stay integers through the loop live in machine registers without
+// type checks, guarded once on entry. When a later entry finds other types the
+// code is thrown away and the loop is counted again.
+// Back edges of the compiled code are safepoints like in the interpreter (see
+// vm_set_budget): they burn fuel, and call vm_safepoint once it runs out.
+// The templates address the 16 byte Value layout, NaN-boxed values stay interpreted.
+#if defined(__x86_64__) && defined(__linux__) && !defined(TIGE_NO_JIT) && !defined(TIGE_NAN_BOXING)
+#define TIGE_JIT_SUPPORTED 1
+#else
+#define TIGE_JIT_SUPPORTED 0
+#endif
+
+// calls before a function is compiled
+#define JIT_HOT_CALLS 64
+// iterations before a loop is compiled
+#define JIT_HOT_LOOP 1024
+// a loop whose types keep changing stays interpreted
+#define JIT_MAX_LOOP_DEOPTS 4
+
+typedef struct VM VM;
+typedef struct Function Function;
+typedef struct Jit Jit;
+
+// nullptr when the JIT is not supported on this platform
+Jit *create_jit(void);
+void destroy_jit(Jit *jit);
+
+// forget all compiled code, the VM loaded another instruction stream
+void jit_reset(Jit *jit, const InstructionStream *stream);
+
+// Compile fn and route its entry points (the function entry and the instruction
+// after every call) to the machine code. Returns false when it stays interpreted,
+// e.g. because it uses an opcode the JIT cannot run.
+bool jit_compile_function(VM *vm, Function *fn);
+
+// Count an iteration of the loop starting at header and return where dispatching
+// it goes: the original handler, or the compiled loop once it got hot.
+InstructionHandler jit_loop_header(VM *vm, Instruction *header);
+
+// whether ins can be run in compiled code, e.g. where a suspended VM resumes
+bool jit_has_code(const Jit *jit, const Instruction *ins);
+
+// Run the machine code of ins until execution has to leave it, vm->pc tells
+// where the interpreter continues. Same contract as an opcode handler: false
+// stops execution.
+bool jit_enter(VM *vm, const Instruction *ins);
+
+#endif //TIGE_JIT_H
@@ -36,72 +36,39 @@ static Keyword keywords[] = {
         {NULL,        TOKEN_EOF}  // sentinel
 };
 
-TokenList *token_list_create(size_t initial_capacity) {
-    TokenList *list = malloc(sizeof(TokenList));
-    list->tokens = malloc(sizeof(Token *) * initial_capacity);
-    list->capacity = initial_capacity;
-    list->size = 0;
-    list->current_index = 0;
-    return list;
+void token_stream_init(TokenStream *stream, Lexer *lexer) {
+    stream->lexer = lexer;
+    stream->consumed = 0;
+    stream->lexed = 0;
 }
 
-void token_list_add(TokenList *list, Token *token) {
-    if (list->size >= list->capacity) {
-        list->capacity *= 2;
-        list->tokens = realloc(list->tokens, sizeof(Token *) * list->capacity);
+Token *token_stream_peek(TokenStream *stream, size_t offset) {
+    const size_t wanted = stream->consumed + offset;
+    // lexing it must not overwrite the current token
+    if (offset >= TOKEN_RING_SIZE - 1) {
+        return nullptr;
     }
-    list->tokens[list->size++] = token;
-}
-
-Token *token_list_current(TokenList *list) {
-    if (list->current_index < list->size) {
-        return list->tokens[list->current_index];
-    } else {
-        return NULL;
+    while (stream->lexed <= wanted) {
+        stream->ring[stream->lexed % TOKEN_RING_SIZE] = lex(stream->lexer);
+        stream->lexed++;
     }
+    return &stream->ring[wanted % TOKEN_RING_SIZE];
 }
 
-Token *token_list_at(TokenList *list, size_t index) {
-    if (index < list->size) {
-        return list->tokens[index];
-    }
-    return list->tokens[list->size - 1];
-}
-
-Token *token_list_next(TokenList *list) {
-    if (list->current_index + 1 < list->size) {
-        Token *tok = list->tokens[list->current_index];
-        list->current_index++;
-
-        return tok;
-    }
-
-    return create_token(TOKEN_EOF, nullptr, -1, -1);
-}
-
-Token *token_list_prev(TokenList *list) {
-    if (list->current_index > 0) {
-        list->current_index--;
-    }
-    // Optional: Handle case where you're at the start
-}
-
-void token_list_free(TokenList *list) {
-    for (size_t i = 0; i < list->size; i++) {
-        token_free(list->tokens[i]);
-    }
-    free(list->tokens);
-    free(list);
+Token *token_stream_next(TokenStream *stream) {
+    Token *token = token_stream_peek(stream, 0);
+    stream->consumed++;
+    return token;
 }
 
 // Helper functions
-void lexer_init(Lexer *lexer, const char *source) {
+void lexer_init(Lexer *lexer, const char *source, size_t length) {
     lexer->source = source;
-    lexer->source_len = source != nullptr ? strlen(source) : 0;
+    lexer->source_len = source != nullptr ? length : 0;
     lexer->position = 0;
     lexer->line = 1;
     lexer->column = 1;
-    lexer->current = source != nullptr ? source[0] : EOF;
+    lexer->current = lexer->source_len > 0 ? source[0] : '\0';
 }
 
 bool lexer_is_initialized(Lexer *lexer) {
@@ -170,7 +137,7 @@ void skip_block_comment(Lexer *lexer) {
     }
 }
 
-Token *lex_number(Lexer *lexer) {
+Token lex_number(Lexer *lexer) {
     size_t start_pos = lexer->position;
     int start_col = lexer->column;
     int is_float = 0;
@@ -184,11 +151,8 @@ Token *lex_number(Lexer *lexer) {
         lexer_advance(lexer);
 
         if (!is_digit(lexer->current)) {
-            size_t length = lexer->position - start_pos;
-            char *value = (char *) malloc(length + 1);
-            strncpy(value, &lexer->source[start_pos], length);
-            value[length] = '\0';
-            return create_token(TOKEN_ERROR, value, lexer->line, start_col);
+            return create_token(TOKEN_ERROR, &lexer->source[start_pos], lexer->position - start_pos,
+                                lexer->line, start_col);
         }
 
         while (is_digit(lexer->current)) {
@@ -204,11 +168,8 @@ Token *lex_number(Lexer *lexer) {
             }
 
             if (!is_digit(lexer->current)) {
-                size_t length = lexer->position - start_pos;
-                char *value = (char *) malloc(length + 1);
-                strncpy(value, &lexer->source[start_pos], length);
-                value[length] = '\0';
-                return create_token(TOKEN_ERROR, value, lexer->line, start_col);
+                return create_token(TOKEN_ERROR, &lexer->source[start_pos], lexer->position - start_pos,
+                                    lexer->line, start_col);
             }
 
             while (is_digit(lexer->current)) {
@@ -225,11 +186,8 @@ Token *lex_number(Lexer *lexer) {
         }
 
         if (!is_digit(lexer->current)) {
-            size_t length = lexer->position - start_pos;
-            char *value = (char *) malloc(length + 1);
-            strncpy(value, &lexer->source[start_pos], length);
-            value[length] = '\0';
-            return create_token(TOKEN_ERROR, value, lexer->line, start_col);
+            return create_token(TOKEN_ERROR, &lexer->source[start_pos], lexer->position - start_pos,
+                                lexer->line, start_col);
         }
 
         while (is_digit(lexer->current)) {
@@ -237,16 +195,11 @@ Token *lex_number(Lexer *lexer) {
         }
     }
 
-    size_t length = lexer->position - start_pos;
-    char *value = (char *) malloc(length + 1);
-    strncpy(value, &lexer->source[start_pos], length);
-    value[length] = '\0';
-
     TokenType type = is_float ? TOKEN_FLOAT : TOKEN_INTEGER;
-    return create_token(type, value, lexer->line, start_col);
+    return create_token(type, &lexer->source[start_pos], lexer->position - start_pos, lexer->line, start_col);
 }
 
-Token *lex_string(Lexer *lexer) {
+Token lex_string(Lexer *lexer) {
     char quote = lexer->current;
     size_t start_pos = lexer->position + 1;
     size_t start_col = lexer->column;
@@ -257,17 +210,14 @@ Token *lex_string(Lexer *lexer) {
         lexer_advance(lexer);
     }
 
-    size_t length = lexer->position - start_pos;
-    char *value = (char *) malloc(length + 1);
-    strncpy(value, &lexer->source[start_pos], length);
-    value[length] = '\0';
+    const size_t length = lexer->position - start_pos;
 
     lexer_advance(lexer); // skip closing quote
 
-    return create_token(TOKEN_STRING, value, lexer->line, start_col);
+    return create_token(TOKEN_STRING, &lexer->source[start_pos], length, lexer->line, start_col);
 }
 
-Token *lex_identifier_or_keyword(Lexer *lexer) {
+Token lex_identifier_or_keyword(Lexer *lexer) {
     size_t start_pos = lexer->position;
     size_t start_col = lexer->column;
 
@@ -275,57 +225,71 @@ Token *lex_identifier_or_keyword(Lexer *lexer) {
         lexer_advance(lexer);
     }
 
+    const char *value = &lexer->source[start_pos];
     size_t length = lexer->position - start_pos;
-    char *value = (char *) malloc(length + 1);
-    strncpy(value, &lexer->source[start_pos], length);
-    value[length] = '\0';
 
     // Check if it's a keyword
     for (int i = 0; keywords[i].keyword != NULL; i++) {
-        if (strcmp(value, keywords[i].keyword) == 0) {
+        if (strncmp(keywords[i].keyword, value, length) == 0 && keywords[i].keyword[length] == '\0') {
             TokenType type = keywords[i].type;
-            Token *token = create_token(type, value, lexer->line, start_col);
+            Token token = create_token(type, value, length, lexer->line, start_col);
 
             // Handle boolean literals
             if (type == TOKEN_TRUE) {
-                token->bool_value = true;
-                token->type = TOKEN_TRUE;
+                token.bool_value = true;
+                token.type = TOKEN_TRUE;
             } else if (type == TOKEN_FALSE) {
-                token->bool_value = false;
-                token->type = TOKEN_TRUE;
+                token.bool_value = false;
+                token.type = TOKEN_TRUE;
             }
 
             return token;
         }
     }
 
-    return create_token(TOKEN_IDENTIFIER, value, lexer->line, start_col);
+    return create_token(TOKEN_IDENTIFIER, value, length, lexer->line, start_col);
 }
 
-Token *create_token(TokenType type, const char *value, int line, int column) {
-    Token *token = (Token *) malloc(sizeof(Token));
-    token->type = type;
-    token->line = line;
-    token->column = column;
-    token->value = NULL;
-    if (value) {
-        // For float and integer tokens, store both string and numeric values
-        if (type == TOKEN_FLOAT) {
-            token->str_value = strdup(value);
-            token->float_value = atof(value);  // Convert string to float
-        } else if (type == TOKEN_INTEGER) {
-            token->str_value = strdup(value);
-            token->int_value = atoll(value);   // Convert string to long long
-        } else {
-            token->str_value = strdup(value);
-        }
-    } else {
-        token->str_value = nullptr;
+// the text of number tokens is all digits, '.', 'e' and signs (see lex_number)
+static int64_t parse_integer(const char *text, size_t length) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < length; i++) {
+        value = value * 10 + (uint64_t) (text[i] - '0');
+    }
+    return (int64_t) value;
+}
+
+static double parse_float(const char *text, size_t length) {
+    char small[64];
+    char *copy = length < sizeof(small) ? small : malloc(length + 1);
+    if (copy == nullptr) {
+        return 0;
+    }
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    const double value = atof(copy);
+    if (copy != small) {
+        free(copy);
+    }
+    return value;
+}
+
+Token create_token(TokenType type, const char *value, size_t length, int line, int column) {
+    Token token = {.type = type, .str_value = value, .length = value ? length : 0, .line = line, .column = column};
+    // For float and integer tokens, the numeric value replaces the text
+    if (type == TOKEN_FLOAT) {
+        token.float_value = parse_float(value, length);
+    } else if (type == TOKEN_INTEGER) {
+        token.int_value = parse_integer(value, length);
     }
 
     return token;
 }
 
+char *token_strdup(const Token *token) {
+    return strndup(token->str_value, token->length);
+}
+
 int token_is_type(const Token *token, TokenType type) {
     return token != NULL && token->type == type;
 }
@@ -334,11 +298,11 @@ const LexerError *lexer_get_error(const Lexer *lexer) {
     return NULL;
 }
 
-Token *lex(Lexer *lexer) {
+Token lex(Lexer *lexer) {
     skip_whitespace(lexer);
 
     if (lexer->current == '\0') {
-        return create_token(TOKEN_EOF, NULL, lexer->line, lexer->column);
+        return create_token(TOKEN_EOF, NULL, 0, lexer->line, lexer->column);
     }
 
     int current_line = lexer->line;
@@ -375,98 +339,82 @@ Token *lex(Lexer *lexer) {
 
     switch (current) {
         case ';':
-            return create_token(TOKEN_SEMICOLON, ";", current_line, current_column);
+            return create_token(TOKEN_SEMICOLON, ";", 1, current_line, current_column);
         case ':':
             if (lexer->current == ':') {
                 lexer_advance(lexer);
-                return create_token(TOKEN_SCOPE, "::", current_line, current_column);
+                return create_token(TOKEN_SCOPE, "::", 2, current_line, current_column);
             }
-            return create_token(TOKEN_COLON, ":", current_line, current_column);
+            return create_token(TOKEN_COLON, ":", 1, current_line, current_column);
         case ',':
-            return create_token(TOKEN_COMMA, ",", current_line, current_column);
+            return create_token(TOKEN_COMMA, ",", 1, current_line, current_column);
         case '.':
             if (lexer->current == '.') {
                 lexer_advance(lexer);
-                return create_token(TOKEN_DOTDOT, "..", current_line, current_column);
+                return create_token(TOKEN_DOTDOT, "..", 2, current_line, current_column);
             }
-            return create_token(TOKEN_DOT, ".", current_line, current_column);
+            return create_token(TOKEN_DOT, ".", 1, current_line, current_column);
         case '(':
-            return create_token(TOKEN_LPAREN, "(", current_line, current_column);
+            return create_token(TOKEN_LPAREN, "(", 1, current_line, current_column);
         case ')':
-            return create_token(TOKEN_RPAREN, ")", current_line, current_column);
+            return create_token(TOKEN_RPAREN, ")", 1, current_line, current_column);
         case '{':
-            return create_token(TOKEN_LBRACE, "{", current_line, current_column);
+            return create_token(TOKEN_LBRACE, "{", 1, current_line, current_column);
         case '}':
-            return create_token(TOKEN_RBRACE, "}", current_line, current_column);
+            return create_token(TOKEN_RBRACE, "}", 1, current_line, current_column);
         case '+':
-            return create_token(TOKEN_PLUS, "+", current_line, current_column);
+            return create_token(TOKEN_PLUS, "+", 1, current_line, current_column);
         case '-':
-            return create_token(TOKEN_MINUS, "-", current_line, current_column);
+            return create_token(TOKEN_MINUS, "-", 1, current_line, current_column);
         case '*':
-            return create_token(TOKEN_ASTERISK, "*", current_line, current_column);
+            return create_token(TOKEN_ASTERISK, "*", 1, current_line, current_column);
         case '/':
-            return create_token(TOKEN_SLASH, "/", current_line, current_column);
+            return create_token(TOKEN_SLASH, "/", 1, current_line, current_column);
         case '|':
             if (lexer->current == '|') {
                 lexer_advance(lexer);
-                return create_token(TOKEN_OR, "||", current_line, current_column);
+                return create_token(TOKEN_OR, "||", 2, current_line, current_column);
             }
             break;
         case '&':
             if (lexer->current == '&') {
                 lexer_advance(lexer);
-                return create_token(TOKEN_AND, "||", current_line, current_column);
+                return create_token(TOKEN_AND, "||", 2, current_line, current_column);
             }
             break;
         case '=':
             if (lexer->current == '=') {
                 lexer_advance(lexer);
-                return create_token(TOKEN_EQ, "==", current_line, current_column);
+                return create_token(TOKEN_EQ, "==", 2, current_line, current_column);
             }
-            return create_token(TOKEN_EQUALS, "=", current_line, current_column);
+            return create_token(TOKEN_EQUALS, "=", 1, current_line, current_column);
         case '>':
             if (lexer->current == '=') {
                 lexer_advance(lexer);
-                return create_token(TOKEN_GTE, ">=", current_line, current_column);
+                return create_token(TOKEN_GTE, ">=", 2, current_line, current_column);
             }
-            return create_token(TOKEN_GT, ">", current_line, current_column);
+            return create_token(TOKEN_GT, ">", 1, current_line, current_column);
         case '<':
             if (lexer->current == '=') {
                 lexer_advance(lexer);
-                return create_token(TOKEN_LTE, "<=", current_line, current_column);
+                return create_token(TOKEN_LTE, "<=", 2, current_line, current_column);
             }
-            return create_token(TOKEN_LT, "<", current_line, current_column);
+            return create_token(TOKEN_LT, "<", 1, current_line, current_column);
         case '!':
             if (lexer->current == '=') {
                 lexer_advance(lexer);
-                return create_token(TOKEN_NEQ, "!=", current_line, current_column);
+                return create_token(TOKEN_NEQ, "!=", 2, current_line, current_column);
             } else {
                 lexer_advance(lexer);
-                return create_token(TOKEN_BANG, "!", current_line, current_column);
+                return create_token(TOKEN_BANG, "!", 1, current_line, current_column);
             }
             break;
         case '?':
-            return create_token(TOKEN_QUESTION, "?", current_line, current_column);
+            return create_token(TOKEN_QUESTION, "?", 1, current_line, current_column);
     }
 
     // Handle unknown characters
-    char unknown_char[2] = {current, '\0'};
-    return create_token(TOKEN_EOF, unknown_char, current_line, current_column);
-}
-
-// Token manipulation functions
-void token_free(Token *token) {
-    if (token != NULL) {
-        if (
-                (token->type == TOKEN_STRING ||
-                 token->type == TOKEN_IDENTIFIER ||
-                 token_is_keyword(token->type)) &&
-                token->str_value != nullptr
-                ) {
-            free(token->str_value);
-        }
-        free(token);         // Free the token structure itself
-    }
+    return create_token(TOKEN_EOF, &lexer->source[lexer->position - 1], 1, current_line, current_column);
 }
 
 #ifdef LEXER_DEBUG
@@ -476,8 +424,8 @@ void print_token(const Token *token) {
     printf("Line %d, Column %d: %s", token->line, token->column, token_type_to_string(token->type));
 
     // Check if the token has a value to print
-    if (token->value != NULL) {
-        printf(" '%s'", token->value);
+    if (!token_is_numeric(token->type) && token->str_value != NULL) {
+        printf(" '%.*s'", (int) token->length, token->str_value);
     }
 
     printf("\n");
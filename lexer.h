@@ -69,12 +69,13 @@ typedef enum {
 typedef struct {
     TokenType type;
     union {
-        char *str_value;
+        const char *str_value;      // the text in the source, length bytes, not NUL terminated
         int64_t int_value;
         double float_value;
         bool bool_value;
         void *value;
     };
+    size_t length;
     int line;
     int column;
 } Token;
@@ -90,35 +91,39 @@ typedef struct {
     ErrorList* error_list;
 } Lexer;
 
-typedef struct TokenList {
-    Token **tokens;
-    size_t capacity;
-    size_t size;
-    size_t current_index;
-} TokenList;
+// Tokens are lexed as the parser pulls them into a ring that holds the token
+// consumed last and the ones peeked after it, so parsing takes the same memory
+// whatever the size of the source.
+#define TOKEN_RING_SIZE 4
 
-TokenList *token_list_create(size_t initial_capacity);
+typedef struct TokenStream {
+    Lexer *lexer;
+    Token ring[TOKEN_RING_SIZE];
+    size_t consumed;            // tokens taken with token_stream_next
+    size_t lexed;
+} TokenStream;
 
-void token_list_add(TokenList *list, Token *token);
+void token_stream_init(TokenStream *stream, Lexer *lexer);
 
-void token_list_free(TokenList *list);
+// the token offset places after the next one, nullptr past the lookahead of the ring
+Token* token_stream_peek(TokenStream *stream, size_t offset);
 
-Token* token_list_current(TokenList* list);
-Token* token_list_at(TokenList* list, size_t index);
-Token* token_list_next(TokenList* list);
-Token* token_list_prev(TokenList* list);
+// consume the next token, it stays valid for TOKEN_RING_SIZE - 2 more of them
+Token* token_stream_next(TokenStream *stream);
 
-void lexer_init(Lexer *lexer, const char *source);
+// source is borrowed, tokens point into it, so it has to outlive them
+void lexer_init(Lexer *lexer, const char *source, size_t length);
 bool lexer_is_initialized(Lexer *lexer);
-Token *lex(Lexer *lexer);
+Token lex(Lexer *lexer);
 
 const char *token_type_to_string(TokenType type);
 
-void token_free(Token *token);
-
 int token_is_type(const Token *token, TokenType type);
 
-Token *create_token(TokenType type, const char *value, int line, int column);
+Token create_token(TokenType type, const char *value, size_t length, int line, int column);
+
+// a NUL terminated copy of the text of token, to free
+char *token_strdup(const Token *token);
 
 Token *token_create_string(TokenType type, const char *value, int line, int column);
 
@@ -1,6 +1,14 @@
 #include <stdio.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "context.h"
 #include "evaluator.h"
@@ -8,39 +16,87 @@
 #include "bytecode_buffer.h"
 #include "compiler.h"
 #include "vm.h"
+#include "aot.h"
+#include "scheduler.h"
+#include "event_loop.h"
+#include "server.h"
+#include "snapshot.h"
 
-// Read entire file into memory
-char *read_file(const char *filename, size_t *file_size) {
-    FILE *file = fopen(filename, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Error: Could not open file '%s'\n", filename);
-        return NULL;
+// read what is left of fd into a malloc'd buffer, for sources that cannot be mapped
+static char *read_source(int fd, size_t *size) {
+    size_t capacity = 4096;
+    char *buffer = malloc(capacity);
+    *size = 0;
+    while (buffer) {
+        if (*size == capacity) {
+            char *grown = realloc(buffer, capacity * 2);
+            if (!grown) {
+                break;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+        const ssize_t count = read(fd, buffer + *size, capacity - *size);
+        if (count == 0) {
+            return buffer;
+        }
+        if (count < 0 && errno != EINTR) {
+            break;
+        }
+        *size += count > 0 ? (size_t) count : 0;
     }
+    free(buffer);
+    return nullptr;
+}
 
-    // Get file size
-    fseek(file, 0, SEEK_END);
-    *file_size = ftell(file);
-    rewind(file);
-
-    char *buffer = (char *) malloc(*file_size + 1);
-    if (buffer == NULL) {
-        fprintf(stderr, "Error: Could not allocate memory for file content\n");
-        fclose(file);
+// Map a source file read only. The text is *file_size bytes and not NUL terminated,
+// tokens point into it, so it stays mapped until every context using it is destroyed.
+// Pipes cannot be mapped, they are read into a buffer instead and *mapped is false.
+const char *map_source(const char *filename, size_t *file_size, bool *mapped) {
+    const int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not open file '%s'\n", filename);
         return nullptr;
     }
 
-    size_t bytes_read = fread(buffer, 1, *file_size, file);
-    if (bytes_read < *file_size) {
-        fprintf(stderr, "Error: Could not read entire file\n");
-        free(buffer);
-        fclose(file);
+    struct stat info;
+    if (fstat(fd, &info) < 0 || S_ISDIR(info.st_mode)) {
+        fprintf(stderr, "Error: '%s' is not a file\n", filename);
+        close(fd);
         return nullptr;
     }
+    *mapped = S_ISREG(info.st_mode);
+    if (!*mapped) {
+        char *source = read_source(fd, file_size);
+        close(fd);
+        if (source == nullptr) {
+            fprintf(stderr, "Error: Could not read file '%s'\n", filename);
+        }
+        return source;
+    }
+    *file_size = (size_t) info.st_size;
+    if (*file_size == 0) {
+        close(fd);
+        return "";
+    }
 
-    buffer[*file_size] = '\0';
+    // the lexer reads it front to back once
+    void *source = mmap(nullptr, *file_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+    close(fd);
+    if (source == MAP_FAILED) {
+        fprintf(stderr, "Error: Could not map file '%s'\n", filename);
+        return nullptr;
+    }
+    madvise(source, *file_size, MADV_SEQUENTIAL);
+    return source;
+}
 
-    fclose(file);
-    return buffer;
+void unmap_source(const char *source, size_t file_size, bool mapped) {
+    if (!mapped) {
+        free((void *) source);
+    } else if (source != nullptr && file_size > 0) {
+        munmap((void *) source, file_size);
+    }
 }
 
 const char* opcode_to_mnemonic(Opcode opcode) {
@@ -50,6 +106,8 @@ const char* opcode_to_mnemonic(Opcode opcode) {
         case OP_LOAD_BOOL:           return "LDZ";
         case OP_LOAD_VAR:            return "LD";
         case OP_STORE_VAR:           return "STORE";
+        case OP_LOAD_GLOBAL:         return "LDG";
+        case OP_STORE_GLOBAL:        return "STOREG";
         case OP_ADD:                 return "ADD";
         case OP_SUB:                 return "SUB";
         case OP_MUL:                 return "MUL";
@@ -67,83 +125,229 @@ const char* opcode_to_mnemonic(Opcode opcode) {
         case OP_HALT:                return "HALT";
         case OP_NOT:                 return "NOT";
         case OP_RETURN:              return "RET";
+        case OP_CALL:                return "CALL";
+        case OP_TAIL_CALL:           return "TCALL";
+        case OP_CALL_NATIVE:         return "CALLN";
+        case OP_ADD_RRR:             return "ADDR";
+        case OP_SUB_RRR:             return "SUBR";
+        case OP_MUL_RRR:             return "MULR";
+        case OP_DIV_RRR:             return "DIVR";
+        case OP_ADD_RRI:             return "ADDI";
+        case OP_SUB_RRI:             return "SUBI";
+        case OP_MUL_RRI:             return "MULI";
+        case OP_DIV_RRI:             return "DIVI";
+        case OP_MOV_RR:              return "MOV";
+        case OP_MOV_RI:              return "MOVI";
+        case OP_EQ_RR_JMP:
+        case OP_EQ_RI_JMP:           return "JEQ";
+        case OP_NE_RR_JMP:
+        case OP_NE_RI_JMP:           return "JNE";
+        case OP_LT_RR_JMP:
+        case OP_LT_RI_JMP:           return "JLT";
+        case OP_LE_RR_JMP:
+        case OP_LE_RI_JMP:           return "JLE";
+        case OP_GT_RR_JMP:
+        case OP_GT_RI_JMP:           return "JGT";
+        case OP_GE_RR_JMP:
+        case OP_GE_RI_JMP:           return "JGE";
         default:                     return "UNKNOWN";
     }
 }
 
-void disassemble_chunk(BytecodeChunk* chunk) {
-    if (!chunk || !chunk->bytecode) {
-        fprintf(stderr, "Error: Invalid BytecodeChunk.\n");
+void disassemble_segment(CodeSegment* segment) {
+    if (!segment || !segment->bytecode) {
+        fprintf(stderr, "Error: Invalid CodeSegment.\n");
         return;
     }
 
     size_t offset = 0;
 
-    while (offset < chunk->size) {
-        Opcode opcode = chunk->bytecode[offset];
+    while (offset < segment->size) {
+        Opcode opcode = segment->bytecode[offset];
         const char* mnemonic = opcode_to_mnemonic(opcode);
-        size_t instruction_offset = offset; // Current instruction offset within chunk
+        size_t instruction_offset = offset; // Current instruction offset within segment
 
         switch (opcode) {
             case OP_LOAD_CONST_INT: {
-                if (offset + 4 >= chunk->size) {
-                    fprintf(stderr, "Error: Unexpected end of bytecode at chunk %zu, offset 0x%02zx\n",
-                            chunk->chunk_id, offset);
+                if (offset + 4 >= segment->size) {
+                    fprintf(stderr, "Error: Unexpected end of bytecode at segment %zu, offset 0x%02zx\n",
+                            segment->segment_id, offset);
                     return;
                 }
                 int64_t value;
-                memcpy(&value, chunk->bytecode + offset + 1, sizeof(int64_t));
-                printf("0x%02zx %-10s %lld\n", instruction_offset, mnemonic, value);
+                memcpy(&value, segment->bytecode + offset + 1, sizeof(int64_t));
+                printf("0x%02zx %-10s %" PRId64 "\n", instruction_offset, mnemonic, value);
                 offset += 1 + sizeof(int64_t);
                 break;
             }
             case OP_LOAD_CONST_FLOAT: {
-                if (offset + 4 >= chunk->size) {
-                    fprintf(stderr, "Error: Unexpected end of bytecode at chunk %zu, offset 0x%02zx\n",
-                            chunk->chunk_id, offset);
+                if (offset + 4 >= segment->size) {
+                    fprintf(stderr, "Error: Unexpected end of bytecode at segment %zu, offset 0x%02zx\n",
+                            segment->segment_id, offset);
                     return;
                 }
                 double value;
-                memcpy(&value, chunk->bytecode + offset + 1, sizeof(double));
+                memcpy(&value, segment->bytecode + offset + 1, sizeof(double));
                 printf("0x%02zx %-10s %f\n", instruction_offset, mnemonic, value);
                 offset += 1 + sizeof(double); // opcode + operand
                 break;
             }
             case OP_LOAD_BOOL: {
-                if (offset + 1 >= chunk->size) {
-                    fprintf(stderr, "Error: Unexpected end of bytecode at chunk %zu, offset 0x%02zx\n",
-                            chunk->chunk_id, offset);
+                if (offset + 1 >= segment->size) {
+                    fprintf(stderr, "Error: Unexpected end of bytecode at segment %zu, offset 0x%02zx\n",
+                            segment->segment_id, offset);
                     return;
                 }
-                unsigned char value = chunk->bytecode[offset + 1];
+                unsigned char value = segment->bytecode[offset + 1];
                 printf("0x%02zx %-10s %s\n", instruction_offset, mnemonic, value ? "true" : "false");
                 offset += 1 + 1;
                 break;
             }
             case OP_LOAD_VAR:
-            case OP_STORE_VAR: {
-                if (offset + 2 >= chunk->size) {
-                    fprintf(stderr, "Error: Unexpected end of bytecode at chunk %zu, offset 0x%02zx\n",
-                            chunk->chunk_id, offset);
+            case OP_STORE_VAR:
+            case OP_LOAD_GLOBAL:
+            case OP_STORE_GLOBAL: {
+                if (offset + 2 >= segment->size) {
+                    fprintf(stderr, "Error: Unexpected end of bytecode at segment %zu, offset 0x%02zx\n",
+                            segment->segment_id, offset);
                     return;
                 }
                 uint16_t reg_index;
-                memcpy(&reg_index, chunk->bytecode + offset + 1, sizeof(uint16_t));
+                memcpy(&reg_index, segment->bytecode + offset + 1, sizeof(uint16_t));
                 printf("0x%02zx %-10s r%u\n", instruction_offset, mnemonic, reg_index);
                 offset += 1 + sizeof(uint16_t);
                 break;
             }
+            case OP_CALL:
+            case OP_TAIL_CALL: {
+                const void *end = offset + 3 < segment->size
+                                  ? memchr(segment->bytecode + offset + 3, '\0', segment->size - offset - 3)
+                                  : nullptr;
+                if (!end) {
+                    fprintf(stderr, "Error: Unexpected end of bytecode at segment %zu, offset 0x%02zx\n",
+                            segment->segment_id, offset);
+                    return;
+                }
+                uint16_t base;
+                memcpy(&base, segment->bytecode + offset + 1, sizeof(uint16_t));
+                printf("0x%02zx %-10s r%u %s\n", instruction_offset, mnemonic, base,
+                       (const char *) (segment->bytecode + offset + 3));
+                offset = (const uint8_t *) end - segment->bytecode + 1;
+                break;
+            }
+            case OP_CALL_NATIVE: {
+                if (offset + 2 >= segment->size) {
+                    fprintf(stderr, "Error: Unexpected end of bytecode at segment %zu, offset 0x%02zx\n",
+                            segment->segment_id, offset);
+                    return;
+                }
+                uint16_t index;
+                memcpy(&index, segment->bytecode + offset + 1, sizeof(uint16_t));
+                printf("0x%02zx %-10s #%u\n", instruction_offset, mnemonic, index);
+                offset += 1 + sizeof(uint16_t);
+                break;
+            }
             case OP_JMP_IF_FALSE:
             case OP_JMP: {
-                if (offset + 2 >= chunk->size) {
-                    fprintf(stderr, "Error: Unexpected end of bytecode at chunk %zu, offset 0x%02zx\n",
-                            chunk->chunk_id, offset);
+                if (offset + sizeof(JumpOffset) >= segment->size) {
+                    fprintf(stderr, "Error: Unexpected end of bytecode at segment %zu, offset 0x%02zx\n",
+                            segment->segment_id, offset);
                     return;
                 }
-                size_t target_offset;
-                memcpy(&target_offset, chunk->bytecode + offset + 1 + sizeof(size_t), sizeof(size_t));
-                printf("0x%02zx %-10s 0x%02llx\n", instruction_offset, mnemonic, target_offset);
-                offset += 1 + sizeof(size_t) * 2;
+                JumpOffset relative;
+                memcpy(&relative, segment->bytecode + offset + 1, sizeof(JumpOffset));
+                offset += 1 + sizeof(JumpOffset);
+                printf("0x%02zx %-10s 0x%02zx\n", instruction_offset, mnemonic, offset + relative);
+                break;
+            }
+            case OP_ADD_RRR:
+            case OP_SUB_RRR:
+            case OP_MUL_RRR:
+            case OP_DIV_RRR: {
+                if (offset + 3 * sizeof(uint16_t) >= segment->size) {
+                    fprintf(stderr, "Error: Unexpected end of bytecode at segment %zu, offset 0x%02zx\n",
+                            segment->segment_id, offset);
+                    return;
+                }
+                uint16_t regs[3];
+                memcpy(regs, segment->bytecode + offset + 1, sizeof(regs));
+                printf("0x%02zx %-10s r%u, r%u, r%u\n", instruction_offset, mnemonic, regs[0], regs[1], regs[2]);
+                offset += 1 + sizeof(regs);
+                break;
+            }
+            case OP_ADD_RRI:
+            case OP_SUB_RRI:
+            case OP_MUL_RRI:
+            case OP_DIV_RRI: {
+                if (offset + 2 * sizeof(uint16_t) + sizeof(int64_t) >= segment->size) {
+                    fprintf(stderr, "Error: Unexpected end of bytecode at segment %zu, offset 0x%02zx\n",
+                            segment->segment_id, offset);
+                    return;
+                }
+                uint16_t regs[2];
+                int64_t value;
+                memcpy(regs, segment->bytecode + offset + 1, sizeof(regs));
+                memcpy(&value, segment->bytecode + offset + 1 + sizeof(regs), sizeof(int64_t));
+                printf("0x%02zx %-10s r%u, r%u, %" PRId64 "\n", instruction_offset, mnemonic, regs[0], regs[1], value);
+                offset += 1 + sizeof(regs) + sizeof(int64_t);
+                break;
+            }
+            case OP_MOV_RR:
+            case OP_MOV_RI: {
+                const size_t size = opcode == OP_MOV_RR ? sizeof(uint16_t) : sizeof(int64_t);
+                if (offset + sizeof(uint16_t) + size >= segment->size) {
+                    fprintf(stderr, "Error: Unexpected end of bytecode at segment %zu, offset 0x%02zx\n",
+                            segment->segment_id, offset);
+                    return;
+                }
+                uint16_t dst;
+                memcpy(&dst, segment->bytecode + offset + 1, sizeof(uint16_t));
+                if (opcode == OP_MOV_RR) {
+                    uint16_t src;
+                    memcpy(&src, segment->bytecode + offset + 1 + sizeof(uint16_t), sizeof(uint16_t));
+                    printf("0x%02zx %-10s r%u, r%u\n", instruction_offset, mnemonic, dst, src);
+                } else {
+                    int64_t value;
+                    memcpy(&value, segment->bytecode + offset + 1 + sizeof(uint16_t), sizeof(int64_t));
+                    printf("0x%02zx %-10s r%u, %" PRId64 "\n", instruction_offset, mnemonic, dst, value);
+                }
+                offset += 1 + sizeof(uint16_t) + size;
+                break;
+            }
+            case OP_EQ_RR_JMP:
+            case OP_NE_RR_JMP:
+            case OP_LT_RR_JMP:
+            case OP_LE_RR_JMP:
+            case OP_GT_RR_JMP:
+            case OP_GE_RR_JMP:
+            case OP_EQ_RI_JMP:
+            case OP_NE_RI_JMP:
+            case OP_LT_RI_JMP:
+            case OP_LE_RI_JMP:
+            case OP_GT_RI_JMP:
+            case OP_GE_RI_JMP: {
+                const bool immediate = opcode >= OP_EQ_RI_JMP;
+                const size_t operands = sizeof(uint16_t) + (immediate ? sizeof(int64_t) : sizeof(uint16_t));
+                if (offset + operands + sizeof(JumpOffset) >= segment->size) {
+                    fprintf(stderr, "Error: Unexpected end of bytecode at segment %zu, offset 0x%02zx\n",
+                            segment->segment_id, offset);
+                    return;
+                }
+                uint16_t a;
+                JumpOffset relative;
+                memcpy(&a, segment->bytecode + offset + 1, sizeof(uint16_t));
+                memcpy(&relative, segment->bytecode + offset + 1 + operands, sizeof(JumpOffset));
+                const size_t target_offset = offset + 1 + operands + sizeof(JumpOffset) + relative;
+                if (immediate) {
+                    int64_t value;
+                    memcpy(&value, segment->bytecode + offset + 1 + sizeof(uint16_t), sizeof(int64_t));
+                    printf("0x%02zx %-10s r%u, %" PRId64 ", 0x%02zx\n", instruction_offset, mnemonic, a, value, target_offset);
+                } else {
+                    uint16_t b;
+                    memcpy(&b, segment->bytecode + offset + 1 + sizeof(uint16_t), sizeof(uint16_t));
+                    printf("0x%02zx %-10s r%u, r%u, 0x%02zx\n", instruction_offset, mnemonic, a, b, target_offset);
+                }
+                offset += 1 + operands + sizeof(JumpOffset);
                 break;
             }
             case OP_ADD:
@@ -181,31 +385,329 @@ void disassemble_bytecode(BytecodeBuffer* buffer) {
 
     printf("[CODE]\n");
 
-    // Iterate through all chunks in order
-    BytecodeChunk* current = buffer->head;
+    // Iterate through all segments in order
+    CodeSegment* current = buffer->head;
     while (current) {
-        disassemble_chunk(current);
+        printf("; segment %zu\n", current->segment_id);
+        disassemble_segment(current);
         current = current->next;
     }
 }
 
+// run the script to its end, in slices of budget safepoints when budget is set:
+// the VM suspends after each one and is resumed where it stopped. On a fiber,
+// nothing waits for the natives that park it, they are continued right away.
+// Then the event loop runs the callbacks of the timers and sockets the script opened.
+static Value run_script(VM *vm, AotModule *module, int64_t budget, bool on_fiber) {
+    Value value;
+    do {
+        if (budget > 0) {
+            vm_set_budget(vm, budget, nullptr, nullptr);
+        }
+        value = module ? aot_execute(module, vm) : on_fiber ? vm_run_fiber(vm) : vm_execute(vm);
+        // a native parked the fiber (sleep), it continues once what it waits for is there
+        if (vm_is_parked(vm) && !event_loop_wait_parked(vm->events)) {
+            break;
+        }
+    } while (vm_is_suspended(vm) || vm_is_parked(vm));
+
+    if (vm->events) {
+        event_loop_run(vm->events);
+    }
+    return value;
+}
+
+// Compile the script into the context, or load its code cache when it is up to date
+// (see snapshot.h). A compilation refreshes the cache, best effort: the directory of
+// the script may not be writable. On failure the context still has to be destroyed.
+static bool load_script(Context *context, const char *path, const char *source, size_t size, bool use_cache) {
+    char *cache = use_cache ? code_cache_path(path) : nullptr;
+    if (cache && code_cache_load(context, cache, source, size)) {
+        free(cache);
+        return true;
+    }
+    ctx_init(context, source, size);
+    ctx_start_parsing(context);
+    const bool compiled = !ctx_check_errors(context);
+    if (compiled && context->code && cache) {
+        code_cache_write(context, cache, source, size);
+    }
+    free(cache);
+    return compiled;
+}
+
+// safepoints per time slice when --isolates is given without --budget
+#define DEFAULT_SLICE 10000
+
+static void isolate_done([[maybe_unused]] VM *vm, [[maybe_unused]] Value result, void *data) {
+    atomic_fetch_add((_Atomic int *) data, 1);
+}
+
+// run count instances of the script, each in its own context, on a pool of workers
+static int run_isolates(const char *path, const char *source, size_t size, bool use_cache,
+                        int count, int workers, int64_t slice, bool use_jit, bool stats) {
+    Context *contexts = calloc(count, sizeof(Context));
+    Scheduler *scheduler = contexts ? create_scheduler(workers, slice) : nullptr;
+    if (!scheduler) {
+        free(contexts);
+        return 1;
+    }
+
+    _Atomic int finished = 0;
+    int spawned = 0;
+    for (; spawned < count; spawned++) {
+        Context *context = &contexts[spawned];
+        const bool loaded = load_script(context, path, source, size, use_cache);
+        VM *vm = ctx_get_active_vm(context);
+        if (!loaded || !vm) {
+            ctx_destroy(context);
+            break;
+        }
+        if (use_jit && !(vm->jit = create_jit()) && spawned == 0) {
+            fprintf(stderr, "Warning: the JIT is not supported on this platform, interpreting.\n");
+        }
+        if (!vm_swap_code_buffer(vm, context->code) || !scheduler_spawn(scheduler, vm, isolate_done, &finished)) {
+            ctx_destroy(context);
+            break;
+        }
+    }
+    scheduler_wait(scheduler);
+
+    if (stats) {
+        for (int i = 0; i < scheduler_workers(scheduler); i++) {
+            WorkerStats worker;
+            scheduler_worker_stats(scheduler, i, &worker);
+            fprintf(stderr, "worker %d: %" PRIu64 " slices, %" PRIu64 " completed, %" PRIu64 " steals (%" PRIu64
+                            " failed), %" PRIu64 " sleeps, %" PRIu64 " parks, %zu queued\n",
+                    i, worker.slices, worker.completed, worker.steals, worker.failed_steals, worker.sleeps,
+                    worker.parks, worker.queue_depth);
+        }
+        fprintf(stderr, "%d of %d isolates finished\n", atomic_load(&finished), count);
+    }
+    destroy_scheduler(scheduler);
+
+    for (int i = 0; i < spawned; i++) {
+        ctx_destroy(&contexts[i]);
+    }
+    free(contexts);
+    return spawned == count ? 0 : 1;
+}
+
+// run the function entry of an image, its top level code ran when the image was made
+static int run_image(const char *path, const char *entry, bool use_jit) {
+    if (!entry) {
+        fprintf(stderr, "Error: '%s' is a snapshot, name the function to run with --entry.\n", path);
+        return 1;
+    }
+    Context context;
+    if (!snapshot_load(&context, path)) {
+        return 1;
+    }
+    VM *vm = ctx_get_active_vm(&context);
+    if (use_jit && !(vm->jit = create_jit())) {
+        fprintf(stderr, "Warning: the JIT is not supported on this platform, interpreting.\n");
+    }
+    Function *fn = vm_swap_code_buffer(vm, context.code) ? get_function(&context, entry) : nullptr;
+    Value result;
+    int status = fn && vm_call(vm, fn, nullptr, 0, &result) ? 0 : 1;
+    if (status == 0 && vm->events && !event_loop_run(vm->events)) {
+        status = 1;
+    }
+    ctx_destroy(&context);
+    return status;
+}
+
+// tige serve [--host <address>] [--port <n>] [--workers <n>] [--handler <name>] [--jit] [--no-cache] <source_file|image>
+static int serve_main(int argc, char *argv[]) {
+    ServeOptions options = {
+        .host = "127.0.0.1",
+        .port = 8080,
+        .workers = (int) sysconf(_SC_NPROCESSORS_ONLN),
+        .handler = "handle",
+    };
+    bool use_jit = false;
+    bool use_cache = true;
+    int arg = 2;
+    for (; arg < argc - 1; arg++) {
+        if (strcmp(argv[arg], "--host") == 0 && arg + 2 < argc) {
+            options.host = argv[++arg];
+        } else if (strcmp(argv[arg], "--handler") == 0 && arg + 2 < argc) {
+            options.handler = argv[++arg];
+        } else if ((strcmp(argv[arg], "--port") == 0 || strcmp(argv[arg], "--workers") == 0) && arg + 2 < argc) {
+            int *number = argv[arg][2] == 'p' ? &options.port : &options.workers;
+            char *end;
+            const long value = strtol(argv[++arg], &end, 10);
+            if (*end != '\0' || value <= 0 || value > (number == &options.port ? 65535 : 1024)) {
+                fprintf(stderr, "Error: %s expects a positive number.\n", argv[arg - 1]);
+                return 1;
+            }
+            *number = (int) value;
+        } else if (strcmp(argv[arg], "--jit") == 0) {
+            use_jit = true;
+        } else if (strcmp(argv[arg], "--no-cache") == 0) {
+            use_cache = false;
+        } else {
+            break;
+        }
+    }
+    if (arg != argc - 1) {
+        fprintf(stderr, "Usage: %s serve [--host <address>] [--port <n>] [--workers <n>] [--handler <name>] [--jit] [--no-cache] <source_file|image>\n", argv[0]);
+        return 1;
+    }
+    if (options.workers <= 0) {
+        options.workers = 1;
+    }
+
+    Context context;
+    const char *source = nullptr;
+    size_t file_size = 0;
+    bool mapped = true;
+    options.from_snapshot = snapshot_is_image(argv[argc - 1]);
+    if (options.from_snapshot) {
+        if (!snapshot_load(&context, argv[argc - 1])) {
+            return 1;
+        }
+    } else {
+        source = map_source(argv[argc - 1], &file_size, &mapped);
+        if (source == nullptr) {
+            return 1;
+        }
+        if (!load_script(&context, argv[argc - 1], source, file_size, use_cache && mapped)) {
+            ctx_destroy(&context);
+            unmap_source(source, file_size, mapped);
+            return 1;
+        }
+    }
+    VM *vm = ctx_get_active_vm(&context);
+    if (!vm) {
+        ctx_destroy(&context);
+        unmap_source(source, file_size, mapped);
+        return 1;
+    }
+    if (use_jit && !(vm->jit = create_jit())) {
+        fprintf(stderr, "Warning: the JIT is not supported on this platform, interpreting.\n");
+    }
+    int status = 1;
+    if (vm_swap_code_buffer(vm, context.code)) {
+        status = serve(&context, &options);
+    }
+    ctx_destroy(&context);
+    unmap_source(source, file_size, mapped);
+    return status;
+}
 
 int main(int argc, char *argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <source_file>\n", argv[0]);
+    // --profile-ops <file>: count executed opcode pairs/triples and merge them into <file>
+    // --jit: compile hot functions to machine code
+    // --emit-c <file>: translate the script to C instead of running it (see aot.h)
+    // --aot <module>: run the script with the module generated from it
+    // --budget <n>: suspend and resume the VM every n safepoints (see vm_set_budget)
+    // --isolates <n>: run n instances of the script on the scheduler (see scheduler.h), each on its fiber,
+    //     in time slices of --budget safepoints
+    // --workers <n>: worker threads for --isolates, one per core by default
+    // --stats: print per worker scheduler statistics after --isolates
+    // --fiber: run the script on a fiber (see vm_run_fiber)
+    // --snapshot <image>: run the top level code, then write the state to an image (see snapshot.h)
+    // --entry <name>: with an image instead of a source file, the function to call
+    // --no-cache: always compile, neither read nor write the code cache of the script (see snapshot.h)
+    // serve ...: run the script as an HTTP server (see serve_main)
+    const char *profile_path = nullptr;
+    const char *emit_c_path = nullptr;
+    const char *aot_path = nullptr;
+    const char *snapshot_path = nullptr;
+    const char *entry = nullptr;
+    bool use_jit = false;
+    int64_t budget = 0;
+    long isolates = 0;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    bool stats = false;
+    bool on_fiber = false;
+    bool use_cache = true;
+    if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+        return serve_main(argc, argv);
+    }
+    int arg = 1;
+    for (; arg < argc - 1; arg++) {
+        if (strcmp(argv[arg], "--profile-ops") == 0 && arg + 2 < argc) {
+            profile_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--jit") == 0) {
+            use_jit = true;
+        } else if (strcmp(argv[arg], "--emit-c") == 0 && arg + 2 < argc) {
+            emit_c_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--aot") == 0 && arg + 2 < argc) {
+            aot_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--snapshot") == 0 && arg + 2 < argc) {
+            snapshot_path = argv[++arg];
+        } else if (strcmp(argv[arg], "--entry") == 0 && arg + 2 < argc) {
+            entry = argv[++arg];
+        } else if (strcmp(argv[arg], "--budget") == 0 && arg + 2 < argc) {
+            char *end;
+            budget = strtoll(argv[++arg], &end, 10);
+            if (*end != '\0' || budget <= 0) {
+                fprintf(stderr, "Error: --budget expects a positive number of safepoints.\n");
+                return 1;
+            }
+        } else if ((strcmp(argv[arg], "--isolates") == 0 || strcmp(argv[arg], "--workers") == 0) && arg + 2 < argc) {
+            long *count = argv[arg][2] == 'i' ? &isolates : &workers;
+            char *end;
+            *count = strtol(argv[++arg], &end, 10);
+            if (*end != '\0' || *count <= 0 || *count > INT_MAX) {
+                fprintf(stderr, "Error: %s expects a positive number.\n", argv[arg - 1]);
+                return 1;
+            }
+        } else if (strcmp(argv[arg], "--stats") == 0) {
+            stats = true;
+        } else if (strcmp(argv[arg], "--fiber") == 0) {
+            on_fiber = true;
+        } else if (strcmp(argv[arg], "--no-cache") == 0) {
+            use_cache = false;
+        } else {
+            break;
+        }
+    }
+    if (arg != argc - 1) {
+        fprintf(stderr, "Usage: %s [--profile-ops <profile_file>] [--jit] [--emit-c <c_file>] [--aot <module>] [--budget <n>] [--isolates <n>] [--workers <n>] [--stats] [--fiber] [--snapshot <image>] [--entry <name>] [--no-cache] <source_file|image>\n", argv[0]);
+        return 1;
+    }
+
+    if ((isolates || profile_path || emit_c_path || aot_path) && (snapshot_path || entry)) {
+        fprintf(stderr, "Error: --snapshot and --entry cannot be combined with --isolates, --profile-ops, --emit-c or --aot.\n");
+        return 1;
+    }
+    if (snapshot_is_image(argv[argc - 1])) {
+        if (snapshot_path) {
+            fprintf(stderr, "Error: '%s' is already a snapshot.\n", argv[argc - 1]);
+            return 1;
+        }
+        return run_image(argv[argc - 1], entry, use_jit);
+    }
+    if (entry) {
+        fprintf(stderr, "Error: --entry needs a snapshot to run.\n");
         return 1;
     }
 
-    // Read the source file
+    // Map the source file, a pipe has nowhere to keep a code cache
     size_t file_size;
-    char *source = read_file(argv[1], &file_size);
+    bool mapped;
+    const char *source = map_source(argv[argc - 1], &file_size, &mapped);
     if (source == nullptr) {
         return 1;
     }
+    if (isolates) {
+        if (profile_path || emit_c_path || aot_path) {
+            fprintf(stderr, "Error: --isolates cannot be combined with --profile-ops, --emit-c or --aot.\n");
+            unmap_source(source, file_size, mapped);
+            return 1;
+        }
+        const int status = run_isolates(argv[argc - 1], source, file_size, use_cache && mapped, (int) isolates,
+                                        workers > 0 ? (int) workers : 1, budget ? budget : DEFAULT_SLICE,
+                                        use_jit, stats);
+        unmap_source(source, file_size, mapped);
+        return status;
+    }
 
     Context context;
-    ctx_init(&context, source);
-
+    const bool loaded = load_script(&context, argv[argc - 1], source, file_size, use_cache && mapped);
 
     // configs:
     // ctx_set_strict_mode(&context, false);
@@ -217,16 +719,9 @@ int main(int argc, char *argv[]) {
     // ctx_set_vm_max_memory(&context, 1024);
     // ctx_set_vm_debug(&context, true);
 
-    if (ctx_is_initialized(&context)) {
-        // add the print function
-        auto print_fn = create_function();
-        print_fn->arity = 1;
-        print_fn->name = "print";
-        register_function(&context, "print", print_fn);
-
-        ctx_start_parsing(&context);
-
-        if (ctx_check_errors(&context)) {
+    // a context loaded from the code cache has no source to lex
+    if (loaded || ctx_is_initialized(&context)) {
+        if (!loaded) {
             // TODO: print errors and exit
             ctx_clean_parse_info(&context);
             return -1;
@@ -240,9 +735,58 @@ int main(int argc, char *argv[]) {
         BytecodeBuffer* buffer;
         ctx_get_compiled_code(&context, &buffer);
 
-        if (vm && bc_is_buffer_valid(buffer)) {
-            vm_swap_code_buffer(vm, buffer);
-            auto value = vm_execute(vm);
+        if (vm && profile_path) {
+            vm->profile = create_opcode_profile();
+        }
+
+        if (vm && use_jit && !aot_path && !emit_c_path && !(vm->jit = create_jit())) {
+            fprintf(stderr, "Warning: the JIT is not supported on this platform, interpreting.\n");
+        }
+
+        if (vm && vm_swap_code_buffer(vm, buffer)) {
+            if (emit_c_path) {
+                FILE *out = fopen(emit_c_path, "w");
+                const bool emitted = out && aot_emit_c(vm->code, out);
+                if (out) {
+                    fclose(out);
+                }
+                if (!emitted) {
+                    fprintf(stderr, "Error: could not write '%s'.\n", emit_c_path);
+                    ctx_destroy(&context);
+                    return 1;
+                }
+            } else if (snapshot_path) {
+                vm_execute(vm);
+                if (vm->events && event_loop_pending(vm->events)) {
+                    fprintf(stderr, "Error: timers and sockets cannot be part of a snapshot.\n");
+                    ctx_destroy(&context);
+                    return 1;
+                }
+                if (!snapshot_write(&context, snapshot_path)) {
+                    ctx_destroy(&context);
+                    return 1;
+                }
+            } else if (aot_path) {
+                AotModule *module = aot_load(aot_path, vm->code);
+                if (!module) {
+                    fprintf(stderr, "Warning: interpreting '%s'.\n", argv[argc - 1]);
+                }
+                run_script(vm, module, budget, false);
+                if (module) {
+                    aot_unload(module);
+                }
+            } else {
+                run_script(vm, nullptr, budget, on_fiber);
+            }
+        }
+
+        if (vm && vm->profile) {
+            // profiles accumulate across runs, so a corpus is profiled one script at a time
+            if (profile_load(vm->profile, profile_path)) {
+                profile_save(vm->profile, profile_path);
+            }
+            destroy_opcode_profile(vm->profile);
+            vm->profile = nullptr;
         }
         // printf("\n\n##disassembly##\n\n");
         // disassemble_bytecode(buffer);
@@ -250,5 +794,6 @@ int main(int argc, char *argv[]) {
 
     // Cleanup
     ctx_destroy(&context);
+    unmap_source(source, file_size, mapped);
     return 0;
 }
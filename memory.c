@@ -4,7 +4,7 @@
 
 #include "context.h"
 #include "memory.h"
-#include "vm.h"         // To access the global VM
+#include "vm.h"         // VM heaps
 #include "value.h"      // Assuming Value is defined here
 #include <stdio.h>
 #include <stdlib.h>
@@ -114,13 +114,7 @@ void destroy_heap(Heap *heap) {
 }
 
 // Allocate a block of memory on the heap (allocates an Object)
-uint8_t *heap_alloc(size_t size) {
-    if (!get_vm()) {
-        fprintf(stderr, "VM not initialized. Cannot allocate memory.\n");
-        exit(EXIT_FAILURE);
-    }
-
-    Heap *heap = get_vm()->heap;
+uint8_t *heap_alloc(Heap *heap, size_t size) {
     HeapBlock *block = malloc(sizeof(HeapBlock));
     if (!block) {
         fprintf(stderr, "Failed to allocate memory for heap block.\n");
@@ -141,13 +135,7 @@ uint8_t *heap_alloc(size_t size) {
 }
 
 // Free a block of memory on the heap (frees an Object)
-bool heap_free(uint8_t *ptr) {
-    if (!get_vm()) {
-        fprintf(stderr, "VM not initialized. Cannot free memory.\n");
-        return false;
-    }
-
-    Heap *heap = get_vm()->heap;
+bool heap_free(Heap *heap, uint8_t *ptr) {
     HeapBlock **current = &heap->blocks;
     while (*current) {
         if ((*current)->object == ptr) {
@@ -164,19 +152,95 @@ bool heap_free(uint8_t *ptr) {
     return false;
 }
 
+// ------------------------
+// String Arenas
+// ------------------------
+
+#define STRING_CHUNK_SIZE 4096
+
+struct StringChunk {
+    StringChunk *next;
+    size_t used;
+    size_t capacity;
+    char data[];
+};
+
+void string_arena_init(StringArena *arena) {
+    arena->chunks = nullptr;
+}
+
+void string_arena_destroy(StringArena *arena) {
+    while (arena->chunks) {
+        StringChunk *next = arena->chunks->next;
+        free(arena->chunks);
+        arena->chunks = next;
+    }
+}
+
+char *string_arena_copy(StringArena *arena, const char *chars, size_t length) {
+    StringChunk *chunk = arena->chunks;
+    if (!chunk || chunk->capacity - chunk->used < length + 1) {
+        const bool large = length + 1 > STRING_CHUNK_SIZE / 2;
+        const size_t capacity = large ? length + 1 : STRING_CHUNK_SIZE;
+        chunk = malloc(sizeof(StringChunk) + capacity);
+        if (!chunk) {
+            return nullptr;
+        }
+        chunk->used = 0;
+        chunk->capacity = capacity;
+        // a large string gets a chunk of its own, behind the one small strings fill
+        if (large && arena->chunks) {
+            chunk->next = arena->chunks->next;
+            arena->chunks->next = chunk;
+        } else {
+            chunk->next = arena->chunks;
+            arena->chunks = chunk;
+        }
+    }
+    char *copy = chunk->data + chunk->used;
+    memcpy(copy, chars, length);
+    copy[length] = '\0';
+    chunk->used += length + 1;
+    return copy;
+}
+
+void string_arena_reset(StringArena *arena) {
+    // one regular chunk stays, so a steady load does not allocate
+    StringChunk *kept = nullptr;
+    for (StringChunk *chunk = arena->chunks, *next; chunk; chunk = next) {
+        next = chunk->next;
+        if (!kept && chunk->capacity == STRING_CHUNK_SIZE) {
+            kept = chunk;
+            kept->used = 0;
+            kept->next = nullptr;
+        } else {
+            free(chunk);
+        }
+    }
+    arena->chunks = kept;
+}
+
 // ------------------------
 // Memory Management Functions
 // ------------------------
 
 // Allocate memory using the heap (wrapper for heap_alloc)
-void *vm_malloc(size_t size) {
-    return (void *)heap_alloc(size);
+void *vm_malloc(VM *vm, size_t size) {
+    if (!vm) {
+        fprintf(stderr, "VM not initialized. Cannot allocate memory.\n");
+        exit(EXIT_FAILURE);
+    }
+    return (void *)heap_alloc(vm->heap, size);
 }
 
 // Free memory using the heap (wrapper for heap_free)
-void vm_free(void *ptr) {
+void vm_free(VM *vm, void *ptr) {
     if (ptr == NULL) return; // Nothing to free
-    if (!heap_free((uint8_t *)ptr)) {
+    if (!vm) {
+        fprintf(stderr, "VM not initialized. Cannot free memory.\n");
+        return;
+    }
+    if (!heap_free(vm->heap, (uint8_t *)ptr)) {
         fprintf(stderr, "vm_free failed to deallocate memory at %p.\n", ptr);
         // TODO: error handling
     }
@@ -187,13 +251,13 @@ void vm_free(void *ptr) {
 // ------------------------
 
 // Print memory statistics for debugging
-void print_memory_stats(void) {
-    if (!get_vm()) {
+void print_memory_stats(VM *vm) {
+    if (!vm) {
         fprintf(stderr, "VM not initialized. Cannot print memory stats.\n");
         return;
     }
 
-    Heap *heap = get_vm()->heap;
+    Heap *heap = vm->heap;
     printf("Heap Memory Stats:\n");
     printf("Total Allocated: %zu bytes\n", heap->total_allocated);
     printf("Total Freed: %zu bytes\n", heap->total_freed);
@@ -9,6 +9,7 @@
 #include <memory.h>
 
 typedef struct Context Context;
+typedef struct VM VM;
 
 typedef struct Heap Heap;
 typedef struct HeapBlock HeapBlock;
@@ -43,12 +44,29 @@ bool peek_stack(Stack *stack, Value *value);
 // heap functions
 Heap *create_heap();
 void destroy_heap(Heap *heap);
-uint8_t *heap_alloc(size_t size);
-bool heap_free(uint8_t *ptr);
+uint8_t *heap_alloc(Heap *heap, size_t size);
+bool heap_free(Heap *heap, uint8_t *ptr);
 
-// ..
-void *vm_malloc(size_t size);
-void vm_free(void *ptr);
+// Strings that are released all at once, like the ones made while `tige serve` answers
+// a request (see vm_make_string). Copies are bumped into chunks, a reset keeps one.
+typedef struct StringChunk StringChunk;
+
+typedef struct {
+    StringChunk *chunks;        // newest first, small strings go into the first
+} StringArena;
+
+void string_arena_init(StringArena *arena);
+void string_arena_destroy(StringArena *arena);
+
+// a NUL terminated copy of length bytes of chars, nullptr when out of memory
+char *string_arena_copy(StringArena *arena, const char *chars, size_t length);
+
+// release every string of the arena
+void string_arena_reset(StringArena *arena);
+
+// allocations on the heap of a VM
+void *vm_malloc(VM *vm, size_t size);
+void vm_free(VM *vm, void *ptr);
 
 void* tige_alloc(Context* ctx, size_t size);
 void tige_free(Context* ctx, void* ptr);
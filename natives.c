@@ -0,0 +1,130 @@
+//
+// Created by fathi on 11/18/2024.
+//
+
+#include "natives.h"
+#include "context.h"
+#include "event_loop.h"
+#include <stdio.h>
+#include <string.h>
+
+int64_t register_native(Context *context, const char *name, NativeFn fn, uint8_t arity, uint8_t flags) {
+    if (!context || !name || !fn) {
+        fprintf(stderr, "Invalid arguments to register_native.\n");
+        return -1;
+    }
+    if (context->natives.count > UINT16_MAX) {
+        fprintf(stderr, "Error: too many native functions.\n");
+        return -1;
+    }
+
+    // natives are called like any other function, so they share its namespace
+    if (add_function_symbol(context->symbols, name, arity) < 0) {
+        return -1;
+    }
+
+    NativeTable *table = &context->natives;
+    if (table->count >= table->capacity) {
+        table->capacity = table->capacity == 0 ? 32 : table->capacity * 2;
+        table->entries = realloc(table->entries, sizeof(NativeFunction) * table->capacity);
+        if (!table->entries) {
+            fprintf(stderr, "Failed to allocate memory for the native table.\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    const size_t index = table->count++;
+    table->entries[index] = (NativeFunction) {
+            .name = strdup(name),
+            .fn = fn,
+            .arity = arity,
+            .flags = flags,
+    };
+
+    Symbol *symbol = lookup_symbol(context->symbols, name);
+    symbol->data.function.native = (int32_t) index;
+    return (int64_t) index;
+}
+
+const NativeFunction *get_native(Context *context, size_t index) {
+    if (!context || index >= context->natives.count) {
+        return nullptr;
+    }
+    return &context->natives.entries[index];
+}
+
+void destroy_native_table(NativeTable *table) {
+    for (size_t i = 0; i < table->count; i++) {
+        free(table->entries[i].name);
+    }
+    free(table->entries);
+    table->entries = nullptr;
+    table->count = table->capacity = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Builtins
+////////////////////////////////////////////////////////////////////////////////
+
+static bool native_print([[maybe_unused]] VM *vm, const Value *args, [[maybe_unused]] size_t argc,
+                         Value *result) {
+    if (VALUE_TYPE(args[0]) != VAL_STRING) {
+        // TODO: proper error reporting
+        fprintf(stderr, "First argument of print is the format string.\n");
+        return false;
+    }
+
+    printf("%s\n", AS_STRING(args[0]));
+
+    // every function should return a value
+    *result = make_null();
+    return true;
+}
+
+static bool native_abs([[maybe_unused]] VM *vm, const Value *args, [[maybe_unused]] size_t argc,
+                       Value *result) {
+    switch (VALUE_TYPE(args[0])) {
+        case VAL_INT:
+            *result = make_int(AS_INT(args[0]) < 0 ? -AS_INT(args[0]) : AS_INT(args[0]));
+            return true;
+        case VAL_FLOAT:
+            *result = make_float(AS_FLOAT(args[0]) < 0 ? -AS_FLOAT(args[0]) : AS_FLOAT(args[0]));
+            return true;
+        default:
+            fprintf(stderr, "abs expects a number.\n");
+            return false;
+    }
+}
+
+// min/max of two numbers of the same type
+static bool numeric_pick(const Value *args, bool pick_smaller, Value *result) {
+    const Value a = args[0], b = args[1];
+    if (IS_INT(a) && IS_INT(b)) {
+        *result = (AS_INT(a) < AS_INT(b)) == pick_smaller ? a : b;
+        return true;
+    }
+    if (IS_FLOAT(a) && IS_FLOAT(b)) {
+        *result = (AS_FLOAT(a) < AS_FLOAT(b)) == pick_smaller ? a : b;
+        return true;
+    }
+    fprintf(stderr, "%s expects two integers or two floats.\n", pick_smaller ? "min" : "max");
+    return false;
+}
+
+static bool native_min([[maybe_unused]] VM *vm, const Value *args, [[maybe_unused]] size_t argc,
+                       Value *result) {
+    return numeric_pick(args, true, result);
+}
+
+static bool native_max([[maybe_unused]] VM *vm, const Value *args, [[maybe_unused]] size_t argc,
+                       Value *result) {
+    return numeric_pick(args, false, result);
+}
+
+void register_builtin_natives(Context *context) {
+    register_native(context, "print", native_print, 1, NATIVE_NO_GC);
+    register_native(context, "abs", native_abs, 1, NATIVE_PURE | NATIVE_NO_GC);
+    register_native(context, "min", native_min, 2, NATIVE_PURE | NATIVE_NO_GC);
+    register_native(context, "max", native_max, 2, NATIVE_PURE | NATIVE_NO_GC);
+    register_event_natives(context);
+}
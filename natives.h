@@ -0,0 +1,53 @@
+//
+// Created by fathi on 11/18/2024.
+//
+
+#ifndef TIGE_NATIVES_H
+#define TIGE_NATIVES_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "value.h"
+
+typedef struct VM VM;
+typedef struct Context Context;
+
+// A builtin implemented in C.
+// args points at the argc arguments on the operand stack (first argument first),
+// they are popped by the VM once the native returns. Returning false reports an
+// error and stops execution, unless the native is flagged NATIVE_NO_THROW.
+typedef bool (*NativeFn)(VM *vm, const Value *args, size_t argc, Value *result);
+
+typedef enum {
+    NATIVE_PURE = 1 << 0,       // result depends only on the arguments, calls with constant arguments are folded
+    NATIVE_NO_GC = 1 << 1,      // never allocates nor parks, the interpreter calls it without syncing its state
+    NATIVE_NO_THROW = 1 << 2,   // never fails, the return value is not checked
+} NativeFlags;
+
+typedef struct NativeFunction {
+    char *name;
+    NativeFn fn;
+    uint8_t arity;
+    uint8_t flags;
+} NativeFunction;
+
+// Natives are called by index (OP_CALL_NATIVE), so entries never move once
+// compiled code refers to them
+typedef struct NativeTable {
+    NativeFunction *entries;
+    size_t count;
+    size_t capacity;
+} NativeTable;
+
+// Register a builtin, it can then be called from scripts like any function.
+// Must happen before the code calling it is compiled. Returns its index, -1 on error.
+int64_t register_native(Context *context, const char *name, NativeFn fn, uint8_t arity, uint8_t flags);
+
+const NativeFunction *get_native(Context *context, size_t index);
+
+// print, abs, min, max, and the timers and sockets of event_loop.h
+void register_builtin_natives(Context *context);
+
+void destroy_native_table(NativeTable *table);
+
+#endif //TIGE_NATIVES_H
@@ -14,9 +14,9 @@ void object_free(const TObject *ptr) {
     free(ptr->props);
 }
 
-void object_init(TObject* ptr)
+void object_init(VM* vm, TObject* ptr)
 {
-    ptr->metadata = (TObjectMetadata *)vm_malloc(sizeof(TObjectMetadata));
+    ptr->metadata = (TObjectMetadata *)vm_malloc(vm, sizeof(TObjectMetadata));
     // TODO: initialize object metadata
 
     printf("Is marked %s ", ptr->metadata->gc_marked ? "true" : "false");
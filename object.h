@@ -42,7 +42,7 @@ struct TObject {
 
 TObject* object_new();
 void object_free(const TObject* ptr);
-void object_init(TObject* ptr);
+void object_init(VM* vm, TObject* ptr);
 
 // functions are just object without any property or access to this
 TObject* make_function();
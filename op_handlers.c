@@ -3,33 +3,25 @@
 #include "vm.h"
 #include "value.h"
 #include "context.h"
+#include "decoder.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
 
-// TODO: we need a better way to read from memory structured values (eg, uint64_t, double, strings)
+// operands are decoded (and bounds checked) once by the decoder, see decoder.c
 
 // Handler for OP_LOAD_CONST
-inline bool handle_load_const_int(void) {
-    auto vm = get_vm();
-    if (vm->ip + sizeof(int64_t) > vm->chunk->size) {
-        fprintf(stderr, "Unexpected end of chunk during LOAD_CONST.\n");
-        return false;
-    }
-    int64_t value;
-    memcpy(&value, &vm->chunk->bytecode[vm->ip], sizeof(int64_t));
-    vm->ip += sizeof(int64_t);
-    Value val = make_int(value);
+inline bool handle_load_const_int(VM *vm, const Instruction *ins) {
+    Value val = make_int(ins->operand.as_int);
     vm_push(vm, val);
     return true;
 }
 
 // Handler for OP_LOAD_STRING
-inline bool handle_load_string(void) {
-    const auto vm = get_vm();
-    const auto str = vm_read_string(vm);
-    const Value val = make_string(str->chars);
+inline bool handle_load_string(VM *vm, const Instruction *ins) {
+    const auto str = ins->operand.as_string;
+    const Value val = vm_make_string(vm, str->chars, strlen(str->chars));
     vm_push(vm, val);
 
     // TODO: GC String
@@ -38,602 +30,546 @@ inline bool handle_load_string(void) {
 }
 
 // Handler for OP_LOAD_BOOL
-inline bool handle_load_bool(void) {
-    auto vm = get_vm();
-    if (vm->ip + sizeof(uint8_t) > vm->chunk->size) {
-        fprintf(stderr, "Unexpected end of bytecode during LOAD_BOOL.\n");
-        return false;
-    }
-    uint8_t val = vm->chunk->bytecode[vm->ip++];
-    Value bool_val = make_bool(val != 0);
+inline bool handle_load_bool(VM *vm, const Instruction *ins) {
+    Value bool_val = make_bool(ins->operand.as_bool);
     vm_push(vm, bool_val);
     return true;
 }
 
-// Handler for OP_ADD
-inline bool handle_add(void) {
-    auto vm = get_vm();
-
-    if (SP < 1) {
-        fprintf(stderr, "Not enough values on stack for ADD operation.\n");
-        return false;
-    }
-
-    Value b = vm_pop(vm);
-    Value a = vm_pop(vm);
-
-    Value result;
+// Value level operations, shared by the stack and the register instructions
 
+static bool value_add(Value a, Value b, Value *result) {
     // Integer addition
-    if (a.type == VAL_INT && b.type == VAL_INT) {
-        result = make_int(a.as_integer + b.as_integer);
+    if (IS_INT(a) && IS_INT(b)) {
+        *result = make_int(AS_INT(a) + AS_INT(b));
     }
         // Float addition
-    else if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-        result = make_float(a.as_float + b.as_float);
+    else if (IS_FLOAT(a) && IS_FLOAT(b)) {
+        *result = make_float(AS_FLOAT(a) + AS_FLOAT(b));
     } else {
         fprintf(stderr, "ADD operation requires two integers or two floats.\n");
         return false;
     }
-
-    vm_push(vm, result);
     return true;
 }
 
-// Handler for OP_SUB
-inline bool handle_sub(void) {
-    auto vm = get_vm();
-
-    if (SP < 1) {
-        fprintf(stderr, "Not enough values on stack for SUB operation.\n");
-        return false;
-    }
-
-    Value a, b;
-    b = vm_pop(vm);
-    a = vm_pop(vm);
-
-    Value result;
-
+static bool value_sub(Value a, Value b, Value *result) {
     // if one of them is a float then the result is a float too
-    if (a.type == VAL_FLOAT || b.type == VAL_FLOAT) {
-        result.type = VAL_FLOAT;
-        double operand_a = (a.type == VAL_FLOAT) ? a.as_float : (double) a.as_integer;
-        double operand_b = (b.type == VAL_FLOAT) ? b.as_float : (double) b.as_integer;
-        result.as_float = operand_a - operand_b;
-    } else if (a.type == VAL_INT && b.type == VAL_INT) {
-        result.type = VAL_INT;
-        result.as_integer = a.as_integer - b.as_integer;
+    if (IS_FLOAT(a) || IS_FLOAT(b)) {
+        double operand_a = IS_FLOAT(a) ? AS_FLOAT(a) : (double) AS_INT(a);
+        double operand_b = IS_FLOAT(b) ? AS_FLOAT(b) : (double) AS_INT(b);
+        *result = make_float(operand_a - operand_b);
+    } else if (IS_INT(a) && IS_INT(b)) {
+        *result = make_int(AS_INT(a) - AS_INT(b));
     } else {
         fprintf(stderr, "Error: Unsupported types for SUB operation.\n");
         return false;
     }
-
-    vm_push(vm, result);
     return true;
 }
 
-// Handler for OP_MUL
-inline bool handle_mul(void) {
-    auto vm = get_vm();
-    if (SP < 1) {
-        fprintf(stderr, "Not enough values on stack for SUB operation.\n");
-        return false;
-    }
-
-    Value a, b;
-    b = vm_pop(vm);
-    a = vm_pop(vm);
-
-    Value result;
-
+static bool value_mul(Value a, Value b, Value *result) {
     // if one of them is a float then the result is a float too
-    if (a.type == VAL_FLOAT || b.type == VAL_FLOAT) {
-        result.type = VAL_FLOAT;
-        double operand_a = (a.type == VAL_FLOAT) ? a.as_float : (double) a.as_integer;
-        double operand_b = (b.type == VAL_FLOAT) ? b.as_float : (double) b.as_integer;
-        result.as_float = operand_a * operand_b;
-    } else if (a.type == VAL_INT && b.type == VAL_INT) {
-        result.type = VAL_INT;
-        result.as_integer = a.as_integer * b.as_integer;
+    if (IS_FLOAT(a) || IS_FLOAT(b)) {
+        double operand_a = IS_FLOAT(a) ? AS_FLOAT(a) : (double) AS_INT(a);
+        double operand_b = IS_FLOAT(b) ? AS_FLOAT(b) : (double) AS_INT(b);
+        *result = make_float(operand_a * operand_b);
+    } else if (IS_INT(a) && IS_INT(b)) {
+        *result = make_int(AS_INT(a) * AS_INT(b));
     } else {
         fprintf(stderr, "Error: Unsupported types for MUL operation.\n");
         return false;
     }
-
-    vm_push(vm, result);
     return true;
 }
 
-// Handler for OP_DIV
-inline bool handle_div(void) {
-    auto vm = get_vm();
-    if (SP < 1) {
-        fprintf(stderr, "Not enough values on stack for DIV operugh values on stack for DIV operation.\n");
-        return false;
-    }
-
-    Value b = vm_pop(vm);
-    Value a = vm_pop(vm);
-
-    Value result;
-
+static bool value_div(Value a, Value b, Value *result) {
     // Integer division
-    if (a.type == VAL_INT && b.type == VAL_INT) {
-        if (b.as_integer == 0) {
+    if (IS_INT(a) && IS_INT(b)) {
+        if (AS_INT(b) == 0) {
             fprintf(stderr, "Division by zero!\n");
             return false;
         }
-        result = make_int(a.as_integer / b.as_integer);
+        *result = make_int(AS_INT(a) / AS_INT(b));
     }
         // Float division
-    else if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-        if (b.as_float == 0.0) {
+    else if (IS_FLOAT(a) && IS_FLOAT(b)) {
+        if (AS_FLOAT(b) == 0.0) {
             fprintf(stderr, "Division by zero!\n");
             return false;
         }
-        result = make_float(a.as_float / b.as_float);
+        *result = make_float(AS_FLOAT(a) / AS_FLOAT(b));
     } else {
         fprintf(stderr, "DIV operation requires two integers or two floats.\n");
         return false;
     }
-
-    vm_push(vm, result);
     return true;
 }
 
-// Handler for OP_AND
-inline bool handle_and(void) {
-    auto vm = get_vm();
-    if (SP < 1) {
-        fprintf(stderr, "Not enough values on stack for AND operation.\n");
+static bool value_equals(Value a, Value b) {
+    if (VALUE_TYPE(a) != VALUE_TYPE(b)) {
         return false;
     }
 
-    Value b = vm_pop(vm);
-    Value a = vm_pop(vm);
+    switch (VALUE_TYPE(a)) {
+        case VAL_INT:
+            return AS_INT(a) == AS_INT(b);
+        case VAL_FLOAT:
+            return AS_FLOAT(a) == AS_FLOAT(b);
+        case VAL_BOOL:
+            return AS_BOOL(a) == AS_BOOL(b);
+        case VAL_STRING:
+            return strcmp(AS_STRING(a), AS_STRING(b)) == 0;
+        case VAL_PTR:
+            return AS_PTR(a) == AS_PTR(b);
+        default:
+            return false;
+    }
+}
 
-    if (a.type != VAL_BOOL || b.type != VAL_BOOL) {
-        fprintf(stderr, "AND operation requires two booleans.\n");
+// ordering comparisons, relation is one of OP_LESS_THAN, OP_GREATER_THAN, OP_LESS_EQUAL, OP_GREATER_EQUAL
+static bool value_order(Opcode relation, Value a, Value b, bool *result) {
+    const char *name = relation == OP_LESS_THAN ? "LESS_THAN"
+                     : relation == OP_GREATER_THAN ? "GREATER_THAN"
+                     : relation == OP_LESS_EQUAL ? "LESS_EQUAL" : "GREATER_EQUAL";
+    double x, y;
+
+    // Integer comparison
+    if (IS_INT(a) && IS_INT(b)) {
+        switch (relation) {
+            case OP_LESS_THAN: *result = AS_INT(a) < AS_INT(b); return true;
+            case OP_GREATER_THAN: *result = AS_INT(a) > AS_INT(b); return true;
+            case OP_LESS_EQUAL: *result = AS_INT(a) <= AS_INT(b); return true;
+            default: *result = AS_INT(a) >= AS_INT(b); return true;
+        }
+    }
+        // Float comparison
+    else if (IS_FLOAT(a) && IS_FLOAT(b)) {
+        x = AS_FLOAT(a);
+        y = AS_FLOAT(b);
+    } else {
+        fprintf(stderr, "%s operation requires two integers or two floats.\n", name);
         return false;
     }
 
-    Value result = make_bool(a.as_boolean && b.as_boolean);
-    vm_push(vm, result);
+    switch (relation) {
+        case OP_LESS_THAN: *result = x < y; break;
+        case OP_GREATER_THAN: *result = x > y; break;
+        case OP_LESS_EQUAL: *result = x <= y; break;
+        default: *result = x >= y; break;
+    }
     return true;
 }
 
-// Handler for OP_OR
-inline bool handle_or(void) {
-    auto vm = get_vm();
-    if (SP < 1) {
-        fprintf(stderr, "Not enough values on stack for OR operation.\n");
-        return false;
-    }
+////////////////////////////////////////////////////////////////////////////////
+// Quickening
+////////////////////////////////////////////////////////////////////////////////
 
-    Value b = vm_pop(vm);
-    Value a = vm_pop(vm);
+// A generic arithmetic or comparison instruction records the operand types it
+// sees: b holds the kind seen last and c how many times in a row. Once the streak
+// reaches the warmup, the instruction rewrites itself into the form specialized for
+// that kind, which only guards the types. When the guard fails it goes back to the
+// generic form, and a counts how often that happened to back off the next warmup.
+#define QUICKEN_WARMUP 8
+#define QUICKEN_MAX_BACKOFF 6
 
-    if (a.type != VAL_BOOL || b.type != VAL_BOOL) {
-        fprintf(stderr, "OR operation requires two booleans.\n");
-        return false;
-    }
+enum { KIND_OTHER, KIND_INT, KIND_FLOAT };
 
-    Value result = make_bool(a.as_boolean || b.as_boolean);
-    vm_push(vm, result);
-    return true;
+// int form of the generic opcodes that can be quickened, the float form follows it
+static const Opcode quickened_forms[256] = {
+        [OP_ADD] = OP_ADD_INT_INT,
+        [OP_SUB] = OP_SUB_INT_INT,
+        [OP_MUL] = OP_MUL_INT_INT,
+        [OP_DIV] = OP_DIV_INT_INT,
+        [OP_EQUAL] = OP_EQ_INT_INT,
+        [OP_NOT_EQUAL] = OP_NE_INT_INT,
+        [OP_LESS_THAN] = OP_LT_INT_INT,
+        [OP_GREATER_THAN] = OP_GT_INT_INT,
+        [OP_LESS_EQUAL] = OP_LE_INT_INT,
+        [OP_GREATER_EQUAL] = OP_GE_INT_INT,
+};
+
+static Opcode generic_form(Opcode quickened) {
+    for (int op = 0; op < 256; op++) {
+        if (quickened_forms[op] && (quickened & ~1) == quickened_forms[op]) {
+            return (Opcode) op;
+        }
+    }
+    return quickened;
 }
 
-// Handler for OP_NOT
-bool handle_not(void) {
-    auto vm = get_vm();
-    if (SP < 0) {
-        fprintf(stderr, "Not enough values on stack for NOT operation.\n");
-        return false;
+static void observe_operands(VM *vm, const Instruction *ins, Value a, Value b) {
+    const Opcode int_form = quickened_forms[ins->opcode];
+    if (!int_form) {
+        return;
     }
 
-    Value a = vm_pop(vm);
+    Instruction *site = (Instruction *) ins;
+    const uint16_t kind = VALUE_TYPE(a) != VALUE_TYPE(b) ? KIND_OTHER
+                        : IS_INT(a) ? KIND_INT
+                        : IS_FLOAT(a) ? KIND_FLOAT : KIND_OTHER;
+    if (kind == KIND_OTHER || kind != site->b) {
+        site->b = kind;
+        site->c = kind != KIND_OTHER;
+        return;
+    }
 
-    if (a.type != VAL_BOOL) {
-        fprintf(stderr, "NOT operation requires a boolean.\n");
-        return false;
+    const uint16_t warmup = QUICKEN_WARMUP << (site->a < QUICKEN_MAX_BACKOFF ? site->a : QUICKEN_MAX_BACKOFF);
+    if (++site->c >= warmup) {
+        site->c = 0;
+        vm_rewrite_instruction(vm, site, int_form + (kind == KIND_FLOAT));
     }
+}
 
-    Value result = make_bool(!a.as_boolean);
-    vm_push(vm, result);
-    return true;
+static void dequicken(VM *vm, const Instruction *ins) {
+    Instruction *site = (Instruction *) ins;
+    if (vm_rewrite_instruction(vm, site, generic_form(site->opcode))) {
+        if (site->a < QUICKEN_MAX_BACKOFF) {
+            site->a++;
+        }
+        site->b = KIND_OTHER;
+        site->c = 0;
+    }
 }
 
-// Handler for OP_EQUAL
-inline bool handle_equal(void) {
-    auto vm = get_vm();
+// Pop two operands, apply a binary value operation and push its result
+static bool binary_stack_op(VM *vm, const Instruction *ins, const char *name, bool (*op)(Value, Value, Value *)) {
 
-    if (SP < 1) {
-        fprintf(stderr, "Not enough values on stack for EQUAL operation.\n");
+    if (vm->stack->sp < 1) {
+        fprintf(stderr, "Not enough values on stack for %s operation.\n", name);
         return false;
     }
 
     Value b = vm_pop(vm);
     Value a = vm_pop(vm);
+    observe_operands(vm, ins, a, b);
 
-    bool is_equal = false;
-
-    if (a.type != b.type) {
-        is_equal = false;
-    } else {
-        switch (a.type) {
-            case VAL_INT:
-                is_equal = (a.as_integer == b.as_integer);
-                break;
-            case VAL_FLOAT:
-                is_equal = (a.as_float == b.as_float);
-                break;
-            case VAL_BOOL:
-                is_equal = (a.as_boolean == b.as_boolean);
-                break;
-            case VAL_STRING:
-                is_equal = (strcmp(a.as_string, b.as_string) == 0);
-                break;
-            case VAL_PTR:
-                is_equal = (a.as_ptr == b.as_ptr);
-                break;
-            default:
-                is_equal = false;
-        }
+    Value result;
+    if (!op(a, b, &result)) {
+        return false;
     }
 
-    Value result = make_bool(is_equal);
     vm_push(vm, result);
     return true;
 }
 
-// Handler for OP_NOT_EQUAL
-bool handle_not_equal(void) {
-    auto vm = get_vm();
-    if (SP < 1) {
-        fprintf(stderr, "Not enough values on stack for NOT_EQUAL operation.\n");
+// Pop two operands, compare them and push the boolean result
+static bool compare_stack_op(VM *vm, const Instruction *ins, const char *name, Opcode relation) {
+
+    if (vm->stack->sp < 1) {
+        fprintf(stderr, "Not enough values on stack for %s operation.\n", name);
         return false;
     }
 
     Value b = vm_pop(vm);
     Value a = vm_pop(vm);
+    observe_operands(vm, ins, a, b);
 
-    bool is_not_equal = false;
-
-    if (a.type != b.type) {
-        is_not_equal = true;
-    } else {
-        switch (a.type) {
-            case VAL_INT:
-                is_not_equal = (a.as_integer != b.as_integer);
-                break;
-            case VAL_FLOAT:
-                is_not_equal = (a.as_float != b.as_float);
-                break;
-            case VAL_BOOL:
-                is_not_equal = (a.as_boolean != b.as_boolean);
-                break;
-            case VAL_STRING:
-                is_not_equal = (strcmp(a.as_string, b.as_string) != 0);
-                break;
-            case VAL_PTR:
-                is_not_equal = (a.as_ptr != b.as_ptr);
-                break;
-            default:
-                is_not_equal = true;
-        }
+    bool result_bool = false;
+    switch (relation) {
+        case OP_EQUAL:
+            result_bool = value_equals(a, b);
+            break;
+        case OP_NOT_EQUAL:
+            result_bool = !value_equals(a, b);
+            break;
+        default:
+            if (!value_order(relation, a, b, &result_bool)) {
+                return false;
+            }
     }
 
-    Value result = make_bool(is_not_equal);
-    vm_push(vm, result);
+    vm_push(vm, make_bool(result_bool));
     return true;
 }
 
-// Handler for OP_LESS_THAN
-bool handle_less_than(void) {
-    auto vm = get_vm();
-    if (SP < 1) {
-        fprintf(stderr, "Not enough values on stack for LESS_THAN operation.\n");
-        return false;
-    }
-
-    Value b = vm_pop(vm);
-    Value a = vm_pop(vm);
+// Handler for OP_ADD
+inline bool handle_add(VM *vm, const Instruction *ins) {
+    return binary_stack_op(vm, ins, "ADD", value_add);
+}
 
-    bool result_bool = false;
+// Handler for OP_SUB
+inline bool handle_sub(VM *vm, const Instruction *ins) {
+    return binary_stack_op(vm, ins, "SUB", value_sub);
+}
 
-    // Integer comparison
-    if (a.type == VAL_INT && b.type == VAL_INT) {
-        result_bool = (a.as_integer < b.as_integer);
-    }
-        // Float comparison
-    else if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-        result_bool = (a.as_float < b.as_float);
-    } else {
-        fprintf(stderr, "LESS_THAN operation requires two integers or two floats.\n");
-        return false;
-    }
+// Handler for OP_MUL
+inline bool handle_mul(VM *vm, const Instruction *ins) {
+    return binary_stack_op(vm, ins, "MUL", value_mul);
+}
 
-    Value result = make_bool(result_bool);
-    vm_push(vm, result);
-    return true;
+// Handler for OP_DIV
+inline bool handle_div(VM *vm, const Instruction *ins) {
+    return binary_stack_op(vm, ins, "DIV", value_div);
 }
 
-// Handler for OP_GREATER_THAN
-bool handle_greater_than(void) {
-    auto vm = get_vm();
-    if (SP < 1) {
-        fprintf(stderr, "Not enough values on stack for GREATER_THAN operation.\n");
+// Handler for OP_AND
+inline bool handle_and(VM *vm, [[maybe_unused]] const Instruction *ins) {
+    if (vm->stack->sp < 1) {
+        fprintf(stderr, "Not enough values on stack for AND operation.\n");
         return false;
     }
 
     Value b = vm_pop(vm);
     Value a = vm_pop(vm);
 
-    bool result_bool = false;
-
-    // Integer comparison
-    if (a.type == VAL_INT && b.type == VAL_INT) {
-        result_bool = (a.as_integer > b.as_integer);
-    }
-        // Float comparison
-    else if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-        result_bool = (a.as_float > b.as_float);
-    } else {
-        fprintf(stderr, "GREATER_THAN operation requires two integers or two floats.\n");
+    if (!IS_BOOL(a) || !IS_BOOL(b)) {
+        fprintf(stderr, "AND operation requires two booleans.\n");
         return false;
     }
 
-    Value result = make_bool(result_bool);
+    Value result = make_bool(AS_BOOL(a) && AS_BOOL(b));
     vm_push(vm, result);
     return true;
 }
 
-// Handler for OP_LESS_EQUAL
-bool handle_less_equal(void) {
-    auto vm = get_vm();
-    if (SP < 1) {
-        fprintf(stderr, "Not enough values on stack for LESS_EQUAL operation.\n");
+// Handler for OP_OR
+inline bool handle_or(VM *vm, [[maybe_unused]] const Instruction *ins) {
+    if (vm->stack->sp < 1) {
+        fprintf(stderr, "Not enough values on stack for OR operation.\n");
         return false;
     }
 
     Value b = vm_pop(vm);
     Value a = vm_pop(vm);
 
-    bool result_bool = false;
-
-    // Integer comparison
-    if (a.type == VAL_INT && b.type == VAL_INT) {
-        result_bool = (a.as_integer <= b.as_integer);
-    }
-        // Float comparison
-    else if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-        result_bool = (a.as_float <= b.as_float);
-    } else {
-        fprintf(stderr, "LESS_EQUAL operation requires two integers or two floats.\n");
+    if (!IS_BOOL(a) || !IS_BOOL(b)) {
+        fprintf(stderr, "OR operation requires two booleans.\n");
         return false;
     }
 
-    Value result = make_bool(result_bool);
+    Value result = make_bool(AS_BOOL(a) || AS_BOOL(b));
     vm_push(vm, result);
     return true;
 }
 
-// Handler for OP_GREATER_EQUAL
-bool handle_greater_equal(void) {
-    auto vm = get_vm();
-    if (SP < 1) {
-        fprintf(stderr, "Not enough values on stack for GREATER_EQUAL operation.\n");
+// Handler for OP_NOT
+bool handle_not(VM *vm, [[maybe_unused]] const Instruction *ins) {
+    if (vm->stack->sp < 0) {
+        fprintf(stderr, "Not enough values on stack for NOT operation.\n");
         return false;
     }
 
-    Value b = vm_pop(vm);
     Value a = vm_pop(vm);
 
-    bool result_bool = false;
-
-    // Integer comparison
-    if (a.type == VAL_INT && b.type == VAL_INT) {
-        result_bool = (a.as_integer >= b.as_integer);
-    }
-        // Float comparison
-    else if (a.type == VAL_FLOAT && b.type == VAL_FLOAT) {
-        result_bool = (a.as_float >= b.as_float);
-    } else {
-        fprintf(stderr, "GREATER_EQUAL operation requires two integers or two floats.\n");
+    if (!IS_BOOL(a)) {
+        fprintf(stderr, "NOT operation requires a boolean.\n");
         return false;
     }
 
-    Value result = make_bool(result_bool);
+    Value result = make_bool(!AS_BOOL(a));
     vm_push(vm, result);
     return true;
 }
 
-// Handler for OP_JMP
-inline bool handle_jmp(void) {
-    auto vm = get_vm();
-    if (vm->ip + sizeof(size_t) * 2 > vm->chunk->size) {
-        fprintf(stderr, "Unexpected end of chunk during JMP.\n");
-        return false;
-    }
-
-    size_t chunk_id = vm_read_offset(vm);
-    size_t jmp_offset = vm_read_offset(vm);
+// Handler for OP_EQUAL
+inline bool handle_equal(VM *vm, const Instruction *ins) {
+    return compare_stack_op(vm, ins, "EQUAL", OP_EQUAL);
+}
 
+// Handler for OP_NOT_EQUAL
+bool handle_not_equal(VM *vm, const Instruction *ins) {
+    return compare_stack_op(vm, ins, "NOT_EQUAL", OP_NOT_EQUAL);
+}
 
-    if (vm_jump_to_chunk(vm, chunk_id)) {
-        vm->ip = jmp_offset;
-    } else {
-        return false;
-    }
-    return true;
+// Handler for OP_LESS_THAN
+bool handle_less_than(VM *vm, const Instruction *ins) {
+    return compare_stack_op(vm, ins, "LESS_THAN", OP_LESS_THAN);
 }
 
-// jump to a region in memory that contains a valid BytecodeChunk
-inline bool handle_jmp_adr(void) {
-    auto vm = get_vm();
-    uintptr_t jmp_to = vm_read_ptr(vm);
-    // get the chunk addr
-    BytecodeChunk *chunk = (BytecodeChunk *) (jmp_to);
-    vm->chunk = chunk;
-    vm->ip = 0;
+// Handler for OP_GREATER_THAN
+bool handle_greater_than(VM *vm, const Instruction *ins) {
+    return compare_stack_op(vm, ins, "GREATER_THAN", OP_GREATER_THAN);
+}
 
-    return true;
+// Handler for OP_LESS_EQUAL
+bool handle_less_equal(VM *vm, const Instruction *ins) {
+    return compare_stack_op(vm, ins, "LESS_EQUAL", OP_LESS_EQUAL);
 }
 
-// Handler for OP_JMP_IF_TRUE
-inline bool handle_jmp_if_true(void) {
-    auto vm = get_vm();
-    if (vm->ip + sizeof(size_t) * 2 > vm->chunk->size) {
-        fprintf(stderr, "Unexpected end of chunk during JMP_IF_TRUE.\n");
-        return false;
-    }
+// Handler for OP_GREATER_EQUAL
+bool handle_greater_equal(VM *vm, const Instruction *ins) {
+    return compare_stack_op(vm, ins, "GREATER_EQUAL", OP_GREATER_EQUAL);
+}
+
+// Quickened forms, the operands are checked in place and anything unexpected
+// de-quickens the instruction and runs the generic handler
+#define QUICKENED_HANDLER(name, is, as, make, op, guard, generic) \
+    bool handle_##name(VM *vm, const Instruction *ins) { \
+        Value *values = vm->stack->values; \
+        const int sp = vm->stack->sp; \
+        if (sp < 1 || !is(values[sp - 1]) || !is(values[sp]) || !(guard)) { \
+            dequicken(vm, ins); \
+            return generic(vm, ins); \
+        } \
+        values[sp - 1] = make(as(values[sp - 1]) op as(values[sp])); \
+        vm->stack->sp = sp - 1; \
+        return true; \
+    }
+
+QUICKENED_HANDLER(add_int_int, IS_INT, AS_INT, make_int, +, true, handle_add)
+QUICKENED_HANDLER(add_float_float, IS_FLOAT, AS_FLOAT, make_float, +, true, handle_add)
+QUICKENED_HANDLER(sub_int_int, IS_INT, AS_INT, make_int, -, true, handle_sub)
+QUICKENED_HANDLER(sub_float_float, IS_FLOAT, AS_FLOAT, make_float, -, true, handle_sub)
+QUICKENED_HANDLER(mul_int_int, IS_INT, AS_INT, make_int, *, true, handle_mul)
+QUICKENED_HANDLER(mul_float_float, IS_FLOAT, AS_FLOAT, make_float, *, true, handle_mul)
+QUICKENED_HANDLER(div_int_int, IS_INT, AS_INT, make_int, /, AS_INT(values[sp]) != 0, handle_div)
+QUICKENED_HANDLER(div_float_float, IS_FLOAT, AS_FLOAT, make_float, /, AS_FLOAT(values[sp]) != 0.0, handle_div)
+QUICKENED_HANDLER(eq_int_int, IS_INT, AS_INT, make_bool, ==, true, handle_equal)
+QUICKENED_HANDLER(eq_float_float, IS_FLOAT, AS_FLOAT, make_bool, ==, true, handle_equal)
+QUICKENED_HANDLER(ne_int_int, IS_INT, AS_INT, make_bool, !=, true, handle_not_equal)
+QUICKENED_HANDLER(ne_float_float, IS_FLOAT, AS_FLOAT, make_bool, !=, true, handle_not_equal)
+QUICKENED_HANDLER(lt_int_int, IS_INT, AS_INT, make_bool, <, true, handle_less_than)
+QUICKENED_HANDLER(lt_float_float, IS_FLOAT, AS_FLOAT, make_bool, <, true, handle_less_than)
+QUICKENED_HANDLER(gt_int_int, IS_INT, AS_INT, make_bool, >, true, handle_greater_than)
+QUICKENED_HANDLER(gt_float_float, IS_FLOAT, AS_FLOAT, make_bool, >, true, handle_greater_than)
+QUICKENED_HANDLER(le_int_int, IS_INT, AS_INT, make_bool, <=, true, handle_less_equal)
+QUICKENED_HANDLER(le_float_float, IS_FLOAT, AS_FLOAT, make_bool, <=, true, handle_less_equal)
+QUICKENED_HANDLER(ge_int_int, IS_INT, AS_INT, make_bool, >=, true, handle_greater_equal)
+QUICKENED_HANDLER(ge_float_float, IS_FLOAT, AS_FLOAT, make_bool, >=, true, handle_greater_equal)
+
+#undef QUICKENED_HANDLER
 
-    size_t chunk_id = vm_read_offset(vm);
-    size_t jmp_offset = vm_read_offset(vm);
+// Handler for OP_JMP
+inline bool handle_jmp(VM *vm, const Instruction *ins) {
+    vm->pc = ins->target;
+    return ins->target > ins || vm_poll(vm);
+}
 
-    if (SP < 0) {
+// Handler for OP_JMP_IF_TRUE
+inline bool handle_jmp_if_true(VM *vm, const Instruction *ins) {
+    if (vm->stack->sp < 0) {
         fprintf(stderr, "Not enough values on stack for JMP_IF_TRUE.\n");
         return false;
     }
     Value condition = vm_pop(vm);
-    if (condition.type != VAL_BOOL) {
+    if (!IS_BOOL(condition)) {
         fprintf(stderr, "JMP_IF_TRUE requires a boolean condition.\n");
         return false;
     }
-    if (condition.as_boolean) {
-        if (vm_jump_to_chunk(vm, chunk_id)) {
-            vm->ip = jmp_offset;
-        } else {
-            return false;
-        }
+    if (AS_BOOL(condition)) {
+        vm->pc = ins->target;
+        return ins->target > ins || vm_poll(vm);
     }
     return true;
 }
 
 // Handler for OP_JMP_IF_FALSE
-inline bool handle_jmp_if_false(void) {
-    auto vm = get_vm();
-    if (vm->ip + sizeof(size_t) * 2 > vm->chunk->size) {
-        fprintf(stderr, "Unexpected end of chunk during JMP_IF_FALSE.\n");
-        return false;
-    }
-
-    size_t chunk_id = vm_read_offset(vm);
-    size_t jmp_offset = vm_read_offset(vm);
-
-    if (SP < 0) {
+inline bool handle_jmp_if_false(VM *vm, const Instruction *ins) {
+    if (vm->stack->sp < 0) {
         fprintf(stderr, "Not enough values on stack for JMP_IF_FALSE.\n");
         return false;
     }
     Value condition = vm_pop(vm);
-    if (condition.type != VAL_BOOL) {
+    if (!IS_BOOL(condition)) {
         fprintf(stderr, "JMP_IF_FALSE requires a boolean condition.\n");
         return false;
     }
-    if (!condition.as_boolean) {
-        if (vm_jump_to_chunk(vm, chunk_id)) {
-            vm->ip = jmp_offset;
-        } else {
-            return false;
-        }
+    if (!AS_BOOL(condition)) {
+        vm->pc = ins->target;
+        return ins->target > ins || vm_poll(vm);
     }
     return true;
 }
 
-void std_out(VM* vm)
-{
-    const auto format = vm_pop(vm);
-
-    if (format.type != VAL_STRING)
-    {
-        // TODO: proper error reporting
-        fprintf(stderr, "First argument of print is the format string.\n");
-        exit(EXIT_FAILURE);
+// the callee was resolved by the decoder, only a redefinition of its name invalidates it
+static Function *resolve_callee(const Instruction *ins) {
+    auto fn = ins->operand.as_function;
+    if (fn->redefined_by) {
+        while (fn->redefined_by) {
+            fn = fn->redefined_by;
+        }
+        ((Instruction *) ins)->operand.as_function = fn;
     }
+    return fn;
+}
 
-    const auto str = format.as_string;
-    printf("%s\n", str);
-
-    // every function should return a value
-    vm_push(vm, make_null());
+// hot functions get compiled on their JIT_HOT_CALLS-th call
+static inline void count_call(VM *vm, Function *fn) {
+    if (vm->jit && ++fn->calls == JIT_HOT_CALLS) {
+        jit_compile_function(vm, fn);
+    }
 }
 
 // Handler for OP_CALL
-bool handle_call(void) {
-    const auto vm = get_vm();
-    // we ensured that the function name will be in the same chunk
-    // so...
-    const char* name = vm_read_fn_name(get_vm());
-    // get the function object
-    const auto fn = get_function(get_vm()->context, name);
-
-    if (strcmp(fn->name, "print") == 0)
-    {
-        std_out(vm);
-        return true;
+bool handle_call(VM *vm, const Instruction *ins) {
+    const auto fn = resolve_callee(ins);
+    // the callee's window starts at its arguments, nothing is copied
+    Value *window = vm->registers + ins->a;
+    if (window + fn->register_count > vm->register_end) {
+        fprintf(stderr, "Error: register file exhausted calling '%s'.\n", fn->name);
+        return false;
     }
-
-    if (fn) {
-        push_call_frame(vm->call_stack, vm->chunk, vm->ip, vm->registers);
-        fn->return_addr.offset = vm->ip;
-        vm->chunk = fn->chunk;
-        vm->ip = 0;
+    if (!push_call_frame(vm->call_stack, vm->pc, vm->registers, vm->sp_reset)) {
+        return false;
     }
-
-    return true;
+    vm->registers = window;
+    count_call(vm, fn);
+    vm->pc = fn->entry;
+    return vm_poll(vm);
 }
 
-// Handler for OP_RETURN
-bool handle_return(void) {
-    auto vm = get_vm();
-    if (SP < 0) {
-        fprintf(stderr, "Nothing on stack to return.\n");
+// Handler for OP_TAIL_CALL
+// The callee takes over the frame and the register window of the running function,
+// so it returns straight to our caller and recursion runs in constant space
+bool handle_tail_call(VM *vm, const Instruction *ins) {
+    const auto fn = resolve_callee(ins);
+
+    if (vm->registers + fn->register_count > vm->register_end) {
+        fprintf(stderr, "Error: register file exhausted calling '%s'.\n", fn->name);
         return false;
     }
+    // the arguments were evaluated above our variables, they become the callee's first registers
+    if (ins->a != 0) {
+        memmove(vm->registers, vm->registers + ins->a, sizeof(Value) * fn->arity);
+    }
+    count_call(vm, fn);
+    vm->pc = fn->entry;
+    return vm_poll(vm);
+}
 
-    BytecodeChunk* previous_chunk = NULL;
-    size_t previous_ip = 0;
-    Value* previous_registers = NULL;
-
-    if (!pop_call_frame(vm->call_stack, &previous_chunk, &previous_ip, &previous_registers)) {
-        fprintf(stderr, "Call stack underflow on OP_RETURN.\n");
+// Handler for OP_CALL_NATIVE, arity in c and flags in b
+bool handle_call_native(VM *vm, const Instruction *ins) {
+    const size_t argc = ins->c;
+    if ((size_t) (vm->stack->sp + 1) < argc) {
+        fprintf(stderr, "Not enough arguments on stack for CALL_NATIVE.\n");
         return false;
     }
 
-    // Restore the previous execution context
-    vm->chunk = previous_chunk;
-    vm->ip = previous_ip;
-    memcpy(vm->registers, previous_registers, MAX_REGISTERS);
-    // vm_jump_to_chunk(vm, 0);
-    // SP = 27;
-    return true;
-    // Pop return address
-    if (SP < 0) {
-        fprintf(stderr, "No return address on stack.\n");
+    Value result = make_null();
+    const bool ok = ins->operand.as_native(vm, &vm->stack->values[vm->stack->sp + 1 - (int) argc], argc, &result);
+    vm->stack->sp -= (int) argc;
+    if (!ok && !(ins->b & NATIVE_NO_THROW)) {
         return false;
     }
-    Value return_address_val = vm_pop(vm);
-    if (return_address_val.type != VAL_INT) {
-        fprintf(stderr, "RETURN expects an integer return address.\n");
+
+    vm_push(vm, result);
+    return true;
+}
+
+// Handler for OP_RETURN
+bool handle_return(VM *vm, [[maybe_unused]] const Instruction *ins) {
+    if (vm->stack->sp < 0) {
+        fprintf(stderr, "Nothing on stack to return.\n");
         return false;
     }
-    int32_t return_address = return_address_val.as_integer;
-    if (return_address < 0 || (size_t) return_address >= vm->size) {
-        fprintf(stderr, "RETURN to invalid address: %d\n", return_address);
+
+    CallFrame frame;
+    if (!pop_call_frame(vm->call_stack, &frame)) {
         return false;
     }
-    vm->ip = return_address;
-    // Optionally, vm_push the return value back onto the stack
-    vm_push(vm, make_null());
+
+    // Restore the previous execution context, the return value stays on the stack
+    vm->pc = frame.return_pc;
+    vm->registers = frame.registers;
+    vm->sp_reset = frame.sp_reset;
     return true;
 }
 
 
 // Handler for OP_TERNARY
-bool handle_ternary(void) {
-    auto vm = get_vm();
-    if (SP < 2) {
+bool handle_ternary(VM *vm, [[maybe_unused]] const Instruction *ins) {
+    if (vm->stack->sp < 2) {
         fprintf(stderr, "Not enough values on stack for TERNARY operation.\n");
         return false;
     }
@@ -642,63 +578,59 @@ bool handle_ternary(void) {
     Value true_val = vm_pop(vm);
     Value condition = vm_pop(vm);
 
-    if (condition.type != VAL_BOOL) {
+    if (!IS_BOOL(condition)) {
         fprintf(stderr, "TERNARY operation requires a boolean condition.\n");
         return false;
     }
 
-    Value result = condition.as_boolean ? true_val : false_val;
+    Value result = AS_BOOL(condition) ? true_val : false_val;
     vm_push(vm, result);
     return true;
 }
 
 // Handler for OP_HALT
-bool handle_halt(void) {
+bool handle_halt([[maybe_unused]] VM *vm, [[maybe_unused]] const Instruction *ins) {
     return false;
 }
 
 // Handler for OP_NOP
-bool handle_nop(void) {
+bool handle_nop([[maybe_unused]] VM *vm, [[maybe_unused]] const Instruction *ins) {
     // No operation; simply continue execution
-    get_vm()->ip++;
     return true;
 }
 
 // Handler for OP_STORE_VAR
 // OP_STORE_VAR <index:uint64_t>
 // where index is the index of the variable in the symbol table
-inline bool handle_store_var(void) {
-    auto vm = get_vm();
-    uint16_t variable_index = vm_read_uint16(vm);
+inline bool handle_store_var(VM *vm, const Instruction *ins) {
     Value val = vm_pop(vm);
-    vm->registers[variable_index] = val;
+    vm->registers[ins->a] = val;
     return true;
 }
 
-inline bool handle_load_const_float(void) {
-    auto vm = get_vm();
-    if (vm->ip + sizeof(double) > vm->size) {
-        fprintf(stderr, "Unexpected end of bytecode during LOAD_CONST.\n");
-        return false;
-    }
-
-    double value;
-    memcpy(&value, &vm->bytecode[vm->ip], sizeof(double));
-    vm->ip += sizeof(double);
-    Value val = make_float(value);
+inline bool handle_load_const_float(VM *vm, const Instruction *ins) {
+    Value val = make_float(ins->operand.as_float);
     vm_push(vm, val);
     return true;
 }
 
-inline bool handle_load_var(void) {
-    auto vm = get_vm();
-    uint16_t variable_index = vm_read_uint16(vm);
-    vm_push(vm, vm->registers[variable_index]);
+inline bool handle_load_var(VM *vm, const Instruction *ins) {
+    vm_push(vm, vm->registers[ins->a]);
     return true;
 }
 
-bool handle_enter_scope(void) {
-    auto vm = get_vm();
+// globals are the registers of the top level code, at the bottom of the register file
+bool handle_load_global(VM *vm, const Instruction *ins) {
+    vm_push(vm, vm->register_file[ins->a]);
+    return true;
+}
+
+bool handle_store_global(VM *vm, const Instruction *ins) {
+    vm->register_file[ins->a] = vm_pop(vm);
+    return true;
+}
+
+bool handle_enter_scope(VM *vm, [[maybe_unused]] const Instruction *ins) {
     if (vm->context->symbols) {
         enter_scope(vm->context->symbols);
     } else {
@@ -708,40 +640,124 @@ bool handle_enter_scope(void) {
     return true;
 }
 
-bool handle_exit_scope(void) {
-    exit_scope(get_vm()->context->symbols);
+bool handle_exit_scope(VM *vm, [[maybe_unused]] const Instruction *ins) {
+    exit_scope(vm->context->symbols);
     return true;
 }
 
-inline bool handle_pop(void) {
-    vm_pop(get_vm());
+inline bool handle_pop(VM *vm, [[maybe_unused]] const Instruction *ins) {
+    vm_pop(vm);
     return true;
 }
 
-bool handle_push(void) {
+bool handle_push([[maybe_unused]] VM *vm, [[maybe_unused]] const Instruction *ins) {
     return false;
 }
 
-bool handle_save_sp(void) {
-    get_vm()->sp_reset = SP;
+bool handle_save_sp(VM *vm, [[maybe_unused]] const Instruction *ins) {
+    vm->sp_reset = vm->stack->sp;
     return true;
 }
 
-bool handle_reset_sp(void) {
-    // for (int i = SP; i <= vm->sp_reset; i--) vm_pop(vm);
-    SP = get_vm()->sp_reset;
+bool handle_reset_sp(VM *vm, [[maybe_unused]] const Instruction *ins) {
+    // for (int i = vm->stack->sp; i <= vm->sp_reset; i--) vm_pop(vm);
+    vm->stack->sp = vm->sp_reset;
     return true;
 }
 
-inline bool handle_inc_reg(void) {
-    auto vm = get_vm();
-    uint16_t variable_index = vm_read_uint16(vm);
-    Value val = vm->registers[variable_index];
+inline bool handle_inc_reg(VM *vm, const Instruction *ins) {
+    Value val = vm->registers[ins->a];
 
-    if (val.type == VAL_INT) {
-        ((vm->registers) + variable_index)->as_integer++;
+    if (IS_INT(val)) {
+        vm->registers[ins->a] = make_int(AS_INT(val) + 1);
     }
 
     return true;
 }
 
+
+
+// Register instructions
+// operands: a = destination, b = left register, c = right register or operand.as_int
+
+static bool register_op(VM *vm, const Instruction *ins, bool (*op)(Value, Value, Value *), bool immediate) {
+    const Value rhs = immediate ? make_int(ins->operand.as_int) : vm->registers[ins->c];
+    return op(vm->registers[ins->b], rhs, &vm->registers[ins->a]);
+}
+
+bool handle_add_rrr(VM *vm, const Instruction *ins) {
+    return register_op(vm, ins, value_add, false);
+}
+
+bool handle_sub_rrr(VM *vm, const Instruction *ins) {
+    return register_op(vm, ins, value_sub, false);
+}
+
+bool handle_mul_rrr(VM *vm, const Instruction *ins) {
+    return register_op(vm, ins, value_mul, false);
+}
+
+bool handle_div_rrr(VM *vm, const Instruction *ins) {
+    return register_op(vm, ins, value_div, false);
+}
+
+bool handle_add_rri(VM *vm, const Instruction *ins) {
+    return register_op(vm, ins, value_add, true);
+}
+
+bool handle_sub_rri(VM *vm, const Instruction *ins) {
+    return register_op(vm, ins, value_sub, true);
+}
+
+bool handle_mul_rri(VM *vm, const Instruction *ins) {
+    return register_op(vm, ins, value_mul, true);
+}
+
+bool handle_div_rri(VM *vm, const Instruction *ins) {
+    return register_op(vm, ins, value_div, true);
+}
+
+bool handle_mov_rr(VM *vm, const Instruction *ins) {
+    vm->registers[ins->a] = vm->registers[ins->b];
+    return true;
+}
+
+bool handle_mov_ri(VM *vm, const Instruction *ins) {
+    vm->registers[ins->a] = make_int(ins->operand.as_int);
+    return true;
+}
+
+// Fused compare and jump: a = left register, b = right register or operand.as_int
+bool handle_compare_jmp(VM *vm, const Instruction *ins) {
+    const bool immediate = ins->opcode >= OP_EQ_RI_JMP;
+    const Value lhs = vm->registers[ins->a];
+    const Value rhs = immediate ? make_int(ins->operand.as_int) : vm->registers[ins->b];
+
+    bool taken = false;
+    switch (immediate ? ins->opcode - (OP_EQ_RI_JMP - OP_EQ_RR_JMP) : ins->opcode) {
+        case OP_EQ_RR_JMP:
+            taken = value_equals(lhs, rhs);
+            break;
+        case OP_NE_RR_JMP:
+            taken = !value_equals(lhs, rhs);
+            break;
+        case OP_LT_RR_JMP:
+            if (!value_order(OP_LESS_THAN, lhs, rhs, &taken)) return false;
+            break;
+        case OP_LE_RR_JMP:
+            if (!value_order(OP_LESS_EQUAL, lhs, rhs, &taken)) return false;
+            break;
+        case OP_GT_RR_JMP:
+            if (!value_order(OP_GREATER_THAN, lhs, rhs, &taken)) return false;
+            break;
+        default:
+            if (!value_order(OP_GREATER_EQUAL, lhs, rhs, &taken)) return false;
+            break;
+    }
+
+    if (taken) {
+        vm->pc = ins->target;
+        return ins->target > ins || vm_poll(vm);
+    }
+    return true;
+}
@@ -6,60 +6,92 @@
 #define TIGE_OP_HANDLERS_H
 
 typedef struct VM VM;
+typedef struct Instruction Instruction;
 
-typedef bool (*OpcodeHandler)(void);
+// Handlers receive the VM running them and the instruction being executed; vm->pc
+// already points to the next instruction and only needs to be changed by control
+// flow handlers.
+typedef bool (*OpcodeHandler)(VM *vm, const Instruction *ins);
 
-bool handle_nop(void);
+bool handle_nop(VM *vm, const Instruction *ins);
 
-bool handle_load_const_int(void);
+bool handle_load_const_int(VM *vm, const Instruction *ins);
 
-bool handle_load_const_float(void);
+bool handle_load_const_float(VM *vm, const Instruction *ins);
 
-bool handle_load_string(void);
+bool handle_load_string(VM *vm, const Instruction *ins);
 
-bool handle_load_bool(void);
+bool handle_load_bool(VM *vm, const Instruction *ins);
 
-bool handle_load_var(void);
+bool handle_load_var(VM *vm, const Instruction *ins);
 
-bool handle_store_var(void);
+bool handle_store_var(VM *vm, const Instruction *ins);
 
-bool handle_add(void);
+bool handle_load_global(VM *vm, const Instruction *ins);
 
-bool handle_sub(void);
+bool handle_store_global(VM *vm, const Instruction *ins);
 
-bool handle_mul(void);
+bool handle_add(VM *vm, const Instruction *ins);
 
-bool handle_div(void);
+bool handle_sub(VM *vm, const Instruction *ins);
 
-bool handle_and(void);
+bool handle_mul(VM *vm, const Instruction *ins);
 
-bool handle_or(void);
+bool handle_div(VM *vm, const Instruction *ins);
 
-bool handle_not(void);
+bool handle_and(VM *vm, const Instruction *ins);
 
-bool handle_equal(void);
+bool handle_or(VM *vm, const Instruction *ins);
 
-bool handle_not_equal(void);
+bool handle_not(VM *vm, const Instruction *ins);
 
-bool handle_less_than(void);
+bool handle_equal(VM *vm, const Instruction *ins);
 
-bool handle_greater_than(void);
+bool handle_not_equal(VM *vm, const Instruction *ins);
 
-bool handle_less_equal(void);
+bool handle_less_than(VM *vm, const Instruction *ins);
 
-bool handle_greater_equal(void);
+bool handle_greater_than(VM *vm, const Instruction *ins);
 
-bool handle_jmp(void);
+bool handle_less_equal(VM *vm, const Instruction *ins);
 
-bool handle_jmp_adr(void);
+bool handle_greater_equal(VM *vm, const Instruction *ins);
 
-bool handle_jmp_if_true(void);
+// quickened forms of the handlers above
+bool handle_add_int_int(VM *vm, const Instruction *ins);
+bool handle_add_float_float(VM *vm, const Instruction *ins);
+bool handle_sub_int_int(VM *vm, const Instruction *ins);
+bool handle_sub_float_float(VM *vm, const Instruction *ins);
+bool handle_mul_int_int(VM *vm, const Instruction *ins);
+bool handle_mul_float_float(VM *vm, const Instruction *ins);
+bool handle_div_int_int(VM *vm, const Instruction *ins);
+bool handle_div_float_float(VM *vm, const Instruction *ins);
+bool handle_eq_int_int(VM *vm, const Instruction *ins);
+bool handle_eq_float_float(VM *vm, const Instruction *ins);
+bool handle_ne_int_int(VM *vm, const Instruction *ins);
+bool handle_ne_float_float(VM *vm, const Instruction *ins);
+bool handle_lt_int_int(VM *vm, const Instruction *ins);
+bool handle_lt_float_float(VM *vm, const Instruction *ins);
+bool handle_gt_int_int(VM *vm, const Instruction *ins);
+bool handle_gt_float_float(VM *vm, const Instruction *ins);
+bool handle_le_int_int(VM *vm, const Instruction *ins);
+bool handle_le_float_float(VM *vm, const Instruction *ins);
+bool handle_ge_int_int(VM *vm, const Instruction *ins);
+bool handle_ge_float_float(VM *vm, const Instruction *ins);
 
-bool handle_jmp_if_false(void);
+bool handle_jmp(VM *vm, const Instruction *ins);
 
-bool handle_call(void);
+bool handle_jmp_if_true(VM *vm, const Instruction *ins);
 
-bool handle_return(void);
+bool handle_jmp_if_false(VM *vm, const Instruction *ins);
+
+bool handle_call(VM *vm, const Instruction *ins);
+
+bool handle_call_native(VM *vm, const Instruction *ins);
+
+bool handle_return(VM *vm, const Instruction *ins);
+
+bool handle_tail_call(VM *vm, const Instruction *ins);
 
 bool handle_new_object(VM *vm);
 
@@ -71,22 +103,44 @@ bool handle_alloc_heap(VM *vm);
 
 bool handle_free_heap(VM *vm);
 
-bool handle_ternary(void);
+bool handle_ternary(VM *vm, const Instruction *ins);
+
+bool handle_enter_scope(VM *vm, const Instruction *ins);
+
+bool handle_exit_scope(VM *vm, const Instruction *ins);
+
+bool handle_push(VM *vm, const Instruction *ins);
+
+bool handle_pop(VM *vm, const Instruction *ins);
+
+bool handle_halt(VM *vm, const Instruction *ins);
+
+bool handle_save_sp(VM *vm, const Instruction *ins);
+
+bool handle_reset_sp(VM *vm, const Instruction *ins);
+
+bool handle_inc_reg(VM *vm, const Instruction *ins);
+
+bool handle_add_rrr(VM *vm, const Instruction *ins);
+
+bool handle_sub_rrr(VM *vm, const Instruction *ins);
+
+bool handle_mul_rrr(VM *vm, const Instruction *ins);
 
-bool handle_enter_scope(void);
+bool handle_div_rrr(VM *vm, const Instruction *ins);
 
-bool handle_exit_scope(void);
+bool handle_add_rri(VM *vm, const Instruction *ins);
 
-bool handle_push(void);
+bool handle_sub_rri(VM *vm, const Instruction *ins);
 
-bool handle_pop(void);
+bool handle_mul_rri(VM *vm, const Instruction *ins);
 
-bool handle_halt(void);
+bool handle_div_rri(VM *vm, const Instruction *ins);
 
-bool handle_save_sp(void);
+bool handle_mov_rr(VM *vm, const Instruction *ins);
 
-bool handle_reset_sp(void);
+bool handle_mov_ri(VM *vm, const Instruction *ins);
 
-bool handle_inc_reg(void);
+bool handle_compare_jmp(VM *vm, const Instruction *ins);
 
 #endif //TIGE_OP_HANDLERS_H
@@ -11,6 +11,9 @@ typedef enum {
     OP_LOAD_CONST_FLOAT = 0x2D,
     OP_LOAD_VAR = 0x02,
     OP_STORE_VAR = 0x03,
+    // top level variables used from inside a function, index:u16 into the bottom frame
+    OP_LOAD_GLOBAL = 0x2E,
+    OP_STORE_GLOBAL = 0x2F,
 
     // Arithmetic Operations
     OP_ADD = 0x04,
@@ -31,14 +34,17 @@ typedef enum {
     OP_LESS_EQUAL = 0x0F,
     OP_GREATER_EQUAL = 0x10,
 
-    // Control Flow
+    // Control Flow, jumps end in rel:i32 relative to the end of the instruction
     OP_JMP = 0x11,
     OP_JMP_IF_TRUE = 0x12,
     OP_JMP_IF_FALSE = 0x13,
 
     // Function Calls
+    // CALL base:u16 name\0, the callee's register window starts at r[base] (its arguments)
     OP_CALL = 0x14,
     OP_RETURN = 0x15,
+    // TAIL_CALL base:u16 name\0, `return f(...)`: the callee replaces the running function in its frame
+    OP_TAIL_CALL = 0x1E,
 
     // Object Handling
     OP_NEW_OBJECT = 0x16,
@@ -50,14 +56,13 @@ typedef enum {
     OP_FREE_HEAP = 0x1A,
 
     // Data Types
+    // LOAD_STRING index:u32 into the constant pool of the buffer
     OP_LOAD_STRING = 0x1B,
     OP_LOAD_BOOL = 0x1C,
 
     // Ternary Operator
     OP_TERNARY = 0x1D,
 
-    OP_JMP_ADR = 0x1E,
-
     OP_ENTER_SCOPE = 0x1F,
     OP_EXIT_SCOPE = 0xF1,
 
@@ -70,6 +75,65 @@ typedef enum {
     OP_INC_REG = 0x21,
     OP_DEC_REG = 0x22,
 
+    // Register (three-address) arithmetic
+    // <op> dst:u16 a:u16 b:u16        => r[dst] = r[a] <op> r[b]
+    // <op> dst:u16 a:u16 imm:i64      => r[dst] = r[a] <op> imm
+    OP_ADD_RRR = 0x30,
+    OP_SUB_RRR = 0x31,
+    OP_MUL_RRR = 0x32,
+    OP_DIV_RRR = 0x33,
+    OP_ADD_RRI = 0x34,
+    OP_SUB_RRI = 0x35,
+    OP_MUL_RRI = 0x36,
+    OP_DIV_RRI = 0x37,
+
+    // Register moves
+    // MOV_RR dst:u16 src:u16, MOV_RI dst:u16 imm:i64
+    OP_MOV_RR = 0x38,
+    OP_MOV_RI = 0x39,
+
+    // Fused compare and branch, jumps when the comparison holds
+    // <op> a:u16 b:u16 rel:i32   |   <op> a:u16 imm:i64 rel:i32
+    OP_EQ_RR_JMP = 0x40,
+    OP_NE_RR_JMP = 0x41,
+    OP_LT_RR_JMP = 0x42,
+    OP_LE_RR_JMP = 0x43,
+    OP_GT_RR_JMP = 0x44,
+    OP_GE_RR_JMP = 0x45,
+    OP_EQ_RI_JMP = 0x46,
+    OP_NE_RI_JMP = 0x47,
+    OP_LT_RI_JMP = 0x48,
+    OP_LE_RI_JMP = 0x49,
+    OP_GT_RI_JMP = 0x4A,
+    OP_GE_RI_JMP = 0x4B,
+
+    // Direct call of a C builtin: CALL_NATIVE index:u16, bypasses call frames
+    OP_CALL_NATIVE = 0x50,
+
+    // Quickened forms of the generic arithmetic and comparisons, never emitted by the
+    // compiler: a decoded instruction rewrites itself into one once its operand types
+    // are stable, and back when they change. Int form first, float form right after.
+    OP_ADD_INT_INT = 0x60,
+    OP_ADD_FLOAT_FLOAT = 0x61,
+    OP_SUB_INT_INT = 0x62,
+    OP_SUB_FLOAT_FLOAT = 0x63,
+    OP_MUL_INT_INT = 0x64,
+    OP_MUL_FLOAT_FLOAT = 0x65,
+    OP_DIV_INT_INT = 0x66,
+    OP_DIV_FLOAT_FLOAT = 0x67,
+    OP_EQ_INT_INT = 0x68,
+    OP_EQ_FLOAT_FLOAT = 0x69,
+    OP_NE_INT_INT = 0x6A,
+    OP_NE_FLOAT_FLOAT = 0x6B,
+    OP_LT_INT_INT = 0x6C,
+    OP_LT_FLOAT_FLOAT = 0x6D,
+    OP_GT_INT_INT = 0x6E,
+    OP_GT_FLOAT_FLOAT = 0x6F,
+    OP_LE_INT_INT = 0x70,
+    OP_LE_FLOAT_FLOAT = 0x71,
+    OP_GE_INT_INT = 0x72,
+    OP_GE_FLOAT_FLOAT = 0x73,
+
     // Halt Execution
     OP_HALT = 0xFF,
 
@@ -0,0 +1,250 @@
+//
+// Created by fathi on 11/16/2024.
+//
+
+#include "opcode_profile.h"
+#include "decoder.h"
+#include "uthash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct OpcodeTriple {
+    uint32_t key;
+    uint64_t count;
+    UT_hash_handle hh;
+};
+
+static const char *opcode_names[256] = {
+        [OP_NOPE]            = "NOPE",
+        [OP_LOAD_CONST_INT]  = "LOAD_CONST_INT",
+        [OP_LOAD_CONST_FLOAT]= "LOAD_CONST_FLOAT",
+        [OP_LOAD_VAR]        = "LOAD_VAR",
+        [OP_STORE_VAR]       = "STORE_VAR",
+        [OP_LOAD_GLOBAL]     = "LOAD_GLOBAL",
+        [OP_STORE_GLOBAL]    = "STORE_GLOBAL",
+        [OP_ADD]             = "ADD",
+        [OP_SUB]             = "SUB",
+        [OP_MUL]             = "MUL",
+        [OP_DIV]             = "DIV",
+        [OP_AND]             = "AND",
+        [OP_OR]              = "OR",
+        [OP_NOT]             = "NOT",
+        [OP_EQUAL]           = "EQUAL",
+        [OP_NOT_EQUAL]       = "NOT_EQUAL",
+        [OP_LESS_THAN]       = "LESS_THAN",
+        [OP_GREATER_THAN]    = "GREATER_THAN",
+        [OP_LESS_EQUAL]      = "LESS_EQUAL",
+        [OP_GREATER_EQUAL]   = "GREATER_EQUAL",
+        [OP_JMP]             = "JMP",
+        [OP_JMP_IF_TRUE]     = "JMP_IF_TRUE",
+        [OP_JMP_IF_FALSE]    = "JMP_IF_FALSE",
+        [OP_CALL]            = "CALL",
+        [OP_RETURN]          = "RETURN",
+        [OP_TAIL_CALL]       = "TAIL_CALL",
+        [OP_NEW_OBJECT]      = "NEW_OBJECT",
+        [OP_GET_PROPERTY]    = "GET_PROPERTY",
+        [OP_SET_PROPERTY]    = "SET_PROPERTY",
+        [OP_ALLOC_HEAP]      = "ALLOC_HEAP",
+        [OP_FREE_HEAP]       = "FREE_HEAP",
+        [OP_LOAD_STRING]     = "LOAD_STRING",
+        [OP_LOAD_BOOL]       = "LOAD_BOOL",
+        [OP_TERNARY]         = "TERNARY",
+        [OP_ENTER_SCOPE]     = "ENTER_SCOPE",
+        [OP_EXIT_SCOPE]      = "EXIT_SCOPE",
+        [OP_PUSH]            = "PUSH",
+        [OP_POP]             = "POP",
+        [OP_SAVE_SP]         = "SAVE_SP",
+        [OP_RESET_SP]        = "RESET_SP",
+        [OP_INC_REG]         = "INC_REG",
+        [OP_DEC_REG]         = "DEC_REG",
+        [OP_ADD_RRR]         = "ADD_RRR",
+        [OP_SUB_RRR]         = "SUB_RRR",
+        [OP_MUL_RRR]         = "MUL_RRR",
+        [OP_DIV_RRR]         = "DIV_RRR",
+        [OP_ADD_RRI]         = "ADD_RRI",
+        [OP_SUB_RRI]         = "SUB_RRI",
+        [OP_MUL_RRI]         = "MUL_RRI",
+        [OP_DIV_RRI]         = "DIV_RRI",
+        [OP_MOV_RR]          = "MOV_RR",
+        [OP_MOV_RI]          = "MOV_RI",
+        [OP_EQ_RR_JMP]       = "EQ_RR_JMP",
+        [OP_NE_RR_JMP]       = "NE_RR_JMP",
+        [OP_LT_RR_JMP]       = "LT_RR_JMP",
+        [OP_LE_RR_JMP]       = "LE_RR_JMP",
+        [OP_GT_RR_JMP]       = "GT_RR_JMP",
+        [OP_GE_RR_JMP]       = "GE_RR_JMP",
+        [OP_EQ_RI_JMP]       = "EQ_RI_JMP",
+        [OP_NE_RI_JMP]       = "NE_RI_JMP",
+        [OP_LT_RI_JMP]       = "LT_RI_JMP",
+        [OP_LE_RI_JMP]       = "LE_RI_JMP",
+        [OP_GT_RI_JMP]       = "GT_RI_JMP",
+        [OP_GE_RI_JMP]       = "GE_RI_JMP",
+        [OP_CALL_NATIVE]     = "CALL_NATIVE",
+        [OP_HALT]            = "HALT",
+};
+
+const char *opcode_name(Opcode opcode) {
+    return opcode_names[opcode & 0xFF];
+}
+
+bool opcode_from_name(const char *name, Opcode *opcode) {
+    for (int i = 0; i < 256; i++) {
+        if (opcode_names[i] && strcmp(opcode_names[i], name) == 0) {
+            *opcode = (Opcode) i;
+            return true;
+        }
+    }
+    return false;
+}
+
+OpcodeProfile *create_opcode_profile(void) {
+    OpcodeProfile *profile = calloc(1, sizeof(OpcodeProfile));
+    if (!profile) {
+        fprintf(stderr, "Failed to allocate memory for the opcode profile.\n");
+        exit(EXIT_FAILURE);
+    }
+    return profile;
+}
+
+void destroy_opcode_profile(OpcodeProfile *profile) {
+    if (profile) {
+        OpcodeTriple *triple, *tmp;
+        HASH_ITER(hh, profile->triples, triple, tmp) {
+            HASH_DEL(profile->triples, triple);
+            free(triple);
+        }
+        free(profile);
+    }
+}
+
+static void add_triple(OpcodeProfile *profile, uint32_t key, uint64_t count) {
+    OpcodeTriple *triple;
+    HASH_FIND(hh, profile->triples, &key, sizeof(uint32_t), triple);
+    if (!triple) {
+        triple = calloc(1, sizeof(OpcodeTriple));
+        triple->key = key;
+        HASH_ADD(hh, profile->triples, key, sizeof(uint32_t), triple);
+    }
+    triple->count += count;
+}
+
+void profile_record(OpcodeProfile *profile, const Instruction *ins) {
+    const Instruction *previous = profile->previous;
+
+    if (previous && ins == previous + 1) {
+        profile->pairs[previous->opcode & 0xFF][ins->opcode & 0xFF]++;
+
+        const Instruction *before = profile->before_previous;
+        if (before && previous == before + 1) {
+            add_triple(profile, (uint32_t) (before->opcode & 0xFF) << 16 |
+                                (uint32_t) (previous->opcode & 0xFF) << 8 |
+                                (uint32_t) (ins->opcode & 0xFF), 1);
+        }
+    }
+
+    profile->before_previous = previous;
+    profile->previous = ins;
+}
+
+bool profile_load(OpcodeProfile *profile, const char *path) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        return true;
+    }
+
+    char line[256];
+    size_t line_number = 0;
+    while (fgets(line, sizeof(line), file)) {
+        line_number++;
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+
+        unsigned long long count;
+        char names[3][64];
+        const int fields = sscanf(line, "%llu %63s %63s %63s", &count, names[0], names[1], names[2]);
+        Opcode ops[3];
+        bool valid = fields == 3 || fields == 4;
+        for (int i = 0; valid && i < fields - 1; i++) {
+            valid = opcode_from_name(names[i], &ops[i]);
+        }
+        if (!valid) {
+            fprintf(stderr, "Error: malformed opcode profile entry at %s:%zu.\n", path, line_number);
+            fclose(file);
+            return false;
+        }
+
+        if (fields == 3) {
+            profile->pairs[ops[0]][ops[1]] += count;
+        } else {
+            add_triple(profile, (uint32_t) ops[0] << 16 | (uint32_t) ops[1] << 8 | (uint32_t) ops[2], count);
+        }
+    }
+
+    fclose(file);
+    return true;
+}
+
+typedef struct {
+    uint64_t count;
+    uint32_t key;
+    int length;
+} ProfileEntry;
+
+static int compare_entries(const void *a, const void *b) {
+    const ProfileEntry *x = a, *y = b;
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    if (x->length != y->length) {
+        return x->length - y->length;
+    }
+    return x->key < y->key ? -1 : x->key > y->key;
+}
+
+bool profile_save(const OpcodeProfile *profile, const char *path) {
+    size_t count = HASH_COUNT(profile->triples);
+    for (int a = 0; a < 256; a++) {
+        for (int b = 0; b < 256; b++) {
+            count += profile->pairs[a][b] != 0;
+        }
+    }
+
+    ProfileEntry *entries = malloc(sizeof(ProfileEntry) * (count + 1));
+    size_t n = 0;
+    for (int a = 0; a < 256; a++) {
+        for (int b = 0; b < 256; b++) {
+            if (profile->pairs[a][b]) {
+                entries[n++] = (ProfileEntry) {profile->pairs[a][b], (uint32_t) a << 8 | (uint32_t) b, 2};
+            }
+        }
+    }
+    OpcodeTriple *triple, *tmp;
+    HASH_ITER(hh, profile->triples, triple, tmp) {
+        entries[n++] = (ProfileEntry) {triple->count, triple->key, 3};
+    }
+    qsort(entries, n, sizeof(ProfileEntry), compare_entries);
+
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        fprintf(stderr, "Error: Could not write opcode profile '%s'\n", path);
+        free(entries);
+        return false;
+    }
+
+    fprintf(file, "# tige opcode profile: <count> <opcode> <opcode> [<opcode>]\n");
+    for (size_t i = 0; i < n; i++) {
+        const uint32_t key = entries[i].key;
+        fprintf(file, "%llu", (unsigned long long) entries[i].count);
+        for (int shift = (entries[i].length - 1) * 8; shift >= 0; shift -= 8) {
+            const char *name = opcode_name((Opcode) (key >> shift & 0xFF));
+            fprintf(file, " %s", name ? name : "NOPE");
+        }
+        fprintf(file, "\n");
+    }
+
+    fclose(file);
+    free(entries);
+    return true;
+}
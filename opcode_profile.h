@@ -0,0 +1,44 @@
+//
+// Created by fathi on 11/16/2024.
+//
+
+#ifndef TIGE_OPCODE_PROFILE_H
+#define TIGE_OPCODE_PROFILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "opcode.h"
+
+typedef struct Instruction Instruction;
+typedef struct OpcodeTriple OpcodeTriple;
+
+// Execution counts of adjacent opcode pairs and triples.
+// Only sequences where control falls through from one instruction to the next
+// are counted, since those are the only ones a superinstruction can replace.
+typedef struct OpcodeProfile {
+    uint64_t pairs[256][256];
+    OpcodeTriple *triples;          // uthash map keyed by (a << 16 | b << 8 | c)
+
+    const Instruction *previous;    // the last two executed instructions
+    const Instruction *before_previous;
+} OpcodeProfile;
+
+OpcodeProfile *create_opcode_profile(void);
+
+void destroy_opcode_profile(OpcodeProfile *profile);
+
+// account for one executed instruction
+void profile_record(OpcodeProfile *profile, const Instruction *ins);
+
+// merge the counts of a profile file written by profile_save, a missing file is not an error
+bool profile_load(OpcodeProfile *profile, const char *path);
+
+// write every non-zero pair and triple as `<count> <OPCODE> <OPCODE> [<OPCODE>]`, most frequent first
+bool profile_save(const OpcodeProfile *profile, const char *path);
+
+// enum name of an opcode without the OP_ prefix, nullptr for unassigned values
+const char *opcode_name(Opcode opcode);
+
+bool opcode_from_name(const char *name, Opcode *opcode);
+
+#endif //TIGE_OPCODE_PROFILE_H
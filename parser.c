@@ -13,14 +13,9 @@
 void parser_init(Parser *parser, Context *context) {
     parser->context = context;
     parser->lexer = &context->lexer;
-    parser->token_list = token_list_create(16);
     parser->current_token = nullptr;
-
-    Token *token;
-    do {
-        token = lex(parser->lexer);
-        token_list_add(parser->token_list, token);
-    } while (token->type != TOKEN_EOF);
+    // tokens are lexed as parsing goes
+    token_stream_init(&parser->tokens, parser->lexer);
 }
 
 bool parser_is_initialized(Parser *parser) {
@@ -29,12 +24,11 @@ bool parser_is_initialized(Parser *parser) {
 
 
 void advance(Parser *parser) {
-    parser->current_token = token_list_next(parser->token_list);
+    parser->current_token = token_stream_next(&parser->tokens);
 }
 
 Token *peek(Parser *parser) {
-    size_t next = parser->token_list->current_index;
-    return token_list_at(parser->token_list, next);
+    return token_stream_peek(&parser->tokens, 0);
 }
 
 bool expect(Parser *parser, TokenType expected) {
@@ -91,9 +85,7 @@ bool matches_current(Parser *parser, ...) {
 }
 
 ASTNode *parse(Context *ctx) {
-    ASTNode *root = parse_program(&ctx->parser);
-    token_list_free(ctx->parser.token_list);
-    return root;
+    return parse_program(&ctx->parser);
 }
 
 ASTNode *parse_program(Parser *parser) {
@@ -130,7 +122,7 @@ ASTNode *parse_program(Parser *parser) {
 
 ASTNode *parse_fn_decl_stmt(Parser *parser) {
     expect(parser, TOKEN_IDENTIFIER);
-    char *func_name = strdup(parser->current_token->str_value);
+    char *func_name = token_strdup(parser->current_token);
 
     expect(parser, TOKEN_LPAREN);
 
@@ -147,8 +139,9 @@ ASTNode *parse_fn_decl_stmt(Parser *parser) {
         }
 
         if (CURRENT(parser, TOKEN_IDENTIFIER)) {
-            char *param_name = strdup(parser->current_token->str_value);
-            ASTNode *param_node = create_ast(AST_SYMBOL, create_string_value(param_name));
+            const Token *param = parser->current_token;
+            ASTNode *param_node = create_ast(AST_SYMBOL, create_string_value(parser->context->vm, param->str_value,
+                                                                             param->length));
             ast_node_list_add(params, param_node);
         }
 
@@ -164,7 +157,7 @@ ASTNode *parse_fn_decl_stmt(Parser *parser) {
 
 ASTNode *parse_var_decl_stmt(Parser *parser) {
     expect(parser, TOKEN_IDENTIFIER);
-    char *id = strdup(parser->current_token->str_value);
+    char *id = token_strdup(parser->current_token);
     expect(parser, TOKEN_EQUALS);
     ASTNode *node = create_ast(AST_VAR_DECL, nullptr);
     node->var_decl_expr.identifier = id;
@@ -278,7 +271,7 @@ ASTNode *parse_for_stmt(Parser *parser) {
     expect(parser, TOKEN_IDENTIFIER);
 
     // loop variable name
-    const char *identifier = strdup(parser->current_token->str_value);
+    const char *identifier = token_strdup(parser->current_token);
 
     expect(parser, TOKEN_IN);
 
@@ -530,13 +523,14 @@ ASTNode *parse_primary_expression(Parser *parser) {
     } else if (MATCH(parser, TOKEN_TRUE)) {
         node = create_ast(AST_BOOL, create_bool_value(parser->current_token->bool_value));
     } else if (MATCH(parser, TOKEN_STRING)) {
-        node = create_ast(AST_STRING, create_string_value(parser->current_token->str_value));
+        const Token *string = parser->current_token;
+        node = create_ast(AST_STRING, create_string_value(parser->context->vm, string->str_value, string->length));
     }
         // TODO: function calls
     else if (MATCH(parser, TOKEN_IDENTIFIER)) {
-        char* id = parser->current_token->str_value;
+        const Token *id = parser->current_token;
 
-        node = create_ast(AST_SYMBOL, create_string_value(id));
+        node = create_ast(AST_SYMBOL, create_string_value(parser->context->vm, id->str_value, id->length));
 
     } else if (MATCH(parser, TOKEN_LPAREN)) {
         node = parse_expression(parser);
@@ -18,8 +18,7 @@ struct Parser {
     Context* context;
     Token *current_token;
     Lexer *lexer;
-    TokenList *token_list;
-    unsigned int current_token_index;
+    TokenStream tokens;
 };
 
 void parser_init(Parser *parser, Context* ctx);
@@ -0,0 +1,535 @@
+//
+// Created by fathi on 11/24/2024.
+//
+
+#include "scheduler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <threads.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include "vm.h"
+#include "event_loop.h"
+
+#define DEQUE_INITIAL_CAPACITY 64
+#define CACHE_LINE 64
+#define WAKE_BATCH 64
+
+struct Isolate {
+    VM *vm;
+    IsolateDone done;
+    void *data;
+    Scheduler *scheduler;
+    Isolate *next;              // in the inbox
+    Value result;               // of the script, kept while its event loop runs
+    bool draining;              // the script ended, its timers and sockets keep it alive
+    int wait_fd;                // what it sleeps on, see park
+};
+
+// Chase-Lev deque: only the owner pushes at the bottom, everyone takes from the top.
+// The owner takes from the top as well: isolates are time sliced, a preempted one
+// goes to the back of the line behind the others.
+typedef struct DequeArray {
+    int64_t capacity;           // power of two
+    struct DequeArray *retired; // smaller arrays thieves may still be reading
+    _Atomic(Isolate *) items[];
+} DequeArray;
+
+typedef struct {
+    alignas(CACHE_LINE) _Atomic int64_t top;
+    alignas(CACHE_LINE) _Atomic int64_t bottom;
+    _Atomic(DequeArray *) array;
+} Deque;
+
+typedef struct {
+    alignas(CACHE_LINE) Deque deque;
+    Scheduler *scheduler;
+    thrd_t thread;
+    uint64_t random;            // victim selection
+
+    // isolates waiting for a sleep, a timer or a socket are parked in an epoll set of
+    // the worker that ran them, under the descriptor of their event loop
+    int waiting_fd;
+    int wakeup_fd;              // eventfd in that set, new work for an idle worker blocked on it
+    size_t waiting;             // owner only
+    bool polling;               // idle and blocked on waiting_fd rather than on work, under the lock
+
+    _Atomic uint64_t slices;
+    _Atomic uint64_t completed;
+    _Atomic uint64_t steals;
+    _Atomic uint64_t failed_steals;
+    _Atomic uint64_t sleeps;
+    _Atomic uint64_t parks;
+} Worker;
+
+struct Scheduler {
+    Worker *workers;
+    int count;
+    int64_t slice;
+
+    // isolates spawned from outside the workers, taken before stealing
+    mtx_t lock;
+    cnd_t work;                 // idle workers wait here
+    cnd_t finished;             // scheduler_wait waits here
+    Isolate *inbox_head;
+    Isolate *inbox_tail;
+    _Atomic size_t inbox_size;
+
+    _Atomic int idle;           // workers waiting for work
+    _Atomic int64_t live;       // isolates spawned and not finished
+    _Atomic bool stopping;
+};
+
+static DequeArray *create_deque_array(int64_t capacity) {
+    DequeArray *array = malloc(sizeof(DequeArray) + capacity * sizeof(Isolate *));
+    if (array) {
+        array->capacity = capacity;
+        array->retired = nullptr;
+    }
+    return array;
+}
+
+static bool deque_init(Deque *deque) {
+    DequeArray *array = create_deque_array(DEQUE_INITIAL_CAPACITY);
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    atomic_init(&deque->array, array);
+    return array != nullptr;
+}
+
+static void deque_destroy(Deque *deque) {
+    DequeArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+    while (array) {
+        DequeArray *retired = array->retired;
+        free(array);
+        array = retired;
+    }
+}
+
+static size_t deque_size(Deque *deque) {
+    const int64_t bottom = atomic_load(&deque->bottom);
+    const int64_t top = atomic_load(&deque->top);
+    return bottom > top ? (size_t) (bottom - top) : 0;
+}
+
+// owner only
+static bool deque_push(Deque *deque, Isolate *isolate) {
+    const int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    const int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    DequeArray *array = atomic_load_explicit(&deque->array, memory_order_relaxed);
+
+    if (bottom - top >= array->capacity) {
+        DequeArray *grown = create_deque_array(array->capacity * 2);
+        if (!grown) {
+            return false;
+        }
+        for (int64_t i = top; i < bottom; i++) {
+            atomic_store_explicit(&grown->items[i & (grown->capacity - 1)],
+                                  atomic_load_explicit(&array->items[i & (array->capacity - 1)],
+                                                       memory_order_relaxed),
+                                  memory_order_relaxed);
+        }
+        // freed with the deque, a thief may have loaded the old array already
+        grown->retired = array;
+        atomic_store_explicit(&deque->array, grown, memory_order_release);
+        array = grown;
+    }
+
+    atomic_store_explicit(&array->items[bottom & (array->capacity - 1)], isolate, memory_order_relaxed);
+    // publishes the item and the state of its VM to the thread that takes it
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_release);
+    return true;
+}
+
+// Take the oldest isolate, from any thread. Sets *lost when another thread took it
+// first and the deque may still hold more.
+static Isolate *deque_steal(Deque *deque, bool *lost) {
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    const int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    *lost = false;
+    if (top >= bottom) {
+        return nullptr;
+    }
+
+    DequeArray *array = atomic_load_explicit(&deque->array, memory_order_acquire);
+    Isolate *isolate = atomic_load_explicit(&array->items[top & (array->capacity - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed)) {
+        *lost = true;
+        return nullptr;
+    }
+    return isolate;
+}
+
+static void count(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static bool has_work(Scheduler *scheduler) {
+    if (atomic_load(&scheduler->inbox_size)) {
+        return true;
+    }
+    for (int i = 0; i < scheduler->count; i++) {
+        if (deque_size(&scheduler->workers[i].deque)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// under the lock: the idle workers blocked on their parked isolates miss cnd_signal
+static void wake_polling(Scheduler *scheduler) {
+    const uint64_t one = 1;
+    for (int i = 0; i < scheduler->count; i++) {
+        if (scheduler->workers[i].polling && write(scheduler->workers[i].wakeup_fd, &one, sizeof(one)) < 0) {
+            perror("Error: eventfd");
+        }
+    }
+}
+
+// wake a sleeping worker, if any, after work was published
+static void notify(Scheduler *scheduler) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&scheduler->idle)) {
+        mtx_lock(&scheduler->lock);
+        cnd_signal(&scheduler->work);
+        wake_polling(scheduler);
+        mtx_unlock(&scheduler->lock);
+    }
+}
+
+static void inbox_push(Scheduler *scheduler, Isolate *isolate) {
+    isolate->next = nullptr;
+    mtx_lock(&scheduler->lock);
+    if (scheduler->inbox_tail) {
+        scheduler->inbox_tail->next = isolate;
+    } else {
+        scheduler->inbox_head = isolate;
+    }
+    scheduler->inbox_tail = isolate;
+    atomic_fetch_add(&scheduler->inbox_size, 1);
+    cnd_signal(&scheduler->work);
+    wake_polling(scheduler);
+    mtx_unlock(&scheduler->lock);
+}
+
+static Isolate *inbox_pop(Scheduler *scheduler) {
+    if (!atomic_load_explicit(&scheduler->inbox_size, memory_order_relaxed)) {
+        return nullptr;
+    }
+    mtx_lock(&scheduler->lock);
+    Isolate *isolate = scheduler->inbox_head;
+    if (isolate) {
+        scheduler->inbox_head = isolate->next;
+        if (!scheduler->inbox_head) {
+            scheduler->inbox_tail = nullptr;
+        }
+        atomic_fetch_sub(&scheduler->inbox_size, 1);
+    }
+    mtx_unlock(&scheduler->lock);
+    return isolate;
+}
+
+// xorshift, victims only need to be spread out
+static uint64_t next_random(Worker *worker) {
+    worker->random ^= worker->random << 13;
+    worker->random ^= worker->random >> 7;
+    worker->random ^= worker->random << 17;
+    return worker->random;
+}
+
+static Isolate *steal_work(Worker *worker) {
+    Scheduler *scheduler = worker->scheduler;
+    const int self = (int) (worker - scheduler->workers);
+    const int start = (int) (next_random(worker) % scheduler->count);
+    for (int i = 0; i < scheduler->count; i++) {
+        const int victim = (start + i) % scheduler->count;
+        if (victim == self) {
+            continue;
+        }
+        bool lost;
+        Isolate *isolate = deque_steal(&scheduler->workers[victim].deque, &lost);
+        if (isolate) {
+            count(&worker->steals, 1);
+            return isolate;
+        }
+        count(&worker->failed_steals, 1);
+    }
+    return nullptr;
+}
+
+static Isolate *find_work(Worker *worker) {
+    Isolate *isolate;
+    bool lost;
+    do {
+        isolate = deque_steal(&worker->deque, &lost);
+    } while (!isolate && lost);
+    if (!isolate) {
+        isolate = inbox_pop(worker->scheduler);
+    }
+    if (!isolate) {
+        isolate = steal_work(worker);
+    }
+    return isolate;
+}
+
+static void finish(Worker *worker, Isolate *isolate) {
+    Scheduler *scheduler = worker->scheduler;
+    isolate->done(isolate->vm, isolate->result, isolate->data);
+    free(isolate);
+    count(&worker->completed, 1);
+
+    if (atomic_fetch_sub(&scheduler->live, 1) == 1) {
+        mtx_lock(&scheduler->lock);
+        cnd_broadcast(&scheduler->finished);
+        mtx_unlock(&scheduler->lock);
+    }
+}
+
+static void requeue(Worker *worker, Isolate *isolate) {
+    if (!deque_push(&worker->deque, isolate)) {
+        inbox_push(worker->scheduler, isolate);
+        return;
+    }
+    notify(worker->scheduler);
+}
+
+// put the isolate to sleep until fd is readable, wake_ready queues it again
+static bool park(Worker *worker, Isolate *isolate, int fd) {
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = isolate};
+    if (epoll_ctl(worker->waiting_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        perror("Error: epoll_ctl");
+        return false;
+    }
+    isolate->wait_fd = fd;
+    worker->waiting++;
+    count(&worker->parks, 1);
+    return true;
+}
+
+// queue the parked isolates that can go on, waiting up to timeout ms (-1 for ever)
+static void wake_ready(Worker *worker, int timeout) {
+    struct epoll_event events[WAKE_BATCH];
+    const int ready = epoll_wait(worker->waiting_fd, events, WAKE_BATCH, timeout);
+    for (int i = 0; i < ready; i++) {
+        Isolate *isolate = events[i].data.ptr;
+        if (!isolate) {
+            uint64_t wakeups;
+            if (read(worker->wakeup_fd, &wakeups, sizeof(wakeups)) < 0) {
+                perror("Error: eventfd");
+            }
+            continue;
+        }
+        epoll_ctl(worker->waiting_fd, EPOLL_CTL_DEL, isolate->wait_fd, nullptr);
+        worker->waiting--;
+        requeue(worker, isolate);
+    }
+}
+
+// A time slice of the script on the VM's fiber, or once it has ended, the callbacks
+// of the events its loop has ready. Isolates with nothing to do are parked.
+static void run_slice(Worker *worker, Isolate *isolate) {
+    VM *vm = isolate->vm;
+    count(&worker->slices, 1);
+    if (!isolate->draining) {
+        // back from a sleep: the timer expired, this only clears it
+        if (vm_is_parked(vm)) {
+            event_loop_wait_parked(vm->events);
+        }
+        vm_set_budget(vm, worker->scheduler->slice, nullptr, nullptr);
+        isolate->result = vm_run_fiber(vm);
+        if (vm_is_parked(vm)) {
+            if (!park(worker, isolate, event_loop_wait_fd(vm->events))) {
+                event_loop_wait_parked(vm->events);
+                requeue(worker, isolate);
+            }
+            return;
+        }
+        if (vm_is_suspended(vm)) {
+            requeue(worker, isolate);
+            return;
+        }
+        isolate->draining = true;
+    } else if (!event_loop_run_ready(vm->events)) {
+        finish(worker, isolate);
+        return;
+    }
+
+    if (!vm->events || !event_loop_pending(vm->events)) {
+        finish(worker, isolate);
+    } else if (!park(worker, isolate, event_loop_wait_fd(vm->events))) {
+        event_loop_run(vm->events);
+        finish(worker, isolate);
+    }
+}
+
+static bool worker_init(Worker *worker) {
+    worker->waiting_fd = epoll_create1(EPOLL_CLOEXEC);
+    worker->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = nullptr};
+    return deque_init(&worker->deque) && worker->waiting_fd >= 0 && worker->wakeup_fd >= 0 &&
+           epoll_ctl(worker->waiting_fd, EPOLL_CTL_ADD, worker->wakeup_fd, &event) == 0;
+}
+
+static void worker_release(Worker *worker) {
+    deque_destroy(&worker->deque);
+    if (worker->waiting_fd >= 0) {
+        close(worker->waiting_fd);
+    }
+    if (worker->wakeup_fd >= 0) {
+        close(worker->wakeup_fd);
+    }
+}
+
+static int worker_main(void *arg) {
+    Worker *worker = arg;
+    Scheduler *scheduler = worker->scheduler;
+
+    while (!atomic_load(&scheduler->stopping)) {
+        if (worker->waiting) {
+            wake_ready(worker, 0);
+        }
+        Isolate *isolate = find_work(worker);
+        if (isolate) {
+            run_slice(worker, isolate);
+            continue;
+        }
+
+        // the idle count is raised before looking again, so a push either sees it
+        // and signals or is seen here
+        mtx_lock(&scheduler->lock);
+        atomic_fetch_add(&scheduler->idle, 1);
+        if (!atomic_load(&scheduler->stopping) && !has_work(scheduler)) {
+            count(&worker->sleeps, 1);
+            if (worker->waiting) {
+                // until one of the parked isolates can go on, or new work wakes it up
+                worker->polling = true;
+                mtx_unlock(&scheduler->lock);
+                wake_ready(worker, -1);
+                mtx_lock(&scheduler->lock);
+                worker->polling = false;
+            } else {
+                cnd_wait(&scheduler->work, &scheduler->lock);
+            }
+        }
+        atomic_fetch_sub(&scheduler->idle, 1);
+        mtx_unlock(&scheduler->lock);
+    }
+    return 0;
+}
+
+Scheduler *create_scheduler(int workers, int64_t slice) {
+    if (workers <= 0 || slice <= 0) {
+        fprintf(stderr, "Error: the scheduler needs at least one worker and a positive time slice.\n");
+        return nullptr;
+    }
+
+    Scheduler *scheduler = calloc(1, sizeof(Scheduler));
+    if (!scheduler) {
+        return nullptr;
+    }
+    scheduler->workers = aligned_alloc(CACHE_LINE, workers * sizeof(Worker));
+    if (!scheduler->workers) {
+        free(scheduler);
+        return nullptr;
+    }
+    scheduler->count = workers;
+    scheduler->slice = slice;
+    atomic_init(&scheduler->inbox_size, 0);
+    atomic_init(&scheduler->idle, 0);
+    atomic_init(&scheduler->live, 0);
+    atomic_init(&scheduler->stopping, false);
+    mtx_init(&scheduler->lock, mtx_plain);
+    cnd_init(&scheduler->work);
+    cnd_init(&scheduler->finished);
+
+    for (int i = 0; i < workers; i++) {
+        Worker *worker = &scheduler->workers[i];
+        *worker = (Worker) {.scheduler = scheduler, .random = 0x9E3779B97F4A7C15ULL * (i + 1)};
+        if (!worker_init(worker)) {
+            for (int j = 0; j <= i; j++) {
+                worker_release(&scheduler->workers[j]);
+            }
+            free(scheduler->workers);
+            free(scheduler);
+            return nullptr;
+        }
+    }
+    for (int i = 0; i < workers; i++) {
+        if (thrd_create(&scheduler->workers[i].thread, worker_main, &scheduler->workers[i]) != thrd_success) {
+            fprintf(stderr, "Error: could not start worker thread %d.\n", i);
+            for (int j = i; j < workers; j++) {
+                worker_release(&scheduler->workers[j]);
+            }
+            // the workers already running see stopping and exit
+            scheduler->count = i;
+            destroy_scheduler(scheduler);
+            return nullptr;
+        }
+    }
+    return scheduler;
+}
+
+void destroy_scheduler(Scheduler *scheduler) {
+    if (!scheduler) {
+        return;
+    }
+    scheduler_wait(scheduler);
+
+    mtx_lock(&scheduler->lock);
+    atomic_store(&scheduler->stopping, true);
+    cnd_broadcast(&scheduler->work);
+    mtx_unlock(&scheduler->lock);
+
+    for (int i = 0; i < scheduler->count; i++) {
+        thrd_join(scheduler->workers[i].thread, nullptr);
+        worker_release(&scheduler->workers[i]);
+    }
+    cnd_destroy(&scheduler->finished);
+    cnd_destroy(&scheduler->work);
+    mtx_destroy(&scheduler->lock);
+    free(scheduler->workers);
+    free(scheduler);
+}
+
+Isolate *scheduler_spawn(Scheduler *scheduler, VM *vm, IsolateDone done, void *data) {
+    Isolate *isolate = malloc(sizeof(Isolate));
+    if (!isolate) {
+        return nullptr;
+    }
+    *isolate = (Isolate) {.vm = vm, .done = done, .data = data, .scheduler = scheduler, .result = make_null(),
+                          .wait_fd = -1};
+    atomic_fetch_add(&scheduler->live, 1);
+    inbox_push(scheduler, isolate);
+    return isolate;
+}
+
+void scheduler_wait(Scheduler *scheduler) {
+    mtx_lock(&scheduler->lock);
+    while (atomic_load(&scheduler->live) > 0) {
+        cnd_wait(&scheduler->finished, &scheduler->lock);
+    }
+    mtx_unlock(&scheduler->lock);
+}
+
+int scheduler_workers(const Scheduler *scheduler) {
+    return scheduler->count;
+}
+
+void scheduler_worker_stats(const Scheduler *scheduler, int worker, WorkerStats *stats) {
+    Worker *w = &scheduler->workers[worker];
+    *stats = (WorkerStats) {
+        .queue_depth = deque_size(&w->deque),
+        .slices = atomic_load_explicit(&w->slices, memory_order_relaxed),
+        .completed = atomic_load_explicit(&w->completed, memory_order_relaxed),
+        .steals = atomic_load_explicit(&w->steals, memory_order_relaxed),
+        .failed_steals = atomic_load_explicit(&w->failed_steals, memory_order_relaxed),
+        .sleeps = atomic_load_explicit(&w->sleeps, memory_order_relaxed),
+        .parks = atomic_load_explicit(&w->parks, memory_order_relaxed),
+    };
+}
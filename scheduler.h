@@ -0,0 +1,56 @@
+//
+// Created by fathi on 11/24/2024.
+//
+
+#ifndef TIGE_SCHEDULER_H
+#define TIGE_SCHEDULER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "value.h"
+
+// Work-stealing scheduler.
+// A fixed pool of worker threads runs many isolates (a VM with its own context, one
+// per job) in time slices: each slice is a budget of safepoints (see vm_set_budget)
+// after which the VM suspends and goes back to the end of its worker's queue. Every
+// worker owns a deque of runnable isolates, idle workers steal from the others and
+// sleep when there is nothing left to steal.
+// Isolates run on their VM's fiber (see vm_run_fiber). One that waits, in sleep() or
+// for the timers and sockets of its event loop once its script has ended, is parked
+// on its worker without holding the thread, and queued again when it can go on. An
+// isolate is done once its script has ended and its event loop has nothing open.
+
+typedef struct VM VM;
+typedef struct Scheduler Scheduler;
+typedef struct Isolate Isolate;
+
+// called on the worker that ran the isolate to its end, the VM is not touched again
+typedef void (*IsolateDone)(VM *vm, Value result, void *data);
+
+typedef struct {
+    size_t queue_depth;         // isolates waiting in the worker's deque
+    uint64_t slices;            // time slices run
+    uint64_t completed;         // isolates run to their end
+    uint64_t steals;            // isolates taken from other workers
+    uint64_t failed_steals;     // steal attempts that found nothing or lost a race
+    uint64_t sleeps;            // times the worker ran out of work
+    uint64_t parks;             // times an isolate was parked waiting for its event loop
+} WorkerStats;
+
+// workers threads, slice safepoints per time slice, nullptr when the threads cannot start
+Scheduler *create_scheduler(int workers, int64_t slice);
+
+// wait for every isolate to finish, then stop the workers
+void destroy_scheduler(Scheduler *scheduler);
+
+// Schedule a VM with its code loaded. The scheduler owns it until done is called,
+// nullptr when out of memory.
+Isolate *scheduler_spawn(Scheduler *scheduler, VM *vm, IsolateDone done, void *data);
+
+// wait until every isolate spawned so far has finished
+void scheduler_wait(Scheduler *scheduler);
+
+int scheduler_workers(const Scheduler *scheduler);
+void scheduler_worker_stats(const Scheduler *scheduler, int worker, WorkerStats *stats);
+
+#endif //TIGE_SCHEDULER_H
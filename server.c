@@ -0,0 +1,606 @@
+//
+// Created by fathi on 11/27/2024.
+//
+
+// accept4, memmem
+#define _GNU_SOURCE
+#include "server.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include "context.h"
+#include "vm.h"
+
+#define EVENT_BATCH 128
+#define READ_CHUNK 16384
+#define MAX_HEADER_SIZE 8192
+#define MAX_BODY_SIZE (1024 * 1024)
+// a client that does not read its responses stops being read from past this much output
+#define MAX_PENDING_OUTPUT (1024 * 1024)
+
+typedef struct {
+    char *data;
+    size_t start;               // consumed (input) or written (output) bytes
+    size_t length;
+    size_t capacity;
+} Buffer;
+
+typedef struct {
+    int fd;
+    Buffer in;
+    Buffer out;
+    uint32_t events;
+    bool close_after_write;     // a response said Connection: close, or the request was malformed
+    bool peer_closed;
+} Connection;
+
+typedef struct {
+    VM *vm;
+    Function *handler;
+    Value *globals;             // registers as the top level code left them
+    StringArena strings;        // strings made while answering a request
+    int epoll_fd;
+    int listener;
+} Worker;
+
+typedef struct {
+    const char *method;
+    size_t method_length;
+    const char *path;
+    size_t path_length;
+    const char *body;
+    size_t body_length;
+    size_t size;                // of the whole request
+    bool keep_alive;
+} Request;
+
+typedef enum {
+    PARSE_INCOMPLETE,
+    PARSE_DONE,
+    PARSE_ERROR,
+} ParseResult;
+
+static volatile sig_atomic_t stop_requested;
+
+////////////////////////////////////////////////////////////////////////////////
+// Buffers
+////////////////////////////////////////////////////////////////////////////////
+
+static bool buffer_reserve(Buffer *buffer, size_t extra) {
+    // drop what was consumed before growing
+    if (buffer->start && buffer->length + extra > buffer->capacity) {
+        memmove(buffer->data, buffer->data + buffer->start, buffer->length - buffer->start);
+        buffer->length -= buffer->start;
+        buffer->start = 0;
+    }
+    if (buffer->length + extra <= buffer->capacity) {
+        return true;
+    }
+    size_t capacity = buffer->capacity ? buffer->capacity : READ_CHUNK;
+    while (capacity < buffer->length + extra) {
+        capacity *= 2;
+    }
+    char *data = realloc(buffer->data, capacity);
+    if (!data) {
+        return false;
+    }
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+
+static bool buffer_append(Buffer *buffer, const char *data, size_t length) {
+    if (!buffer_reserve(buffer, length)) {
+        return false;
+    }
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    return true;
+}
+
+static size_t buffer_pending(const Buffer *buffer) {
+    return buffer->length - buffer->start;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// HTTP
+////////////////////////////////////////////////////////////////////////////////
+
+static bool header_is(const char *line, size_t length, const char *name) {
+    const size_t name_length = strlen(name);
+    return length > name_length && line[name_length] == ':' && strncasecmp(line, name, name_length) == 0;
+}
+
+// value of a header line, without the surrounding spaces
+static const char *header_value(const char *line, size_t length, size_t *value_length) {
+    const char *value = memchr(line, ':', length) + 1;
+    const char *end = line + length;
+    while (value < end && (*value == ' ' || *value == '\t')) {
+        value++;
+    }
+    while (end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+        end--;
+    }
+    *value_length = end - value;
+    return value;
+}
+
+// parse the request at the start of data, *status is the error response on PARSE_ERROR
+static ParseResult parse_request(const char *data, size_t length, Request *request, int *status) {
+    const char *header_end = memmem(data, length < MAX_HEADER_SIZE ? length : MAX_HEADER_SIZE, "\r\n\r\n", 4);
+    if (!header_end) {
+        *status = 431;
+        return length < MAX_HEADER_SIZE ? PARSE_INCOMPLETE : PARSE_ERROR;
+    }
+    *status = 400;
+
+    // request line: METHOD SP PATH SP HTTP/1.x
+    const char *line_end = memmem(data, header_end + 2 - data, "\r\n", 2);
+    const char *space = memchr(data, ' ', line_end - data);
+    const char *second_space = space ? memchr(space + 1, ' ', line_end - space - 1) : nullptr;
+    if (!second_space || space == data || second_space == space + 1 ||
+        line_end - second_space != 9 || memcmp(second_space + 1, "HTTP/1.", 7) != 0) {
+        return PARSE_ERROR;
+    }
+    const char minor = second_space[8];
+    if (minor != '0' && minor != '1') {
+        *status = 505;
+        return PARSE_ERROR;
+    }
+    *request = (Request) {
+        .method = data,
+        .method_length = space - data,
+        .path = space + 1,
+        .path_length = second_space - space - 1,
+        .keep_alive = minor == '1',
+    };
+
+    size_t content_length = 0;
+    bool has_length = false;
+    for (const char *line = line_end + 2; line < header_end + 2;) {
+        const char *end = memmem(line, header_end + 2 - line, "\r\n", 2);
+        const size_t line_length = end - line;
+        if (!memchr(line, ':', line_length)) {
+            return PARSE_ERROR;
+        }
+        size_t value_length;
+        const char *value = header_value(line, line_length, &value_length);
+        if (header_is(line, line_length, "Content-Length")) {
+            size_t length = 0;
+            for (size_t i = 0; i < value_length; i++) {
+                if (value[i] < '0' || value[i] > '9' || length > MAX_BODY_SIZE) {
+                    *status = value[i] < '0' || value[i] > '9' ? 400 : 413;
+                    return PARSE_ERROR;
+                }
+                length = length * 10 + (value[i] - '0');
+            }
+            // lengths that disagree would let a proxy and us split the stream differently
+            if (has_length && length != content_length) {
+                *status = 400;
+                return PARSE_ERROR;
+            }
+            content_length = length;
+            has_length = true;
+        } else if (header_is(line, line_length, "Transfer-Encoding")) {
+            // chunked bodies are not supported
+            *status = 501;
+            return PARSE_ERROR;
+        } else if (header_is(line, line_length, "Connection")) {
+            if (value_length == 5 && strncasecmp(value, "close", 5) == 0) {
+                request->keep_alive = false;
+            } else if (value_length == 10 && strncasecmp(value, "keep-alive", 10) == 0) {
+                request->keep_alive = true;
+            }
+        }
+        line = end + 2;
+    }
+    if (content_length > MAX_BODY_SIZE) {
+        *status = 413;
+        return PARSE_ERROR;
+    }
+
+    const size_t header_size = header_end + 4 - data;
+    if (length - header_size < content_length) {
+        return PARSE_INCOMPLETE;
+    }
+    request->body = header_end + 4;
+    request->body_length = content_length;
+    request->size = header_size + content_length;
+    return PARSE_DONE;
+}
+
+static const char *status_text(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 400: return "Bad Request";
+        case 413: return "Payload Too Large";
+        case 431: return "Request Header Fields Too Large";
+        case 500: return "Internal Server Error";
+        case 501: return "Not Implemented";
+        case 505: return "HTTP Version Not Supported";
+        default:  return "Unknown";
+    }
+}
+
+static bool respond(Buffer *out, int status, const char *body, size_t length, bool keep_alive) {
+    char head[256];
+    const int head_length = snprintf(head, sizeof(head),
+                                     "HTTP/1.1 %d %s\r\n"
+                                     "Content-Type: text/plain; charset=utf-8\r\n"
+                                     "Content-Length: %zu\r\n"
+                                     "%s\r\n",
+                                     status, status_text(status), length, keep_alive ? "" : "Connection: close\r\n");
+    return buffer_append(out, head, head_length) && buffer_append(out, body, length);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Requests
+////////////////////////////////////////////////////////////////////////////////
+
+
+// run the handler on a VM in the state the top level code left it
+static bool handle_request(Worker *worker, const Request *request, Buffer *out) {
+    VM *vm = worker->vm;
+    memcpy(vm->register_file, worker->globals, sizeof(Value) * MAX_REGISTERS);
+    vm->registers = vm->register_file;
+    vm->stack->sp = -1;
+    vm->sp_reset = -1;
+    vm->call_stack->count = 0;
+
+    Value args[] = {
+        vm_make_string(vm, request->method, request->method_length),
+        vm_make_string(vm, request->path, request->path_length),
+        vm_make_string(vm, request->body, request->body_length),
+    };
+    Value result;
+    const bool ok = vm_call(vm, worker->handler, args, worker->handler->arity, &result);
+
+    char number[32];
+    const char *body = number;
+    switch (ok ? VALUE_TYPE(result) : VAL_NULL) {
+        case VAL_STRING:
+            body = AS_STRING(result);
+            break;
+        case VAL_INT:
+            snprintf(number, sizeof(number), "%lld", (long long) AS_INT(result));
+            break;
+        case VAL_FLOAT:
+            snprintf(number, sizeof(number), "%g", AS_FLOAT(result));
+            break;
+        case VAL_BOOL:
+            body = AS_BOOL(result) ? "true" : "false";
+            break;
+        default:
+            body = ok ? "" : status_text(500);
+            break;
+    }
+    const bool written = respond(out, ok ? 200 : 500, body, strlen(body), request->keep_alive);
+
+    // the body may be one of them, so only once it is copied out; the globals are
+    // restored before the next request, so no string of this one outlives it
+    string_arena_reset(&worker->strings);
+    return written;
+}
+
+static void close_connection(Connection *connection) {
+    close(connection->fd);
+    free(connection->in.data);
+    free(connection->out.data);
+    free(connection);
+}
+
+static bool update_events(Worker *worker, Connection *connection) {
+    // pipelined requests are answered in order: stop reading while responses wait
+    const uint32_t events = buffer_pending(&connection->out) ? EPOLLOUT : EPOLLIN;
+    if (events == connection->events) {
+        return true;
+    }
+    struct epoll_event event = {.events = events, .data.ptr = connection};
+    if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) < 0) {
+        return false;
+    }
+    connection->events = events;
+    return true;
+}
+
+// answer every complete request in the input, in order
+static bool process_requests(Worker *worker, Connection *connection) {
+    Buffer *in = &connection->in;
+    while (!connection->close_after_write && buffer_pending(in) &&
+           buffer_pending(&connection->out) < MAX_PENDING_OUTPUT) {
+        Request request;
+        int status;
+        const ParseResult result = parse_request(in->data + in->start, buffer_pending(in), &request, &status);
+        if (result == PARSE_INCOMPLETE) {
+            break;
+        }
+        if (result == PARSE_ERROR) {
+            const char *text = status_text(status);
+            connection->close_after_write = true;
+            return respond(&connection->out, status, text, strlen(text), false);
+        }
+        if (!handle_request(worker, &request, &connection->out)) {
+            return false;
+        }
+        in->start += request.size;
+        connection->close_after_write = !request.keep_alive;
+    }
+    if (in->start == in->length) {
+        in->start = in->length = 0;
+    }
+    return true;
+}
+
+// returns false once the connection is closed
+static bool flush_output(Worker *worker, Connection *connection) {
+    Buffer *out = &connection->out;
+    while (buffer_pending(out)) {
+        const ssize_t written = send(connection->fd, out->data + out->start, buffer_pending(out), MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            close_connection(connection);
+            return false;
+        }
+        out->start += (size_t) written;
+    }
+    if (!buffer_pending(out)) {
+        out->start = out->length = 0;
+        if (connection->close_after_write || connection->peer_closed) {
+            close_connection(connection);
+            return false;
+        }
+    }
+    if (!update_events(worker, connection)) {
+        close_connection(connection);
+        return false;
+    }
+    return true;
+}
+
+static void on_readable(Worker *worker, Connection *connection) {
+    Buffer *in = &connection->in;
+    for (;;) {
+        if (!buffer_reserve(in, READ_CHUNK)) {
+            close_connection(connection);
+            return;
+        }
+        const ssize_t count = recv(connection->fd, in->data + in->length, in->capacity - in->length, 0);
+        if (count > 0) {
+            in->length += (size_t) count;
+            // a full buffer may have more behind it, a partial one is all there is
+            if (in->length < in->capacity && buffer_pending(in) <= MAX_HEADER_SIZE + MAX_BODY_SIZE) {
+                break;
+            }
+            if (buffer_pending(in) > MAX_HEADER_SIZE + MAX_BODY_SIZE) {
+                break;
+            }
+            continue;
+        }
+        if (count == 0) {
+            connection->peer_closed = true;
+            break;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            break;
+        }
+        close_connection(connection);
+        return;
+    }
+
+    if (!process_requests(worker, connection)) {
+        close_connection(connection);
+        return;
+    }
+    if (connection->peer_closed && !buffer_pending(&connection->out)) {
+        close_connection(connection);
+        return;
+    }
+    flush_output(worker, connection);
+}
+
+static void on_writable(Worker *worker, Connection *connection) {
+    if (!flush_output(worker, connection)) {
+        return;
+    }
+    // responses were held back by MAX_PENDING_OUTPUT, or requests wait behind them
+    if (buffer_pending(&connection->in) && !buffer_pending(&connection->out)) {
+        if (!process_requests(worker, connection)) {
+            close_connection(connection);
+            return;
+        }
+        flush_output(worker, connection);
+    }
+}
+
+static void on_accept(Worker *worker) {
+    for (;;) {
+        const int fd = accept4(worker->listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED) {
+                perror("Error: accept");
+            }
+            return;
+        }
+        // responses go out whole, there is nothing to coalesce
+        const int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        Connection *connection = calloc(1, sizeof(Connection));
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = connection};
+        if (!connection || epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+            free(connection);
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        connection->events = EPOLLIN;
+    }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Workers
+////////////////////////////////////////////////////////////////////////////////
+
+static int open_listener(const ServeOptions *options) {
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons((uint16_t) options->port)};
+    if (inet_pton(AF_INET, options->host, &address.sin_addr) != 1) {
+        fprintf(stderr, "Error: '%s' is not an IPv4 address.\n", options->host);
+        return -1;
+    }
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    const int on = 1;
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0 ||
+        bind(fd, (struct sockaddr *) &address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        perror("Error: could not listen");
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+static int run_worker(Context *context, const ServeOptions *options, Function *handler) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    Worker worker = {.vm = ctx_get_active_vm(context), .handler = handler};
+    VM *vm = worker.vm;
+
+    // the top level code sets up what every request starts from
+    if (!options->from_snapshot) {
+        vm_execute(vm);
+    }
+    worker.globals = malloc(sizeof(Value) * MAX_REGISTERS);
+    worker.listener = open_listener(options);
+    worker.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event listen_event = {.events = EPOLLIN, .data.ptr = nullptr};
+    if (!worker.globals || worker.listener < 0 || worker.epoll_fd < 0 ||
+        epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, worker.listener, &listen_event) < 0) {
+        return 1;
+    }
+    memcpy(worker.globals, vm->register_file, sizeof(Value) * MAX_REGISTERS);
+    string_arena_init(&worker.strings);
+    vm->strings = &worker.strings;
+
+    struct epoll_event events[EVENT_BATCH];
+    for (;;) {
+        const int count = epoll_wait(worker.epoll_fd, events, EVENT_BATCH, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error: epoll_wait");
+            return 1;
+        }
+        for (int i = 0; i < count; i++) {
+            Connection *connection = events[i].data.ptr;
+            if (!connection) {
+                on_accept(&worker);
+            } else if (events[i].events & EPOLLOUT) {
+                on_writable(&worker, connection);
+            } else {
+                on_readable(&worker, connection);
+            }
+        }
+    }
+}
+
+static void request_stop([[maybe_unused]] int signal) {
+    stop_requested = 1;
+}
+
+int serve(Context *context, const ServeOptions *options) {
+    Function *handler = get_function(context, options->handler);
+    if (!handler) {
+        return 1;
+    }
+    if (handler->arity > 3) {
+        fprintf(stderr, "Error: '%s' takes at most 3 arguments (method, path, body).\n", options->handler);
+        return 1;
+    }
+
+    struct sigaction action = {.sa_handler = request_stop};
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    pid_t *pids = calloc(options->workers, sizeof(pid_t));
+    if (!pids) {
+        return 1;
+    }
+    fflush(stdout);
+    fflush(stderr);
+    int running = 0;
+    for (; running < options->workers; running++) {
+        const pid_t pid = fork();
+        if (pid < 0) {
+            perror("Error: fork");
+            stop_requested = 1;
+            break;
+        }
+        if (pid == 0) {
+            _exit(run_worker(context, options, handler));
+        }
+        pids[running] = pid;
+    }
+    if (!stop_requested) {
+        printf("Serving on http://%s:%d with %d worker(s)\n", options->host, options->port, options->workers);
+        fflush(stdout);
+    }
+
+    // a worker that exits on its own (could not listen, crashed) takes the others down
+    int status = 0;
+    bool stopping = false;
+    for (int left = running; left > 0;) {
+        if (stop_requested && !stopping) {
+            stopping = true;
+            for (int i = 0; i < running; i++) {
+                if (pids[i]) {
+                    kill(pids[i], SIGTERM);
+                }
+            }
+        }
+        int worker_status;
+        const pid_t pid = wait(&worker_status);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        for (int i = 0; i < running; i++) {
+            if (pids[i] == pid) {
+                pids[i] = 0;
+                left--;
+            }
+        }
+        if (!stopping) {
+            fprintf(stderr, "Error: worker %d exited, stopping.\n", (int) pid);
+            status = 1;
+            stop_requested = 1;
+        }
+    }
+    free(pids);
+    return status;
+}
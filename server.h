@@ -0,0 +1,33 @@
+//
+// Created by fathi on 11/27/2024.
+//
+
+#ifndef TIGE_SERVER_H
+#define TIGE_SERVER_H
+
+#include <stdbool.h>
+
+// HTTP/1.1 server mode, `tige serve app.tg`.
+// The script is compiled and decoded once, then the server forks workers. Each
+// worker listens on its own SO_REUSEPORT socket bound to the same port, so the
+// kernel spreads the connections, and runs an epoll loop over them with keep-alive
+// and pipelining. The top level code of the script runs once per worker; every
+// request then calls the handler function, handle(method, path, body) by default
+// (it may take fewer arguments), on a VM reset to the state the top level code left
+// it in. Whatever the handler returns is the body of a 200 response, a failing
+// handler answers 500.
+
+typedef struct Context Context;
+
+typedef struct {
+    const char *host;           // IPv4 address
+    int port;
+    int workers;
+    const char *handler;        // name of the script function called per request
+    bool from_snapshot;         // the globals come from an image (see snapshot.h), the top level code does not run
+} ServeOptions;
+
+// serve the code swapped into the context's VM until SIGINT or SIGTERM, returns the exit status
+int serve(Context *context, const ServeOptions *options);
+
+#endif //TIGE_SERVER_H
@@ -0,0 +1,563 @@
+//
+// Created by fathi on 11/28/2024.
+//
+
+#include "snapshot.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "context.h"
+#include "functions.h"
+#include "tige_string.h"
+#include "vm.h"
+
+// Layout, native byte order, strings are a u32 length and their bytes:
+//   magic, u32 SNAPSHOT_VERSION, u32 BYTECODE_VERSION
+//   caches:        u64 source hash, u64 source length
+//   u32 natives:   name
+//   u32 constants: string
+//   u32 segments:  u32 size, bytecode
+//   u32 functions: name, u32 arity, u32 register count, u32 segment index
+//                  (redefinitions in definition order)
+//   snapshots:     u32 globals: u8 type, i64 | f64 | u8 | string | nothing
+#define SNAPSHOT_MAGIC "TIGESNAP"
+#define CACHE_MAGIC "TIGECODE"
+#define MAGIC_SIZE 8
+
+typedef struct {
+    FILE *file;
+    bool ok;
+} Writer;
+
+typedef struct {
+    const uint8_t *data;
+    size_t size;
+    size_t offset;
+    bool ok;
+    bool quiet;                 // a cache that does not fit is a miss, not an error
+} Reader;
+
+////////////////////////////////////////////////////////////////////////////////
+// Writing
+////////////////////////////////////////////////////////////////////////////////
+
+static void write_bytes(Writer *writer, const void *data, size_t size) {
+    if (writer->ok && size && fwrite(data, 1, size, writer->file) != size) {
+        writer->ok = false;
+    }
+}
+
+static void write_u32(Writer *writer, uint32_t value) {
+    write_bytes(writer, &value, sizeof(value));
+}
+
+static void write_u64(Writer *writer, uint64_t value) {
+    write_bytes(writer, &value, sizeof(value));
+}
+
+static void write_string(Writer *writer, const char *string) {
+    const size_t length = strlen(string);
+    write_u32(writer, (uint32_t) length);
+    write_bytes(writer, string, length);
+}
+
+// segments are listed in creation order, so their ids are sorted
+static int64_t segment_index(CodeSegment **segments, size_t count, const CodeSegment *segment) {
+    size_t lo = 0, hi = count;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (segments[mid] == segment) {
+            return (int64_t) mid;
+        }
+        if (segments[mid]->segment_id < segment->segment_id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return -1;
+}
+
+// everything but the header and the globals
+static void write_program(Writer *writer, Context *context) {
+    const BytecodeBuffer *buffer = context->code;
+
+    write_u32(writer, (uint32_t) context->natives.count);
+    for (size_t i = 0; i < context->natives.count; i++) {
+        write_string(writer, context->natives.entries[i].name);
+    }
+
+    write_u32(writer, (uint32_t) buffer->constant_count);
+    for (size_t i = 0; i < buffer->constant_count; i++) {
+        write_string(writer, buffer->constants[i]->chars);
+    }
+
+    CodeSegment **segments = malloc(sizeof(CodeSegment *) * buffer->segment_count);
+    if (!segments) {
+        writer->ok = false;
+        return;
+    }
+    size_t segment_count = 0;
+    for (CodeSegment *segment = buffer->head; segment && segment_count < buffer->segment_count;
+         segment = segment->next) {
+        segments[segment_count++] = segment;
+    }
+    write_u32(writer, (uint32_t) segment_count);
+    for (size_t i = 0; i < segment_count; i++) {
+        write_u32(writer, (uint32_t) segments[i]->size);
+        write_bytes(writer, segments[i]->bytecode, segments[i]->size);
+    }
+
+    uint32_t function_count = 0;
+    FunctionEntry *entry, *tmp;
+    HASH_ITER(hh, context->functions, entry, tmp) {
+        for (const Function *fn = entry->first; fn; fn = fn->redefined_by) {
+            function_count++;
+        }
+    }
+    write_u32(writer, function_count);
+    HASH_ITER(hh, context->functions, entry, tmp) {
+        for (const Function *fn = entry->first; fn; fn = fn->redefined_by) {
+            const int64_t index = fn->segment ? segment_index(segments, segment_count, fn->segment) : -1;
+            if (index < 0) {
+                fprintf(stderr, "Error: function '%s' has no code in this buffer.\n", fn->name);
+                writer->ok = false;
+            }
+            write_string(writer, entry->name);
+            write_u32(writer, (uint32_t) fn->arity);
+            write_u32(writer, fn->register_count);
+            write_u32(writer, (uint32_t) index);
+        }
+    }
+    free(segments);
+}
+
+static bool write_global(Writer *writer, size_t index, Value value) {
+    const uint8_t type = VALUE_TYPE(value);
+    write_bytes(writer, &type, sizeof(type));
+    switch (type) {
+        case VAL_INT: {
+            const int64_t integer = AS_INT(value);
+            write_bytes(writer, &integer, sizeof(integer));
+            return true;
+        }
+        case VAL_FLOAT: {
+            const double number = AS_FLOAT(value);
+            write_bytes(writer, &number, sizeof(number));
+            return true;
+        }
+        case VAL_BOOL: {
+            const uint8_t boolean = AS_BOOL(value);
+            write_bytes(writer, &boolean, sizeof(boolean));
+            return true;
+        }
+        case VAL_STRING:
+            write_string(writer, AS_STRING(value));
+            return true;
+        case VAL_NULL:
+            return true;
+        default:
+            fprintf(stderr, "Error: global r%zu holds an object, it cannot be part of a snapshot.\n", index);
+            return false;
+    }
+}
+
+static void write_header(Writer *writer, const char *magic) {
+    write_bytes(writer, magic, MAGIC_SIZE);
+    write_u32(writer, SNAPSHOT_VERSION);
+    write_u32(writer, BYTECODE_VERSION);
+}
+
+// files are written next to their final path and renamed over it, so a process
+// mapping the old one keeps it intact and nothing ever maps a partial file
+static bool begin_write(Writer *writer, const char *path, char **temporary) {
+    const size_t size = strlen(path) + 32;
+    *temporary = malloc(size);
+    if (!*temporary) {
+        return false;
+    }
+    snprintf(*temporary, size, "%s.%ld.tmp", path, (long) getpid());
+    writer->file = fopen(*temporary, "wb");
+    writer->ok = writer->file != nullptr;
+    if (!writer->ok) {
+        free(*temporary);
+    }
+    return writer->ok;
+}
+
+static bool finish_write(Writer *writer, char *temporary, const char *path) {
+    if (fclose(writer->file) != 0) {
+        writer->ok = false;
+    }
+    if (!writer->ok || rename(temporary, path) != 0) {
+        remove(temporary);
+        writer->ok = false;
+    }
+    free(temporary);
+    return writer->ok;
+}
+
+bool snapshot_write(Context *context, const char *path) {
+    VM *vm = ctx_get_active_vm(context);
+    if (!vm || !bc_is_buffer_valid(context->code)) {
+        fprintf(stderr, "Error: nothing was compiled to snapshot.\n");
+        return false;
+    }
+    Writer writer;
+    char *temporary;
+    if (!begin_write(&writer, path, &temporary)) {
+        fprintf(stderr, "Error: could not write the snapshot '%s'.\n", path);
+        return false;
+    }
+    write_header(&writer, SNAPSHOT_MAGIC);
+    write_program(&writer, context);
+
+    // the top level window, up to its last variable that was set
+    uint32_t global_count = MAX_REGISTERS;
+    while (global_count > 0 && VALUE_TYPE(vm->register_file[global_count - 1]) == VAL_NULL) {
+        global_count--;
+    }
+    write_u32(&writer, global_count);
+    for (uint32_t i = 0; i < global_count && writer.ok; i++) {
+        writer.ok = write_global(&writer, i, vm->register_file[i]);
+    }
+
+    if (!finish_write(&writer, temporary, path)) {
+        fprintf(stderr, "Error: could not write the snapshot '%s'.\n", path);
+        return false;
+    }
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Loading
+////////////////////////////////////////////////////////////////////////////////
+
+static const uint8_t *read_bytes(Reader *reader, size_t size) {
+    if (!reader->ok || size > reader->size - reader->offset) {
+        reader->ok = false;
+        return nullptr;
+    }
+    const uint8_t *data = reader->data + reader->offset;
+    reader->offset += size;
+    return data;
+}
+
+static uint32_t read_u32(Reader *reader) {
+    uint32_t value = 0;
+    const uint8_t *data = read_bytes(reader, sizeof(value));
+    if (data) {
+        memcpy(&value, data, sizeof(value));
+    }
+    return value;
+}
+
+static uint64_t read_u64(Reader *reader) {
+    uint64_t value = 0;
+    const uint8_t *data = read_bytes(reader, sizeof(value));
+    if (data) {
+        memcpy(&value, data, sizeof(value));
+    }
+    return value;
+}
+
+// a string of the file, not null terminated
+static const char *read_string(Reader *reader, uint32_t *length) {
+    *length = read_u32(reader);
+    return (const char *) read_bytes(reader, *length);
+}
+
+static bool load_natives(Reader *reader, Context *context) {
+    const uint32_t count = read_u32(reader);
+    if (reader->ok && count != context->natives.count) {
+        if (!reader->quiet) {
+            fprintf(stderr, "Error: the snapshot was made with %u builtins, this build has %zu.\n",
+                    count, context->natives.count);
+        }
+        return false;
+    }
+    for (uint32_t i = 0; i < count && reader->ok; i++) {
+        uint32_t length;
+        const char *name = read_string(reader, &length);
+        const char *expected = context->natives.entries[i].name;
+        if (name && (strlen(expected) != length || memcmp(expected, name, length) != 0)) {
+            if (!reader->quiet) {
+                fprintf(stderr, "Error: builtin %u of the snapshot is '%.*s', this build has '%s'.\n",
+                        i, (int) length, name, expected);
+            }
+            return false;
+        }
+    }
+    return reader->ok;
+}
+
+static bool load_constants(Reader *reader, VM *vm, BytecodeBuffer *buffer) {
+    const uint32_t count = read_u32(reader);
+    for (uint32_t i = 0; i < count && reader->ok; i++) {
+        uint32_t length;
+        const char *chars = read_string(reader, &length);
+        if (chars) {
+            TString *string = new_string(vm);
+            string->chars = strndup(chars, length);
+            bc_add_constant(buffer, string);
+        }
+    }
+    return reader->ok;
+}
+
+// the segments are left in the mapping
+static bool load_segments(Reader *reader, BytecodeBuffer *buffer, CodeSegment ***segments, uint32_t *count) {
+    *count = read_u32(reader);
+    // every segment takes at least its size field, a larger count is corrupt
+    if (!reader->ok || *count == 0 || *count > (reader->size - reader->offset) / sizeof(uint32_t) ||
+        !(*segments = calloc(*count, sizeof(CodeSegment *)))) {
+        reader->ok = false;
+        return false;
+    }
+    for (uint32_t i = 0; i < *count && reader->ok; i++) {
+        const uint32_t size = read_u32(reader);
+        const uint8_t *bytecode = read_bytes(reader, size);
+        if (!bytecode) {
+            break;
+        }
+        // the buffer comes with the top level segment
+        CodeSegment *segment = buffer->head;
+        if (i > 0) {
+            segment = bc_create_segment(0);
+            buffer->tail->next = segment;
+            buffer->tail = segment;
+            buffer->segment_count++;
+        }
+        free(segment->bytecode);
+        segment->bytecode = (uint8_t *) bytecode;
+        segment->size = segment->capacity = size;
+        segment->mapped = true;
+        (*segments)[i] = segment;
+    }
+    return reader->ok;
+}
+
+static bool load_functions(Reader *reader, Context *context, CodeSegment **segments, uint32_t segment_count) {
+    const uint32_t count = read_u32(reader);
+    for (uint32_t i = 0; i < count && reader->ok; i++) {
+        uint32_t length;
+        const char *name = read_string(reader, &length);
+        const uint32_t arity = read_u32(reader);
+        const uint32_t register_count = read_u32(reader);
+        const uint32_t index = read_u32(reader);
+        // the arguments of a call are copied into the callee's registers
+        if (!reader->ok || index >= segment_count || register_count > MAX_REGISTERS || arity > register_count) {
+            reader->ok = false;
+            return false;
+        }
+        Function *function = create_function(context->vm);
+        function->props = nullptr;
+        function->metadata = nullptr;
+        function->stack = context->vm->stack;
+        function->arity = arity;
+        function->segment = segments[index];
+        function->name = strndup(name, length);
+        function->register_count = (uint16_t) register_count;
+        register_function(context, function->name, function);
+    }
+    return reader->ok;
+}
+
+static bool load_globals(Reader *reader, VM *vm) {
+    const uint32_t count = read_u32(reader);
+    if (count > MAX_REGISTERS) {
+        reader->ok = false;
+    }
+    for (uint32_t i = 0; i < count && reader->ok; i++) {
+        const uint8_t *type = read_bytes(reader, sizeof(uint8_t));
+        const uint8_t *payload;
+        switch (type ? *type : VAL_OBJECT) {
+            case VAL_INT: {
+                int64_t integer = 0;
+                if ((payload = read_bytes(reader, sizeof(integer)))) {
+                    memcpy(&integer, payload, sizeof(integer));
+                }
+                vm->register_file[i] = make_int(integer);
+                break;
+            }
+            case VAL_FLOAT: {
+                double number = 0;
+                if ((payload = read_bytes(reader, sizeof(number)))) {
+                    memcpy(&number, payload, sizeof(number));
+                }
+                vm->register_file[i] = make_float(number);
+                break;
+            }
+            case VAL_BOOL:
+                payload = read_bytes(reader, sizeof(uint8_t));
+                vm->register_file[i] = make_bool(payload && *payload);
+                break;
+            case VAL_STRING: {
+                uint32_t length;
+                const char *chars = read_string(reader, &length);
+                char *copy = chars ? strndup(chars, length) : nullptr;
+                if (copy) {
+                    vm->register_file[i] = make_string_ref(copy);
+                }
+                break;
+            }
+            case VAL_NULL:
+                vm->register_file[i] = make_null();
+                break;
+            default:
+                reader->ok = false;
+                break;
+        }
+    }
+    return reader->ok;
+}
+
+// Map a file of the given kind and check its header. Returns the mapping, nullptr
+// when the file is missing or of another kind or build.
+static void *map_file(const char *path, const char *magic, bool quiet, Reader *reader) {
+    const int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) < 0 || info.st_size < MAGIC_SIZE) {
+        if (!quiet) {
+            fprintf(stderr, "Error: could not read '%s'.\n", path);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        return nullptr;
+    }
+    const size_t size = (size_t) info.st_size;
+    void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        if (!quiet) {
+            fprintf(stderr, "Error: could not map '%s'.\n", path);
+        }
+        return nullptr;
+    }
+
+    *reader = (Reader) {.data = mapping, .size = size, .ok = true, .quiet = quiet};
+    const uint8_t *header = read_bytes(reader, MAGIC_SIZE);
+    const uint32_t version = read_u32(reader);
+    const uint32_t bytecode_version = read_u32(reader);
+    if (!reader->ok || memcmp(header, magic, MAGIC_SIZE) != 0 ||
+        version != SNAPSHOT_VERSION || bytecode_version != BYTECODE_VERSION) {
+        if (!quiet) {
+            fprintf(stderr, "Error: '%s' was not saved by this version of tige.\n", path);
+        }
+        munmap(mapping, size);
+        return nullptr;
+    }
+    return mapping;
+}
+
+// initialize context from the rest of a mapped file, which it then owns
+static bool load_program(Context *context, const char *path, void *mapping, Reader *reader, bool with_globals) {
+    // an empty program brings up the builtins and the VM
+    *context = (Context) {};
+    ctx_init(context, "", 0);
+
+    context->code = bc_buffer_create();
+    context->code->mapping = mapping;
+    context->code->mapping_size = reader->size;
+
+    CodeSegment **segments = nullptr;
+    uint32_t segment_count = 0;
+    const bool ok = load_natives(reader, context) &&
+                    load_constants(reader, context->vm, context->code) &&
+                    load_segments(reader, context->code, &segments, &segment_count) &&
+                    load_functions(reader, context, segments, segment_count) &&
+                    (!with_globals || load_globals(reader, context->vm));
+    free(segments);
+
+    if (!ok) {
+        if (!reader->ok && !reader->quiet) {
+            fprintf(stderr, "Error: '%s' is truncated or corrupt.\n", path);
+        }
+        ctx_destroy(context);
+        return false;
+    }
+    return true;
+}
+
+bool snapshot_load(Context *context, const char *path) {
+    Reader reader;
+    void *mapping = map_file(path, SNAPSHOT_MAGIC, false, &reader);
+    return mapping && load_program(context, path, mapping, &reader, true);
+}
+
+bool snapshot_is_image(const char *path) {
+    // peeking into a pipe would eat the start of a script
+    struct stat info;
+    if (stat(path, &info) < 0 || !S_ISREG(info.st_mode)) {
+        return false;
+    }
+    FILE *file = fopen(path, "rb");
+    char magic[MAGIC_SIZE];
+    const bool image = file && fread(magic, 1, sizeof(magic), file) == sizeof(magic) &&
+                       memcmp(magic, SNAPSHOT_MAGIC, MAGIC_SIZE) == 0;
+    if (file) {
+        fclose(file);
+    }
+    return image;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Code cache
+////////////////////////////////////////////////////////////////////////////////
+
+// FNV-1a, the length is part of the key as well
+static uint64_t hash_source(const char *source, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (uint8_t) source[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+char *code_cache_path(const char *source_path) {
+    const size_t length = strlen(source_path);
+    char *path = malloc(length + 5);
+    if (path) {
+        // app.tg -> app.tgc, anything else gets .tgc appended
+        const bool tg = length > 3 && strcmp(source_path + length - 3, ".tg") == 0;
+        snprintf(path, length + 5, "%s%s", source_path, tg ? "c" : ".tgc");
+    }
+    return path;
+}
+
+bool code_cache_write(Context *context, const char *path, const char *source, size_t length) {
+    if (!bc_is_buffer_valid(context->code)) {
+        return false;
+    }
+    Writer writer;
+    char *temporary;
+    if (!begin_write(&writer, path, &temporary)) {
+        return false;
+    }
+    write_header(&writer, CACHE_MAGIC);
+    write_u64(&writer, hash_source(source, length));
+    write_u64(&writer, length);
+    write_program(&writer, context);
+    return finish_write(&writer, temporary, path);
+}
+
+bool code_cache_load(Context *context, const char *path, const char *source, size_t length) {
+    Reader reader;
+    void *mapping = map_file(path, CACHE_MAGIC, true, &reader);
+    if (!mapping) {
+        return false;
+    }
+    const uint64_t hash = read_u64(&reader);
+    const uint64_t cached_length = read_u64(&reader);
+    if (!reader.ok || hash != hash_source(source, length) || cached_length != length) {
+        munmap(mapping, reader.size);
+        return false;
+    }
+    return load_program(context, path, mapping, &reader, false);
+}
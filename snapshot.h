@@ -0,0 +1,54 @@
+//
+// Created by fathi on 11/28/2024.
+//
+
+#ifndef TIGE_SNAPSHOT_H
+#define TIGE_SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Saved code.
+// The compiled form of a script (bytecode, constant pool, functions) holds no
+// addresses, so it is written to disk as it is and mapped back read only: the
+// segments of a loaded buffer point into the mapping, which processes loading the
+// same file share. Loading skips lexing, parsing and compiling, what is left is
+// decoding the bytecode (see vm_swap_code_buffer).
+//
+// Two kinds of files hold it:
+// - code caches, app.tgc next to app.tg, keyed by a hash of the source: the
+//   tige executable compiles a script only when its cache is missing or stale
+// - snapshots, images of a context once its top level code has run, which also
+//   hold the globals (ints, floats, bools, strings and null; open timers and
+//   sockets are not part of an image)
+//
+// Both belong to the build that wrote them: the format and the bytecode encoding
+// are checked with SNAPSHOT_VERSION and BYTECODE_VERSION, and the builtins must be
+// registered under the same indices.
+
+#define SNAPSHOT_VERSION 2
+
+typedef struct Context Context;
+
+// write the state of the context, its VM included, to path
+bool snapshot_write(Context *context, const char *path);
+
+// Initialize context from an image, like ctx_init and ctx_start_parsing do from
+// source, with the globals already set. The code still has to be swapped into the VM.
+// On error nothing is left to destroy.
+bool snapshot_load(Context *context, const char *path);
+
+// whether path starts like an image
+bool snapshot_is_image(const char *path);
+
+// path of the code cache of a source file, to free
+char *code_cache_path(const char *source_path);
+
+// save the compiled code of the context as the cache of source
+bool code_cache_write(Context *context, const char *path, const char *source, size_t length);
+
+// Initialize context from the cache of source, like ctx_init and ctx_start_parsing.
+// False when there is no cache for this source and build, nothing is left to destroy then.
+bool code_cache_load(Context *context, const char *path, const char *source, size_t length);
+
+#endif //TIGE_SNAPSHOT_H
@@ -0,0 +1,164 @@
+# tige opcode profile: <count> <opcode> <opcode> [<opcode>]
+28022396 INC_REG LT_RR_JMP
+23020603 ADD_RRR INC_REG
+23020572 ADD_RRR INC_REG LT_RR_JMP
+8000000 MUL_RRI ADD_RRR
+5022076 SAVE_SP LE_RI_JMP
+5002075 RESET_SP INC_REG
+5001791 RESET_SP INC_REG LT_RR_JMP
+5000000 ADD_RRR SUB_RRR
+5000000 SUB_RRR SAVE_SP
+5000000 ADD_RRR SUB_RRR SAVE_SP
+5000000 SUB_RRR SAVE_SP LE_RI_JMP
+5000000 MUL_RRI ADD_RRR SUB_RRR
+3000000 MUL_RRI ADD_RRR INC_REG
+241688 JMP RESET_SP
+241683 MOV_RI JMP
+241683 LE_RI_JMP MOV_RI
+241683 JMP RESET_SP INC_REG
+241683 MOV_RI JMP RESET_SP
+241683 LE_RI_JMP MOV_RI JMP
+241683 SAVE_SP LE_RI_JMP MOV_RI
+20005 SAVE_SP NE_RI_JMP
+20001 RESET_SP SAVE_SP
+20000 SUB_RRR ADD_RRR
+20000 ADD_RRI SAVE_SP
+20000 MUL_RRI ADD_RRI
+20000 RESET_SP SUB_RRR
+20000 SUB_RRR ADD_RRR INC_REG
+20000 ADD_RRI SAVE_SP LE_RI_JMP
+20000 MUL_RRI ADD_RRI SAVE_SP
+20000 RESET_SP SUB_RRR ADD_RRR
+20000 RESET_SP SAVE_SP NE_RI_JMP
+19966 ADD_RRI JMP
+19966 LE_RI_JMP ADD_RRI
+19966 LE_RI_JMP ADD_RRI JMP
+19966 SAVE_SP LE_RI_JMP ADD_RRI
+2075 ADD_RRR SAVE_SP
+2075 ADD_RRI RESET_SP
+2075 ADD_RRR SAVE_SP LE_RI_JMP
+2075 ADD_RRI RESET_SP INC_REG
+111 MOV_RI MOV_RI
+97 MOV_RI GE_RR_JMP
+97 MOV_RI MOV_RI GE_RR_JMP
+96 GE_RR_JMP ADD_RRR
+93 MOV_RI GE_RR_JMP ADD_RRR
+88 LT_RR_JMP MOV_RI
+88 LT_RR_JMP MOV_RI MOV_RI
+79 INC_REG LT_RR_JMP MOV_RI
+61 GE_RR_JMP ADD_RRR SAVE_SP
+34 SUB_RRI RESET_SP
+34 SUB_RRI RESET_SP SAVE_SP
+34 GE_RR_JMP ADD_RRR INC_REG
+30 ADD_RRR MOV_RR
+30 MOV_RR INC_REG
+30 MOV_RR MOV_RR
+30 ADD_RRR MOV_RR MOV_RR
+30 MOV_RR INC_REG LT_RR_JMP
+30 MOV_RR MOV_RR INC_REG
+24 CALL POP
+24 LOAD_STRING CALL
+24 LOAD_STRING CALL POP
+12 MOV_RI MOV_RI MOV_RI
+10 POP JMP
+10 CALL POP JMP
+6 LOAD_CONST_INT RETURN
+6 NE_RI_JMP LOAD_STRING
+6 POP LOAD_CONST_INT
+6 POP HALT
+6 CALL POP LOAD_CONST_INT
+6 CALL POP HALT
+6 NE_RI_JMP LOAD_STRING CALL
+6 POP LOAD_CONST_INT RETURN
+6 SAVE_SP NE_RI_JMP LOAD_STRING
+5 LT_RR_JMP SAVE_SP
+5 INC_REG LT_RR_JMP SAVE_SP
+5 POP JMP RESET_SP
+4 LT_RR_JMP LOAD_STRING
+4 RESET_SP HALT
+4 INC_REG LT_RR_JMP LOAD_STRING
+4 LT_RR_JMP LOAD_STRING CALL
+4 LT_RR_JMP SAVE_SP NE_RI_JMP
+3 LOAD_CONST_FLOAT STORE_VAR
+3 GE_RR_JMP MUL_RRI
+3 POP LOAD_STRING
+3 POP INC_REG
+3 MOV_RI GE_RR_JMP MUL_RRI
+3 POP LOAD_STRING CALL
+3 POP INC_REG LT_RR_JMP
+2 STORE_VAR NE_RR_JMP
+2 STORE_VAR SAVE_SP
+2 LOAD_STRING STORE_VAR
+2 MOV_RR GE_RR_JMP
+2 MOV_RI MOV_RR
+2 NE_RR_JMP LOAD_STRING
+2 POP MOV_RI
+2 RESET_SP LOAD_STRING
+2 STORE_VAR NE_RR_JMP LOAD_STRING
+2 JMP RESET_SP LOAD_STRING
+2 MOV_RR GE_RR_JMP ADD_RRR
+2 MOV_RI MOV_RR GE_RR_JMP
+2 NE_RR_JMP LOAD_STRING CALL
+2 GE_RR_JMP MUL_RRI ADD_RRR
+2 POP MOV_RI MOV_RI
+2 RESET_SP LOAD_STRING CALL
+1 LOAD_CONST_INT CALL
+1 LOAD_VAR JMP_IF_FALSE
+1 LOAD_VAR RETURN
+1 LOAD_VAR MOV_RI
+1 STORE_VAR LOAD_STRING
+1 STORE_VAR LOAD_CONST_FLOAT
+1 JMP_IF_FALSE LOAD_STRING
+1 LOAD_BOOL STORE_VAR
+1 ADD_RRR LOAD_CONST_FLOAT
+1 ADD_RRI MOV_RI
+1 LT_RR_JMP LOAD_CONST_INT
+1 LT_RR_JMP LOAD_VAR
+1 LT_RR_JMP LOAD_BOOL
+1 GE_RR_JMP CALL
+1 LE_RI_JMP LOAD_STRING
+1 POP SAVE_SP
+1 SAVE_SP LOAD_VAR
+1 SAVE_SP LOAD_STRING
+1 SAVE_SP ADD_RRR
+1 RESET_SP CALL
+1 RESET_SP ADD_RRI
+1 LOAD_VAR JMP_IF_FALSE LOAD_STRING
+1 LOAD_VAR MOV_RI MOV_RI
+1 STORE_VAR LOAD_STRING STORE_VAR
+1 STORE_VAR LOAD_CONST_FLOAT STORE_VAR
+1 STORE_VAR SAVE_SP LOAD_VAR
+1 STORE_VAR SAVE_SP ADD_RRR
+1 JMP RESET_SP CALL
+1 JMP RESET_SP SUB_RRR
+1 JMP RESET_SP SAVE_SP
+1 JMP_IF_FALSE LOAD_STRING CALL
+1 CALL POP MOV_RI
+1 CALL POP SAVE_SP
+1 LOAD_STRING STORE_VAR LOAD_STRING
+1 LOAD_STRING STORE_VAR NE_RR_JMP
+1 LOAD_BOOL STORE_VAR SAVE_SP
+1 INC_REG LT_RR_JMP LOAD_CONST_INT
+1 INC_REG LT_RR_JMP LOAD_VAR
+1 INC_REG LT_RR_JMP LOAD_BOOL
+1 LOAD_CONST_FLOAT STORE_VAR LOAD_CONST_FLOAT
+1 LOAD_CONST_FLOAT STORE_VAR NE_RR_JMP
+1 LOAD_CONST_FLOAT STORE_VAR SAVE_SP
+1 ADD_RRR LOAD_CONST_FLOAT STORE_VAR
+1 ADD_RRI MOV_RI MOV_RR
+1 MOV_RI MOV_RI MOV_RR
+1 MOV_RI GE_RR_JMP CALL
+1 LT_RR_JMP LOAD_CONST_INT CALL
+1 LT_RR_JMP LOAD_VAR RETURN
+1 LT_RR_JMP LOAD_BOOL STORE_VAR
+1 LT_RR_JMP SAVE_SP LE_RI_JMP
+1 GE_RR_JMP ADD_RRR MOV_RR
+1 GE_RR_JMP MUL_RRI ADD_RRI
+1 LE_RI_JMP LOAD_STRING CALL
+1 POP SAVE_SP NE_RI_JMP
+1 SAVE_SP LOAD_VAR JMP_IF_FALSE
+1 SAVE_SP LOAD_STRING STORE_VAR
+1 SAVE_SP ADD_RRR LOAD_CONST_FLOAT
+1 SAVE_SP LE_RI_JMP LOAD_STRING
+1 RESET_SP ADD_RRI MOV_RI
+1 RESET_SP SAVE_SP LOAD_STRING
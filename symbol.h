@@ -22,6 +22,7 @@ typedef struct Symbol {
             char* var_type;
             bool is_initialized;
             uint16_t index;
+            uint8_t function_depth;     // 0 for globals, registers are relative to that function's frame
         } variable;
 
         // For functions
@@ -29,6 +30,7 @@ typedef struct Symbol {
             size_t arity;
             uint16_t arg_b;
             uint16_t arg_e;
+            int32_t native;     // index in the native table, -1 for bytecode functions
         } function;
     } data;
 
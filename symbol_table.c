@@ -24,6 +24,8 @@ static Scope* create_scope(Scope* parent) {
 
     scope->parent = parent;
     scope->variable_index_counter = parent ? parent->variable_index_counter + 1 : 0;
+    scope->is_function = false;
+    scope->saved_frame_size = 0;
     return scope;
 }
 
@@ -36,6 +38,8 @@ SymbolTable* create_symbol_table() {
     }
     table->current_scope = create_scope(nullptr); // global scope has no parent
     table->level = 0;
+    table->function_depth = 0;
+    table->frame_size = 0;
     return table;
 }
 
@@ -81,6 +85,24 @@ void enter_scope(SymbolTable* table) {
     table->level++;
 }
 
+// Enter the scope of a function body
+void enter_function_scope(SymbolTable* table) {
+    if (!table) return;
+    enter_scope(table);
+    Scope* scope = table->current_scope;
+    scope->variable_index_counter = 0;
+    scope->is_function = true;
+    scope->saved_frame_size = table->frame_size;
+    table->frame_size = 0;
+    table->function_depth++;
+}
+
+void reserve_register(SymbolTable* table, uint16_t index) {
+    if (table && index >= table->frame_size) {
+        table->frame_size = index + 1;
+    }
+}
+
 // Exit the current scope
 void exit_scope(SymbolTable* table) {
     if (!table || !table->current_scope) return;
@@ -89,6 +111,10 @@ void exit_scope(SymbolTable* table) {
         return;
     }
     Scope* temp = table->current_scope;
+    if (temp->is_function) {
+        table->frame_size = temp->saved_frame_size;
+        table->function_depth--;
+    }
     table->current_scope = table->current_scope->parent;
     table->level--;
     destroy_scope(temp);
@@ -122,6 +148,8 @@ int64_t add_symbol(SymbolTable* table, const char* name, SymbolType type) {
     if (type == SYMBOL_VARIABLE) {
         new_symbol->data.variable.is_initialized = false;
         new_symbol->data.variable.index = scope->variable_index_counter++;
+        new_symbol->data.variable.function_depth = table->function_depth;
+        reserve_register(table, new_symbol->data.variable.index);
     }
 
     // Chaining
@@ -154,6 +182,7 @@ int64_t add_function_symbol(SymbolTable* table, const char* name, size_t arity)
     new_symbol->name = strdup(name);
     new_symbol->type = SYMBOL_FUNCTION;
     new_symbol->data.function.arity = arity;
+    new_symbol->data.function.native = -1;
     new_symbol->next =  scope->hash_table[index];
     scope->hash_table[index] = new_symbol;
 
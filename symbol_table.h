@@ -15,12 +15,19 @@ typedef struct Scope {
     size_t capacity;
     struct Scope* parent;
     uint16_t variable_index_counter;
+    // function bodies start a new register window
+    bool is_function;
+    uint16_t saved_frame_size;
 } Scope;
 
 typedef struct SymbolTable {
     Scope* current_scope;
     // the current nesting level
     uint8_t level;
+    // number of enclosing function bodies
+    uint8_t function_depth;
+    // registers used so far by the innermost function (or the top level code)
+    uint16_t frame_size;
 } SymbolTable;
 
 // Create a new symbol table (with global scope)
@@ -32,6 +39,13 @@ void destroy_symbol_table(SymbolTable* table);
 // Enter a new scope
 void enter_scope(SymbolTable* table);
 
+// Enter the scope of a function body, its variables are numbered from 0 in the
+// callee's register window
+void enter_function_scope(SymbolTable* table);
+
+// Make sure the current frame covers the register `index`
+void reserve_register(SymbolTable* table, uint16_t index);
+
 // Exit the current scope
 void exit_scope(SymbolTable* table);
 
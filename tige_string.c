@@ -8,16 +8,16 @@
 #include <stdlib.h>
 #include <string.h>
 
-TString* new_string(void)
+TString* new_string(VM* vm)
 {
-    const auto string = (TString*)vm_malloc(sizeof(TString));
+    const auto string = (TString*)vm_malloc(vm, sizeof(TString));
     if (!string)
     {
-        vm_free(string);
+        vm_free(vm, string);
         return nullptr;
     }
 
-    object_init((TObject*)string);
+    object_init(vm, (TObject*)string);
     return string;
 }
 
@@ -27,9 +27,9 @@ void free_string(TString* str)
     object_free((TObject*)str);
 }
 
-TString* string_copy(const TString* str)
+TString* string_copy(VM* vm, const TString* str)
 {
-    const auto string = new_string();
+    const auto string = new_string(vm);
     string->chars = str->chars;
     return string;
 }
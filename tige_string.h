@@ -10,6 +10,7 @@
 typedef struct TObjectMetadata TObjectMetadata;
 typedef struct TObjectProperty TObjectProperty;
 typedef struct TString TString;
+typedef struct VM VM;
 
 struct TString
 {
@@ -18,12 +19,12 @@ struct TString
     char* chars;
 };
 
-TString* new_string(void);
+TString* new_string(VM* vm);
 void free_string(TString* str);
 
 size_t string_length(TString* str);
 bool string_equals(const TString* str1, const TString* str2);
-TString* string_copy(const TString* str);
+TString* string_copy(VM* vm, const TString* str);
 TString* string_concat(TString* str1, TString* str2);
 TString* string_at(TString* str, size_t index);
 TString* string_slice(TString* str, size_t start, size_t end);
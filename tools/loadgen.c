@@ -0,0 +1,236 @@
+//
+// Created by fathi on 11/27/2024.
+//
+// Load generator for `tige serve` (see server.h).
+// Opens keep-alive connections to a server on the loopback interface, keeps
+// `pipeline` GET requests in flight on each of them for the given number of
+// seconds and reports the requests per second and the latency percentiles.
+//
+// usage: tige_loadgen <port> [connections] [seconds] [pipeline] [path]
+//
+
+// memmem
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#define MAX_PIPELINE 64
+#define READ_BUFFER_SIZE 65536
+// latencies are counted per microsecond up to this, slower ones in the last bucket
+#define HISTOGRAM_SIZE 1000000
+
+typedef struct {
+    int fd;
+    char buffer[READ_BUFFER_SIZE];
+    size_t length;
+    uint64_t sent_at[MAX_PIPELINE];    // ring of the requests in flight, oldest at head
+    int head;
+    int in_flight;
+} Connection;
+
+static uint64_t histogram[HISTOGRAM_SIZE];
+
+static uint64_t now_ns(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000ull + (uint64_t) time.tv_nsec;
+}
+
+static bool send_all(int fd, const char *data, size_t length) {
+    while (length) {
+        const ssize_t written = send(fd, data, length, MSG_NOSIGNAL);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        data += written;
+        length -= (size_t) written;
+    }
+    return true;
+}
+
+// send count requests in one write
+static bool send_requests(Connection *connection, const char *request, size_t length, int count) {
+    char batch[MAX_PIPELINE * 256];
+    const uint64_t now = now_ns();
+    for (int i = 0; i < count; i++) {
+        memcpy(batch + i * length, request, length);
+        connection->sent_at[(connection->head + connection->in_flight + i) % MAX_PIPELINE] = now;
+    }
+    connection->in_flight += count;
+    return send_all(connection->fd, batch, length * count);
+}
+
+// size of the response at the start of data, 0 while it is incomplete
+static size_t response_size(const char *data, size_t length, bool *ok) {
+    const char *header_end = memmem(data, length, "\r\n\r\n", 4);
+    if (!header_end) {
+        return 0;
+    }
+    size_t content_length = 0;
+    const char *field = memmem(data, header_end - data, "Content-Length:", 15);
+    if (field) {
+        content_length = strtoull(field + 15, nullptr, 10);
+    }
+    const size_t size = header_end + 4 - data + content_length;
+    *ok = length >= 12 && memcmp(data + 9, "200", 3) == 0;
+    return size <= length ? size : 0;
+}
+
+static int connect_to(uint16_t port) {
+    struct sockaddr_in address = {.sin_family = AF_INET, .sin_port = htons(port)};
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof(address)) < 0) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        return -1;
+    }
+    const int nodelay = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    return fd;
+}
+
+static uint64_t percentile(uint64_t total, double fraction) {
+    const uint64_t rank = (uint64_t) (total * fraction);
+    uint64_t seen = 0;
+    for (size_t i = 0; i < HISTOGRAM_SIZE; i++) {
+        seen += histogram[i];
+        if (seen > rank) {
+            return i;
+        }
+    }
+    return HISTOGRAM_SIZE - 1;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <port> [connections] [seconds] [pipeline] [path]\n", argv[0]);
+        return 1;
+    }
+    const long port = strtol(argv[1], nullptr, 10);
+    const int connections = argc > 2 ? atoi(argv[2]) : 64;
+    const double seconds = argc > 3 ? atof(argv[3]) : 5.0;
+    const int pipeline = argc > 4 ? atoi(argv[4]) : 1;
+    const char *path = argc > 5 ? argv[5] : "/";
+    if (port <= 0 || port > 65535 || connections <= 0 || seconds <= 0 || pipeline <= 0 || pipeline > MAX_PIPELINE) {
+        fprintf(stderr, "Error: invalid arguments (pipeline is at most %d).\n", MAX_PIPELINE);
+        return 1;
+    }
+
+    char request[256];
+    const int request_length = snprintf(request, sizeof(request),
+                                        "GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n", path);
+    if (request_length <= 0 || (size_t) request_length >= sizeof(request)) {
+        fprintf(stderr, "Error: the path is too long.\n");
+        return 1;
+    }
+
+    const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    Connection *pool = calloc(connections, sizeof(Connection));
+    if (epoll_fd < 0 || !pool) {
+        fprintf(stderr, "Error: out of resources.\n");
+        return 1;
+    }
+    for (int i = 0; i < connections; i++) {
+        pool[i].fd = connect_to((uint16_t) port);
+        struct epoll_event event = {.events = EPOLLIN, .data.ptr = &pool[i]};
+        if (pool[i].fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pool[i].fd, &event) < 0) {
+            fprintf(stderr, "Error: could not connect to 127.0.0.1:%ld.\n", port);
+            return 1;
+        }
+    }
+
+    const uint64_t start = now_ns();
+    const uint64_t end = start + (uint64_t) (seconds * 1e9);
+    for (int i = 0; i < connections; i++) {
+        if (!send_requests(&pool[i], request, request_length, pipeline)) {
+            fprintf(stderr, "Error: could not send.\n");
+            return 1;
+        }
+    }
+
+    uint64_t completed = 0;
+    uint64_t failed = 0;
+    int open = connections;
+    bool sending = true;
+    struct epoll_event events[256];
+    while (open > 0) {
+        const int count = epoll_wait(epoll_fd, events, 256, 100);
+        const uint64_t now = now_ns();
+        if (now >= end) {
+            sending = false;
+        }
+        for (int i = 0; i < count; i++) {
+            Connection *connection = events[i].data.ptr;
+            const ssize_t read = recv(connection->fd, connection->buffer + connection->length,
+                                      READ_BUFFER_SIZE - connection->length, MSG_DONTWAIT);
+            if (read <= 0) {
+                if (read < 0 && (errno == EAGAIN || errno == EINTR)) {
+                    continue;
+                }
+                // the server closed it, what was in flight is lost
+                failed += connection->in_flight;
+                connection->in_flight = 0;
+            } else {
+                connection->length += (size_t) read;
+            }
+
+            const uint64_t received = now_ns();
+            size_t consumed = 0;
+            int answered = 0;
+            bool ok;
+            for (size_t size; connection->in_flight &&
+                              (size = response_size(connection->buffer + consumed, connection->length - consumed, &ok));
+                 consumed += size) {
+                const uint64_t latency = (received - connection->sent_at[connection->head]) / 1000;
+                histogram[latency < HISTOGRAM_SIZE ? latency : HISTOGRAM_SIZE - 1]++;
+                connection->head = (connection->head + 1) % MAX_PIPELINE;
+                connection->in_flight--;
+                answered++;
+                completed += ok;
+                failed += !ok;
+            }
+            memmove(connection->buffer, connection->buffer + consumed, connection->length - consumed);
+            connection->length -= consumed;
+
+            if (read > 0 && sending && answered) {
+                if (!send_requests(connection, request, request_length, answered)) {
+                    failed += connection->in_flight;
+                    connection->in_flight = 0;
+                }
+            }
+            if (connection->in_flight == 0 && (read <= 0 || !sending)) {
+                close(connection->fd);
+                open--;
+            }
+        }
+    }
+    const double elapsed = (double) (now_ns() - start) / 1e9;
+
+    printf("%llu requests in %.2fs over %d connections (pipeline %d), %llu failed\n",
+           (unsigned long long) completed, elapsed, connections, pipeline, (unsigned long long) failed);
+    printf("%.0f req/s\n", completed / elapsed);
+    if (completed + failed) {
+        printf("latency p50 %llu us, p99 %llu us, p99.9 %llu us\n",
+               (unsigned long long) percentile(completed + failed, 0.50),
+               (unsigned long long) percentile(completed + failed, 0.99),
+               (unsigned long long) percentile(completed + failed, 0.999));
+    }
+    free(pool);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,227 @@
+//
+// Created by fathi on 11/16/2024.
+//
+// Build-time superinstruction generator.
+// Reads an opcode profile (written by `tige --profile-ops <file> <script>`, see
+// opcode_profile.c) and emits superinstructions.h: the X-macro list of the most
+// profitable opcode sequences, which vm.c expands into fused handlers and into
+// the peephole patterns applied when a stream is loaded.
+//
+// usage: tige_supergen <profile> <output header> [max superinstructions]
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define DEFAULT_MAX_SUPERINSTRUCTIONS 24
+#define MAX_SEQUENCE 3
+
+// Opcodes that have a STEP_ fragment in vm.c (INLINED_OPCODES), branches may only end a sequence
+typedef struct {
+    const char *name;
+    bool branch;
+} Fusable;
+
+static const Fusable fusable[] = {
+        {"NOPE",             false},
+        {"LOAD_CONST_INT",   false},
+        {"LOAD_CONST_FLOAT", false},
+        {"LOAD_BOOL",        false},
+        {"LOAD_VAR",         false},
+        {"STORE_VAR",        false},
+        {"LOAD_GLOBAL",      false},
+        {"STORE_GLOBAL",     false},
+        {"ADD",              false},
+        {"SUB",              false},
+        {"MUL",              false},
+        {"EQUAL",            false},
+        {"NOT_EQUAL",        false},
+        {"LESS_THAN",        false},
+        {"GREATER_THAN",     false},
+        {"LESS_EQUAL",       false},
+        {"GREATER_EQUAL",    false},
+        {"JMP",              true},
+        {"JMP_IF_TRUE",      true},
+        {"JMP_IF_FALSE",     true},
+        {"POP",              false},
+        {"SAVE_SP",          false},
+        {"RESET_SP",         false},
+        {"INC_REG",          false},
+        {"ADD_RRR",          false},
+        {"SUB_RRR",          false},
+        {"MUL_RRR",          false},
+        {"ADD_RRI",          false},
+        {"SUB_RRI",          false},
+        {"MUL_RRI",          false},
+        {"MOV_RR",           false},
+        {"MOV_RI",           false},
+        {"EQ_RR_JMP",        true},
+        {"NE_RR_JMP",        true},
+        {"LT_RR_JMP",        true},
+        {"LE_RR_JMP",        true},
+        {"GT_RR_JMP",        true},
+        {"GE_RR_JMP",        true},
+        {"EQ_RI_JMP",        true},
+        {"NE_RI_JMP",        true},
+        {"LT_RI_JMP",        true},
+        {"LE_RI_JMP",        true},
+        {"GT_RI_JMP",        true},
+        {"GE_RI_JMP",        true},
+};
+
+typedef struct {
+    char names[MAX_SEQUENCE][32];
+    int length;
+    uint64_t count;
+    uint64_t saved;     // dispatches saved: count * (length - 1)
+} Sequence;
+
+static const Fusable *find_fusable(const char *name) {
+    for (size_t i = 0; i < sizeof(fusable) / sizeof(fusable[0]); i++) {
+        if (strcmp(fusable[i].name, name) == 0) {
+            return &fusable[i];
+        }
+    }
+    return nullptr;
+}
+
+// every opcode must have a fragment and only the last one may change the pc
+static bool is_fusable(const Sequence *sequence) {
+    for (int i = 0; i < sequence->length; i++) {
+        const Fusable *op = find_fusable(sequence->names[i]);
+        if (!op || (op->branch && i != sequence->length - 1)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static int by_saved_dispatches(const void *a, const void *b) {
+    const Sequence *x = a, *y = b;
+    if (x->saved != y->saved) {
+        return x->saved < y->saved ? 1 : -1;
+    }
+    return y->length - x->length;
+}
+
+// longer patterns are matched first, ties by profit
+static int by_match_priority(const void *a, const void *b) {
+    const Sequence *x = a, *y = b;
+    if (x->length != y->length) {
+        return y->length - x->length;
+    }
+    return by_saved_dispatches(a, b);
+}
+
+static bool same_sequence(const Sequence *a, const Sequence *b) {
+    if (a->length != b->length) {
+        return false;
+    }
+    for (int i = 0; i < a->length; i++) {
+        if (strcmp(a->names[i], b->names[i]) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3 || argc > 4) {
+        fprintf(stderr, "Usage: %s <profile> <output header> [max superinstructions]\n", argv[0]);
+        return 1;
+    }
+
+    const int max = argc == 4 ? atoi(argv[3]) : DEFAULT_MAX_SUPERINSTRUCTIONS;
+
+    FILE *in = fopen(argv[1], "r");
+    if (!in) {
+        fprintf(stderr, "Error: Could not open profile '%s'\n", argv[1]);
+        return 1;
+    }
+
+    Sequence *sequences = nullptr;
+    size_t count = 0, capacity = 0;
+    char line[256];
+    while (fgets(line, sizeof(line), in)) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+
+        Sequence sequence = {};
+        unsigned long long hits;
+        const int fields = sscanf(line, "%llu %31s %31s %31s", &hits,
+                                  sequence.names[0], sequence.names[1], sequence.names[2]);
+        if (fields < 3) {
+            fprintf(stderr, "Error: malformed profile line: %s", line);
+            fclose(in);
+            return 1;
+        }
+        sequence.length = fields - 1;
+        sequence.count = hits;
+        sequence.saved = hits * (uint64_t) (sequence.length - 1);
+
+        if (!is_fusable(&sequence)) {
+            continue;
+        }
+
+        // merged profiles may list a sequence more than once
+        bool merged = false;
+        for (size_t i = 0; i < count && !merged; i++) {
+            if (same_sequence(&sequences[i], &sequence)) {
+                sequences[i].count += sequence.count;
+                sequences[i].saved += sequence.saved;
+                merged = true;
+            }
+        }
+        if (merged) {
+            continue;
+        }
+
+        if (count >= capacity) {
+            capacity = capacity == 0 ? 64 : capacity * 2;
+            sequences = realloc(sequences, sizeof(Sequence) * capacity);
+            if (!sequences) {
+                fprintf(stderr, "Failed to allocate memory for the profile.\n");
+                return 1;
+            }
+        }
+        sequences[count++] = sequence;
+    }
+    fclose(in);
+
+    qsort(sequences, count, sizeof(Sequence), by_saved_dispatches);
+    const size_t selected = count < (size_t) max ? count : (size_t) max;
+    qsort(sequences, selected, sizeof(Sequence), by_match_priority);
+
+    FILE *out = fopen(argv[2], "w");
+    if (!out) {
+        fprintf(stderr, "Error: Could not write '%s'\n", argv[2]);
+        return 1;
+    }
+
+    fprintf(out, "// Generated by tige_supergen from %s, do not edit.\n", argv[1]);
+    fprintf(out, "// X(id, name, length, opcode, opcode, opcode), in match priority order\n\n");
+    fprintf(out, "#ifndef TIGE_SUPERINSTRUCTIONS_H\n#define TIGE_SUPERINSTRUCTIONS_H\n\n");
+    fprintf(out, "#define TIGE_SUPERINSTRUCTION_COUNT %zu\n\n", selected);
+    fprintf(out, "#define TIGE_SUPERINSTRUCTIONS(X)");
+    for (size_t i = 0; i < selected; i++) {
+        const Sequence *sequence = &sequences[i];
+        fprintf(out, " \\\n    X(%zu, ", i);
+        for (int k = 0; k < sequence->length; k++) {
+            fprintf(out, "%s%s", k ? "__" : "", sequence->names[k]);
+        }
+        fprintf(out, ", %d", sequence->length);
+        for (int k = 0; k < MAX_SEQUENCE; k++) {
+            fprintf(out, ", OP_%s", k < sequence->length ? sequence->names[k] : "NOPE");
+        }
+        fprintf(out, ")  /* %llu */", (unsigned long long) sequence->count);
+    }
+    fprintf(out, "\n\n#endif //TIGE_SUPERINSTRUCTIONS_H\n");
+    fclose(out);
+
+    free(sequences);
+    return 0;
+}
@@ -3,58 +3,43 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
 #include "value.h"
 
 #include <string.h>
 
-Value make_int(int64_t x) {
-    Value value;
-    value.type = VAL_INT;
-    value.as_integer = x;
-    return value;
-}
-
-Value make_bool(bool x) {
-    Value value;
-    value.type = VAL_BOOL;
-    value.as_boolean = x;
-    return value;
-}
-
-Value make_float(double x) {
-    Value value;
-    value.type = VAL_FLOAT;
-    value.as_float = x;
-    return value;
-}
-
-Value make_null() {
-    Value value;
-    value.type = VAL_NULL;
-    value.as_ptr = 0x00;
-    return value;
+Value make_string(const char *x) {
+    return make_string_ref(strdup(x)); // TODO: free this
 }
 
-Value make_string(const char *x) {
+Value make_string_ref(char *chars) {
+#ifdef TIGE_NAN_BOXING
+    if ((uintptr_t) chars > NAN_BOX_PAYLOAD_MASK) {
+        fprintf(stderr, "Error: string at %p does not fit in a NaN-boxed value.\n", (void *) chars);
+        exit(EXIT_FAILURE);
+    }
+    return NAN_BOX(VAL_STRING, (uintptr_t) chars);
+#else
     Value value;
     value.type = VAL_STRING;
-    value.as_string = strdup(x); // TODO: free this
+    value.as_string = chars;
     return value;
+#endif
 }
 
 void print_value(Value value) {
-    switch (value.type) {
+    switch (VALUE_TYPE(value)) {
         case VAL_INT:
-            printf("INT(%lld)", value.as_integer);
+            printf("INT(%lld)", (long long) AS_INT(value));
             break;
         case VAL_BOOL:
-            printf("BOOL(%s)", value.as_boolean ? "true" : "false");
+            printf("BOOL(%s)", AS_BOOL(value) ? "true" : "false");
             break;
         case VAL_STRING:
-            printf("STRING(\"%s\")", value.as_string);
+            printf("STRING(\"%s\")", AS_STRING(value));
             break;
         case VAL_FLOAT:
-            printf("FLOAT(%lf)", value.as_float);
+            printf("FLOAT(%lf)", AS_FLOAT(value));
             break;
         default:
             printf("UNKNOWN");
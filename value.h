@@ -7,8 +7,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
-
-#define IS_NULL(val) (((val)->type == VAL_PTR) && ((val)->as_ptr == nullptr))
+#include <string.h>
 
 typedef enum {
     VAL_INT,
@@ -20,6 +19,79 @@ typedef enum {
     VAL_NULL,
 } ValueType;
 
+// Values are built with the make_* functions and read through the accessor macros
+// below, never through their fields: their layout depends on TIGE_NAN_BOXING.
+//
+// By default a Value is a 16 byte tagged union. With TIGE_NAN_BOXING it is a single
+// 64 bit word: doubles are stored as they are (NaNs collapse into one canonical
+// quiet NaN) and everything else is packed into the payload of the NaN patterns
+// with the sign, exponent and quiet bits set:
+//   1 11111111111 1 1 <50 bit integer>                     integers
+//   1 11111111111 1 0 <3 bit type> <47 bit payload>        bools, null, pointers
+// Integers are 50 bits wide and wrap around at that width, pointers have to fit in
+// 47 bits (user space addresses on x86-64 and arm64 Linux do).
+#ifdef TIGE_NAN_BOXING
+
+typedef struct {
+    uint64_t bits;
+} Value;
+
+#define NAN_BOX_BASE 0xFFF8000000000000ULL          // sign, exponent and quiet bits
+#define NAN_BOX_INT 0xFFFC000000000000ULL           // base and the integer bit
+#define NAN_BOX_INT_MASK ((1ULL << 50) - 1)
+#define NAN_BOX_PAYLOAD_MASK ((1ULL << 47) - 1)
+#define NAN_BOX_TYPE_SHIFT 47
+#define NAN_BOX_CANONICAL_NAN 0x7FF8000000000000ULL
+#define NAN_BOX(type, payload) ((Value) {NAN_BOX_BASE | (uint64_t) (type) << NAN_BOX_TYPE_SHIFT | (payload)})
+
+static inline ValueType value_type(Value v) {
+    if ((v.bits & NAN_BOX_BASE) != NAN_BOX_BASE) {
+        return VAL_FLOAT;
+    }
+    if ((v.bits & NAN_BOX_INT) == NAN_BOX_INT) {
+        return VAL_INT;
+    }
+    return (ValueType) (v.bits >> NAN_BOX_TYPE_SHIFT & 7);
+}
+
+static inline double value_as_float(Value v) {
+    double x;
+    memcpy(&x, &v.bits, sizeof(x));
+    return x;
+}
+
+#define VALUE_TYPE(v) value_type(v)
+#define IS_INT(v) (((v).bits & NAN_BOX_INT) == NAN_BOX_INT)
+#define IS_FLOAT(v) (((v).bits & NAN_BOX_BASE) != NAN_BOX_BASE)
+#define IS_BOOL(v) (((v).bits & ~1ULL) == NAN_BOX(VAL_BOOL, 0).bits)
+#define AS_INT(v) ((int64_t) ((v).bits << 14) >> 14)
+#define AS_FLOAT(v) value_as_float(v)
+#define AS_BOOL(v) ((bool) ((v).bits & 1))
+#define AS_PTR(v) ((v).bits & NAN_BOX_PAYLOAD_MASK)
+#define AS_STRING(v) ((char *) (uintptr_t) AS_PTR(v))
+
+static inline Value make_int(int64_t x) {
+    return (Value) {NAN_BOX_INT | ((uint64_t) x & NAN_BOX_INT_MASK)};
+}
+
+static inline Value make_float(double x) {
+    Value value = {NAN_BOX_CANONICAL_NAN};
+    if (x == x) {
+        memcpy(&value.bits, &x, sizeof(x));
+    }
+    return value;
+}
+
+static inline Value make_bool(bool x) {
+    return NAN_BOX(VAL_BOOL, x ? 1 : 0);
+}
+
+static inline Value make_null() {
+    return NAN_BOX(VAL_NULL, 0);
+}
+
+#else
+
 typedef struct {
     ValueType type;
     union {
@@ -31,12 +103,41 @@ typedef struct {
     };
 } Value;
 
+#define VALUE_TYPE(v) ((v).type)
+#define IS_INT(v) ((v).type == VAL_INT)
+#define IS_FLOAT(v) ((v).type == VAL_FLOAT)
+#define IS_BOOL(v) ((v).type == VAL_BOOL)
+#define AS_INT(v) ((v).as_integer)
+#define AS_FLOAT(v) ((v).as_float)
+#define AS_BOOL(v) ((v).as_boolean)
+#define AS_PTR(v) ((v).as_ptr)
+#define AS_STRING(v) ((v).as_string)
+
+static inline Value make_int(int64_t x) {
+    return (Value) {.type = VAL_INT, .as_integer = x};
+}
+
+static inline Value make_float(double x) {
+    return (Value) {.type = VAL_FLOAT, .as_float = x};
+}
+
+static inline Value make_bool(bool x) {
+    return (Value) {.type = VAL_BOOL, .as_boolean = x};
+}
+
+static inline Value make_null() {
+    return (Value) {.type = VAL_NULL, .as_ptr = 0x00};
+}
+
+#endif
+
+#define IS_NULL(val) ((VALUE_TYPE(*(val)) == VAL_PTR) && (AS_PTR(*(val)) == 0))
+
 // primitives
-Value make_int(int64_t x);
-Value make_float(double x);
-Value make_bool(bool x);
 Value make_string(const char* x);
-Value make_null();
+
+// a string value for chars, which it does not copy
+Value make_string_ref(char* chars);
 
 void print_value(Value value);
 
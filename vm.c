@@ -6,10 +6,11 @@
 #include "op_handlers.h"
 #include "context.h"
 #include "bytecode_buffer.h"
+#include "event_loop.h"
 #include <stdio.h>
 #include <memory.h>
-
-static VM *g_vm = nullptr;
+#include <threads.h>
+#include <sys/mman.h>
 
 static OpcodeHandler opcode_handlers[256] = {
         [OP_NOPE]            = handle_nop,             // 0x00
@@ -17,6 +18,8 @@ static OpcodeHandler opcode_handlers[256] = {
         [OP_LOAD_CONST_FLOAT]= handle_load_const_float,
         [OP_LOAD_VAR]        = handle_load_var,        // 0x02
         [OP_STORE_VAR]       = handle_store_var,       // 0x03
+        [OP_LOAD_GLOBAL]     = handle_load_global,
+        [OP_STORE_GLOBAL]    = handle_store_global,
 
         [OP_ADD]             = handle_add,             // 0x04
         [OP_SUB]             = handle_sub,             // 0x05
@@ -34,12 +37,36 @@ static OpcodeHandler opcode_handlers[256] = {
         [OP_LESS_EQUAL]      = handle_less_equal,      // 0x0F (to be implemented)
         [OP_GREATER_EQUAL]   = handle_greater_equal,   // 0x10 (to be implemented)
 
+        // quickened forms (0x60 - 0x73)
+        [OP_ADD_INT_INT]     = handle_add_int_int,
+        [OP_ADD_FLOAT_FLOAT] = handle_add_float_float,
+        [OP_SUB_INT_INT]     = handle_sub_int_int,
+        [OP_SUB_FLOAT_FLOAT] = handle_sub_float_float,
+        [OP_MUL_INT_INT]     = handle_mul_int_int,
+        [OP_MUL_FLOAT_FLOAT] = handle_mul_float_float,
+        [OP_DIV_INT_INT]     = handle_div_int_int,
+        [OP_DIV_FLOAT_FLOAT] = handle_div_float_float,
+        [OP_EQ_INT_INT]      = handle_eq_int_int,
+        [OP_EQ_FLOAT_FLOAT]  = handle_eq_float_float,
+        [OP_NE_INT_INT]      = handle_ne_int_int,
+        [OP_NE_FLOAT_FLOAT]  = handle_ne_float_float,
+        [OP_LT_INT_INT]      = handle_lt_int_int,
+        [OP_LT_FLOAT_FLOAT]  = handle_lt_float_float,
+        [OP_GT_INT_INT]      = handle_gt_int_int,
+        [OP_GT_FLOAT_FLOAT]  = handle_gt_float_float,
+        [OP_LE_INT_INT]      = handle_le_int_int,
+        [OP_LE_FLOAT_FLOAT]  = handle_le_float_float,
+        [OP_GE_INT_INT]      = handle_ge_int_int,
+        [OP_GE_FLOAT_FLOAT]  = handle_ge_float_float,
+
         [OP_JMP]             = handle_jmp,                // 0x11 (to be implemented)
         [OP_JMP_IF_TRUE]     = handle_jmp_if_true,        // 0x12 (to be implemented)
         [OP_JMP_IF_FALSE]    = handle_jmp_if_false,       // 0x13 (to be implemented)
 
         [OP_CALL]            = handle_call,                // 0x14 (to be implemented)
+        [OP_CALL_NATIVE]     = handle_call_native,     // 0x50
         [OP_RETURN]          = handle_return,          // 0x15
+        [OP_TAIL_CALL]       = handle_tail_call,       // 0x1E
 
         [OP_NEW_OBJECT]      = nullptr,                // 0x16 (to be implemented)
         [OP_GET_PROPERTY]    = nullptr,                // 0x17 (to be implemented)
@@ -53,7 +80,6 @@ static OpcodeHandler opcode_handlers[256] = {
 
         [OP_TERNARY]         = nullptr,                // 0x1D
 
-        [OP_JMP_ADR]         = handle_jmp_adr,
 
         [OP_ENTER_SCOPE]     = handle_enter_scope,
         [OP_EXIT_SCOPE]      = handle_exit_scope,
@@ -66,6 +92,30 @@ static OpcodeHandler opcode_handlers[256] = {
 
         [OP_INC_REG]         = handle_inc_reg,
 
+        [OP_ADD_RRR]         = handle_add_rrr,         // 0x30
+        [OP_SUB_RRR]         = handle_sub_rrr,
+        [OP_MUL_RRR]         = handle_mul_rrr,
+        [OP_DIV_RRR]         = handle_div_rrr,
+        [OP_ADD_RRI]         = handle_add_rri,         // 0x34
+        [OP_SUB_RRI]         = handle_sub_rri,
+        [OP_MUL_RRI]         = handle_mul_rri,
+        [OP_DIV_RRI]         = handle_div_rri,
+        [OP_MOV_RR]          = handle_mov_rr,          // 0x38
+        [OP_MOV_RI]          = handle_mov_ri,
+
+        [OP_EQ_RR_JMP]       = handle_compare_jmp,     // 0x40
+        [OP_NE_RR_JMP]       = handle_compare_jmp,
+        [OP_LT_RR_JMP]       = handle_compare_jmp,
+        [OP_LE_RR_JMP]       = handle_compare_jmp,
+        [OP_GT_RR_JMP]       = handle_compare_jmp,
+        [OP_GE_RR_JMP]       = handle_compare_jmp,
+        [OP_EQ_RI_JMP]       = handle_compare_jmp,     // 0x46
+        [OP_NE_RI_JMP]       = handle_compare_jmp,
+        [OP_LT_RI_JMP]       = handle_compare_jmp,
+        [OP_LE_RI_JMP]       = handle_compare_jmp,
+        [OP_GT_RI_JMP]       = handle_compare_jmp,
+        [OP_GE_RI_JMP]       = handle_compare_jmp,
+
         [OP_HALT]            = handle_halt,            // 0xFF
         // All other opcodes remain nullptr by default
 };
@@ -73,191 +123,907 @@ static OpcodeHandler opcode_handlers[256] = {
 // Initialize the VM
 VM *create_vm(Context *context) {
     VM *vm = (VM *) malloc(sizeof(VM));
-    // TODO: remove these two lines
-    vm->bytecode = nullptr;
-    vm->size = -1;
-
     vm->buffer = context->code;
-    vm->chunk = nullptr;
+    vm->code = nullptr;
+    vm->pc = nullptr;
+    vm->profile = nullptr;
+    vm->jit = nullptr;
     vm->context = context;
-    vm->call_stack = create_call_stack();
-    vm->ip = 0;
+    vm->call_stack = create_call_stack(CALL_STACK_SIZE);
     vm->sp = -1; // Empty stack
+    vm->sp_reset = -1;
+    vm->fuel = VM_UNLIMITED_FUEL;
+    vm->parked_fuel = 0;
+    vm->on_budget = nullptr;
+    vm->budget_data = nullptr;
+    vm->suspend_requested = false;
+    vm->suspended = false;
+    vm->fiber = nullptr;
+    vm->fiber_result = make_null();
+    vm->parked = false;
+    vm->events = nullptr;
+    vm->strings = nullptr;
 
+    // only reserved: a page is backed once a call goes that deep, so a VM costs the same
+    // whatever REGISTER_FILE_SIZE is
+    vm->register_file = mmap(nullptr, sizeof(Value) * REGISTER_FILE_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (vm->register_file == MAP_FAILED) {
+        fprintf(stderr, "Failed to allocate the register file.\n");
+        exit(EXIT_FAILURE);
+    }
+    // globals read as null until assigned; the windows of calls are written before they
+    // are read, they start out zeroed and hold what the previous call left afterwards
     for (int i = 0; i < MAX_REGISTERS; i++) {
-        vm->registers[i] = make_null(); // TODO: change to make_undefined
+        vm->register_file[i] = make_null(); // TODO: change to make_undefined
     }
+    vm->register_end = vm->register_file + REGISTER_FILE_SIZE;
+    vm->registers = vm->register_file;
 
     vm->stack = create_stack(STACK_SIZE);
     vm->heap = create_heap();
 
     // TODO: GC thread here
 
-    g_vm = vm;
     return vm;
 }
 
 // Destroy the VM
 void destroy_vm(VM *vm) {
     if (vm) {
+        destroy_instruction_stream(vm->code);
+        destroy_jit(vm->jit);
+        destroy_fiber(vm->fiber);
+        destroy_event_loop(vm->events);
+        destroy_call_stack(vm->call_stack);
+        munmap(vm->register_file, sizeof(Value) * REGISTER_FILE_SIZE);
         free(vm);
-        g_vm = nullptr;
     }
 }
 
-// TODO: remove the vm argument and use get_vm()
 // Push a value onto the stack
 inline void vm_push(VM *vm, Value value) {
-    if (!g_vm) {
+    if (!vm) {
         fprintf(stderr, "VM not initialized.\n");
         // TODO: handle error
         exit(EXIT_FAILURE);
     }
 
-    bool success = push_stack(g_vm->stack, value);
+    bool success = push_stack(vm->stack, value);
     // TODO: error handling for non-successful stack operation
 }
 
-// TODO: remove the vm argument and use get_vm()
 // Pop a value from the stack
 inline Value vm_pop(VM *vm) {
-    if (!g_vm) {
+    if (!vm) {
         fprintf(stderr, "VM not initialized.\n");
         // TODO: handle error
         exit(EXIT_FAILURE);
     }
 
     Value val;
-    bool success = pop_stack(g_vm->stack, &val);
+    bool success = pop_stack(vm->stack, &val);
     // TODO: error handling for non-successful stack operation
     return val;
 }
 
-Value vm_execute(VM *vm) {
-    while (vm->ip < vm->size) {
-        // total num of chunks
-        auto op = (Opcode) vm->chunk->bytecode[vm->ip];
-        vm->ip++;
-        auto handler = opcode_handlers[op];
-        bool continue_execution = handler();
-
-        if (!continue_execution) {
-            break;
-        } else {
-            // this is temp code to be removed
-            if (vm->ip >= vm->chunk->size) {
-                vm->ip = 0;
-            } else {
-                continue; // each handler increments the ip with the required size
+#if TIGE_THREADED_DISPATCH
+
+#include "superinstructions.h"
+
+// Top-of-stack caching.
+// The threaded loop keeps up to TIGE_TOS_CACHE_DEPTH (1 or 2) of the topmost
+// operand stack values in the locals `tos` and `nos`. How many are cached on entry to an instruction is its
+// tos_state, computed once at load time (see assign_tos_states), and every
+// inlined opcode has a label per state so the state never has to be tested at
+// run time. Cached values are only spilled to vm->stack when an instruction goes
+// through its generic handler (calls, returns, GC points, slow paths), which
+// refills the cache for whatever state its successor expects.
+#ifndef TIGE_TOS_CACHE_DEPTH
+#define TIGE_TOS_CACHE_DEPTH 1  // a second cached slot costs more in register pressure than it saves
+#endif
+#define TOS_STATES 3
+#define TOS_UNSET 0xFF
+
+static const void *dispatch_labels[TOS_STATES][256];
+static const void *generic_label;
+static const void *jit_label;
+static const void *loop_label;
+static bool inlined_opcodes[256];
+
+// opcode sequences fused into a single dispatch, generated from the opcode profile
+typedef struct {
+    uint8_t length;
+    Opcode opcodes[3];
+} Superinstruction;
+
+#define SUPERINSTRUCTION_PATTERN(id, name, n, a, b, c) {n, {a, b, c}},
+static const Superinstruction superinstructions[] = {
+        TIGE_SUPERINSTRUCTIONS(SUPERINSTRUCTION_PATTERN)
+        {0, {OP_NOPE, OP_NOPE, OP_NOPE}}
+};
+#undef SUPERINSTRUCTION_PATTERN
+
+static const void *superinstruction_labels[TIGE_SUPERINSTRUCTION_COUNT + 1];
+
+// Opcodes implemented inline by the threaded loop. Each one has a STEP_<opcode>(k, s)
+// fragment executing the instruction at pc[k] entered with s cached values, so that
+// the same code serves every specialized single instruction label (k = 0, constant s)
+// and any position of a superinstruction (s read from the instruction). A fragment
+// that cannot handle its operands falls back to the generic handler of pc[k] before
+// touching anything; branch fragments dispatch on their own.
+#define INLINED_OPCODES(X) \
+    X(OP_NOPE) X(OP_LOAD_CONST_INT) X(OP_LOAD_CONST_FLOAT) X(OP_LOAD_BOOL) X(OP_LOAD_VAR) X(OP_STORE_VAR) \
+    X(OP_LOAD_GLOBAL) X(OP_STORE_GLOBAL) \
+    X(OP_ADD) X(OP_SUB) X(OP_MUL) \
+    X(OP_EQUAL) X(OP_NOT_EQUAL) X(OP_LESS_THAN) X(OP_GREATER_THAN) X(OP_LESS_EQUAL) X(OP_GREATER_EQUAL) \
+    X(OP_JMP) X(OP_JMP_IF_TRUE) X(OP_JMP_IF_FALSE) \
+    X(OP_POP) X(OP_SAVE_SP) X(OP_RESET_SP) X(OP_INC_REG) \
+    X(OP_ADD_RRR) X(OP_SUB_RRR) X(OP_MUL_RRR) X(OP_ADD_RRI) X(OP_SUB_RRI) X(OP_MUL_RRI) \
+    X(OP_MOV_RR) X(OP_MOV_RI) \
+    X(OP_EQ_RR_JMP) X(OP_NE_RR_JMP) X(OP_LT_RR_JMP) X(OP_LE_RR_JMP) X(OP_GT_RR_JMP) X(OP_GE_RR_JMP) \
+    X(OP_EQ_RI_JMP) X(OP_NE_RI_JMP) X(OP_LT_RI_JMP) X(OP_LE_RI_JMP) X(OP_GT_RI_JMP) X(OP_GE_RI_JMP) \
+    X(OP_CALL_NATIVE) \
+    X(OP_ADD_INT_INT) X(OP_ADD_FLOAT_FLOAT) X(OP_SUB_INT_INT) X(OP_SUB_FLOAT_FLOAT) \
+    X(OP_MUL_INT_INT) X(OP_MUL_FLOAT_FLOAT) X(OP_DIV_INT_INT) X(OP_DIV_FLOAT_FLOAT) \
+    X(OP_EQ_INT_INT) X(OP_EQ_FLOAT_FLOAT) X(OP_NE_INT_INT) X(OP_NE_FLOAT_FLOAT) \
+    X(OP_LT_INT_INT) X(OP_LT_FLOAT_FLOAT) X(OP_GT_INT_INT) X(OP_GT_FLOAT_FLOAT) \
+    X(OP_LE_INT_INT) X(OP_LE_FLOAT_FLOAT) X(OP_GE_INT_INT) X(OP_GE_FLOAT_FLOAT)
+
+// cache state an inlined opcode leaves behind when entered in `state`
+static uint8_t tos_state_after(Opcode opcode, uint8_t state) {
+    switch (opcode) {
+        case OP_LOAD_CONST_INT:
+        case OP_LOAD_CONST_FLOAT:
+        case OP_LOAD_BOOL:
+        case OP_LOAD_VAR:
+        case OP_LOAD_GLOBAL:
+            return state < TIGE_TOS_CACHE_DEPTH ? state + 1 : state;
+        case OP_STORE_VAR:
+        case OP_STORE_GLOBAL:
+        case OP_POP:
+        case OP_JMP_IF_TRUE:
+        case OP_JMP_IF_FALSE:
+            return state == 2 ? 1 : 0;
+        case OP_ADD:
+        case OP_SUB:
+        case OP_MUL:
+        case OP_EQUAL:
+        case OP_NOT_EQUAL:
+        case OP_LESS_THAN:
+        case OP_GREATER_THAN:
+        case OP_LESS_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_CALL_NATIVE:
+        case OP_ADD_INT_INT:
+        case OP_ADD_FLOAT_FLOAT:
+        case OP_SUB_INT_INT:
+        case OP_SUB_FLOAT_FLOAT:
+        case OP_MUL_INT_INT:
+        case OP_MUL_FLOAT_FLOAT:
+        case OP_DIV_INT_INT:
+        case OP_DIV_FLOAT_FLOAT:
+        case OP_EQ_INT_INT:
+        case OP_EQ_FLOAT_FLOAT:
+        case OP_NE_INT_INT:
+        case OP_NE_FLOAT_FLOAT:
+        case OP_LT_INT_INT:
+        case OP_LT_FLOAT_FLOAT:
+        case OP_GT_INT_INT:
+        case OP_GT_FLOAT_FLOAT:
+        case OP_LE_INT_INT:
+        case OP_LE_FLOAT_FLOAT:
+        case OP_GE_INT_INT:
+        case OP_GE_FLOAT_FLOAT:
+            return 1;
+        case OP_RESET_SP:
+            return 0;
+        default:
+            return state;
+    }
+}
+
+#define DISPATCH() goto *pc->handler.label
+#define NEXT() do { pc++; DISPATCH(); } while (0)
+#define SLOW_PATH() goto op_generic
+#define BAIL(k) do { pc += (k); SLOW_PATH(); } while (0)
+#define DEPTH() (top - stack + 1)   // values in memory, not counting the cached ones
+
+// move s cached values to memory and back
+#define SPILL(s) do { \
+        if ((s) == 2) { top[1] = nos; top[2] = tos; top += 2; } \
+        else if ((s) == 1) { *++top = tos; } \
+    } while (0)
+#define FILL(s) do { \
+        if ((s) == 2) { tos = top[0]; nos = top[-1]; top -= 2; } \
+        else if ((s) == 1) { tos = *top--; } \
+    } while (0)
+
+#define PUSH(value, k, s) do { \
+        if (top + (s) + 1 >= limit) BAIL(k); \
+        const Value pushed = (value); \
+        if ((s) == 2) { *++top = nos; nos = tos; } \
+        else if ((s) == 1 && TIGE_TOS_CACHE_DEPTH == 1) { *++top = tos; } \
+        else if ((s) == 1) { nos = tos; } \
+        tos = pushed; \
+    } while (0)
+// the top value, only valid if there is one
+#define PEEK(s) ((s) ? tos : top[0])
+#define DROP(s) do { \
+        if ((s) == 2) { tos = nos; } \
+        else if ((s) == 0) { top--; } \
+    } while (0)
+// operands of a binary operation and how many of them live in memory
+#define LHS(s) ((s) == 2 ? nos : (s) == 1 ? top[0] : top[-1])
+#define RHS(s) PEEK(s)
+#define IN_MEMORY(s) (2 - (s))
+
+#define INT_BINARY(op, k, s) do { \
+        if (DEPTH() < IN_MEMORY(s)) BAIL(k); \
+        const Value l = LHS(s), r = RHS(s); \
+        if (!IS_INT(l) || !IS_INT(r)) BAIL(k); \
+        top -= IN_MEMORY(s); \
+        tos = make_int(AS_INT(l) op AS_INT(r)); \
+    } while (0)
+#define INT_COMPARE(cmp, k, s) do { \
+        if (DEPTH() < IN_MEMORY(s)) BAIL(k); \
+        const Value l = LHS(s), r = RHS(s); \
+        if (!IS_INT(l) || !IS_INT(r)) BAIL(k); \
+        top -= IN_MEMORY(s); \
+        tos = make_bool(AS_INT(l) cmp AS_INT(r)); \
+    } while (0)
+// quickened forms: the guard failing sends the instruction to its handler, which de-quickens it
+#define TYPED_BINARY(is, as, make, op, k, s) do { \
+        if (DEPTH() < IN_MEMORY(s)) BAIL(k); \
+        const Value l = LHS(s), r = RHS(s); \
+        if (!is(l) || !is(r)) BAIL(k); \
+        top -= IN_MEMORY(s); \
+        tos = make(as(l) op as(r)); \
+    } while (0)
+#define TYPED_DIV(is, as, make, zero, k, s) do { \
+        if (DEPTH() < IN_MEMORY(s)) BAIL(k); \
+        const Value l = LHS(s), r = RHS(s); \
+        if (!is(l) || !is(r) || as(r) == (zero)) BAIL(k); \
+        top -= IN_MEMORY(s); \
+        tos = make(as(l) / as(r)); \
+    } while (0)
+// jumps backwards are safepoints, they stop at their target once the fuel runs out
+#define JUMP(to, k) do { \
+        const Instruction *to_ = (to); \
+        const bool back_edge = to_ <= pc + (k); \
+        pc = to_; \
+        if (back_edge && --fuel <= 0) goto safepoint; \
+        DISPATCH(); \
+    } while (0)
+#define BOOL_BRANCH(taken_if, k, s) do { \
+        if ((s) == 0 && DEPTH() < 1) BAIL(k); \
+        if (!IS_BOOL(PEEK(s))) BAIL(k); \
+        const bool condition = AS_BOOL(PEEK(s)); \
+        DROP(s); \
+        JUMP(condition == (taken_if) ? pc[k].target : pc + (k) + 1, k); \
+    } while (0)
+// register operands never touch the stack, only the integer case is inlined
+#define INT_RRR(op, k) do { \
+        const Value *x = &registers[pc[k].b], *y = &registers[pc[k].c]; \
+        if (!IS_INT(*x) || !IS_INT(*y)) BAIL(k); \
+        registers[pc[k].a] = make_int(AS_INT(*x) op AS_INT(*y)); \
+    } while (0)
+#define INT_RRI(op, k) do { \
+        const Value *x = &registers[pc[k].b]; \
+        if (!IS_INT(*x)) BAIL(k); \
+        registers[pc[k].a] = make_int(AS_INT(*x) op pc[k].operand.as_int); \
+    } while (0)
+#define INT_RR_JMP(cmp, k) do { \
+        const Value *x = &registers[pc[k].a], *y = &registers[pc[k].b]; \
+        if (!IS_INT(*x) || !IS_INT(*y)) BAIL(k); \
+        JUMP(AS_INT(*x) cmp AS_INT(*y) ? pc[k].target : pc + (k) + 1, k); \
+    } while (0)
+#define INT_RI_JMP(cmp, k) do { \
+        const Value *x = &registers[pc[k].a]; \
+        if (!IS_INT(*x)) BAIL(k); \
+        JUMP(AS_INT(*x) cmp pc[k].operand.as_int ? pc[k].target : pc + (k) + 1, k); \
+    } while (0)
+
+#define STEP_OP_NOPE(k, s) do { } while (0)
+#define STEP_OP_LOAD_CONST_INT(k, s) PUSH(make_int(pc[k].operand.as_int), k, s)
+#define STEP_OP_LOAD_CONST_FLOAT(k, s) PUSH(make_float(pc[k].operand.as_float), k, s)
+#define STEP_OP_LOAD_BOOL(k, s) PUSH(make_bool(pc[k].operand.as_bool), k, s)
+#define STEP_OP_LOAD_VAR(k, s) PUSH(registers[pc[k].a], k, s)
+#define STEP_OP_STORE_VAR(k, s) do { \
+        if ((s) == 0 && DEPTH() < 1) BAIL(k); \
+        registers[pc[k].a] = PEEK(s); \
+        DROP(s); \
+    } while (0)
+#define STEP_OP_LOAD_GLOBAL(k, s) PUSH(globals[pc[k].a], k, s)
+#define STEP_OP_STORE_GLOBAL(k, s) do { \
+        if ((s) == 0 && DEPTH() < 1) BAIL(k); \
+        globals[pc[k].a] = PEEK(s); \
+        DROP(s); \
+    } while (0)
+#define STEP_OP_ADD(k, s) do { \
+        if (DEPTH() < IN_MEMORY(s)) BAIL(k); \
+        const Value l = LHS(s), r = RHS(s); \
+        if (IS_INT(l) && IS_INT(r)) { \
+            top -= IN_MEMORY(s); \
+            tos = make_int(AS_INT(l) + AS_INT(r)); \
+        } else if (IS_FLOAT(l) && IS_FLOAT(r)) { \
+            top -= IN_MEMORY(s); \
+            tos = make_float(AS_FLOAT(l) + AS_FLOAT(r)); \
+        } else { \
+            BAIL(k); \
+        } \
+    } while (0)
+#define STEP_OP_SUB(k, s) INT_BINARY(-, k, s)
+#define STEP_OP_MUL(k, s) INT_BINARY(*, k, s)
+#define STEP_OP_EQUAL(k, s) INT_COMPARE(==, k, s)
+#define STEP_OP_NOT_EQUAL(k, s) INT_COMPARE(!=, k, s)
+#define STEP_OP_LESS_THAN(k, s) INT_COMPARE(<, k, s)
+#define STEP_OP_GREATER_THAN(k, s) INT_COMPARE(>, k, s)
+#define STEP_OP_LESS_EQUAL(k, s) INT_COMPARE(<=, k, s)
+#define STEP_OP_GREATER_EQUAL(k, s) INT_COMPARE(>=, k, s)
+#define STEP_OP_ADD_INT_INT(k, s) TYPED_BINARY(IS_INT, AS_INT, make_int, +, k, s)
+#define STEP_OP_ADD_FLOAT_FLOAT(k, s) TYPED_BINARY(IS_FLOAT, AS_FLOAT, make_float, +, k, s)
+#define STEP_OP_SUB_INT_INT(k, s) TYPED_BINARY(IS_INT, AS_INT, make_int, -, k, s)
+#define STEP_OP_SUB_FLOAT_FLOAT(k, s) TYPED_BINARY(IS_FLOAT, AS_FLOAT, make_float, -, k, s)
+#define STEP_OP_MUL_INT_INT(k, s) TYPED_BINARY(IS_INT, AS_INT, make_int, *, k, s)
+#define STEP_OP_MUL_FLOAT_FLOAT(k, s) TYPED_BINARY(IS_FLOAT, AS_FLOAT, make_float, *, k, s)
+#define STEP_OP_DIV_INT_INT(k, s) TYPED_DIV(IS_INT, AS_INT, make_int, 0, k, s)
+#define STEP_OP_DIV_FLOAT_FLOAT(k, s) TYPED_DIV(IS_FLOAT, AS_FLOAT, make_float, 0.0, k, s)
+#define STEP_OP_EQ_INT_INT(k, s) TYPED_BINARY(IS_INT, AS_INT, make_bool, ==, k, s)
+#define STEP_OP_EQ_FLOAT_FLOAT(k, s) TYPED_BINARY(IS_FLOAT, AS_FLOAT, make_bool, ==, k, s)
+#define STEP_OP_NE_INT_INT(k, s) TYPED_BINARY(IS_INT, AS_INT, make_bool, !=, k, s)
+#define STEP_OP_NE_FLOAT_FLOAT(k, s) TYPED_BINARY(IS_FLOAT, AS_FLOAT, make_bool, !=, k, s)
+#define STEP_OP_LT_INT_INT(k, s) TYPED_BINARY(IS_INT, AS_INT, make_bool, <, k, s)
+#define STEP_OP_LT_FLOAT_FLOAT(k, s) TYPED_BINARY(IS_FLOAT, AS_FLOAT, make_bool, <, k, s)
+#define STEP_OP_GT_INT_INT(k, s) TYPED_BINARY(IS_INT, AS_INT, make_bool, >, k, s)
+#define STEP_OP_GT_FLOAT_FLOAT(k, s) TYPED_BINARY(IS_FLOAT, AS_FLOAT, make_bool, >, k, s)
+#define STEP_OP_LE_INT_INT(k, s) TYPED_BINARY(IS_INT, AS_INT, make_bool, <=, k, s)
+#define STEP_OP_LE_FLOAT_FLOAT(k, s) TYPED_BINARY(IS_FLOAT, AS_FLOAT, make_bool, <=, k, s)
+#define STEP_OP_GE_INT_INT(k, s) TYPED_BINARY(IS_INT, AS_INT, make_bool, >=, k, s)
+#define STEP_OP_GE_FLOAT_FLOAT(k, s) TYPED_BINARY(IS_FLOAT, AS_FLOAT, make_bool, >=, k, s)
+#define STEP_OP_JMP(k, s) JUMP(pc[k].target, k)
+#define STEP_OP_JMP_IF_TRUE(k, s) BOOL_BRANCH(true, k, s)
+#define STEP_OP_JMP_IF_FALSE(k, s) BOOL_BRANCH(false, k, s)
+#define STEP_OP_POP(k, s) do { \
+        if ((s) == 0 && DEPTH() < 1) BAIL(k); \
+        DROP(s); \
+    } while (0)
+#define STEP_OP_SAVE_SP(k, s) do { vm->sp_reset = (int) (top - stack) + (s); } while (0)
+#define STEP_OP_RESET_SP(k, s) do { SPILL(s); top = stack + vm->sp_reset; } while (0)
+#define STEP_OP_INC_REG(k, s) do { \
+        if (IS_INT(registers[pc[k].a])) registers[pc[k].a] = make_int(AS_INT(registers[pc[k].a]) + 1); \
+    } while (0)
+#define STEP_OP_ADD_RRR(k, s) INT_RRR(+, k)
+#define STEP_OP_SUB_RRR(k, s) INT_RRR(-, k)
+#define STEP_OP_MUL_RRR(k, s) INT_RRR(*, k)
+#define STEP_OP_ADD_RRI(k, s) INT_RRI(+, k)
+#define STEP_OP_SUB_RRI(k, s) INT_RRI(-, k)
+#define STEP_OP_MUL_RRI(k, s) INT_RRI(*, k)
+#define STEP_OP_MOV_RR(k, s) do { registers[pc[k].a] = registers[pc[k].b]; } while (0)
+#define STEP_OP_MOV_RI(k, s) do { registers[pc[k].a] = make_int(pc[k].operand.as_int); } while (0)
+#define STEP_OP_EQ_RR_JMP(k, s) INT_RR_JMP(==, k)
+#define STEP_OP_NE_RR_JMP(k, s) INT_RR_JMP(!=, k)
+#define STEP_OP_LT_RR_JMP(k, s) INT_RR_JMP(<, k)
+#define STEP_OP_LE_RR_JMP(k, s) INT_RR_JMP(<=, k)
+#define STEP_OP_GT_RR_JMP(k, s) INT_RR_JMP(>, k)
+#define STEP_OP_GE_RR_JMP(k, s) INT_RR_JMP(>=, k)
+#define STEP_OP_EQ_RI_JMP(k, s) INT_RI_JMP(==, k)
+#define STEP_OP_NE_RI_JMP(k, s) INT_RI_JMP(!=, k)
+#define STEP_OP_LT_RI_JMP(k, s) INT_RI_JMP(<, k)
+#define STEP_OP_LE_RI_JMP(k, s) INT_RI_JMP(<=, k)
+#define STEP_OP_GT_RI_JMP(k, s) INT_RI_JMP(>, k)
+#define STEP_OP_GE_RI_JMP(k, s) INT_RI_JMP(>=, k)
+// natives read their arguments from memory, so the cache is spilled first. Only
+// natives that never allocate are called from here, the others need the VM synced
+#define STEP_OP_CALL_NATIVE(k, s) do { \
+        const Instruction *call = &pc[k]; \
+        if (!(call->b & NATIVE_NO_GC) || DEPTH() + (s) < call->c) BAIL(k); \
+        SPILL(s); \
+        Value result = make_null(); \
+        top -= call->c; \
+        vm->fuel = fuel; \
+        if (!call->operand.as_native(vm, top + 1, call->c, &result) && !(call->b & NATIVE_NO_THROW)) { \
+            pc += (k) + 1; \
+            VM_SYNC(); \
+            goto done; \
+        } \
+        fuel = vm->fuel; \
+        tos = result; \
+    } while (0)
+
+// Direct-threaded interpreter core.
+// Every decoded instruction carries the address of its dispatch label, so
+// dispatching is a single indirect jump. The pc, the stack top, the fuel and the
+// cached top of stack live in locals; the hot opcodes are implemented inline and
+// everything else (and every slow path) goes through the regular handler after
+// syncing the locals back into the VM. Called with a nullptr VM it only
+// publishes its dispatch labels.
+static Value vm_execute_threaded(VM *vm) {
+    if (vm == nullptr) {
+#define BIND_LABELS(op) \
+        dispatch_labels[0][op] = &&label_##op##_0; \
+        dispatch_labels[1][op] = &&label_##op##_1; \
+        dispatch_labels[2][op] = &&label_##op##_2; \
+        inlined_opcodes[op] = true;
+#define BIND_SUPERINSTRUCTION(id, name, n, a, b, c) superinstruction_labels[id] = &&super_##name;
+        for (int s = 0; s < TOS_STATES; s++) {
+            for (int i = 0; i < 256; i++) {
+                dispatch_labels[s][i] = &&op_generic;
             }
         }
+        // labels stay valid for the whole program, GCC 12+ takes them for locals
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdangling-pointer"
+#endif
+        generic_label = &&op_generic;
+        jit_label = &&op_jit;
+        loop_label = &&op_loop;
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 12
+#pragma GCC diagnostic pop
+#endif
+        INLINED_OPCODES(BIND_LABELS)
+        TIGE_SUPERINSTRUCTIONS(BIND_SUPERINSTRUCTION)
+        return make_null();
+#undef BIND_SUPERINSTRUCTION
+#undef BIND_LABELS
+    }
+
+    const Instruction *pc;
+    Value *stack, *top, *limit;
+    Value tos = make_null(), nos = make_null();
+    // window of the running function, calls and returns (generic handlers) move it
+    Value *registers;
+    Value *const globals = vm->register_file;
+    int64_t fuel;
+
+#define VM_SYNC() do { vm->pc = pc; vm->stack->sp = (int) (top - stack); vm->fuel = fuel; } while (0)
+#define VM_RELOAD() do { \
+        pc = vm->pc; registers = vm->registers; fuel = vm->fuel; \
+        stack = vm->stack->values; top = stack + vm->stack->sp; limit = stack + vm->stack->capacity; \
+    } while (0)
+
+    VM_RELOAD();
+    FILL(pc->tos_state);
+    // a VM resumed in the middle of compiled code goes straight back to it
+    if (vm->jit && jit_has_code(vm->jit, pc)) {
+        goto op_jit;
     }
+    DISPATCH();
 
-    if (SP >= 0) {
+op_generic: {
+        const Instruction *ins = pc;
+        const OpcodeHandler handler = opcode_handlers[ins->opcode];
+        SPILL(ins->tos_state);
+        pc++;
+        VM_SYNC();
+        if (!handler || !handler(vm, ins)) {
+            goto done;
+        }
+        VM_RELOAD();
+        if (DEPTH() < pc->tos_state) {
+            fprintf(stderr, "Error: operand stack underflow.\n");
+            goto done;
+        }
+        FILL(pc->tos_state);
+        DISPATCH();
+    }
+
+    // compiled code, it runs until it needs the interpreter to take over
+op_jit: {
+        SPILL(pc->tos_state);
+        VM_SYNC();
+        if (!jit_enter(vm, pc)) {
+            goto done;
+        }
+        VM_RELOAD();
+        if (DEPTH() < pc->tos_state) {
+            fprintf(stderr, "Error: operand stack underflow.\n");
+            goto done;
+        }
+        FILL(pc->tos_state);
+        DISPATCH();
+    }
+
+    // loop header counting iterations for the JIT, the cached stack values stay put
+op_loop:
+    goto *jit_loop_header(vm, (Instruction *) pc).label;
+
+    // the fuel ran out at a back edge, pc is its target
+safepoint:
+    SPILL(pc->tos_state);
+    VM_SYNC();
+    if (!vm_safepoint(vm)) {
+        goto done;
+    }
+    fuel = vm->fuel;
+    FILL(pc->tos_state);
+    DISPATCH();
+
+#define INLINE_LABELS(op) \
+    label_##op##_0: STEP_##op(0, 0); NEXT(); \
+    label_##op##_1: STEP_##op(0, 1); NEXT(); \
+    label_##op##_2: STEP_##op(0, 2); NEXT();
+    INLINED_OPCODES(INLINE_LABELS)
+#undef INLINE_LABELS
+
+    // a superinstruction runs the fragments of its opcodes back to back, the
+    // instructions it covers stay in the stream for jumps into the middle and for slow paths
+#define SUPERINSTRUCTION_LABEL(id, name, n, a, b, c) \
+    super_##name: \
+        STEP_##a(0, pc[0].tos_state); STEP_##b(1, pc[1].tos_state); STEP_##c(2, pc[2].tos_state); \
+        pc += (n); DISPATCH();
+    TIGE_SUPERINSTRUCTIONS(SUPERINSTRUCTION_LABEL)
+#undef SUPERINSTRUCTION_LABEL
+
+done:
+    if (!vm->suspended && vm->stack->sp >= 0) {
         return vm_pop(vm);
     }
 
     return make_null();
+
+#undef VM_RELOAD
+#undef VM_SYNC
 }
 
-// read a TString object pointer from the bytecode
-TString *vm_read_string(VM *vm) {
-    if (vm == nullptr) {
-        fprintf(stderr, "Error: vm_read_string received nullptr VM pointer.\n");
-        return nullptr;
+static bool falls_through(Opcode opcode) {
+    return opcode != OP_JMP && opcode != OP_RETURN && opcode != OP_TAIL_CALL && opcode != OP_HALT;
+}
+
+// Assign every instruction the number of cached stack values it is entered with.
+// States flow along fall through and jump edges out of inlined instructions; an
+// instruction going through its generic handler spills everything and refills
+// whatever its successor needs, so it adapts to any state. When two edges into
+// the same instruction disagree, the inlined predecessor is demoted to the
+// generic handler. Code not reachable from an already visited instruction
+// (function bodies) starts with an empty cache.
+static void assign_tos_states(Instruction *code, size_t count, bool *demoted) {
+    for (size_t i = 0; i < count; i++) {
+        code[i].tos_state = TOS_UNSET;
+    }
+
+    size_t root = 0;
+    for (;;) {
+        while (root < count && code[root].tos_state != TOS_UNSET) {
+            root++;
+        }
+        if (root == count) {
+            break;
+        }
+        code[root].tos_state = 0;
+        // one past the last instruction this root reached: past it everything is either
+        // unset or settled by an earlier root, sweeping it would not change anything
+        size_t end = root + 1;
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (size_t i = root; i < end; i++) {
+                const Instruction *ins = &code[i];
+                if (ins->tos_state == TOS_UNSET || demoted[i] || !inlined_opcodes[ins->opcode]) {
+                    continue;
+                }
+
+                const uint8_t out = tos_state_after(ins->opcode, ins->tos_state);
+                Instruction *successors[2] = {
+                        falls_through(ins->opcode) && i + 1 < count ? &code[i + 1] : nullptr,
+                        (Instruction *) ins->target,
+                };
+                for (int s = 0; s < 2 && !demoted[i]; s++) {
+                    Instruction *next = successors[s];
+                    if (!next) {
+                        continue;
+                    }
+                    if (next->tos_state == TOS_UNSET) {
+                        next->tos_state = out;
+                        if ((size_t) (next - code) >= end) {
+                            end = (size_t) (next - code) + 1;
+                        }
+                        changed = true;
+                    } else if (next->tos_state != out) {
+                        demoted[i] = true;
+                        changed = true;
+                    }
+                }
+            }
+
+            // successors of generic instructions take an empty cache unless an edge said otherwise
+            for (size_t i = root; !changed && i < end; i++) {
+                const Instruction *ins = &code[i];
+                if (ins->tos_state == TOS_UNSET || (inlined_opcodes[ins->opcode] && !demoted[i])) {
+                    continue;
+                }
+                Instruction *successors[2] = {
+                        falls_through(ins->opcode) && i + 1 < count ? &code[i + 1] : nullptr,
+                        (Instruction *) ins->target,
+                };
+                for (int s = 0; s < 2; s++) {
+                    if (successors[s] && successors[s]->tos_state == TOS_UNSET) {
+                        successors[s]->tos_state = 0;
+                        if ((size_t) (successors[s] - code) >= end) {
+                            end = (size_t) (successors[s] - code) + 1;
+                        }
+                        changed = true;
+                    }
+                }
+            }
+        }
+    }
+}
+
+#endif
+
+#if TIGE_THREADED_DISPATCH
+// the labels are published once per process, VMs of other threads may be loading code too
+static once_flag labels_bound = ONCE_FLAG_INIT;
+
+static void bind_labels(void) {
+    vm_execute_threaded(nullptr);
+}
+#endif
+
+bool vm_bind_handlers(Instruction *code, size_t count) {
+#if TIGE_THREADED_DISPATCH
+    call_once(&labels_bound, bind_labels);
+
+    bool *demoted = calloc(count ? count : 1, sizeof(bool));
+    if (!demoted) {
+        fprintf(stderr, "Failed to allocate memory for the operand stack cache states.\n");
+        return false;
+    }
+    assign_tos_states(code, count, demoted);
+    for (size_t i = 0; i < count; i++) {
+        code[i].handler.label = demoted[i] ? generic_label : dispatch_labels[code[i].tos_state][code[i].opcode];
     }
 
-    if (vm->chunk->bytecode == nullptr) {
-        fprintf(stderr, "Error: vm_read_string received nullptr bytecode pointer.\n");
-        return nullptr;
+#ifndef TIGE_NO_SUPERINSTRUCTIONS
+    // peephole: the first (longest, most profitable) matching pattern wins
+    for (size_t i = 0; i < count; i++) {
+        for (const Superinstruction *super = superinstructions; super->length; super++) {
+            bool match = i + super->length <= count;
+            for (uint8_t k = 0; match && k < super->length; k++) {
+                match = code[i + k].opcode == super->opcodes[k] && !demoted[i + k];
+            }
+            if (match) {
+                code[i].handler.label = superinstruction_labels[super - superinstructions];
+                break;
+            }
+        }
     }
+#endif
+    free(demoted);
+#else
+    for (size_t i = 0; i < count; i++) {
+        code[i].handler.fn = opcode_handlers[code[i].opcode];
+    }
+#endif
+    return true;
+}
 
-    if (vm->ip >= vm->chunk->size) {
-        fprintf(stderr, "Error: Instruction pointer (%zu) out of bounds of the current chunk while reading string.\n",
-                vm->ip);
-        exit(-1);
+bool vm_rewrite_instruction(VM *vm, Instruction *ins, Opcode opcode) {
+    // the profile must see the opcodes the compiler emitted
+    if (vm->profile) {
+        return false;
     }
 
-    const auto str = (TString*)vm_read_ptr(vm);
+#if TIGE_THREADED_DISPATCH
+    const uint8_t state = ins->tos_state;
+    if (ins->handler.label != generic_label && ins->handler.label != dispatch_labels[state][ins->opcode]) {
+        return false;
+    }
+    // the only successor of a quickenable instruction is the next one
+    if (!inlined_opcodes[opcode] || ins[1].tos_state != tos_state_after(opcode, state)) {
+        // the generic path adapts to any state
+        ins->handler.label = generic_label;
+    } else {
+        ins->handler.label = dispatch_labels[state][opcode];
+    }
+#else
+    if (ins->handler.fn != opcode_handlers[ins->opcode]) {
+        return false;
+    }
+    ins->handler.fn = opcode_handlers[opcode];
+#endif
+    ins->opcode = opcode;
+    return true;
+}
 
+OpcodeHandler vm_opcode_handler(Opcode opcode) {
+    return opcode_handlers[opcode];
+}
 
-    return str;
+#if !TIGE_THREADED_DISPATCH
+static bool handle_jit_enter(VM *vm, const Instruction *ins) {
+    vm->pc = ins;
+    return jit_enter(vm, ins);
 }
+#endif
 
-// read a plain string from the current bytecode location
-inline const char* vm_read_fn_name(VM* vm)
-{
-    if (vm == nullptr) {
-        fprintf(stderr, "Error: vm_read_fn_name received nullptr VM pointer.\n");
-        return nullptr;
+void vm_set_jit_entry(Instruction *ins) {
+#if TIGE_THREADED_DISPATCH
+    ins->handler.label = jit_label;
+#else
+    ins->handler.fn = handle_jit_enter;
+#endif
+}
+
+#if !TIGE_THREADED_DISPATCH
+static bool handle_loop_header(VM *vm, const Instruction *ins) {
+    return jit_loop_header(vm, (Instruction *) ins).fn(vm, ins);
+}
+#endif
+
+void vm_set_loop_header(Instruction *ins) {
+#if TIGE_THREADED_DISPATCH
+    ins->handler.label = loop_label;
+#else
+    ins->handler.fn = handle_loop_header;
+#endif
+}
+
+// profiling mode: every instruction goes through its handler so it can be accounted for
+static Value vm_execute_profiled(VM *vm) {
+    for (;;) {
+        const Instruction *ins = vm->pc++;
+        profile_record(vm->profile, ins);
+        const OpcodeHandler handler = opcode_handlers[ins->opcode];
+        if (!handler || !handler(vm, ins)) {
+            break;
+        }
     }
 
-    if (vm->chunk == nullptr || vm->chunk->bytecode == nullptr) {
-        fprintf(stderr, "Error: vm_read_fn_name received nullptr chunk or bytecode pointer.\n");
-        return nullptr;
+    if (!vm->suspended && vm->stack->sp >= 0) {
+        return vm_pop(vm);
     }
 
-    if (vm->ip >= vm->chunk->size) {
-        fprintf(stderr, "Error: Instruction pointer (%zu) out of bounds of the current chunk while reading function name.\n",
-                vm->ip);
-        exit(EXIT_FAILURE);
+    return make_null();
+}
+
+Value vm_execute(VM *vm) {
+    if (vm->pc == nullptr) {
+        fprintf(stderr, "Error: no code loaded in the VM.\n");
+        return make_null();
     }
 
-    size_t remaining = vm->chunk->size - vm->ip;
+    vm->suspended = false;
+    if (vm->profile) {
+        return vm_execute_profiled(vm);
+    }
 
-    // Find the null terminator within the remaining bytes
-    void* null_pos = memchr(vm->chunk->bytecode + vm->ip, '\0', remaining);
-    if (null_pos == nullptr) {
-        fprintf(stderr, "Error: Null terminator not found for function name starting at position %zu.\n", vm->ip);
-        exit(EXIT_FAILURE);
+#if TIGE_THREADED_DISPATCH
+    return vm_execute_threaded(vm);
+#else
+    // portable fallback: one indirect call per instruction, a VM resumed in the
+    // middle of compiled code goes straight back to it
+    bool running = !vm->jit || !jit_has_code(vm->jit, vm->pc) || handle_jit_enter(vm, vm->pc);
+    while (running) {
+        const Instruction *ins = vm->pc++;
+        running = ins->handler.fn && ins->handler.fn(vm, ins);
     }
 
-    // Calculate the length of the string
-    size_t str_length = (uint8_t*)null_pos - (vm->chunk->bytecode + vm->ip);
+    if (!vm->suspended && vm->stack->sp >= 0) {
+        return vm_pop(vm);
+    }
 
-    // Get the pointer to the function name in the bytecode
-    const char* name = (const char*)(vm->chunk->bytecode + vm->ip);
+    return make_null();
+#endif
+}
 
-    // Move the instruction pointer past the string and its null terminator
-    vm->ip += str_length + 1;
+void vm_set_budget(VM *vm, int64_t fuel, BudgetCallback callback, void *data) {
+    vm->fuel = fuel;
+    vm->on_budget = callback;
+    vm->budget_data = data;
+}
 
-    return name;
+void vm_suspend(VM *vm) {
+    if (!vm->suspend_requested) {
+        vm->suspend_requested = true;
+        vm->parked_fuel = vm->fuel;
+        vm->fuel = 0;
+    }
+}
+
+bool vm_is_suspended(const VM *vm) {
+    return vm->suspended;
 }
 
-uintptr_t vm_read_ptr(VM *vm) {
-    return vm_read_uint(vm);
+Value vm_resume(VM *vm) {
+    if (!vm->suspended) {
+        fprintf(stderr, "Error: the VM is not suspended.\n");
+        return make_null();
+    }
+    return vm_execute(vm);
+}
+
+bool vm_call(VM *vm, Function *fn, const Value *args, size_t argc, Value *result) {
+    if (argc != fn->arity) {
+        fprintf(stderr, "Error: '%s' expects %zu argument(s), called with %zu.\n", fn->name, fn->arity, argc);
+        return false;
+    }
+    // the decoder ends the stream with a halt, the callee returns to it
+    const Instruction *halt = vm->code ? &vm->code->code[vm->code->count - 1] : nullptr;
+    // above any window the running code may use
+    Value *window = vm->registers + MAX_REGISTERS;
+    if (!halt || halt->opcode != OP_HALT || window + fn->register_count > vm->register_end) {
+        fprintf(stderr, "Error: cannot call '%s' from here.\n", fn->name);
+        return false;
+    }
+
+    const Instruction *pc = vm->pc;
+    Value *registers = vm->registers;
+    const int sp_reset = vm->sp_reset;
+    const int sp = vm->stack->sp;
+    const size_t frames = vm->call_stack->count;
+    const int64_t fuel = vm->fuel;
+    const bool suspended = vm->suspended;
+    if (!push_call_frame(vm->call_stack, halt, vm->registers, vm->sp_reset)) {
+        return false;
+    }
+    if (argc) {
+        memcpy(window, args, sizeof(Value) * argc);
+    }
+    vm->registers = window;
+    vm->pc = fn->entry;
+    vm->fuel = VM_UNLIMITED_FUEL;
+
+    *result = vm_execute(vm);
+    // an error leaves the callee's frames behind
+    const bool ok = vm->call_stack->count == frames;
+
+    vm->call_stack->count = frames;
+    vm->stack->sp = sp;
+    vm->pc = pc;
+    vm->registers = registers;
+    vm->sp_reset = sp_reset;
+    vm->fuel = fuel;
+    vm->suspended = suspended;
+    return ok;
 }
 
-uint64_t vm_read_uint(VM *vm) {
-    uint64_t value;
-    memcpy(&value, vm->chunk->bytecode + vm->ip, sizeof(uint64_t));
-    vm->ip += sizeof(uint64_t);
-    return value;
+// body of the VM's fiber, each vm_run_fiber runs one vm_execute
+static void run_on_fiber(void *data) {
+    VM *vm = data;
+    for (;;) {
+        vm->fiber_result = vm_execute(vm);
+        fiber_yield();
+    }
 }
 
-size_t vm_read_offset(VM *vm) {
-    size_t value;
-    memcpy(&value, vm->chunk->bytecode + vm->ip, sizeof(size_t));
-    vm->ip += sizeof(size_t);
-    return value;
+Value vm_run_fiber(VM *vm) {
+    if (!vm->fiber && !(vm->fiber = create_fiber(0, run_on_fiber, vm))) {
+        return vm_execute(vm);
+    }
+    vm->parked = false;
+    fiber_resume(vm->fiber);
+    return vm->parked ? make_null() : vm->fiber_result;
 }
 
-bool vm_jump_to_chunk(VM *vm, size_t chunk_id) {
-    auto chunk = bc_get_chunk_by_id(vm->buffer, chunk_id);
-    if (chunk) {
-        vm->chunk = chunk;
-        return true;
+bool vm_park(VM *vm) {
+    if (!vm->fiber || fiber_current() != vm->fiber) {
+        return false;
     }
-    return false;
+    vm->parked = true;
+    fiber_yield();
+    return true;
+}
+
+bool vm_is_parked(const VM *vm) {
+    return vm->parked;
 }
 
-uint16_t vm_read_uint16(VM *vm) {
-    uint16_t value;
-    memcpy(&value, vm->chunk->bytecode + vm->ip, sizeof(uint16_t));
-    vm->ip += sizeof(uint16_t);
-    return value;
+Value vm_make_string(VM *vm, const char *chars, size_t length) {
+    char *copy = vm->strings ? string_arena_copy(vm->strings, chars, length) : strndup(chars, length);
+    return copy ? make_string_ref(copy) : make_null();
 }
 
-inline VM* get_vm(void) {
-    return g_vm;
+bool vm_safepoint(VM *vm) {
+    if (vm->suspend_requested) {
+        vm->suspend_requested = false;
+        vm->fuel = vm->parked_fuel;
+    } else if (vm->on_budget && vm->on_budget(vm, vm->budget_data)) {
+        return true;
+    }
+    vm->suspended = true;
+    return false;
 }
@@ -12,31 +12,76 @@
 #include "bytecode_buffer.h"
 #include "memory.h"
 #include "functions.h"
+#include "decoder.h"
+#include "opcode_profile.h"
+#include "jit.h"
+#include "fiber.h"
 
 #define uimplemented() fprintf(stderr, "%s is not implemented in %s at line %d", __FUNCTION__, __FILE_NAME__, __LINE__); exit(EXIT_FAILURE)
 
+// labels-as-values dispatch is used whenever the compiler supports it,
+// define TIGE_NO_THREADED_DISPATCH to force the portable handler table
+#if (defined(__GNUC__) || defined(__clang__)) && !defined(TIGE_NO_THREADED_DISPATCH)
+#define TIGE_THREADED_DISPATCH 1
+#else
+#define TIGE_THREADED_DISPATCH 0
+#endif
+
 #define STACK_SIZE 2048
-#define MAX_REGISTERS 512
-#define SP get_vm()->stack->sp
+#define MAX_REGISTERS 512           // largest register window of a single function
+#define REGISTER_FILE_SIZE (1 << 16)
 
 typedef struct VM VM;
 typedef struct Context Context;
+typedef struct EventLoop EventLoop;
+
+// Execution budget.
+// Backward jumps and calls are the safepoints of the VM: the only places a script
+// can keep running from without bound, and places where everything it needs to
+// continue is in the VM (pc, stack, registers). Each one burns a unit of fuel, and
+// when the fuel runs out the budget callback decides: it returns true to keep
+// running (refilling the fuel with vm_set_budget if it wants more than one more
+// safepoint), false to suspend the VM there. vm_execute then returns with
+// vm_is_suspended true, and vm_resume continues where it stopped.
+// Without a budget the fuel is unlimited, and it costs a decrement per safepoint.
+typedef bool (*BudgetCallback)(VM *vm, void *data);
+
+#define VM_UNLIMITED_FUEL INT64_MAX
 
 // VM structure
 struct VM {
     Context *context;
-    uint8_t *bytecode;
-    BytecodeChunk *chunk;  // Pointer to the current executing chunk
     BytecodeBuffer *buffer;
-    size_t size;        // Size of bytecode
-    size_t ip;          // Instruction pointer
+    InstructionStream *code;    // decoded form of buffer
+    const Instruction *pc;      // next instruction to execute
+    OpcodeProfile *profile;     // when set, execution counts opcode sequences
+    Jit *jit;                   // when set, hot functions are compiled to machine code
 
-    Value registers[MAX_REGISTERS];
+    // one contiguous register file, every call slides a window over it
+    Value *register_file;       // the top level window starts here, functions read globals from it
+    Value *register_end;
+    Value *registers;           // window of the running function
     Heap* heap;
     Stack* stack;
     CallStack* call_stack;
     int sp;             // Stack pointer
     int sp_reset;
+
+    // execution budget, see vm_set_budget
+    int64_t fuel;               // safepoints left before the callback runs
+    int64_t parked_fuel;        // what was left when a suspension was requested
+    BudgetCallback on_budget;
+    void *budget_data;
+    bool suspend_requested;
+    bool suspended;             // stopped at a safepoint, vm_resume continues there
+
+    // execution on a fiber, see vm_run_fiber
+    Fiber *fiber;
+    Value fiber_result;
+    bool parked;                // a native parked the fiber, vm_run_fiber continues it
+
+    EventLoop *events;          // timers and sockets of the script, see event_loop.h
+    StringArena *strings;       // where vm_make_string copies to, the C heap when nullptr
 };
 
 // Function prototypes
@@ -46,20 +91,64 @@ void vm_push(VM *vm, Value value);
 Value vm_pop(VM *vm);
 Value vm_execute(VM *vm);
 
-// chunks manipulation
-bool vm_jump_to_chunk(VM *vm, size_t chunk_id);
-void vm_jump_to_chunk_adr(VM *vm, uintptr_t chunk_ptr);
-
-// memory reads
-uint8_t vm_read_byte(VM *vm);
-TString *vm_read_string(VM *vm);
-const char* vm_read_fn_name(VM* vm);
-uint64_t vm_read_uint(VM *vm);
-uint16_t vm_read_uint16(VM *vm);
-int64_t vm_read_int(VM *vm);
-size_t vm_read_offset(VM *vm);
-uintptr_t vm_read_ptr(VM *vm);
-
-VM* get_vm(void);
+// Run up to fuel safepoints, then call callback (nullptr suspends right away).
+// VM_UNLIMITED_FUEL removes the budget.
+void vm_set_budget(VM *vm, int64_t fuel, BudgetCallback callback, void *data);
+
+// Suspend at the next safepoint, for natives and anything else running inside the VM.
+// The fuel left is kept for vm_resume.
+void vm_suspend(VM *vm);
+bool vm_is_suspended(const VM *vm);
+
+// continue a suspended VM, returns like vm_execute
+Value vm_resume(VM *vm);
+
+// The fuel ran out at a safepoint: ask the budget callback. Returns true to go on,
+// false when the VM is suspended with vm->pc where it has to continue.
+bool vm_safepoint(VM *vm);
+
+// Call a script function from C, e.g. an event callback, and run it to its return
+// outside of the budget. Works between executions and from natives alike: the VM
+// state is restored afterwards. False when the call fails.
+bool vm_call(VM *vm, Function *fn, const Value *args, size_t argc, Value *result);
+
+// Run the VM on a fiber of its own (see fiber.h) until its code ends, it suspends at
+// a safepoint, or a native parks it with vm_park. Returns like vm_execute, and
+// vm_is_parked tells the last case apart: the next vm_run_fiber continues inside
+// the native. Without a fiber (no memory for its stack) this is vm_execute.
+Value vm_run_fiber(VM *vm);
+
+// From a native: leave the VM's fiber, so that the thread running it can do something
+// else until the native has what it waits for, and return once vm_run_fiber is called
+// again. Returns false right away when the VM is not running on its fiber.
+bool vm_park(VM *vm);
+bool vm_is_parked(const VM *vm);
+
+// a string value made at run time, a copy of length bytes of chars (see vm->strings)
+Value vm_make_string(VM *vm, const char *chars, size_t length);
+
+// a safepoint reached with vm->pc already on the instruction to continue at
+static inline bool vm_poll(VM *vm) {
+    return --vm->fuel > 0 || vm_safepoint(vm);
+}
+
+// point decoded instructions at the dispatch label/handler of their opcode,
+// fusing known opcode sequences into superinstructions. Returns false when out of memory.
+bool vm_bind_handlers(Instruction *code, size_t count);
+
+// Change the opcode of a decoded instruction while it may be running (quickening).
+// Returns false when the instruction has to keep its opcode: while profiling, or
+// when it heads a superinstruction or the new opcode would break the cached stack
+// state its successor expects.
+bool vm_rewrite_instruction(VM *vm, Instruction *ins, Opcode opcode);
+
+// regular handler of an opcode, nullptr when it has none
+OpcodeHandler vm_opcode_handler(Opcode opcode);
+
+// route the instruction to its compiled code (see jit.h)
+void vm_set_jit_entry(Instruction *ins);
+
+// count the iterations of the loop starting at ins (see jit_loop_header)
+void vm_set_loop_header(Instruction *ins);
 
 #endif //TIGE_VM_H